@@ -26,27 +26,23 @@ extern "C" {
 
 #include "ads1291-2.h"
 #include "app_error.h"
-#include "nrf_drv_spi.h"
-#include "nrf_gpio.h"
 #include "app_util_platform.h"
 #include "nrf_log.h"
 #include "ble_bms.h"
-#include "nrf_delay.h"
+#include "hal.h"
+#include "frame_ring.h"
+#include "frame_decim.h"
 /*@stuff for delay:*/
 #include <stdio.h> 
+#include <string.h>
 #include "compiler_abstraction.h"
 #include "nrf.h"
 
-/**@SPI STUFF*/
-#define SPIM0_SCK_PIN      	13    
-#define SPIM0_MOSI_PIN      14    
-#define SPIM0_MISO_PIN      12    
-#define SPIM0_SS_PIN        15
-
 /**@TX,RX Stuff: */
 #define TX_RX_MSG_LENGTH         				7
 
-uint8_t ads1291_2_default_regs[] = {
+/**@brief Register values written by ads1291_2_init_regs(), CONFIG1 to GPIO. */
+static const uint8_t ads1291_2_default_regs[ADS1291_2_NUM_REGS - 1] = {
 		ADS1291_2_REGDEFAULT_CONFIG1,
 		ADS1291_2_REGDEFAULT_CONFIG2,
 		ADS1291_2_REGDEFAULT_LOFF,
@@ -60,38 +56,194 @@ uint8_t ads1291_2_default_regs[] = {
 		ADS1291_2_REGDEFAULT_GPIO 
 	};
 
+/**@ACQUISITION STATE:
+ * IDLE     - RDATAC not running, DRDY edges are ignored.
+ * ARMED    - Waiting for the next DRDY edge.
+ * TRANSFER - A frame is being clocked out into m_frame_rx.
+ * PAUSED   - A command transfer owns the bus, DRDY edges are counted as missed.
+ */
+typedef enum
+{
+		ADS1291_2_ACQ_IDLE,
+		ADS1291_2_ACQ_ARMED,
+		ADS1291_2_ACQ_TRANSFER,
+		ADS1291_2_ACQ_PAUSED
+} ads1291_2_acq_state_t;
+
+static volatile ads1291_2_acq_state_t	m_acq_state = ADS1291_2_ACQ_IDLE;
+static volatile bool									m_cmd_xfer_done = true;
+static uint8_t												m_frame_tx[ADS1291_2_FRAME_LEN];			/**< Dummy bytes clocked out while reading a frame. */
+static uint8_t												m_frame_rx[ADS1291_2_FRAME_LEN];			/**< DMA target for the frame currently being read. */
+static frame_ring_t										m_frame_ring;													/**< Frames handed from the SPI handler to the main loop. */
+static volatile uint32_t							m_frames_missed;											/**< DRDY edges that arrived while the bus was busy. */
+static volatile uint32_t							m_frames_unsynced;										/**< Frames read that did not start with 1100b. */
+static uint32_t												m_drdy_index;													/**< DRDY edges since RDATAC was started, serviced or not. */
+static uint32_t												m_xfer_index;													/**< Conversion being read into m_frame_rx. */
+static uint32_t												m_xfer_ticks;													/**< hal_clock_ticks() at its DRDY edge. */
+static uint16_t												m_xfer_stamp;													/**< Its DRDY edge capture, see hal_drdy_time(). */
+static uint8_t												m_loff_stat;													/**< LOFF_STAT[4:0] of the last frame passed to ads1291_2_lead_off_update(). */
+static frame_decim_t									m_decim;															/**< Reduces oversampled conversions to the output rate. SPI handler only while acquiring. */
+static uint8_t												m_oversample_dr;											/**< Lowest CONFIG1.DR the converter runs at, see ads1291_2_oversample_set(). */
+static uint32_t												m_sclk_hz = ADS1291_2_SPI_HZ;					/**< SCLK of frame reads; commands run at ADS1291_2_SPI_CMD_HZ. */
+static bool														m_rdatac = true;											/**< Device is in RDATAC mode, as it powers up. */
+static uint8_t												m_regs[ADS1291_2_NUM_REGS];						/**< Shadow of the register file, by address, as last written or read. */
+static uint8_t												m_regs_staged[ADS1291_2_NUM_REGS];		/**< Values set by ads1291_2_reg_set() for the next commit. */
+static volatile ads1291_2_startup_t		m_startup;														/**< Where ads1291_2_startup_begin() has got to. */
+static bool														m_regs_valid;													/**< m_regs has been read since the device was last reset. */
+static volatile bool									m_settling;														/**< Frames are still being marked settling, see ads1291_2_wake(). */
+static volatile uint32_t							m_wake_ticks;													/**< hal_clock_ticks() when WAKEUP was sent. */
+#if defined(ADS1291_2_PROFILE)
+static uint32_t												m_decim_cycles;												/**< Cycles spent in frame_decim_push(). */
+static uint32_t												m_decim_pushes;
+static uint16_t												m_decim_cycles_max;
+static uint16_t												m_xfer_cycles;												/**< hal_cycles() at the DRDY edge of the frame read in progress. */
+static uint32_t												m_frame_cycles;												/**< Cycles from DRDY edges to the end of their frame reads. */
+static uint32_t												m_frame_reads;
+static uint16_t												m_frame_cycles_max;
+#endif
+
+/**@brief Decode a raw RDATAC frame.
+ *
+ * @details 0,1,2 = 24-bit STAT
+ *          3,4,5 = 24-bit CH1 DATA
+ *          6,7,8 = 24-bit CH2 DATA
+ */
+static void frame_decode(uint8_t const * p_raw, ads1291_2_frame_t * p_frame)
+{
+		p_frame->stat = ((uint32_t)p_raw[0] << 16) | ((uint32_t)p_raw[1] << 8) | p_raw[2];
+		p_frame->ch1  = SIGN_EXT_24(((uint32_t)p_raw[3] << 16) | ((uint32_t)p_raw[4] << 8) | p_raw[5]);
+		p_frame->ch2  = SIGN_EXT_24(((uint32_t)p_raw[6] << 16) | ((uint32_t)p_raw[7] << 8) | p_raw[8]);
+}
+
 /**@SPI HANDLERS:
  * @brief SPI user event handler.
+ *
+ * @details Completes either a frame read started from the DRDY edge or a command transfer
+ *          issued through ads_spi_xfer().
  * @param event
  */
-void spi_event_handler(nrf_drv_spi_evt_t const * p_event)
+static void spi_event_handler(void)
 {
-		/*switch (p_event->type) {
-				case NRF_DRV_SPI_EVENT_DONE:
-					break;
-				default:
-					break;
-		}*/
-    //NRF_LOG_PRINTF(" >>> Transfer completed.\r\n");
+		if (m_acq_state == ADS1291_2_ACQ_TRANSFER) {
+#if defined(ADS1291_2_PROFILE)
+				uint16_t bus_cycles = (uint16_t)(hal_cycles() - m_xfer_cycles);
+				m_frame_cycles += bus_cycles;
+				m_frame_reads++;
+				m_frame_cycles_max = MAX(m_frame_cycles_max, bus_cycles);
+#endif
+				// Every frame starts with 1100b, anything else means the bus slipped.
+				if ((m_frame_rx[0] & 0xF0) == 0xC0) {
+						ads1291_2_frame_t frame;
+						bool              out;
+						frame_decode(m_frame_rx, &frame);
+						frame.index = m_xfer_index;
+						frame.ticks = m_xfer_ticks;
+						frame.stamp = m_xfer_stamp;
+#if defined(ADS1291_2_PROFILE)
+						uint16_t start = hal_cycles();
+						out = frame_decim_push(&m_decim, &frame);
+						uint16_t cycles = (uint16_t)(hal_cycles() - start);
+						m_decim_cycles += cycles;
+						m_decim_pushes++;
+						m_decim_cycles_max = MAX(m_decim_cycles_max, cycles);
+#else
+						out = frame_decim_push(&m_decim, &frame);
+#endif
+						if (out) {
+								// DRDY stops in standby, so every frame after WAKEUP is later than it.
+								frame.settling = m_settling && (((frame.ticks - m_wake_ticks) & HAL_CLOCK_MASK) <
+								                                HAL_US_TO_TICKS(ADS1291_2_WAKE_SETTLE_MS * 1000UL));
+								m_settling = frame.settling;
+								(void)frame_ring_push(&m_frame_ring, &frame);
+						}
+				} else {
+						// Dropped; its index is skipped like a missed frame's.
+						m_frames_unsynced++;
+				}
+				m_acq_state = ADS1291_2_ACQ_ARMED;
+		} else {
+				m_cmd_xfer_done = true;
+		}
+}
+
+/**@brief Stop the acquisition engine from starting new frame reads.
+ *
+ * @details Waits for a frame read in progress to finish so the bus is free for a command.
+ *
+ * @return  State to hand back to acq_resume().
+ */
+static ads1291_2_acq_state_t acq_pause(void)
+{
+		ads1291_2_acq_state_t prev;
+		do {
+				CRITICAL_REGION_ENTER();
+				prev = m_acq_state;
+				if (prev != ADS1291_2_ACQ_TRANSFER) {
+						m_acq_state = ADS1291_2_ACQ_PAUSED;
+				}
+				CRITICAL_REGION_EXIT();
+				if (prev == ADS1291_2_ACQ_TRANSFER) {
+						// A frame read in progress completes in the SPI handler.
+						hal_yield();
+				}
+		} while (prev == ADS1291_2_ACQ_TRANSFER);
+		return prev;
+}
+
+static void acq_resume(ads1291_2_acq_state_t prev)
+{
+		m_acq_state = prev;
 }
 
-/**@INITIALIZE SPI INSTANCE */
-static const nrf_drv_spi_t spi = NRF_DRV_SPI_INSTANCE(0); //SPI INSTANCE
+/**@brief Blocking command transfer.
+ *
+ * @details The driver runs non-blocking because a handler is registered, so command
+ *          transfers wait here for the DONE event. Frame reads are held off for the duration,
+ *          and the bus drops to ADS1291_2_SPI_CMD_HZ so multi-byte commands meet tSDECODE.
+ */
+static void ads_spi_xfer(uint8_t const * p_tx, uint8_t tx_len, uint8_t * p_rx, uint8_t rx_len)
+{
+		ads1291_2_acq_state_t prev = acq_pause();
+		if (m_sclk_hz != ADS1291_2_SPI_CMD_HZ) {
+				APP_ERROR_CHECK(hal_spi_frequency_set(ADS1291_2_SPI_CMD_HZ));
+		}
+		m_cmd_xfer_done = false;
+		APP_ERROR_CHECK(hal_spi_transfer(p_tx, tx_len, p_rx, rx_len));
+		while (!m_cmd_xfer_done) {
+				// Wait for spi_event_handler().
+				hal_yield();
+		}
+		if (m_sclk_hz != ADS1291_2_SPI_CMD_HZ) {
+				APP_ERROR_CHECK(hal_spi_frequency_set(m_sclk_hz));
+		}
+		acq_resume(prev);
+}
 void ads_spi_init(void) {
-		nrf_drv_spi_config_t spi_config = NRF_DRV_SPI_DEFAULT_CONFIG(0);
-		spi_config.bit_order						= NRF_DRV_SPI_BIT_ORDER_MSB_FIRST;
-		//SCLK = 1MHz is right speed because fCLK = (1/2)*SCLK, and fMOD = fCLK/4, and fMOD MUST BE 128kHz. Do the math.
-		spi_config.frequency						=	NRF_DRV_SPI_FREQ_1M; 	
-		//spi_config.irq_priority					= APP_IRQ_PRIORITY_LOW;
-		spi_config.irq_priority					= APP_IRQ_PRIORITY_HIGHEST;
-		spi_config.mode									= NRF_DRV_SPI_MODE_1; //CPOL = 0 (Active High); CPHA = TRAILING (1)
-		spi_config.miso_pin 						= SPIM0_MISO_PIN;
-		spi_config.sck_pin 							= SPIM0_SCK_PIN;
-		spi_config.mosi_pin 						= SPIM0_MOSI_PIN;
-		spi_config.ss_pin								= SPIM0_SS_PIN;
-		spi_config.orc									= 0x55;
-		APP_ERROR_CHECK(nrf_drv_spi_init(&spi, &spi_config, spi_event_handler));
-		NRF_LOG_PRINTF(" SPI Initialized..\r\n");
+		hal_spi_init(spi_event_handler);
+		APP_ERROR_CHECK(hal_spi_frequency_set(m_sclk_hz));
+		NRF_LOG_PRINTF(" SCLK %d kHz, %d ns per frame..\r\n", m_sclk_hz / 1000, ads1291_2_frame_bus_ns());
+}
+
+uint32_t ads1291_2_sclk_set(uint32_t hz) {
+		if (hz == 0 || hz > ADS1291_2_SCLK_MAX_HZ ||
+		    ADS1291_2_FRAME_BUS_NS(hz) >= 1000000000UL / ADS1291_2_DR_TO_SPS(ADS1291_2_REG_CONFIG1_DR_MAX)) {
+				return NRF_ERROR_INVALID_PARAM;
+		}
+		ads1291_2_acq_state_t prev = acq_pause();
+		uint32_t err_code = hal_spi_frequency_set(hz);
+		if (err_code == NRF_SUCCESS) {
+				m_sclk_hz = hz;
+		}
+		acq_resume(prev);
+		return err_code;
+}
+
+uint32_t ads1291_2_sclk_get(void) {
+		return m_sclk_hz;
+}
+
+uint32_t ads1291_2_frame_bus_ns(void) {
+		return ADS1291_2_FRAME_BUS_NS(m_sclk_hz);
 }
 
 /**@SPI-CLEARS BUFFER
@@ -121,75 +273,196 @@ void init_buf(uint8_t * const p_tx_buffer,
  **************************************************************************************************************************************************/
 
 /* REGISTER READ/WRITE FUNCTIONS *****************************************************************************************************************/
-void ads1291_2_rreg(uint8_t reg_addr, uint8_t num_to_read, uint8_t* read_reg_val_ptr){
-		uint32_t i;
-		uint8_t tx_data_spi[2+num_to_read];
-						tx_data_spi[0] = ADS1291_2_OPC_RREG | reg_addr;
-						tx_data_spi[1] = num_to_read - 1;
-		for (i = 2; i < 2+num_to_read; i++)
-		{
-				tx_data_spi[i] = 0;
+
+/**@brief Bits of a register that read back what was written. LOFF_STAT[4:0] and the GPIO
+ *        data bits of inputs follow the device; ID is read-only.
+ */
+static uint8_t reg_rw_mask(uint8_t reg_addr)
+{
+		switch (reg_addr) {
+				case ADS1291_2_REGADDR_ID:				return 0x00;
+				case ADS1291_2_REGADDR_LOFF_STAT:	return 0xE0;
+				case ADS1291_2_REGADDR_GPIO:			return 0xFC;
+				default:													return 0xFF;
 		}
-		//NRF_LOG_PRINTF(" tx_data_spi: 0x%x \r\n", tx_data_spi);		
-		nrf_drv_spi_transfer(&spi, tx_data_spi, 2+num_to_read, read_reg_val_ptr, 2+num_to_read);
-		//NRF_LOG_PRINTF(" tx_data_spi (after): 0x%x \r\n", tx_data_spi);		
-		NRF_LOG_PRINTF(" Single register read(*): 0x%x, %d \r\n", *read_reg_val_ptr, *read_reg_val_ptr);
-		//NRF_LOG_PRINTF(" Single register read(1): 0x%x, %d \r\n", read_reg_val_ptr, read_reg_val_ptr);
-		
 }
 
-void ads1291_2_wreg(uint8_t reg_addr, uint8_t num_to_write, uint8_t* write_reg_val_ptr){
-		uint32_t i;
+/**@brief What regs_access_end() has to restore. */
+typedef struct
+{
+		ads1291_2_acq_state_t	acq;				/**< Acquisition state before regs_access_begin(). */
+		bool									rdatac;			/**< RDATAC has to be sent again. */
+} regs_access_t;
+
+/**@brief Hold frame reads off and leave RDATAC if the device is in it; RREG and WREG are
+ *        ignored there, and a DRDY edge meanwhile would start a frame read outside RDATAC.
+ */
+static regs_access_t regs_access_begin(void)
+{
+		regs_access_t access;
+		access.acq		= acq_pause();
+		access.rdatac	= m_rdatac;
+		if (m_rdatac) {
+				uint8_t tx_data_spi = ADS1291_2_OPC_SDATAC;
+				uint8_t rx_data_spi;
+				ads_spi_xfer(&tx_data_spi, 1, &rx_data_spi, 1);
+		}
+		return access;
+}
+
+/**@brief Re-enter RDATAC if regs_access_begin() left it, then let frame reads run again. */
+static void regs_access_end(regs_access_t access)
+{
+		if (access.rdatac) {
+				uint8_t tx_data_spi = ADS1291_2_OPC_RDATAC;
+				uint8_t rx_data_spi;
+				ads_spi_xfer(&tx_data_spi, 1, &rx_data_spi, 1);
+		}
+		acq_resume(access.acq);
+}
+
+/**@brief One RREG burst into p_values, outside RDATAC. */
+static void reg_burst_read(uint8_t reg_addr, uint8_t count, uint8_t * p_values)
+{
+		uint8_t tx_data_spi[ADS1291_2_NUM_REGS+2] = {0};
+		uint8_t rx_data_spi[ADS1291_2_NUM_REGS+2];
+		tx_data_spi[0] = ADS1291_2_OPC_RREG | reg_addr;
+		tx_data_spi[1] = count - 1;
+		ads_spi_xfer(tx_data_spi, 2+count, rx_data_spi, 2+count);
+		// The first two bytes clocked in are the opcode's.
+		memcpy(p_values, &rx_data_spi[2], count);
+}
+
+/**@brief One WREG burst from p_values, outside RDATAC. */
+static void reg_burst_write(uint8_t reg_addr, uint8_t count, uint8_t const * p_values)
+{
 		uint8_t tx_data_spi[ADS1291_2_NUM_REGS+2];
 		uint8_t rx_data_spi[ADS1291_2_NUM_REGS+2];
-		
-		if (num_to_write < ADS1291_2_NUM_REGS)
-		{
-			for (i = 0; i < ADS1291_2_NUM_REGS+2; i++)
-			{
-					tx_data_spi[i] = 0;
-			}
-		}
-		
 		tx_data_spi[0] = ADS1291_2_OPC_WREG | reg_addr;
-		tx_data_spi[1] = num_to_write - 1;
-		for (i = 0; i < num_to_write; i++)
-		{
-				tx_data_spi[i+2] = write_reg_val_ptr[i];
+		tx_data_spi[1] = count - 1;
+		memcpy(&tx_data_spi[2], p_values, count);
+		ads_spi_xfer(tx_data_spi, 2+count, rx_data_spi, 2+count);
+}
+
+uint32_t ads1291_2_rreg(uint8_t reg_addr, uint8_t num_to_read, uint8_t* read_reg_val_ptr){
+		if (num_to_read == 0 || reg_addr >= ADS1291_2_NUM_REGS || num_to_read > ADS1291_2_NUM_REGS - reg_addr) {
+				return NRF_ERROR_INVALID_PARAM;
+		}
+		regs_access_t access = regs_access_begin();
+		reg_burst_read(reg_addr, num_to_read, read_reg_val_ptr);
+		regs_access_end(access);
+		if (m_regs_valid) {
+				memcpy(&m_regs[reg_addr], read_reg_val_ptr, num_to_read);
+				memcpy(&m_regs_staged[reg_addr], read_reg_val_ptr, num_to_read);
+		}
+		return NRF_SUCCESS;
+}
+
+uint32_t ads1291_2_wreg(uint8_t reg_addr, uint8_t num_to_write, uint8_t const * write_reg_val_ptr){
+		if (num_to_write == 0 || reg_addr >= ADS1291_2_NUM_REGS || num_to_write > ADS1291_2_NUM_REGS - reg_addr) {
+				return NRF_ERROR_INVALID_PARAM;
+		}
+		regs_access_t access = regs_access_begin();
+		reg_burst_write(reg_addr, num_to_write, write_reg_val_ptr);
+		regs_access_end(access);
+		if (m_regs_valid) {
+				memcpy(&m_regs[reg_addr], write_reg_val_ptr, num_to_write);
+				memcpy(&m_regs_staged[reg_addr], write_reg_val_ptr, num_to_write);
+		}
+		return NRF_SUCCESS;
+}
+
+uint32_t ads1291_2_regs_read(void) {
+		regs_access_t access = regs_access_begin();
+		reg_burst_read(ADS1291_2_REGADDR_ID, ADS1291_2_NUM_REGS, m_regs);
+		regs_access_end(access);
+		memcpy(m_regs_staged, m_regs, sizeof(m_regs));
+		m_regs_valid = true;
+		return NRF_SUCCESS;
+}
+
+uint8_t ads1291_2_reg_get(uint8_t reg_addr) {
+		return (reg_addr < ADS1291_2_NUM_REGS) ? m_regs[reg_addr] : 0;
+}
+
+uint32_t ads1291_2_reg_set(uint8_t reg_addr, uint8_t value) {
+		if (reg_addr == ADS1291_2_REGADDR_ID || reg_addr >= ADS1291_2_NUM_REGS) {
+				return NRF_ERROR_INVALID_PARAM;
+		}
+		m_regs_staged[reg_addr] = value;
+		return NRF_SUCCESS;
+}
+
+uint32_t ads1291_2_regs_commit(void) {
+		uint8_t first = ADS1291_2_NUM_REGS;
+		uint8_t last  = 0;
+		uint8_t bursts = 0;
+		regs_access_t access;
+
+		if (!m_regs_valid) {
+				return NRF_ERROR_INVALID_STATE;
+		}
+		for (uint8_t addr = ADS1291_2_REGADDR_CONFIG1; addr < ADS1291_2_NUM_REGS; addr++) {
+				if (m_regs_staged[addr] == m_regs[addr]) {
+						continue;
+				}
+				// Start a burst here, or carry the current one on through unchanged registers:
+				// rewriting up to two of them costs no more bytes than the two of a new opcode.
+				uint8_t start = addr;
+				uint8_t end   = addr;
+				for (uint8_t next = addr + 1; next < ADS1291_2_NUM_REGS && next <= end + 3; next++) {
+						if (m_regs_staged[next] != m_regs[next]) {
+								end = next;
+						}
+				}
+				if (bursts == 0) {
+						access = regs_access_begin();
+						first  = start;
+				}
+				reg_burst_write(start, end - start + 1, &m_regs_staged[start]);
+				bursts++;
+				last = end;
+				addr = end;
+		}
+		if (bursts == 0) {
+				return NRF_SUCCESS;
+		}
+
+		// One RREG over everything written.
+		uint8_t readback[ADS1291_2_NUM_REGS];
+		uint8_t count = last - first + 1;
+		reg_burst_read(first, count, readback);
+		regs_access_end(access);
+
+		uint32_t err_code = NRF_SUCCESS;
+		for (uint8_t i = 0; i < count; i++) {
+				uint8_t mask = reg_rw_mask(first + i);
+				if ((readback[i] & mask) != (m_regs_staged[first + i] & mask)) {
+						NRF_LOG_PRINTF(" Register 0x%x verify failed: wrote 0x%x, read 0x%x..\r\n", first + i,
+						               m_regs_staged[first + i], readback[i]);
+						err_code = NRF_ERROR_INTERNAL;
+				}
 		}
-		nrf_drv_spi_transfer(&spi,tx_data_spi,2+num_to_write, rx_data_spi,2+num_to_write);
-		NRF_LOG_PRINTF(" Single register written:");
+		NRF_LOG_PRINTF(" Registers 0x%x-0x%x committed in %d WREG bursts..\r\n", first, last, bursts);
+		// The shadow follows the device, so a failed commit is retried by the next one.
+		memcpy(&m_regs[first], readback, count);
+		memcpy(&m_regs_staged[first], readback, count);
+		return err_code;
 }
 
 
 /* SYSTEM CONTROL FUNCTIONS **********************************************************************************************************************/
 
 void ads1291_2_init_regs(void)
-{	
-	
-	/**@TODO: REWRITE THIS FUNCTION. Not sure it works correctly.*/
-	uint8_t i = 0;
-	uint8_t num_registers = 12;
-	uint8_t txrx_size = num_registers+2;
-	uint8_t tx_data_spi[txrx_size]; //Size = 14 bytes
-	uint8_t rx_data_spi[txrx_size]; //Size = 14 bytes
-	uint8_t opcode_1 = 0x41;
-	for(i=0;i<txrx_size;i++) {
-		tx_data_spi[i] = 0;   // Set array to zero. 
-		rx_data_spi[i] = 0;		// Set array to zero. 
-	}
-	// Set first byte to opcode WREG | Starting Address, which is = 0x41
-	//tx_data_spi[0] = ADS1291_2_OPC_WREG | ADS1291_2_REGADDR_CONFIG1; 	
-	tx_data_spi[0] = opcode_1;
-	tx_data_spi[1] = num_registers-1;			//is the number of registers to write  1. (OPCODE2)
-	//fill remainder of tx with commands:
-	for (i=0; i<num_registers; i++) {
-		tx_data_spi[i+2] = ads1291_2_default_regs[i];
-	}
-	nrf_drv_spi_transfer(&spi, tx_data_spi, num_registers+2, rx_data_spi, num_registers+2);
-	nrf_delay_ms(10);
-	//ads1291_2_wreg(ADS1291_2_REGADDR_CONFIG1, ADS1291_2_NUM_REGS-1, ads1291_2_default_regs);
-	NRF_LOG_PRINTF(" Power-on reset and initialization procedure..\r\n");
+{
+		// Registers are whatever reset left; read them once and write only what differs.
+		APP_ERROR_CHECK(ads1291_2_regs_read());
+		for (uint8_t i = 0; i < sizeof(ads1291_2_default_regs); i++) {
+				APP_ERROR_CHECK(ads1291_2_reg_set(ADS1291_2_REGADDR_CONFIG1 + i, ads1291_2_default_regs[i]));
+		}
+		APP_ERROR_CHECK(ads1291_2_regs_commit());
+		frame_decim_init(&m_decim, 0);
+		NRF_LOG_PRINTF(" Power-on reset and initialization procedure..\r\n");
 }
 
 void ads1291_2_standby(void) {
@@ -198,7 +471,7 @@ void ads1291_2_standby(void) {
 	
 		tx_data_spi = ADS1291_2_OPC_STANDBY;
 	
-		nrf_drv_spi_transfer(&spi, &tx_data_spi, 1, &rx_data_spi, 1);
+		ads_spi_xfer(&tx_data_spi, 1, &rx_data_spi, 1);
 		NRF_LOG_PRINTF(" ADS1291-2 placed in standby mode...\r\n");
 }
 
@@ -208,8 +481,10 @@ void ads1291_2_wake(void) {
 	
 		tx_data_spi = ADS1291_2_OPC_WAKEUP;
 	
-		nrf_drv_spi_transfer(&spi, &tx_data_spi, 1, &rx_data_spi, 1);
-		nrf_delay_ms(10);	// Allow time to wake up - 10ms
+		ads_spi_xfer(&tx_data_spi, 1, &rx_data_spi, 1);
+		// Conversions resume right away; mark the ones before the device has settled.
+		m_wake_ticks = hal_clock_ticks();
+		m_settling	 = true;
 		NRF_LOG_PRINTF(" ADS1291-2 Wakeup..\r\n");
 }
 
@@ -219,7 +494,7 @@ void ads1291_2_soft_start_conversion(void) {
 	
 		tx_data_spi = ADS1291_2_OPC_START;
 	
-		nrf_drv_spi_transfer(&spi, &tx_data_spi, 1, &rx_data_spi, 1);
+		ads_spi_xfer(&tx_data_spi, 1, &rx_data_spi, 1);
 		NRF_LOG_PRINTF(" Start ADC conversion..\r\n");
 }
 
@@ -228,8 +503,11 @@ void ads1291_2_stop_rdatac(void) {
 		uint8_t rx_data_spi;
 	
 		tx_data_spi = ADS1291_2_OPC_SDATAC;
-	
-		nrf_drv_spi_transfer(&spi, &tx_data_spi, 1, &rx_data_spi, 1);
+		
+		acq_pause();
+		acq_resume(ADS1291_2_ACQ_IDLE);
+		ads_spi_xfer(&tx_data_spi, 1, &rx_data_spi, 1);
+		m_rdatac = false;
 		NRF_LOG_PRINTF(" Continuous Data Output Disabled..\r\n");
 }
 
@@ -237,22 +515,70 @@ void ads1291_2_start_rdatac(void) {
 		uint8_t tx_data_spi;
 		uint8_t rx_data_spi;
 		tx_data_spi = ADS1291_2_OPC_RDATAC;
-		nrf_drv_spi_transfer(&spi, &tx_data_spi, 1, &rx_data_spi, 1);
+		ads_spi_xfer(&tx_data_spi, 1, &rx_data_spi, 1);
+		m_rdatac = true;
+		if (m_acq_state == ADS1291_2_ACQ_IDLE) {
+				frame_ring_init(&m_frame_ring);
+				frame_decim_init(&m_decim, m_decim.log2_ratio);
+				m_drdy_index = 0;
+		}
+		m_acq_state = ADS1291_2_ACQ_ARMED;
 		NRF_LOG_PRINTF(" Continuous Data Output Enabled..\r\n");
 }
 
-void ads1291_2_powerdn(void)
+void ads1291_2_oversample_set(uint8_t data_rate) {
+		m_oversample_dr = MIN(data_rate, ADS1291_2_REG_CONFIG1_DR_MAX);
+}
+
+void set_sampling_rate (uint8_t sampling_rate) {
+		uint8_t output_dr = MIN(sampling_rate & ADS1291_2_REG_CONFIG1_DR_MASK, ADS1291_2_REG_CONFIG1_DR_MAX);
+		uint8_t afe_dr    = MAX(output_dr, m_oversample_dr);
+		uint8_t config1   = ADS1291_2_REG_CONFIG1_CONTINUOUS_CONVERSION_MODE | afe_dr;
+	
+		// Acquisition is held rather than stopped so frames still in the ring are kept; DRDY
+		// pulses while the commit leaves RDATAC count as missed frames. An unchanged CONFIG1
+		// costs nothing.
+		ads1291_2_acq_state_t prev = acq_pause();
+		APP_ERROR_CHECK(ads1291_2_reg_set(ADS1291_2_REGADDR_CONFIG1, config1));
+		APP_ERROR_CHECK(ads1291_2_regs_commit());
+		// The SPI handler is held off, and conversions until now are missed anyway.
+		frame_decim_config(&m_decim, afe_dr - output_dr, m_drdy_index);
+		acq_resume(prev);
+		NRF_LOG_PRINTF(" Data rate set to %d SPS (converter %d SPS)..\r\n", ADS1291_2_DR_TO_SPS(output_dr),
+		               ADS1291_2_DR_TO_SPS(afe_dr));
+}
+
+/**@brief Next step of the sequence started by ads1291_2_startup_begin(). app_timer context.
+ */
+static void startup_timeout(void)
 {
-	nrf_gpio_pin_clear(ADS1291_2_PWDN_PIN);
-	nrf_delay_ms(10);
-	NRF_LOG_PRINTF(" ADS POWERED DOWN..\r\n");
+		switch (m_startup) {
+				case ADS1291_2_STARTUP_RESET:
+						hal_pwdn_set(true);
+						m_startup = ADS1291_2_STARTUP_POR;
+						hal_timer_start(ADS1291_2_POR_MS);
+						break;
+				case ADS1291_2_STARTUP_POR:
+						m_startup = ADS1291_2_STARTUP_DONE;
+						break;
+				default:
+						break;
+		}
 }
 
-void ads1291_2_powerup(void)
+void ads1291_2_startup_begin(void)
 {
-		nrf_gpio_pin_set(ADS1291_2_PWDN_PIN);
-		nrf_delay_ms(1000);		// Allow time for power-on reset
-		NRF_LOG_PRINTF(" ADS POWERED UP...\r\n");
+		hal_timer_init(startup_timeout);
+		hal_pwdn_set(false);
+		m_regs_valid = false;
+		m_rdatac     = true;
+		m_startup    = ADS1291_2_STARTUP_RESET;
+		hal_timer_start(ADS1291_2_RESET_MS);
+}
+
+bool ads1291_2_startup_done(void)
+{
+		return m_startup == ADS1291_2_STARTUP_DONE;
 }
 
 /* DATA RETRIEVAL FUNCTIONS **********************************************************************************************************************/
@@ -264,27 +590,11 @@ void ads1291_2_check_id(void)
 		device_id = ADS1291_DEVICE_ID;
 		#elif defined(ADS1292)
 		device_id = ADS1292_DEVICE_ID;
+		#elif defined(ADS1292R)
+		device_id = ADS1292R_DEVICE_ID;
 		#endif
-		uint8_t id_reg_val;
-		
-		uint8_t tx_data_spi[3];
-		uint8_t rx_data_spi[7];
-		tx_data_spi[0] = 0x20;	//Request Device ID
-		tx_data_spi[1] = 0x01;	//Intend to read 1 byte
-		tx_data_spi[2] = 0x00;	//This will be replaced by Reg Data
-		nrf_drv_spi_transfer(&spi, tx_data_spi, 2+tx_data_spi[1], rx_data_spi, 2+tx_data_spi[1]);
-		/*
-		nrf_delay_ms(100);
-		NRF_LOG_PRINTF("Check ID: 0x%x \r\n", rx_data_spi[0]);
-		NRF_LOG_PRINTF("Check ID: 0x%x \r\n", rx_data_spi[1]);
-		NRF_LOG_PRINTF("Check ID: 0x%x \r\n", rx_data_spi[2]);
-		NRF_LOG_PRINTF("Check ID: 0x%x \r\n", rx_data_spi[3]);
-		NRF_LOG_PRINTF("Check ID: 0x%x \r\n", rx_data_spi[4]);
-		NRF_LOG_PRINTF("Check ID: 0x%x \r\n", rx_data_spi[5]);
-		NRF_LOG_PRINTF("Check ID: 0x%x \r\n", rx_data_spi[6]);*/
-		/**@NOTE: 0 & 1 contain nonsense information, only third byte we are interested in: **/
-		nrf_delay_ms(1); //Wait for response:
-		id_reg_val = rx_data_spi[2];
+		// Read by ads1291_2_init_regs() with the rest of the register file.
+		uint8_t id_reg_val = ads1291_2_reg_get(ADS1291_2_REGADDR_ID);
 		if (id_reg_val == device_id)
 		{
 			NRF_LOG_PRINTF("Check ID (match): 0x%x \r\n", id_reg_val);
@@ -336,23 +646,95 @@ void get_bvm_sample (body_voltage_t *body_voltage) {
 		//3,4,5 = 24-bit CH1 DATA
 		//6,7,8 = 24-bit CH2 DATA
 }*/
-void get_bvm_sample (body_voltage_t *body_voltage) {
-		uint8_t tx_rx_data[9] = {0x00, 0x00, 0x00,
-														0x00, 0x00, 0x00,
-														0x00, 0x00, 0x00};
-		
-		nrf_drv_spi_transfer(&spi, tx_rx_data, 9, tx_rx_data, 9);
-		uint8_t cnt = 0;
-		/**/do { 
-			cnt++;
-			if(tx_rx_data[6]==0xC0) {
-				*body_voltage = ((tx_rx_data[3] << 8) | tx_rx_data[4]);
-				//NRF_LOG_PRINTF("[cnt] = %d, bv = %d\r\n",cnt ,*body_voltage);
-				break;
-			}
-			nrf_delay_us(1);
-		} while (cnt<255);
+/**@brief Convert a channel code to the sample type carried by the BMS.
+ */
+static body_voltage_t bvm_sample_from_code(int32_t code) {
+#if defined(BLE_BMS_SAMPLE_24BIT)
+		return code;
+#else
+		// Upper 16 bits of the code.
+		return (body_voltage_t)(code >> 8);
+#endif
+}
+
+/**@brief Convert a frame to the samples carried by the BMS, one per channel.
+ */
+void get_bvm_sample (ads1291_2_frame_t const *p_frame, body_voltage_t *body_voltage) {
+		body_voltage[0] = bvm_sample_from_code(p_frame->ch1);
+#if (BLE_BMS_MAX_CHANNELS > 1)
+		body_voltage[1] = bvm_sample_from_code(p_frame->ch2);
+#endif
+}
+
+bool ads1291_2_lead_off_update(ads1291_2_frame_t const *p_frame, uint8_t *p_loff_stat) {
+		uint8_t loff_stat = ADS1291_2_STAT_LOFF(p_frame->stat);
+		bool    changed   = (loff_stat != m_loff_stat);
+		m_loff_stat  = loff_stat;
+		*p_loff_stat = loff_stat;
+		return changed;
+}
+
+uint32_t ads1291_2_frames_peek(ads1291_2_frame_t const ** pp_frames) {
+		return frame_ring_peek(&m_frame_ring, pp_frames);
+}
+
+void ads1291_2_frames_consume(uint32_t count) {
+		frame_ring_consume(&m_frame_ring, count);
+}
+
+uint32_t ads1291_2_frames_overrun(void) {
+		return m_frame_ring.overruns;
+}
+
+uint32_t ads1291_2_frames_pending(void) {
+		return frame_ring_count(&m_frame_ring);
+}
+
+/**@brief DRDY falling edge: start clocking out the frame.
+ *
+ * @details Called from the GPIOTE handler. The transfer completes in spi_event_handler(),
+ *          which publishes the frame for get_bvm_sample().
+ */
+void ads1291_2_drdy_handler(void) {
+		if (m_acq_state == ADS1291_2_ACQ_IDLE) {
+				return;
+		}
+		if (m_acq_state == ADS1291_2_ACQ_ARMED) {
+				m_acq_state = ADS1291_2_ACQ_TRANSFER;
+				m_xfer_index = m_drdy_index;
+				hal_drdy_time(&m_xfer_ticks, &m_xfer_stamp);
+#if defined(ADS1291_2_PROFILE)
+				m_xfer_cycles = hal_cycles();
+#endif
+				if (hal_spi_transfer(m_frame_tx, ADS1291_2_FRAME_LEN, m_frame_rx, ADS1291_2_FRAME_LEN) != NRF_SUCCESS) {
+						m_acq_state = ADS1291_2_ACQ_ARMED;
+						m_frames_missed++;
+				}
+		} else {
+				m_frames_missed++;
+		}
+		m_drdy_index++;
+}
+
+uint32_t ads1291_2_frames_missed(void) {
+		return m_frames_missed;
+}
+
+uint32_t ads1291_2_frames_unsynced(void) {
+		return m_frames_unsynced;
+}
+
+#if defined(ADS1291_2_PROFILE)
+void ads1291_2_decim_cycles(uint32_t * p_mean, uint32_t * p_max) {
+		*p_mean = m_decim_pushes ? (m_decim_cycles / m_decim_pushes) : 0;
+		*p_max  = m_decim_cycles_max;
+}
+
+void ads1291_2_frame_cycles(uint32_t * p_mean, uint32_t * p_max) {
+		*p_mean = m_frame_reads ? (m_frame_cycles / m_frame_reads) : 0;
+		*p_max  = m_frame_cycles_max;
 }
+#endif
 
 
 /*
@@ -28,7 +28,7 @@
 #define ADS1291_2_H__
  
 #include <stdint.h>
-#include "nrf_drv_spi.h"
+#include <stdbool.h>
 #include "ble_bms.h"
 
 //#ifdef __cplusplus
@@ -58,6 +58,54 @@ typedef enum
 
 #define ADS1291_2_NUM_REGS							12
 
+#define ADS1291_2_FRAME_LEN							9				///< RDATAC frame: 24-bit STAT, CH1, CH2.
+
+#define ADS1291_2_RESET_MS							10			///< PWDN held low before a power-up, well above tRST (1 tMOD).
+#if !defined(ADS1291_2_POR_MS)
+#define ADS1291_2_POR_MS								1000		///< From PWDN high to the first command: power-on reset, VCAP1 and reference settling.
+#endif
+#if !defined(ADS1291_2_WAKE_SETTLE_MS)
+#define ADS1291_2_WAKE_SETTLE_MS				10			///< Frames converted this long after ads1291_2_wake() are marked settling.
+#endif
+
+/**
+ *	\brief Progress of ads1291_2_startup_begin().
+ */
+typedef enum
+{
+	ADS1291_2_STARTUP_IDLE,					///< Not started.
+	ADS1291_2_STARTUP_RESET,				///< PWDN low.
+	ADS1291_2_STARTUP_POR,					///< PWDN high, power-on reset running.
+	ADS1291_2_STARTUP_DONE					///< Ready for commands.
+} ads1291_2_startup_t;
+
+/* SCLK has nothing to do with the conversion clock: the modulator runs at fMOD = fCLK/4 = 128 kHz
+ * from the 512 kHz oscillator whatever the bus does. It only bounds how long a frame read holds
+ * the bus, ADS1291_2_FRAME_BUS_NS(), which has to end well inside one conversion period. The
+ * device takes SCLK up to 20 MHz (tSCLK >= 50 ns); the SPI master runs at 125 kHz to 8 MHz in
+ * powers of two, and the nRF51 SPI0 interrupts once per byte, so above about 4 MHz the handler
+ * rather than SCLK sets the pace. Multi-byte commands (RREG, WREG) need 4 tCLK (7.8 us) from the
+ * end of one byte to the end of the next (tSDECODE), which back-to-back bytes only give at
+ * ADS1291_2_SPI_CMD_HZ, so commands drop to that rate and frame reads run at ADS1291_2_SPI_HZ.
+ */
+#if !defined(ADS1291_2_SPI_HZ)
+#define ADS1291_2_SPI_HZ								4000000			///< SCLK of RDATAC frame reads. Override with -DADS1291_2_SPI_HZ=.
+#endif
+#define ADS1291_2_SPI_CMD_HZ						1000000			///< SCLK of command transfers: 8 us per byte covers tSDECODE.
+#define ADS1291_2_SCLK_MAX_HZ						20000000		///< tSCLK min, 50 ns.
+#define ADS1291_2_FRAME_BUS_NS(HZ)			((uint32_t)((ADS1291_2_FRAME_LEN * 8 * 1000000000ULL) / (HZ)))	///< Time a frame read holds the bus at SCLK HZ.
+
+#if (ADS1291_2_SPI_HZ > ADS1291_2_SCLK_MAX_HZ)
+#error "ADS1291_2_SPI_HZ is above the ADS1291/2 SCLK limit"
+#elif (ADS1291_2_SPI_HZ != 1000000) && (ADS1291_2_SPI_HZ != 2000000) && (ADS1291_2_SPI_HZ != 4000000) && (ADS1291_2_SPI_HZ != 8000000)
+/* 125 to 500 kHz are nRF51 rates too, but a 72-bit frame then outlasts the 125 us period at 8000 SPS. */
+#error "ADS1291_2_SPI_HZ must be 1, 2, 4 or 8 MHz"
+#endif
+
+#define ADS1291_2_STAT_LOFF_POS					15			///< LOFF_STAT[4:0] in the STAT word of a frame.
+#define ADS1291_2_STAT_LOFF_MASK				0x1F
+#define ADS1291_2_STAT_LOFF(stat)				((uint8_t)(((stat) >> ADS1291_2_STAT_LOFF_POS) & ADS1291_2_STAT_LOFF_MASK))	///< Lead-off bits of a frame, see ADS1291_2_REG_LOFF_STAT_IN1P_OFF.
+
 /**
  *	\brief ADS1291_2 register addresses.
  *
@@ -137,6 +185,9 @@ typedef enum
 #define ADS1291_2_REG_CONFIG1_4000_SPS								5
 #define	ADS1291_2_REG_CONFIG1_FMOD_DIV_BY_16		 			6		///< Data is output at FMOD/16, or 8000 SPS.
 #define ADS1291_2_REG_CONFIG1_8000_SPS								6
+#define ADS1291_2_REG_CONFIG1_DR_MASK								0x07
+#define ADS1291_2_REG_CONFIG1_DR_MAX								ADS1291_2_REG_CONFIG1_8000_SPS
+#define ADS1291_2_DR_TO_SPS(dr)											(125u << (dr))		///< Output data rate of a CONFIG1.DR code.
 
 /**
  *  \brief Combined value of reserved bits in CONFIG1 register.
@@ -405,11 +456,15 @@ typedef enum
 
 /* RESP1 REGISTER *****************************************************************/
 
-/* RESP1 controls respiration functionality that is:
- * 				1) only present in the ADS1292R
- *				2) not supported by the current board design
- * Therefore this register is currently unimplemented by the present API.
+/* RESP1 controls respiration functionality that is only present in the ADS1292R. The
+ * demodulated signal replaces CH1, see ADS1291_2_REGDEFAULT_RESP1.
+ */
+
+/**
+ *  \brief Bit mask definitions for RESP1.RESP_DEMOD_EN1 and RESP1.RESP_MOD_EN.
  */
+#define ADS1291_2_REG_RESP1_DEMOD_EN							(1<<7)
+#define ADS1291_2_REG_RESP1_MOD_EN								(1<<6)
 
 /**
  *  \brief Combined value of reserved bits in RESP1 register.
@@ -500,18 +555,52 @@ typedef enum
 // DON'T USE > 0x06
 // 
 #define ADS1291_2_REGDEFAULT_CONFIG1		0x01			///< Continuous conversion, data rate = 1000SPS
-#define ADS1291_2_REGDEFAULT_CONFIG2		0xA3			///< LOFF off, REFBUF on, VREF=2.42, CLK_EN=0, INT_TEST=1, TEST_FREQ @ 1Hz
-#define ADS1291_2_REGDEFAULT_LOFF				0x00			///< 95%/5% LOFF comparator threshold, DC lead-off at 6 nA	
+#define ADS1291_2_REGDEFAULT_CONFIG2		0xE3			///< LOFF comparators on, REFBUF on, VREF=2.42, CLK_EN=0, INT_TEST=1, TEST_FREQ @ 1Hz
+#define ADS1291_2_REGDEFAULT_LOFF				0x10			///< 95%/5% LOFF comparator threshold, DC lead-off at 6 nA	
+#if defined(ADS1292R)
+#define ADS1291_2_REGDEFAULT_CH1SET			0x00			///< Channel on, G=6, normal electrode (respiration demodulator output)
+#define ADS1291_2_REGDEFAULT_CH2SET			0x60			///< Channel on, G=12, normal electrode (ECG)
+#define ADS1291_2_REGDEFAULT_RLD_SENS 	0x2C			///< Chop @ fmod/16, RLD buffer on, LOFF off, RLD derivation from CH2 P+N
+#define ADS1291_2_REGDEFAULT_LOFF_SENS	0x0C			///< Current source @ IN+, sink @ IN-, lead-off sensed on IN2P and IN2N
+#define ADS1291_2_ECG_CHANNELS					0x02			///< Channels carrying ECG, bit 0 = CH1: CH2 only
+#elif defined(ADS1292)
+#define ADS1291_2_REGDEFAULT_CH1SET			0x60			///< Channel on, G=12, normal electrode
+#define ADS1291_2_REGDEFAULT_CH2SET			0x60			///< Channel on, G=12, normal electrode
+#define ADS1291_2_REGDEFAULT_RLD_SENS 	0x23			///< Chop @ fmod/16, RLD buffer on, LOFF off, RLD derivation from CH1 P+N
+#define ADS1291_2_REGDEFAULT_LOFF_SENS	0x0F			///< Current source @ IN+, sink @ IN-, lead-off sensed on IN1P, IN1N, IN2P and IN2N
+#define ADS1291_2_ECG_CHANNELS					0x03			///< Channels carrying ECG, bit 0 = CH1: CH1 and CH2
+#else
 #define ADS1291_2_REGDEFAULT_CH1SET			0x60			///< Channel on, G=12, normal electrode
 #define ADS1291_2_REGDEFAULT_CH2SET			0x91			///< Channel off, G=1, input short
 #define ADS1291_2_REGDEFAULT_RLD_SENS 	0x23			///< Chop @ fmod/16, RLD buffer on, LOFF off, RLD derivation from CH1 P+N
-#define ADS1291_2_REGDEFAULT_LOFF_SENS	0x00			///< Current source @ IN+, sink @ IN-, all LOFF channels disconnected
+#define ADS1291_2_REGDEFAULT_LOFF_SENS	0x03			///< Current source @ IN+, sink @ IN-, lead-off sensed on IN1P and IN1N
+#define ADS1291_2_ECG_CHANNELS					0x01			///< Channels carrying ECG, bit 0 = CH1: CH1 only
+#endif
 #define ADS1291_2_REGDEFAULT_LOFF_STAT	0x00			///< Fmod = fclk/4 (for fclk = 512 kHz)
+#if defined(ADS1292R)
+#define ADS1291_2_REGDEFAULT_RESP1			0xEA			///< Resp demodulation and modulation on, phase 112.5 deg, internal clock
+#define ADS1291_2_REGDEFAULT_RESP2			0x03			///< Offset calibration disabled, resp at 32 kHz, RLD internally generated
+#else
 #define ADS1291_2_REGDEFAULT_RESP1			0x02			///< Resp measurement disabled
 #define ADS1291_2_REGDEFAULT_RESP2			0x07			///< Offset calibration disabled, RLD internally generated
+#endif
 #define ADS1291_2_REGDEFAULT_GPIO				0x00			///< All GPIO set to output, logic low
 /**@TYPEDEFS: */
-typedef int16_t body_voltage_t;
+// body_voltage_t is defined in ble_bms.h, selected by BLE_BMS_SAMPLE_24BIT.
+
+/**
+ *	\brief One decoded RDATAC frame.
+ */
+typedef struct
+{
+	uint32_t	stat;				///< 24-bit status word (1100 + LOFF_STAT[4:0] + GPIO[1:0] + 13 zeros).
+	int32_t		ch1;				///< Channel 1, sign-extended from 24 bits.
+	int32_t		ch2;				///< Channel 2, sign-extended from 24 bits.
+	uint32_t	index;			///< Output frame number since RDATAC was started (the conversion number without oversampling); skipped numbers are frames lost before the ring.
+	uint32_t	ticks;			///< hal_clock_ticks() (RTC1) at the DRDY edge; when the handler ran, without ADS1291_2_DRDY_CAPTURE.
+	uint16_t	stamp;			///< TIMER1 at HAL_STAMP_HZ captured by the DRDY edge through PPI, 0 without ADS1291_2_DRDY_CAPTURE.
+	bool			settling;		///< Converted within ADS1291_2_WAKE_SETTLE_MS of ads1291_2_wake(), before the reference and filter have settled.
+} ads1291_2_frame_t;
 /**************************************************************************************************************************************************
 *               Prototypes                                                                                                                        *
 **************************************************************************************************************************************************/
@@ -520,45 +609,76 @@ void init_buf(uint8_t * const p_tx_buffer,
                      uint8_t * const p_rx_buffer,
                      const uint16_t  len);
 /**
- *	\brief Initialize the ADS1291/2.
- *
- * This function performs the power-on reset and initialization procedure documented on page 58 of the
- * ADS1291_2 datasheet, up to "Send SDATAC Command."
+ *	\brief Initialize the ADS1291/2 registers.
  *
- * \pre Requires spi_master.h from the nRF51 SDK.
- * \return Zero if successful, or an error code if unsuccessful.
+ * Reads the register file into the driver's shadow (ads1291_2_regs_read()), then commits the
+ * ADS1291_2_REGDEFAULT_* values: only the registers that differ from what reset left are
+ * written, and the result is verified. Call after power-up, outside RDATAC or not.
  */
 void ads1291_2_init_regs(void);
 
 /**
- *	\brief Read a single register from the ADS1291_2.
+ *	\brief Read registers from the ADS1291/2.
  *
- * This function sends the RREG opcode, logical OR'd with the specified register address, and
- * writes the obtained register value to a variable. This command will have no effect if the 
- * device is in continuous read mode.
+ * Sends one RREG burst. The device ignores RREG in continuous read mode, so RDATAC is left
+ * for the transfer and re-entered afterwards. Updates the register shadow.
  *
- * \pre Requires spi.h from the Atmel Software Framework.
- * \param reg_addr The register address of the register to be read.
- * \param num_to_read The number of registers to read, starting at @param(reg_addr).
- * \param read_reg_val_ptr Pointer to the variable to store the read register value(s).
- * \return Zero if successful, or an error code if unsuccessful.
+ * \param reg_addr The register address of the first register to be read.
+ * \param num_to_read The number of registers to read, starting at reg_addr.
+ * \param read_reg_val_ptr Set to the register values, num_to_read bytes.
+ * \return NRF_SUCCESS, or NRF_ERROR_INVALID_PARAM if the range is outside the register file.
  */
-void ads1291_2_rreg(uint8_t reg_addr, uint8_t num_to_read, uint8_t* read_reg_val_ptr);
+uint32_t ads1291_2_rreg(uint8_t reg_addr, uint8_t num_to_read, uint8_t* read_reg_val_ptr);
 
 /**
- *	\brief Write a single register on the ADS1291_2.
+ *	\brief Write registers on the ADS1291/2, unconditionally and without verifying.
  *
- * This function sends the WREG opcode, logical OR'd with the specified register address, and
- * then writes the specified value to that register. This command will have no effect if the 
- * device is in continuous read mode.
+ * Sends one WREG burst, leaving and re-entering RDATAC as ads1291_2_rreg() does. Prefer
+ * ads1291_2_reg_set() and ads1291_2_regs_commit().
  *
- * \pre Requires spi_master.h from the nRF51 SDK.
- * \param reg_addr The register address of the register to be written.
- * \param num_to_write The number of registers to write, starting at @param(reg_addr).
- * \param write_reg_val_ptr The value(s) to be written to the specified register.
- * \return Zero if successful, or an error code if unsuccessful.
+ * \param reg_addr The register address of the first register to be written.
+ * \param num_to_write The number of registers to write, starting at reg_addr.
+ * \param write_reg_val_ptr The values to be written.
+ * \return NRF_SUCCESS, or NRF_ERROR_INVALID_PARAM if the range is outside the register file.
  */
-void ads1291_2_wreg(uint8_t reg_addr, uint8_t num_to_write, uint8_t* write_reg_val_ptr);
+uint32_t ads1291_2_wreg(uint8_t reg_addr, uint8_t num_to_write, uint8_t const * write_reg_val_ptr);
+
+/**
+ *	\brief Read the whole register file into the shadow kept by the driver.
+ *
+ * Needed once after each power-up before ads1291_2_regs_commit(); ads1291_2_init_regs() does it.
+ *
+ * \return NRF_SUCCESS.
+ */
+uint32_t ads1291_2_regs_read(void);
+
+/**
+ *	\brief Get a register from the shadow, as last written or read. No bus traffic.
+ */
+uint8_t ads1291_2_reg_get(uint8_t reg_addr);
+
+/**
+ *	\brief Stage a register value for the next ads1291_2_regs_commit(). No bus traffic.
+ *
+ * \return NRF_SUCCESS, or NRF_ERROR_INVALID_PARAM for ID or an address past GPIO.
+ */
+uint32_t ads1291_2_reg_set(uint8_t reg_addr, uint8_t value);
+
+/**
+ *	\brief Write the staged registers that differ from the shadow and verify them.
+ *
+ * Changed registers go out in as few WREG bursts as cost the fewest bytes, at most two
+ * unchanged registers being rewritten to join two runs. One RREG burst over the written span
+ * then verifies them, ignoring read-only bits. RDATAC is left and re-entered around the
+ * transfers, a few hundred microseconds at ADS1291_2_SPI_CMD_HZ; with nothing changed there
+ * is no bus traffic at all. Acquisition is held off meanwhile and its DRDY edges counted as
+ * missed. Call from the main context.
+ *
+ * \return NRF_SUCCESS, NRF_ERROR_INVALID_STATE if the shadow has not been read since power-up,
+ *         or NRF_ERROR_INTERNAL if a register read back wrong. The shadow then holds what
+ *         was read.
+ */
+uint32_t ads1291_2_regs_commit(void);
 
 /**
  *	\brief Put the ADS1291_2 in standby mode.
@@ -578,6 +698,9 @@ void ads1291_2_standby(void);
  * This function sends the WAKEUP opcode to the ADS1291_2. This returns the device to normal operation 
  * after entering standby mode using ads1291_2_standby(). The host must wait 4 ADS1291_2 clock cycles
  * (approximately 2 us at 2.048 MHz) after sending this opcode to allow the device to wake up. 
+ * It does not wait for the conversions to settle: frames converted in the next
+ * ADS1291_2_WAKE_SETTLE_MS have ads1291_2_frame_t.settling set instead, so it may be called
+ * from a BLE event handler.
  *
  * \pre Requires spi_master.h from the nRF51 SDK.
  * \return Zero if successful, or an error code if unsuccessful.
@@ -664,9 +787,21 @@ void ads1291_2_stop_rdatac(void);
 
 void ads1291_2_calibrate(void);
 	
-void ads1291_2_powerdn(void);
+/**
+ *	\brief Pulse PWDN low for ADS1291_2_RESET_MS, then wait ADS1291_2_POR_MS for the power-on
+ *	reset, without blocking.
+ *
+ * The reset pulse and the power-on reset run on the HAL timer (app_timer), so the SoftDevice,
+ * the services and advertising come up meanwhile. Commands may be sent once
+ * ads1291_2_startup_done() returns true; continue with ads1291_2_init_regs(). Call after
+ * hal_drdy_init(), which configures PWDN.
+ */
+void ads1291_2_startup_begin(void);
 
-void ads1291_2_powerup(void);
+/**
+ *	\brief Whether the sequence started by ads1291_2_startup_begin() has ended.
+ */
+bool ads1291_2_startup_done(void);
 
 void ads1291_2_soft_reset(void);
 
@@ -676,9 +811,134 @@ void ads1291_2_check_id(void);
 /**@DATA RETRIEVAL FUNCTIONS****/
 
 
-//void get_bvm_sample (body_voltage_t *body_voltage);
-void get_bvm_sample (body_voltage_t *body_voltage);
+/**
+ *	\brief DRDY edge handler. Starts the non-blocking read of the pending frame.
+ *
+ * Must be called from the DRDY GPIOTE event. The frame is completed and published from the
+ * SPI event handler, so neither context waits on the bus.
+ */
+void ads1291_2_drdy_handler(void);
+
+/**
+ *	\brief Number of DRDY edges that could not be serviced because the bus was busy.
+ */
+uint32_t ads1291_2_frames_missed(void);
+
+/**
+ *	\brief Number of frames dropped because their STAT word did not start with 1100b (bus slip).
+ */
+uint32_t ads1291_2_frames_unsynced(void);
+
+/**
+ *	\brief Change the SCLK of frame reads, ADS1291_2_SPI_HZ after a reset.
+ *
+ * Safe while acquiring; the change takes effect from the next frame read.
+ *
+ * \param hz  SCLK in Hz. It must be a rate the SPI master supports, at most
+ *            ADS1291_2_SCLK_MAX_HZ, and fast enough to read a frame within the 125 us period
+ *            at 8000 SPS.
+ * \return NRF_SUCCESS, or NRF_ERROR_INVALID_PARAM leaving the SCLK unchanged.
+ */
+uint32_t ads1291_2_sclk_set(uint32_t hz);
+
+/**
+ *	\brief SCLK of frame reads, in Hz.
+ */
+uint32_t ads1291_2_sclk_get(void);
+
+/**
+ *	\brief Time one frame read holds the bus at the current SCLK, in ns.
+ *
+ * This is the bit time alone; ads1291_2_frame_cycles() measures the whole read.
+ */
+uint32_t ads1291_2_frame_bus_ns(void);
+
+#if defined(ADS1291_2_PROFILE)
+/**
+ *	\brief CPU cycles the decimator (frame_decim.h) spent per conversion, from hal_cycles().
+ *
+ * \param p_mean Set to the mean since RDATAC was first started.
+ * \param p_max  Set to the worst case, which is a conversion ending a block.
+ */
+void ads1291_2_decim_cycles(uint32_t * p_mean, uint32_t * p_max);
+
+/**
+ *	\brief CPU cycles from each DRDY edge to the end of its frame read, from hal_cycles().
+ *
+ * Includes the per-byte SPI interrupts and anything that preempts them, so it is the bus time
+ * the acquisition really costs at the current SCLK.
+ *
+ * \param p_mean Set to the mean since RDATAC was first started.
+ * \param p_max  Set to the worst case.
+ */
+void ads1291_2_frame_cycles(uint32_t * p_mean, uint32_t * p_max);
+#endif
+
+/**
+ *	\brief Get the longest contiguous run of acquired frames waiting to be sent.
+ *
+ * Frames are queued by the SPI handler in a lock-free single-producer/single-consumer ring,
+ * so this may be called from the main loop while acquisition keeps running.
+ *
+ * \param pp_frames Set to the oldest queued frame.
+ * \return Number of frames readable at *pp_frames.
+ */
+uint32_t ads1291_2_frames_peek(ads1291_2_frame_t const ** pp_frames);
+
+/**
+ *	\brief Release frames obtained with ads1291_2_frames_peek().
+ */
+void ads1291_2_frames_consume(uint32_t count);
+
+/**
+ *	\brief Number of frames dropped because the frame ring was full.
+ */
+uint32_t ads1291_2_frames_overrun(void);
+
+/**
+ *	\brief Number of frames waiting in the frame ring.
+ */
+uint32_t ads1291_2_frames_pending(void);
+
+/**
+ *	\brief Convert a frame to the samples carried by the BMS.
+ *
+ * \param body_voltage BLE_BMS_MAX_CHANNELS samples, CH1 first.
+ */
+void get_bvm_sample (ads1291_2_frame_t const *p_frame, body_voltage_t *body_voltage);
 //uint32_t get_bvm_sample (ble_bms_t m_bms, body_voltage_t *body_voltage);
+
+/**
+ *	\brief Track the lead-off state through the STAT word of each frame.
+ *
+ * Call for every frame taken from the ring, in order. The LOFF_STAT bits are compared with
+ * those of the previous frame, so a lead coming off or back on is seen one conversion after
+ * the comparators flip, without the client having to guess it from the waveform.
+ *
+ * \param p_loff_stat Set to LOFF_STAT[4:0] of the frame, a 1 bit per input that is off.
+ * \return true if the bits differ from the previous frame.
+ */
+bool ads1291_2_lead_off_update(ads1291_2_frame_t const *p_frame, uint8_t *p_loff_stat);
+/**
+ *	\brief Set the lowest rate the converter runs at.
+ *
+ * Output rates below it are reached by running the converter at this rate and decimating
+ * (frame_decim.h), which lowers the noise. Takes effect with the next set_sampling_rate().
+ *
+ * \param data_rate CONFIG1.DR code; ADS1291_2_REG_CONFIG1_125_SPS turns oversampling off.
+ */
+void ads1291_2_oversample_set(uint8_t data_rate);
+/**
+ *	\brief Change the output data rate while streaming.
+ *
+ * Commits CONFIG1 with ads1291_2_regs_commit(), which leaves RDATAC only if the value
+ * changes. Frames of the old rate already in the ring
+ * are kept; conversions during the switch are counted by ads1291_2_frames_missed(). Call from
+ * the main loop, not from an interrupt. With ads1291_2_oversample_set() the converter may run
+ * faster than the output rate.
+ *
+ * \param sampling_rate CONFIG1.DR code of the output rate, ADS1291_2_REG_CONFIG1_125_SPS to ADS1291_2_REG_CONFIG1_8000_SPS.
+ */
 void set_sampling_rate (uint8_t sampling_rate);
 
 void ads1291_2_check_id(void);
@@ -27,8 +27,397 @@
 #include "app_error.h"
 #include "ads1291-2.h"
 #include "nrf_log.h"
+#include "hal.h"
+#include "bms_filter.h"
 
-#define MAX_BVM_LENGTH   		20																							 /**< Maximum size in bytes of a transmitted Body Voltage Measurement. */
+#define MAX_BVM_LENGTH   		BLE_BMS_MAX_BVM_LENGTH																		 /**< Maximum size in bytes of a transmitted Body Voltage Measurement. */
+
+#define BLE_BMS_ATTERR_FORMAT_NOT_SUPPORTED		(BLE_GATT_STATUS_ATTERR_APP_BEGIN + 0)	 /**< Reply to a Data Format write the build cannot produce. */
+#define BLE_BMS_ATTERR_RATE_NOT_SUPPORTED			(BLE_GATT_STATUS_ATTERR_APP_BEGIN + 1)	 /**< Reply to a data rate write outside 125-8000 SPS. */
+#define BLE_BMS_ATTERR_CHANNELS_NOT_SUPPORTED	(BLE_GATT_STATUS_ATTERR_APP_BEGIN + 2)	 /**< Reply to a channels write the device cannot stream. */
+#define BLE_BMS_ATTERR_FILTER_NOT_SUPPORTED		(BLE_GATT_STATUS_ATTERR_APP_BEGIN + 3)	 /**< Reply to a filter write with unknown stage bits. */
+#define BLE_BMS_ATTERR_MODE_NOT_SUPPORTED			(BLE_GATT_STATUS_ATTERR_APP_BEGIN + 4)	 /**< Reply to a mode write with an unknown mode or a zero window. */
+#define BLE_BMS_ATTERR_LOG_NOT_SUPPORTED			(BLE_GATT_STATUS_ATTERR_APP_BEGIN + 5)	 /**< Reply to a log write with an unknown command. */
+
+/**@brief Function for checking whether this build can produce a notification format.
+ */
+static bool bvm_format_supported(uint8_t format)
+{
+    switch (format)
+    {
+        case BLE_BMS_FORMAT_RAW:
+        case BLE_BMS_FORMAT_DELTA:
+            return true;
+#if defined(BLE_BMS_SAMPLE_24BIT)
+        case BLE_BMS_FORMAT_PACKED24:
+            return true;
+#else
+        case BLE_BMS_FORMAT_PACKED16:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+/**@brief Function for checking whether the next notification carries a timestamp.
+ */
+static __INLINE bool bvm_next_is_timed(ble_bms_t * p_bms)
+{
+    if (p_bms->format == BLE_BMS_FORMAT_RAW)
+    {
+        return false;
+    }
+    if ((p_bms->seq % BLE_BMS_TIME_INTERVAL) == 0)
+    {
+        return true;
+    }
+    // PACKED24 only carries the index when the conversions do not follow on.
+    return (p_bms->format == BLE_BMS_FORMAT_PACKED24) &&
+           (p_bms->bvm_index[p_bms->bvm_tail & BLE_BMS_BVM_BUFFER_MASK] != p_bms->bvm_next_index);
+}
+
+/**@brief Function for getting the header length of the next notification.
+ */
+static uint8_t bvm_header_len(ble_bms_t * p_bms)
+{
+    if (p_bms->format == BLE_BMS_FORMAT_RAW)
+    {
+        return 0;
+    }
+    if (p_bms->format == BLE_BMS_FORMAT_PACKED24)
+    {
+        return BLE_BMS_PACKED24_HEADER_LEN +
+               (bvm_next_is_timed(p_bms) ? BLE_BMS_PACKED24_INDEX_LEN + BLE_BMS_HEADER_TIME_LEN : 0);
+    }
+    return BLE_BMS_HEADER_LEN + (bvm_next_is_timed(p_bms) ? BLE_BMS_HEADER_TIME_LEN : 0);
+}
+
+/**@brief Function for getting the number of conversions carried by the next notification.
+ */
+static uint8_t bvm_samples_per_packet(ble_bms_t * p_bms)
+{
+    if (p_bms->format == BLE_BMS_FORMAT_DELTA)
+    {
+        // Variable; wait for a batch so the packet is filled.
+        return p_bms->delta_batch;
+    }
+    return (MAX_BVM_LENGTH - bvm_header_len(p_bms)) / (BLE_BMS_SAMPLE_BYTES * p_bms->channels);
+}
+
+/**@brief Function for getting the number of buffered samples not yet sent.
+ */
+static __INLINE uint16_t bvm_count(ble_bms_t * p_bms)
+{
+    return (uint16_t)(p_bms->bvm_head - p_bms->bvm_tail);
+}
+
+/**@brief Function for getting the samples of a buffered conversion, 0 being the oldest.
+ */
+static __INLINE body_voltage_t const * bvm_at(ble_bms_t * p_bms, uint16_t i)
+{
+    return p_bms->bvm_buffer[(uint16_t)(p_bms->bvm_tail + i) & BLE_BMS_BVM_BUFFER_MASK];
+}
+
+/**@brief Function for selecting the notification format. Restarts the sequence number.
+ */
+static void bvm_format_set(ble_bms_t * p_bms, uint8_t format)
+{
+    p_bms->format        = format;
+    p_bms->seq           = 0;
+    p_bms->bvm_value_end = p_bms->bvm_tail;
+    bms_codec_reset(&p_bms->codec);
+}
+
+/**@brief Function for selecting the number of channels streamed. Restarts the sequence number
+ *        and the summary window.
+ */
+static void bvm_channels_set(ble_bms_t * p_bms, uint8_t channels)
+{
+    p_bms->channels = channels;
+    p_bms->summary_restart = true;
+    bms_codec_channels_set(&p_bms->codec, channels);
+    bvm_format_set(p_bms, p_bms->format);
+}
+
+/**@brief Function for selecting the data rate. Sizes DELTA batches to it.
+ */
+static void bvm_data_rate_set(ble_bms_t * p_bms, uint8_t data_rate)
+{
+    uint32_t batch = (ADS1291_2_DR_TO_SPS(data_rate) * BLE_BMS_DELTA_BATCH_MS) / 1000;
+
+    p_bms->data_rate   = data_rate;
+    p_bms->delta_batch = (uint8_t)MIN(MAX(batch, BLE_BMS_DELTA_BATCH_MIN), BLE_BMS_DELTA_BATCH);
+}
+
+#if defined(BLE_BMS_READ_AUTHORIZE)
+static void on_bvm_read(ble_bms_t * p_bms, ble_evt_t * p_ble_evt);
+#endif
+
+/**@brief Function for handling a write to the data rate characteristic.
+ *
+ * @details Only a valid CONFIG1.DR code is accepted. The ADS1291/2 is reprogrammed later
+ *          from the main loop, see ble_bms_data_rate_take().
+ */
+static void on_data_rate_write(ble_bms_t * p_bms, ble_evt_t * p_ble_evt)
+{
+    ble_gatts_evt_write_t const *          p_write = &p_ble_evt->evt.gatts_evt.params.authorize_request.request.write;
+    ble_gatts_rw_authorize_reply_params_t  auth_reply;
+
+    memset(&auth_reply, 0, sizeof(auth_reply));
+    auth_reply.type = BLE_GATTS_AUTHORIZE_TYPE_WRITE;
+    if ((p_write->len == 1) && (p_write->data[0] <= ADS1291_2_REG_CONFIG1_DR_MAX))
+    {
+        auth_reply.params.write.gatt_status = BLE_GATT_STATUS_SUCCESS;
+        auth_reply.params.write.update      = 1;
+        auth_reply.params.write.len         = 1;
+        auth_reply.params.write.p_data      = p_write->data;
+        if (p_write->data[0] != p_bms->data_rate)
+        {
+            bvm_data_rate_set(p_bms, p_write->data[0]);
+            p_bms->data_rate_changed = true;
+        }
+    }
+    else
+    {
+        auth_reply.params.write.gatt_status = BLE_BMS_ATTERR_RATE_NOT_SUPPORTED;
+    }
+    APP_ERROR_CHECK(sd_ble_gatts_rw_authorize_reply(p_ble_evt->evt.gatts_evt.conn_handle, &auth_reply));
+}
+
+/**@brief Function for handling a write to the channels characteristic.
+ */
+static void on_channels_write(ble_bms_t * p_bms, ble_evt_t * p_ble_evt)
+{
+    ble_gatts_evt_write_t const *          p_write = &p_ble_evt->evt.gatts_evt.params.authorize_request.request.write;
+    ble_gatts_rw_authorize_reply_params_t  auth_reply;
+
+    memset(&auth_reply, 0, sizeof(auth_reply));
+    auth_reply.type = BLE_GATTS_AUTHORIZE_TYPE_WRITE;
+    if ((p_write->len == 1) && (p_write->data[0] >= 1) && (p_write->data[0] <= BLE_BMS_MAX_CHANNELS))
+    {
+        auth_reply.params.write.gatt_status = BLE_GATT_STATUS_SUCCESS;
+        auth_reply.params.write.update      = 1;
+        auth_reply.params.write.len         = 1;
+        auth_reply.params.write.p_data      = p_write->data;
+        p_bms->channels_written = p_write->data[0];
+        p_bms->channels_changed = true;
+    }
+    else
+    {
+        auth_reply.params.write.gatt_status = BLE_BMS_ATTERR_CHANNELS_NOT_SUPPORTED;
+    }
+    APP_ERROR_CHECK(sd_ble_gatts_rw_authorize_reply(p_ble_evt->evt.gatts_evt.conn_handle, &auth_reply));
+}
+
+/**@brief Function for handling a write to the filter characteristic.
+ *
+ * @details The stage is reconfigured later from the main loop, see ble_bms_filter_take().
+ */
+static void on_filter_write(ble_bms_t * p_bms, ble_evt_t * p_ble_evt)
+{
+    ble_gatts_evt_write_t const *          p_write = &p_ble_evt->evt.gatts_evt.params.authorize_request.request.write;
+    ble_gatts_rw_authorize_reply_params_t  auth_reply;
+
+    memset(&auth_reply, 0, sizeof(auth_reply));
+    auth_reply.type = BLE_GATTS_AUTHORIZE_TYPE_WRITE;
+    if ((p_write->len == 1) && ((p_write->data[0] & ~BMS_FILTER_ALL) == 0))
+    {
+        auth_reply.params.write.gatt_status = BLE_GATT_STATUS_SUCCESS;
+        auth_reply.params.write.update      = 1;
+        auth_reply.params.write.len         = 1;
+        auth_reply.params.write.p_data      = p_write->data;
+        if (p_write->data[0] != p_bms->filter)
+        {
+            p_bms->filter         = p_write->data[0];
+            p_bms->filter_changed = true;
+        }
+    }
+    else
+    {
+        auth_reply.params.write.gatt_status = BLE_BMS_ATTERR_FILTER_NOT_SUPPORTED;
+    }
+    APP_ERROR_CHECK(sd_ble_gatts_rw_authorize_reply(p_ble_evt->evt.gatts_evt.conn_handle, &auth_reply));
+}
+
+/**@brief Function for handling a write to the mode characteristic.
+ *
+ * @details Applied from the main loop, see ble_bms_config_apply(). The sample stream then
+ *          stops or resumes; a summary window opens at the next sample. Returning to
+ *          streaming restarts the sequence number.
+ */
+static void on_mode_write(ble_bms_t * p_bms, ble_evt_t * p_ble_evt)
+{
+    ble_gatts_evt_write_t const *          p_write = &p_ble_evt->evt.gatts_evt.params.authorize_request.request.write;
+    ble_gatts_rw_authorize_reply_params_t  auth_reply;
+
+    memset(&auth_reply, 0, sizeof(auth_reply));
+    auth_reply.type = BLE_GATTS_AUTHORIZE_TYPE_WRITE;
+    if ((p_write->len == BLE_BMS_MODE_LEN) && (p_write->data[0] <= BLE_BMS_MODE_SUMMARY) && (p_write->data[1] != 0))
+    {
+        auth_reply.params.write.gatt_status = BLE_GATT_STATUS_SUCCESS;
+        auth_reply.params.write.update      = 1;
+        auth_reply.params.write.len         = BLE_BMS_MODE_LEN;
+        auth_reply.params.write.p_data      = p_write->data;
+        memcpy(p_bms->mode_written, p_write->data, BLE_BMS_MODE_LEN);
+        p_bms->mode_changed = true;
+    }
+    else
+    {
+        auth_reply.params.write.gatt_status = BLE_BMS_ATTERR_MODE_NOT_SUPPORTED;
+    }
+    APP_ERROR_CHECK(sd_ble_gatts_rw_authorize_reply(p_ble_evt->evt.gatts_evt.conn_handle, &auth_reply));
+}
+
+/**@brief Function for handling a write to the log characteristic.
+ *
+ * @details The command is carried out from the main loop, see ble_bms_log_take(), which
+ *          then sets the value; the written byte is not stored.
+ */
+static void on_log_write(ble_bms_t * p_bms, ble_evt_t * p_ble_evt)
+{
+    ble_gatts_evt_write_t const *          p_write = &p_ble_evt->evt.gatts_evt.params.authorize_request.request.write;
+    ble_gatts_rw_authorize_reply_params_t  auth_reply;
+
+    memset(&auth_reply, 0, sizeof(auth_reply));
+    auth_reply.type = BLE_GATTS_AUTHORIZE_TYPE_WRITE;
+    if ((p_write->len == 1) && (p_write->data[0] <= BLE_BMS_LOG_ERASE))
+    {
+        auth_reply.params.write.gatt_status = BLE_GATT_STATUS_SUCCESS;
+        p_bms->log_command = p_write->data[0];
+        p_bms->log_changed = true;
+    }
+    else
+    {
+        auth_reply.params.write.gatt_status = BLE_BMS_ATTERR_LOG_NOT_SUPPORTED;
+    }
+    APP_ERROR_CHECK(sd_ble_gatts_rw_authorize_reply(p_ble_evt->evt.gatts_evt.conn_handle, &auth_reply));
+}
+
+/**@brief Function for handling an authorization request.
+ *
+ * @details Data Format, data rate, channels and filter writes are authorized so unsupported values can be refused with an ATT error
+ *          instead of being stored.
+ */
+static void on_rw_authorize_request(ble_bms_t * p_bms, ble_evt_t * p_ble_evt)
+{
+    ble_gatts_evt_rw_authorize_request_t * p_auth_req = &p_ble_evt->evt.gatts_evt.params.authorize_request;
+    ble_gatts_rw_authorize_reply_params_t  auth_reply;
+
+#if defined(BLE_BMS_READ_AUTHORIZE)
+    if ((p_auth_req->type == BLE_GATTS_AUTHORIZE_TYPE_READ) &&
+        (p_auth_req->request.read.handle == p_bms->bvm_handles.value_handle))
+    {
+        on_bvm_read(p_bms, p_ble_evt);
+        return;
+    }
+#endif
+    if ((p_auth_req->type == BLE_GATTS_AUTHORIZE_TYPE_WRITE) &&
+        (p_auth_req->request.write.handle == p_bms->data_rate_handles.value_handle))
+    {
+        on_data_rate_write(p_bms, p_ble_evt);
+        return;
+    }
+    if ((p_auth_req->type == BLE_GATTS_AUTHORIZE_TYPE_WRITE) &&
+        (p_auth_req->request.write.handle == p_bms->channels_handles.value_handle))
+    {
+        on_channels_write(p_bms, p_ble_evt);
+        return;
+    }
+    if ((p_auth_req->type == BLE_GATTS_AUTHORIZE_TYPE_WRITE) &&
+        (p_auth_req->request.write.handle == p_bms->filter_handles.value_handle))
+    {
+        on_filter_write(p_bms, p_ble_evt);
+        return;
+    }
+    if ((p_auth_req->type == BLE_GATTS_AUTHORIZE_TYPE_WRITE) &&
+        (p_auth_req->request.write.handle == p_bms->mode_handles.value_handle))
+    {
+        on_mode_write(p_bms, p_ble_evt);
+        return;
+    }
+    if ((p_auth_req->type == BLE_GATTS_AUTHORIZE_TYPE_WRITE) &&
+        (p_auth_req->request.write.handle == p_bms->log_handles.value_handle))
+    {
+        on_log_write(p_bms, p_ble_evt);
+        return;
+    }
+    if ((p_auth_req->type != BLE_GATTS_AUTHORIZE_TYPE_WRITE) ||
+        (p_auth_req->request.write.handle != p_bms->format_handles.value_handle))
+    {
+        return;
+    }
+
+    memset(&auth_reply, 0, sizeof(auth_reply));
+    auth_reply.type = BLE_GATTS_AUTHORIZE_TYPE_WRITE;
+    if ((p_auth_req->request.write.len == 1) &&
+        bvm_format_supported(p_auth_req->request.write.data[0]))
+    {
+        auth_reply.params.write.gatt_status = BLE_GATT_STATUS_SUCCESS;
+        auth_reply.params.write.update      = 1;
+        auth_reply.params.write.len         = 1;
+        auth_reply.params.write.p_data      = p_auth_req->request.write.data;
+        p_bms->format_written = p_auth_req->request.write.data[0];
+        p_bms->format_changed = true;
+    }
+    else
+    {
+        auth_reply.params.write.gatt_status = BLE_BMS_ATTERR_FORMAT_NOT_SUPPORTED;
+    }
+    APP_ERROR_CHECK(sd_ble_gatts_rw_authorize_reply(p_ble_evt->evt.gatts_evt.conn_handle, &auth_reply));
+}
+
+/**@brief Function for recording whether the client has enabled measurement notifications.
+ *
+ * @details Nothing encoded while they were off reached the client, so turning them on has
+ *          ble_bms_config_apply() restart the encoder.
+ */
+static void bvm_notify_set(ble_bms_t * p_bms, bool enabled)
+{
+    if (enabled && !p_bms->bvm_notify)
+    {
+        p_bms->notify_started = true;
+    }
+    p_bms->bvm_notify = enabled;
+}
+
+/**@brief Function for reading whether the client has enabled measurement notifications.
+ *
+ * @details Writes to the CCCD arrive as BLE_GATTS_EVT_WRITE, but a bonded client's CCCD is
+ *          restored with its system attributes, without one. Called once the device manager
+ *          has set them, so ble_bms_send() never asks the SoftDevice.
+ */
+static void bvm_notify_read(ble_bms_t * p_bms)
+{
+    ble_gatts_value_t gatts_value;
+    uint8_t           cccd[2];
+
+    memset(&gatts_value, 0, sizeof(gatts_value));
+    gatts_value.len     = sizeof(cccd);
+    gatts_value.offset  = 0;
+    gatts_value.p_value = cccd;
+    if (sd_ble_gatts_value_get(p_bms->conn_handle, p_bms->bvm_handles.cccd_handle, &gatts_value) == NRF_SUCCESS &&
+        gatts_value.len == sizeof(cccd))
+    {
+        bvm_notify_set(p_bms, (cccd[0] & BLE_GATT_HVX_NOTIFICATION) != 0);
+    }
+}
+
+/**@brief Function for rewriting the value of a characteristic the client configures.
+ *
+ * @details Authorized writes are stored by the stack, so the value a client reads is the last
+ *          one written, from any connection, until it is rewritten here.
+ */
+static void config_value_set(uint16_t value_handle, uint8_t * p_value, uint16_t len)
+{
+    ble_gatts_value_t gatts_value;
+
+    memset(&gatts_value, 0, sizeof(gatts_value));
+    gatts_value.len     = len;
+    gatts_value.offset  = 0;
+    gatts_value.p_value = p_value;
+    APP_ERROR_CHECK(sd_ble_gatts_value_set(BLE_CONN_HANDLE_INVALID, value_handle, &gatts_value));
+}
 
 void ble_bms_on_ble_evt(ble_bms_t * p_bms, ble_evt_t * p_ble_evt)
 {
@@ -36,75 +425,634 @@ void ble_bms_on_ble_evt(ble_bms_t * p_bms, ble_evt_t * p_ble_evt)
     {
         case BLE_GAP_EVT_CONNECTED:
 						p_bms->conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
+						p_bms->bvm_notify = false;
+						p_bms->format_written = BLE_BMS_FORMAT_RAW;
+						p_bms->format_changed = true;
+						p_bms->channels_written = 1;
+						p_bms->channels_changed = true;
+						p_bms->pending_len  = 0;
+						p_bms->lead_off_pending = false;
+						p_bms->beat_pending = false;
+						p_bms->mode_written[0] = BLE_BMS_MODE_STREAM;
+						p_bms->mode_written[1] = BLE_BMS_SUMMARY_WINDOW_S;
+						p_bms->mode_changed = true;
+						p_bms->summary_pending = false;
+						p_bms->log_pending = false;
+						// The stack still holds what the last client wrote; show what this connection starts with.
+						config_value_set(p_bms->format_handles.value_handle, &p_bms->format_written, 1);
+						config_value_set(p_bms->channels_handles.value_handle, &p_bms->channels_written, 1);
+						config_value_set(p_bms->mode_handles.value_handle, p_bms->mode_written, BLE_BMS_MODE_LEN);
+						if (p_bms->filter != 0) {
+								p_bms->filter         = 0;
+								p_bms->filter_changed = true;
+								config_value_set(p_bms->filter_handles.value_handle, &p_bms->filter, 1);
+						}
+						p_bms->tx_completed = p_bms->tx_queued;
+						if (hal_gatt_tx_buffers(p_bms->conn_handle, &p_bms->tx_buffers) != NRF_SUCCESS) {
+								p_bms->tx_buffers = 1;
+						}
+						bvm_notify_read(p_bms);
+            break;
+
+        case BLE_GATTS_EVT_SYS_ATTR_MISSING:
+        case BLE_GAP_EVT_CONN_SEC_UPDATE:
+						// dm_ble_evt_handler() runs first and has set the system attributes by now.
+						bvm_notify_read(p_bms);
+            break;
+
+        case BLE_EVT_TX_COMPLETE:
+						// Buffers are free again; the main loop resumes sending on its next pass.
+						p_bms->tx_completed += p_ble_evt->evt.common_evt.params.tx_complete.count;
             break;
             
         case BLE_GAP_EVT_DISCONNECTED:
 						p_bms->conn_handle = BLE_CONN_HANDLE_INVALID;
+						p_bms->bvm_notify = false;
+            break;
+
+        case BLE_GATTS_EVT_WRITE:
+						if (p_ble_evt->evt.gatts_evt.params.write.handle == p_bms->bvm_handles.cccd_handle &&
+						    p_ble_evt->evt.gatts_evt.params.write.len == 2) {
+								bvm_notify_set(p_bms, (p_ble_evt->evt.gatts_evt.params.write.data[0] & BLE_GATT_HVX_NOTIFICATION) != 0);
+						}
+            break;
+
+        case BLE_GATTS_EVT_RW_AUTHORIZE_REQUEST:
+						on_rw_authorize_request(p_bms, p_ble_evt);
             break;
         default:
             break;
     }
 }
 
-/**@brief Function for encoding int16 Body Voltage Measurement buffer to a byte array.
+/**@brief Function for encoding a single sample, little endian.
+ *
+ * @param[in]   sample             Sample to be encoded.
+ * @param[out]  p_encoded_data     Buffer where the encoded data will be written.
+ *
+ * @return      Number of bytes written (BLE_BMS_SAMPLE_BYTES).
+ */
+static uint8_t bvm_sample_encode(body_voltage_t sample, uint8_t * p_encoded_data)
+{
+#if defined(BLE_BMS_SAMPLE_24BIT)
+    p_encoded_data[0] = (uint8_t) ((sample & 0x000000FF) >> 0);
+    p_encoded_data[1] = (uint8_t) ((sample & 0x0000FF00) >> 8);
+    p_encoded_data[2] = (uint8_t) ((sample & 0x00FF0000) >> 16);
+    return 3;
+#else
+    return uint16_encode((uint16_t)sample, p_encoded_data);
+#endif
+}
+
+#if defined(BLE_BMS_READ_AUTHORIZE)
+/**@brief Function for answering a read of the Body Voltage Measurement characteristic.
+ *
+ * @details The value is filled in only when a client asks for it, with the newest conversion.
+ */
+static void on_bvm_read(ble_bms_t * p_bms, ble_evt_t * p_ble_evt)
+{
+    ble_gatts_rw_authorize_reply_params_t auth_reply;
+    uint8_t                               encoded_value[BLE_BMS_SAMPLE_BYTES * BLE_BMS_MAX_CHANNELS];
+    uint8_t                               len = 0;
+    uint8_t                               ch;
+
+    for (ch = 0; ch < p_bms->channels; ch++)
+    {
+        len += bvm_sample_encode(p_bms->bvm_latest[ch], &encoded_value[len]);
+    }
+
+    memset(&auth_reply, 0, sizeof(auth_reply));
+    auth_reply.type                    = BLE_GATTS_AUTHORIZE_TYPE_READ;
+    auth_reply.params.read.gatt_status = BLE_GATT_STATUS_SUCCESS;
+    auth_reply.params.read.update      = 1;
+    auth_reply.params.read.offset      = 0;
+    auth_reply.params.read.len         = len;
+    auth_reply.params.read.p_data      = encoded_value;
+    APP_ERROR_CHECK(sd_ble_gatts_rw_authorize_reply(p_ble_evt->evt.gatts_evt.conn_handle, &auth_reply));
+}
+#endif
+
+/**@brief Function for flagging an encoded packet that carries a sample converted while the AFE settled.
+ *
+ * @param[in]   tail               bvm_tail before the packet was encoded.
+ */
+static void bvm_settling_flag(ble_bms_t * p_bms, uint16_t tail, uint8_t * p_encoded_buffer)
+{
+    for (; tail != p_bms->bvm_tail; tail++)
+    {
+        if (p_bms->bvm_settling[tail & BLE_BMS_BVM_BUFFER_MASK])
+        {
+            p_encoded_buffer[0] |= BLE_BMS_HEADER_FLAG_SETTLING;
+            return;
+        }
+    }
+}
+
+/**@brief Function for encoding the Body Voltage Measurement buffer to a byte array.
+ *
+ * @details Samples are read straight from the circular buffer and released by advancing
+ *          the tail, so nothing is moved when only part of the buffer fits.
+ *
+ * @param[in]   p_bms              Biopotential Measurement Service structure.
+ * @param[out]  p_encoded_buffer   Buffer where the encoded data will be written.
+ *
+ * @return      Size of encoded data.
+ */
+static uint8_t bvm_encode(ble_bms_t * p_bms, uint8_t * p_encoded_buffer)
+{
+    uint8_t  len    = 0;
+    uint8_t  format = p_bms->format;
+    uint16_t count  = bvm_count(p_bms);
+    uint16_t tail   = p_bms->bvm_tail;
+    uint16_t first  = tail & BLE_BMS_BVM_BUFFER_MASK;
+    uint16_t i;
+    uint8_t  ch;
+
+    if (format != BLE_BMS_FORMAT_RAW)
+    {
+        bool     timed = bvm_next_is_timed(p_bms);
+
+        p_encoded_buffer[len++] = format | (timed ? BLE_BMS_HEADER_FLAG_TIME : 0);
+        p_encoded_buffer[len++] = p_bms->seq++;
+        if (timed || format != BLE_BMS_FORMAT_PACKED24)
+        {
+            len += uint16_encode((uint16_t)p_bms->bvm_index[first], &p_encoded_buffer[len]);
+        }
+        if (timed)
+        {
+            p_encoded_buffer[len++] = (uint8_t)(p_bms->bvm_ticks[first] >> 0);
+            p_encoded_buffer[len++] = (uint8_t)(p_bms->bvm_ticks[first] >> 8);
+            p_encoded_buffer[len++] = (uint8_t)(p_bms->bvm_ticks[first] >> 16);
+        }
+    }
+
+    if (format == BLE_BMS_FORMAT_DELTA)
+    {
+        bms_codec_packet_t pkt;
+        int32_t            frame[BLE_BMS_MAX_CHANNELS];
+        bms_codec_packet_begin(&p_bms->codec, &pkt, &p_encoded_buffer[len], MAX_BVM_LENGTH - len);
+        for (i = 0; i < count; i++)
+        {
+            for (ch = 0; ch < p_bms->channels; ch++)
+            {
+                frame[ch] = bvm_at(p_bms, i)[ch];
+            }
+            if (!bms_codec_packet_put_frame(&pkt, frame))
+            {
+                break;
+            }
+        }
+        len += bms_codec_packet_end(&pkt, &p_bms->codec);
+        p_bms->bvm_tail += i;
+        bvm_settling_flag(p_bms, tail, p_encoded_buffer);
+        return len;
+    }
+
+    // Encode body voltage measurement
+    for (i = 0; (i < count) && (len + BLE_BMS_SAMPLE_BYTES * p_bms->channels <= MAX_BVM_LENGTH); i++)
+    {
+        for (ch = 0; ch < p_bms->channels; ch++)
+        {
+            len += bvm_sample_encode(bvm_at(p_bms, i)[ch], &p_encoded_buffer[len]);
+        }
+    }
+    p_bms->bvm_tail += i;
+    if (i > 0)
+    {
+        p_bms->bvm_next_index = p_bms->bvm_index[first] + i;
+    }
+    if (format != BLE_BMS_FORMAT_RAW)
+    {
+        bvm_settling_flag(p_bms, tail, p_encoded_buffer);
+    }
+
+    return len;
+}
+
+/**@brief Function for adding the data rate characteristic.
+ *
+ * @details One byte holding the CONFIG1.DR code. Writes go through authorization so codes
+ *          above 8000 SPS are refused.
+ */
+static uint32_t data_rate_char_add(ble_bms_t * p_bms)
+{
+		uint32_t err_code = 0;
+		ble_uuid_t	 						char_uuid;
+		uint8_t             data_rate_array[1] = {p_bms->data_rate};
+		BLE_UUID_BLE_ASSIGN(char_uuid, BLE_UUID_SAMPLE_RATE_CHAR);
+	
+		ble_gatts_char_md_t char_md;
+	
+		memset(&char_md, 0, sizeof(char_md));
+		char_md.char_props.read = 1;
+		char_md.char_props.write = 1;
+		
+		ble_gatts_attr_md_t cccd_md;
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.write_perm);
+    cccd_md.vloc                = BLE_GATTS_VLOC_STACK;    
+    char_md.p_cccd_md           = &cccd_md;
+    char_md.char_props.notify   = 0;
+		ble_gatts_attr_md_t attr_md;
+    memset(&attr_md, 0, sizeof(attr_md));
+    attr_md.vloc = BLE_GATTS_VLOC_STACK;    
+    attr_md.vlen = 0;
+    attr_md.wr_auth = 1;
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.write_perm);
+		
+		ble_gatts_attr_t    attr_char_value;
+    memset(&attr_char_value, 0, sizeof(attr_char_value));
+    attr_char_value.p_uuid      = &char_uuid;
+    attr_char_value.p_attr_md   = &attr_md;
+		attr_char_value.init_len		= sizeof(uint8_t);
+		attr_char_value.init_offs		= 0;
+		attr_char_value.max_len			= sizeof(uint8_t);
+		attr_char_value.p_value   	= data_rate_array;
+		err_code = sd_ble_gatts_characteristic_add(p_bms->service_handle,
+																							&char_md,
+																							&attr_char_value,
+																							&p_bms->data_rate_handles);
+    APP_ERROR_CHECK(err_code);   
+
+    return NRF_SUCCESS;
+		//SET UP LIKE IN MPU EXAMPLE
+}
+
+/**@brief Function for adding the Data Format characteristic.
+ *
+ * @details One byte holding the current ble_bms_format_t. The client writes it to select the
+ *          notification layout; writes go through authorization so unsupported formats are refused.
+ *
+ * @param[in]   p_bms        Biopotential Measurement Service structure.
+ *
+ * @return      NRF_SUCCESS on success, otherwise an error code.
+ */
+static uint32_t data_format_char_add(ble_bms_t * p_bms)
+{
+		uint32_t err_code = 0;
+		ble_uuid_t	 						char_uuid;
+		uint8_t             format_array[1] = {BLE_BMS_FORMAT_RAW};
+		BLE_UUID_BLE_ASSIGN(char_uuid, BLE_UUID_DATA_FORMAT_CHAR);
+	
+		ble_gatts_char_md_t char_md;
+	
+		memset(&char_md, 0, sizeof(char_md));
+		char_md.char_props.read = 1;
+		char_md.char_props.write = 1;
+		
+		ble_gatts_attr_md_t attr_md;
+    memset(&attr_md, 0, sizeof(attr_md));
+    attr_md.vloc = BLE_GATTS_VLOC_STACK;    
+    attr_md.vlen = 0;
+    attr_md.wr_auth = 1;
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.write_perm);
+		
+		ble_gatts_attr_t    attr_char_value;
+    memset(&attr_char_value, 0, sizeof(attr_char_value));
+    attr_char_value.p_uuid      = &char_uuid;
+    attr_char_value.p_attr_md   = &attr_md;
+		attr_char_value.init_len		= sizeof(uint8_t);
+		attr_char_value.init_offs		= 0;
+		attr_char_value.max_len			= sizeof(uint8_t);
+		attr_char_value.p_value   	= format_array;
+		err_code = sd_ble_gatts_characteristic_add(p_bms->service_handle,
+																							&char_md,
+																							&attr_char_value,
+																							&p_bms->format_handles);
+    APP_ERROR_CHECK(err_code);   
+
+    return NRF_SUCCESS;
+}
+
+/**@brief Function for adding the channels characteristic.
+ *
+ * @details One byte holding the number of channels interleaved in each notification. 1 (CH1
+ *          only) after connecting, so single-channel clients are unaffected; a client of an
+ *          ADS1292/ADS1292R writes 2 to also receive CH2.
+ *
+ * @param[in]   p_bms        Biopotential Measurement Service structure.
+ *
+ * @return      NRF_SUCCESS on success, otherwise an error code.
+ */
+static uint32_t channels_char_add(ble_bms_t * p_bms)
+{
+		uint32_t err_code = 0;
+		ble_uuid_t	 						char_uuid;
+		uint8_t             channels_array[1] = {1};
+		BLE_UUID_BLE_ASSIGN(char_uuid, BLE_UUID_CHANNELS_CHAR);
+	
+		ble_gatts_char_md_t char_md;
+	
+		memset(&char_md, 0, sizeof(char_md));
+		char_md.char_props.read = 1;
+		char_md.char_props.write = 1;
+		
+		ble_gatts_attr_md_t attr_md;
+    memset(&attr_md, 0, sizeof(attr_md));
+    attr_md.vloc = BLE_GATTS_VLOC_STACK;    
+    attr_md.vlen = 0;
+    attr_md.wr_auth = 1;
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.write_perm);
+		
+		ble_gatts_attr_t    attr_char_value;
+    memset(&attr_char_value, 0, sizeof(attr_char_value));
+    attr_char_value.p_uuid      = &char_uuid;
+    attr_char_value.p_attr_md   = &attr_md;
+		attr_char_value.init_len		= sizeof(uint8_t);
+		attr_char_value.init_offs		= 0;
+		attr_char_value.max_len			= sizeof(uint8_t);
+		attr_char_value.p_value   	= channels_array;
+		err_code = sd_ble_gatts_characteristic_add(p_bms->service_handle,
+																							&char_md,
+																							&attr_char_value,
+																							&p_bms->channels_handles);
+    APP_ERROR_CHECK(err_code);   
+
+    return NRF_SUCCESS;
+}
+
+/**@brief Function for adding the filter characteristic.
+ *
+ * @details One byte of BMS_FILTER_* bits. 0 (raw codes) after connecting; writes with
+ *          unknown bits are refused.
+ *
+ * @param[in]   p_bms        Biopotential Measurement Service structure.
+ *
+ * @return      NRF_SUCCESS on success, otherwise an error code.
+ */
+static uint32_t filter_char_add(ble_bms_t * p_bms)
+{
+		uint32_t err_code = 0;
+		ble_uuid_t	 						char_uuid;
+		uint8_t             filter_array[1] = {0};
+		BLE_UUID_BLE_ASSIGN(char_uuid, BLE_UUID_FILTER_CHAR);
+	
+		ble_gatts_char_md_t char_md;
+	
+		memset(&char_md, 0, sizeof(char_md));
+		char_md.char_props.read = 1;
+		char_md.char_props.write = 1;
+		
+		ble_gatts_attr_md_t attr_md;
+    memset(&attr_md, 0, sizeof(attr_md));
+    attr_md.vloc = BLE_GATTS_VLOC_STACK;    
+    attr_md.vlen = 0;
+    attr_md.wr_auth = 1;
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.write_perm);
+		
+		ble_gatts_attr_t    attr_char_value;
+    memset(&attr_char_value, 0, sizeof(attr_char_value));
+    attr_char_value.p_uuid      = &char_uuid;
+    attr_char_value.p_attr_md   = &attr_md;
+		attr_char_value.init_len		= sizeof(uint8_t);
+		attr_char_value.init_offs		= 0;
+		attr_char_value.max_len			= sizeof(uint8_t);
+		attr_char_value.p_value   	= filter_array;
+		err_code = sd_ble_gatts_characteristic_add(p_bms->service_handle,
+																							&char_md,
+																							&attr_char_value,
+																							&p_bms->filter_handles);
+    APP_ERROR_CHECK(err_code);   
+
+    return NRF_SUCCESS;
+}
+
+/**@brief Function for adding the lead-off status characteristic.
+ *
+ * @details BLE_BMS_LEAD_OFF_LEN bytes, read and notify. It changes only when an electrode
+ *          comes off or goes back on, so it costs nothing while the leads are good.
+ *
+ * @param[in]   p_bms        Biopotential Measurement Service structure.
+ *
+ * @return      NRF_SUCCESS on success, otherwise an error code.
+ */
+static uint32_t lead_off_char_add(ble_bms_t * p_bms)
+{
+		uint32_t err_code = 0;
+		ble_uuid_t	 						char_uuid;
+		BLE_UUID_BLE_ASSIGN(char_uuid, BLE_UUID_LEAD_OFF_CHAR);
+	
+		ble_gatts_char_md_t char_md;
+	
+		memset(&char_md, 0, sizeof(char_md));
+		char_md.char_props.read = 1;
+		char_md.char_props.write = 0;
+		
+		ble_gatts_attr_md_t cccd_md;
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.write_perm);
+    cccd_md.vloc                = BLE_GATTS_VLOC_STACK;    
+    char_md.p_cccd_md           = &cccd_md;
+    char_md.char_props.notify   = 1;
+		ble_gatts_attr_md_t attr_md;
+    memset(&attr_md, 0, sizeof(attr_md));
+    attr_md.vloc = BLE_GATTS_VLOC_STACK;    
+    attr_md.vlen = 0;
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&attr_md.write_perm);
+		
+		ble_gatts_attr_t    attr_char_value;
+    memset(&attr_char_value, 0, sizeof(attr_char_value));
+    attr_char_value.p_uuid      = &char_uuid;
+    attr_char_value.p_attr_md   = &attr_md;
+		attr_char_value.init_len		= BLE_BMS_LEAD_OFF_LEN;
+		attr_char_value.init_offs		= 0;
+		attr_char_value.max_len			= BLE_BMS_LEAD_OFF_LEN;
+		attr_char_value.p_value   	= p_bms->lead_off;
+		err_code = sd_ble_gatts_characteristic_add(p_bms->service_handle,
+																							&char_md,
+																							&attr_char_value,
+																							&p_bms->lead_off_handles);
+    APP_ERROR_CHECK(err_code);   
+
+    return NRF_SUCCESS;
+}
+
+/**@brief Function for adding the beat characteristic.
+ *
+ * @details BLE_BMS_BEAT_LEN bytes, read and notify. One notification per heart beat is all a
+ *          client that only needs the heart rate or R-R intervals has to receive.
+ *
+ * @param[in]   p_bms        Biopotential Measurement Service structure.
+ *
+ * @return      NRF_SUCCESS on success, otherwise an error code.
+ */
+static uint32_t beat_char_add(ble_bms_t * p_bms)
+{
+		uint32_t err_code = 0;
+		ble_uuid_t	 						char_uuid;
+		BLE_UUID_BLE_ASSIGN(char_uuid, BLE_UUID_BEAT_CHAR);
+	
+		ble_gatts_char_md_t char_md;
+	
+		memset(&char_md, 0, sizeof(char_md));
+		char_md.char_props.read = 1;
+		char_md.char_props.write = 0;
+		
+		ble_gatts_attr_md_t cccd_md;
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.write_perm);
+    cccd_md.vloc                = BLE_GATTS_VLOC_STACK;    
+    char_md.p_cccd_md           = &cccd_md;
+    char_md.char_props.notify   = 1;
+		ble_gatts_attr_md_t attr_md;
+    memset(&attr_md, 0, sizeof(attr_md));
+    attr_md.vloc = BLE_GATTS_VLOC_STACK;    
+    attr_md.vlen = 0;
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&attr_md.write_perm);
+		
+		ble_gatts_attr_t    attr_char_value;
+    memset(&attr_char_value, 0, sizeof(attr_char_value));
+    attr_char_value.p_uuid      = &char_uuid;
+    attr_char_value.p_attr_md   = &attr_md;
+		attr_char_value.init_len		= BLE_BMS_BEAT_LEN;
+		attr_char_value.init_offs		= 0;
+		attr_char_value.max_len			= BLE_BMS_BEAT_LEN;
+		attr_char_value.p_value   	= p_bms->beat;
+		err_code = sd_ble_gatts_characteristic_add(p_bms->service_handle,
+																							&char_md,
+																							&attr_char_value,
+																							&p_bms->beat_handles);
+    APP_ERROR_CHECK(err_code);   
+
+    return NRF_SUCCESS;
+}
+
+/**@brief Function for adding the mode characteristic.
+ *
+ * @details BLE_BMS_MODE_LEN bytes: the ble_bms_mode_t and the summary window in seconds.
+ *          Streaming with a BLE_BMS_SUMMARY_WINDOW_S window after connecting; writes with an
+ *          unknown mode or a zero window are refused.
+ *
+ * @param[in]   p_bms        Biopotential Measurement Service structure.
+ *
+ * @return      NRF_SUCCESS on success, otherwise an error code.
+ */
+static uint32_t mode_char_add(ble_bms_t * p_bms)
+{
+		uint32_t err_code = 0;
+		ble_uuid_t	 						char_uuid;
+		uint8_t             mode_array[BLE_BMS_MODE_LEN] = {BLE_BMS_MODE_STREAM, BLE_BMS_SUMMARY_WINDOW_S};
+		BLE_UUID_BLE_ASSIGN(char_uuid, BLE_UUID_MODE_CHAR);
+	
+		ble_gatts_char_md_t char_md;
+	
+		memset(&char_md, 0, sizeof(char_md));
+		char_md.char_props.read = 1;
+		char_md.char_props.write = 1;
+		
+		ble_gatts_attr_md_t attr_md;
+    memset(&attr_md, 0, sizeof(attr_md));
+    attr_md.vloc = BLE_GATTS_VLOC_STACK;    
+    attr_md.vlen = 0;
+    attr_md.wr_auth = 1;
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.write_perm);
+		
+		ble_gatts_attr_t    attr_char_value;
+    memset(&attr_char_value, 0, sizeof(attr_char_value));
+    attr_char_value.p_uuid      = &char_uuid;
+    attr_char_value.p_attr_md   = &attr_md;
+		attr_char_value.init_len		= BLE_BMS_MODE_LEN;
+		attr_char_value.init_offs		= 0;
+		attr_char_value.max_len			= BLE_BMS_MODE_LEN;
+		attr_char_value.p_value   	= mode_array;
+		err_code = sd_ble_gatts_characteristic_add(p_bms->service_handle,
+																							&char_md,
+																							&attr_char_value,
+																							&p_bms->mode_handles);
+    APP_ERROR_CHECK(err_code);   
+
+    return NRF_SUCCESS;
+}
+
+/**@brief Function for adding the summary characteristic.
  *
- * @param[in]   p_bms              Biopotential Measurement Service structure.
- * @param[in]   body_voltage       Measurement to be encoded.
- * @param[out]  p_encoded_buffer   Buffer where the encoded data will be written.
+ * @details Up to BLE_BMS_SUMMARY_LEN(BLE_BMS_MAX_CHANNELS) bytes, read and notify, empty until
+ *          the first window closes.
  *
- * @return      Size of encoded data.
+ * @param[in]   p_bms        Biopotential Measurement Service structure.
+ *
+ * @return      NRF_SUCCESS on success, otherwise an error code.
  */
-static uint8_t bvm_encode(ble_bms_t * p_bms, uint8_t * p_encoded_buffer)
+static uint32_t summary_char_add(ble_bms_t * p_bms)
 {
-    uint8_t len   = 0;
-    int     i;
-
-    // Encode body voltage measurement
-    for (i = 0; i < p_bms->bvm_count; i++)
-    {			
-        if (len + sizeof(uint16_t) > MAX_BVM_LENGTH)
-        {
-            // Not all stored voltage values can fit into the packet, so
-            // move the remaining values to the start of the buffer.
-            memmove(&p_bms->bvm_buffer[0],
-                    &p_bms->bvm_buffer[i],
-                    (p_bms->bvm_count - i) * sizeof(uint16_t));
-            break;
-        }
-        len += uint16_encode(p_bms->bvm_buffer[i], &p_encoded_buffer[len]);
-    }
-    p_bms->bvm_count -= i;
+		uint32_t err_code = 0;
+		ble_uuid_t	 						char_uuid;
+		BLE_UUID_BLE_ASSIGN(char_uuid, BLE_UUID_SUMMARY_CHAR);
+	
+		ble_gatts_char_md_t char_md;
+	
+		memset(&char_md, 0, sizeof(char_md));
+		char_md.char_props.read = 1;
+		char_md.char_props.write = 0;
+		
+		ble_gatts_attr_md_t cccd_md;
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.write_perm);
+    cccd_md.vloc                = BLE_GATTS_VLOC_STACK;    
+    char_md.p_cccd_md           = &cccd_md;
+    char_md.char_props.notify   = 1;
+		ble_gatts_attr_md_t attr_md;
+    memset(&attr_md, 0, sizeof(attr_md));
+    attr_md.vloc = BLE_GATTS_VLOC_STACK;    
+    attr_md.vlen = 1;
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&attr_md.write_perm);
 		
+		ble_gatts_attr_t    attr_char_value;
+    memset(&attr_char_value, 0, sizeof(attr_char_value));
+    attr_char_value.p_uuid      = &char_uuid;
+    attr_char_value.p_attr_md   = &attr_md;
+		attr_char_value.init_len		= 0;
+		attr_char_value.init_offs		= 0;
+		attr_char_value.max_len			= BLE_BMS_SUMMARY_LEN(BLE_BMS_MAX_CHANNELS);
+		attr_char_value.p_value   	= p_bms->summary;
+		err_code = sd_ble_gatts_characteristic_add(p_bms->service_handle,
+																							&char_md,
+																							&attr_char_value,
+																							&p_bms->summary_handles);
+    APP_ERROR_CHECK(err_code);   
 
-    return len;
+    return NRF_SUCCESS;
 }
 
-/**@DATARATE Characteristic:
-
-*/
-static uint32_t data_rate_constant_char_add(ble_bms_t * p_bms)
+/**@brief Function for adding the log characteristic.
+ *
+ * @details BLE_BMS_LOG_LEN bytes, read, notify and authorized write.
+ *
+ * @param[in]   p_bms        Biopotential Measurement Service structure.
+ *
+ * @return      NRF_SUCCESS on success, otherwise an error code.
+ */
+static uint32_t log_char_add(ble_bms_t * p_bms)
 {
 		uint32_t err_code = 0;
 		ble_uuid_t	 						char_uuid;
-		uint8_t             data_rate_array[1] = {ADS1291_2_REGDEFAULT_CONFIG1};
-		BLE_UUID_BLE_ASSIGN(char_uuid, BLE_UUID_SAMPLE_RATE_CHAR);
+		BLE_UUID_BLE_ASSIGN(char_uuid, BLE_UUID_LOG_CHAR);
 	
 		ble_gatts_char_md_t char_md;
 	
 		memset(&char_md, 0, sizeof(char_md));
 		char_md.char_props.read = 1;
-		char_md.char_props.write = 0;
+		char_md.char_props.write = 1;
 		
 		ble_gatts_attr_md_t cccd_md;
     BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.read_perm);
     BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.write_perm);
     cccd_md.vloc                = BLE_GATTS_VLOC_STACK;    
     char_md.p_cccd_md           = &cccd_md;
-    char_md.char_props.notify   = 0;
+    char_md.char_props.notify   = 1;
 		ble_gatts_attr_md_t attr_md;
     memset(&attr_md, 0, sizeof(attr_md));
     attr_md.vloc = BLE_GATTS_VLOC_STACK;    
-    attr_md.vlen = 0;
+    attr_md.vlen = 1;
+    attr_md.wr_auth = 1;
     BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
     BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.write_perm);
 		
@@ -112,18 +1060,67 @@ static uint32_t data_rate_constant_char_add(ble_bms_t * p_bms)
     memset(&attr_char_value, 0, sizeof(attr_char_value));
     attr_char_value.p_uuid      = &char_uuid;
     attr_char_value.p_attr_md   = &attr_md;
-		attr_char_value.init_len		= sizeof(uint8_t);
+		attr_char_value.init_len		= BLE_BMS_LOG_LEN;
 		attr_char_value.init_offs		= 0;
-		attr_char_value.max_len			= sizeof(uint8_t);
-		attr_char_value.p_value   	= data_rate_array;
+		attr_char_value.max_len			= BLE_BMS_LOG_LEN;
+		attr_char_value.p_value   	= p_bms->log_status;
 		err_code = sd_ble_gatts_characteristic_add(p_bms->service_handle,
 																							&char_md,
 																							&attr_char_value,
-																							&p_bms->data_rate_handles);
+																							&p_bms->log_handles);
+    APP_ERROR_CHECK(err_code);   
+
+    return NRF_SUCCESS;
+}
+
+/**@brief Function for adding the log data characteristic.
+ *
+ * @details Notify only; up to BLE_BMS_MAX_BVM_LENGTH bytes.
+ *
+ * @param[in]   p_bms        Biopotential Measurement Service structure.
+ *
+ * @return      NRF_SUCCESS on success, otherwise an error code.
+ */
+static uint32_t log_data_char_add(ble_bms_t * p_bms)
+{
+		uint32_t err_code = 0;
+		ble_uuid_t	 						char_uuid;
+		BLE_UUID_BLE_ASSIGN(char_uuid, BLE_UUID_LOG_DATA_CHAR);
+	
+		ble_gatts_char_md_t char_md;
+	
+		memset(&char_md, 0, sizeof(char_md));
+		char_md.char_props.read = 0;
+		char_md.char_props.write = 0;
+		
+		ble_gatts_attr_md_t cccd_md;
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.write_perm);
+    cccd_md.vloc                = BLE_GATTS_VLOC_STACK;    
+    char_md.p_cccd_md           = &cccd_md;
+    char_md.char_props.notify   = 1;
+		ble_gatts_attr_md_t attr_md;
+    memset(&attr_md, 0, sizeof(attr_md));
+    attr_md.vloc = BLE_GATTS_VLOC_STACK;    
+    attr_md.vlen = 1;
+    BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&attr_md.write_perm);
+		
+		ble_gatts_attr_t    attr_char_value;
+    memset(&attr_char_value, 0, sizeof(attr_char_value));
+    attr_char_value.p_uuid      = &char_uuid;
+    attr_char_value.p_attr_md   = &attr_md;
+		attr_char_value.init_len		= 0;
+		attr_char_value.init_offs		= 0;
+		attr_char_value.max_len			= MAX_BVM_LENGTH;
+		attr_char_value.p_value   	= NULL;
+		err_code = sd_ble_gatts_characteristic_add(p_bms->service_handle,
+																							&char_md,
+																							&attr_char_value,
+																							&p_bms->log_data_handles);
     APP_ERROR_CHECK(err_code);   
 
     return NRF_SUCCESS;
-		//SET UP LIKE IN MPU EXAMPLE
 }
 
 /**@brief Function for adding the Body Voltage Measurement characteristic.
@@ -157,6 +1154,9 @@ static uint32_t body_voltage_measurement_char_add(ble_bms_t * p_bms)
     memset(&attr_md, 0, sizeof(attr_md));
     attr_md.vloc = BLE_GATTS_VLOC_STACK;    
     attr_md.vlen = 1;
+#if defined(BLE_BMS_READ_AUTHORIZE)
+    attr_md.rd_auth = 1;
+#endif
     BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
     BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.write_perm);
 		
@@ -193,6 +1193,38 @@ void ble_ecg_service_init(ble_bms_t *p_bms) {
     APP_ERROR_CHECK(err_code);    
 
     p_bms->conn_handle = BLE_CONN_HANDLE_INVALID;
+    p_bms->bvm_head    = 0;
+    p_bms->bvm_tail    = 0;
+    p_bms->bvm_notify  = false;
+    p_bms->pending_len = 0;
+    p_bms->tx_buffers  = 0;
+    p_bms->tx_queued   = 0;
+    p_bms->samples_queued = 0;
+    p_bms->tx_completed = 0;
+    p_bms->data_rate_changed = false;
+    p_bms->filter = 0;
+    p_bms->filter_changed = false;
+    p_bms->lead_off_pending = false;
+    memset(p_bms->lead_off, 0, sizeof(p_bms->lead_off));
+    p_bms->beat_pending = false;
+    memset(p_bms->beat, 0, sizeof(p_bms->beat));
+    p_bms->mode = BLE_BMS_MODE_STREAM;
+    p_bms->summary_window_s = BLE_BMS_SUMMARY_WINDOW_S;
+    p_bms->summary_restart = true;
+    p_bms->mode_changed = false;
+    p_bms->summary_count = 0;
+    p_bms->summary_len = 0;
+    p_bms->summary_pending = false;
+    p_bms->log_changed = false;
+    p_bms->log_pending = false;
+    memset(p_bms->log_status, 0, sizeof(p_bms->log_status));
+    bms_codec_init(&p_bms->codec, 2, BMS_CODEC_DEFAULT_KEY_INTERVAL);
+    p_bms->format = BLE_BMS_FORMAT_RAW;
+    p_bms->format_changed = false;
+    p_bms->channels_changed = false;
+    p_bms->notify_started = false;
+    bvm_channels_set(p_bms, 1);
+    bvm_data_rate_set(p_bms, ADS1291_2_REGDEFAULT_CONFIG1 & ADS1291_2_REG_CONFIG1_DR_MASK);
 
     err_code = sd_ble_gatts_service_add(BLE_GATTS_SRVC_TYPE_PRIMARY,
                                         &service_uuid,
@@ -201,55 +1233,428 @@ void ble_ecg_service_init(ble_bms_t *p_bms) {
     APP_ERROR_CHECK(err_code);
 		/*ADD CHARACTERISTIC(S)*/
 		body_voltage_measurement_char_add(p_bms);
-		data_rate_constant_char_add(p_bms);
+		data_rate_char_add(p_bms);
+		data_format_char_add(p_bms);
+		channels_char_add(p_bms);
+		lead_off_char_add(p_bms);
+		filter_char_add(p_bms);
+		beat_char_add(p_bms);
+		mode_char_add(p_bms);
+		summary_char_add(p_bms);
+		log_char_add(p_bms);
+		log_data_char_add(p_bms);
 		
 }
 #if (defined(ADS1291) || defined(ADS1292) || defined(ADS1292R))
-/**@Update adds single int16_t voltage value: */
-void ble_bms_update (ble_bms_t *p_bms, body_voltage_t *body_voltage) {
-		ble_gatts_value_t gatts_value;
-		// Initialize value struct.
-		memset(&gatts_value, 0, sizeof(gatts_value));
-		gatts_value.len     = sizeof(uint16_t);
-		gatts_value.offset  = 0;
-		gatts_value.p_value = (uint8_t*)body_voltage;
-		/*if (p_bms->bvm_count == BLE_BMS_MAX_BUFFERED_MEASUREMENTS)
-    {// The voltage measurement buffer is full, delete the oldest value
-        memmove(&p_bms->bvm_buffer[0],&p_bms->bvm_buffer[1],
-				(BLE_BMS_MAX_BUFFERED_MEASUREMENTS - 1) * sizeof(uint16_t));
-        p_bms->bvm_count--;
-    }*/
+static void status_update(ble_bms_t * p_bms, uint16_t value_handle, uint8_t * p_value, uint16_t len, bool * p_pending);
+
+/**@brief Function for encoding and notifying the statistics of the window that just closed.
+ */
+static void summary_close(ble_bms_t * p_bms)
+{
+    uint8_t len = 0;
+    uint8_t ch;
+
+    len += uint32_encode(p_bms->summary_start, &p_bms->summary[len]);
+    p_bms->summary[len++] = p_bms->summary_beats;
+    p_bms->summary[len++] = (p_bms->summary_beats != 0) ? p_bms->beat[0] : 0;
+    for (ch = 0; ch < p_bms->channels; ch++)
+    {
+        len += uint16_encode((uint16_t)p_bms->summary_min[ch], &p_bms->summary[len]);
+        len += uint16_encode((uint16_t)p_bms->summary_max[ch], &p_bms->summary[len]);
+        len += uint16_encode((uint16_t)(int16_t)(p_bms->summary_sum[ch] / (int32_t)p_bms->summary_count),
+                             &p_bms->summary[len]);
+    }
+    p_bms->summary_len   = len;
+    p_bms->summary_count = 0;
+    p_bms->summary_beats = 0;
+    status_update(p_bms, p_bms->summary_handles.value_handle, p_bms->summary, len, &p_bms->summary_pending);
+}
+
+/**@brief Function for adding a sample to the summary window, closing the window once it
+ *        spans summary_window_s seconds of conversion indices.
+ */
+static void summary_add(ble_bms_t * p_bms, body_voltage_t const * body_voltage, uint32_t index)
+{
+    uint32_t window = (uint32_t)p_bms->summary_window_s * ADS1291_2_DR_TO_SPS(p_bms->data_rate);
+    uint8_t  ch;
+
+    if (p_bms->summary_restart)
+    {
+        p_bms->summary_restart = false;
+        p_bms->summary_count   = 0;
+        p_bms->summary_beats   = 0;
+    }
+    if (p_bms->summary_count == 0)
+    {
+        p_bms->summary_start = index;
+        for (ch = 0; ch < BLE_BMS_MAX_CHANNELS; ch++)
+        {
+            p_bms->summary_min[ch] = INT16_MAX;
+            p_bms->summary_max[ch] = INT16_MIN;
+            p_bms->summary_sum[ch] = 0;
+        }
+    }
+    for (ch = 0; ch < p_bms->channels; ch++)
+    {
+#if defined(BLE_BMS_SAMPLE_24BIT)
+        int16_t v = (int16_t)(body_voltage[ch] >> 8);
+#else
+        int16_t v = body_voltage[ch];
+#endif
+        p_bms->summary_min[ch]  = MIN(p_bms->summary_min[ch], v);
+        p_bms->summary_max[ch]  = MAX(p_bms->summary_max[ch], v);
+        p_bms->summary_sum[ch] += v;
+    }
+    p_bms->summary_count++;
+    if (index - p_bms->summary_start + 1 >= window)
+    {
+        summary_close(p_bms);
+    }
+}
+
+/**@Update adds single body_voltage_t voltage value: */
+void ble_bms_update (ble_bms_t *p_bms, body_voltage_t *body_voltage, uint32_t index, uint32_t ticks, bool settling) {
+		uint16_t slot = p_bms->bvm_head & BLE_BMS_BVM_BUFFER_MASK;
+#if defined(BLE_BMS_READ_AUTHORIZE)
+		memcpy(p_bms->bvm_latest, body_voltage, sizeof(p_bms->bvm_latest));
+#endif
+		if (p_bms->mode != BLE_BMS_MODE_STREAM)
+		{
+				if (p_bms->mode == BLE_BMS_MODE_SUMMARY)
+				{
+						summary_add(p_bms, body_voltage, index);
+				}
+				return;
+		}
+		if (bvm_count(p_bms) == BLE_BMS_MAX_BUFFERED_MEASUREMENTS)
+    {// The voltage measurement buffer is full (nothing could be sent), delete the oldest value
+        p_bms->bvm_tail++;
+    }
     // Add new value
-		p_bms->bvm_buffer[p_bms->bvm_count++] = *body_voltage;
+		memcpy(p_bms->bvm_buffer[slot], body_voltage, sizeof(p_bms->bvm_buffer[slot]));
+		p_bms->bvm_index[slot]	= index;
+		p_bms->bvm_ticks[slot]	= ticks;
+		p_bms->bvm_settling[slot] = settling;
+		p_bms->bvm_head++;
 		
-		if(p_bms->bvm_count == BLE_BMS_MAX_BUFFERED_MEASUREMENTS) {
+		if(bvm_count(p_bms) >= bvm_samples_per_packet(p_bms)) {
 				ble_bms_send(p_bms);
 		}
-		//NRF_LOG_PRINTF("bvm_count: %d \r\n", p_bms->bvm_count);
-		// Update database.
-		sd_ble_gatts_value_set(p_bms->conn_handle, p_bms->bvm_handles.value_handle, &gatts_value);
+		//NRF_LOG_PRINTF("bvm_count: %d \r\n", bvm_count(p_bms));
+}
+
+#if !defined(BLE_BMS_READ_AUTHORIZE)
+/**@brief Function for storing a packet that could not be notified as the readable value.
+ *
+ * @details A notified packet already becomes the attribute value, so the database is only
+ *          written here, once per packet, when notifications are off.
+ */
+static void bvm_value_set(ble_bms_t * p_bms, uint8_t * p_data, uint16_t len)
+{
+    ble_gatts_value_t gatts_value;
+
+    memset(&gatts_value, 0, sizeof(gatts_value));
+    gatts_value.len     = len;
+    gatts_value.offset  = 0;
+    gatts_value.p_value = p_data;
+    (void)sd_ble_gatts_value_set(p_bms->conn_handle, p_bms->bvm_handles.value_handle, &gatts_value);
+}
+#endif
+
+/**@brief Function for getting the number of SoftDevice TX buffers not holding a notification.
+ */
+static uint8_t bvm_tx_free(ble_bms_t * p_bms)
+{
+    uint32_t in_flight = p_bms->tx_queued - p_bms->tx_completed;
+    return (in_flight < p_bms->tx_buffers) ? (uint8_t)(p_bms->tx_buffers - in_flight) : 0;
+}
+
+/**@brief Function for notifying a status value (lead-off, beat) that has not gone out yet.
+ *
+ * @details Takes a TX buffer like a measurement packet, so it is counted in tx_queued.
+ */
+static void status_send(ble_bms_t * p_bms, uint16_t value_handle, uint8_t * p_value, uint16_t len, bool * p_pending)
+{
+    uint32_t err_code;
+
+    if (!*p_pending || bvm_tx_free(p_bms) == 0)
+    {
+        return;
+    }
+    err_code = hal_gatt_notify(p_bms->conn_handle, value_handle, p_value, &len);
+    if (err_code == NRF_SUCCESS)
+    {
+        p_bms->tx_queued++;
+        *p_pending = false;
+    }
+    else if (err_code == BLE_ERROR_NO_TX_PACKETS)
+    {
+        p_bms->tx_completed = p_bms->tx_queued - p_bms->tx_buffers;
+    }
+    else
+    {
+        // Notifications disabled: the client reads the value when it wants it.
+        *p_pending = false;
+    }
+}
+
+/**@brief Function for storing a new status value and notifying it.
+ */
+static void status_update(ble_bms_t * p_bms, uint16_t value_handle, uint8_t * p_value, uint16_t len, bool * p_pending)
+{
+    ble_gatts_value_t gatts_value;
+
+    memset(&gatts_value, 0, sizeof(gatts_value));
+    gatts_value.len     = len;
+    gatts_value.offset  = 0;
+    gatts_value.p_value = p_value;
+    (void)sd_ble_gatts_value_set(p_bms->conn_handle, value_handle, &gatts_value);
+    if (p_bms->conn_handle != BLE_CONN_HANDLE_INVALID)
+    {
+        *p_pending = true;
+        status_send(p_bms, value_handle, p_value, len, p_pending);
+    }
+}
+
+void ble_bms_lead_off_update (ble_bms_t *p_bms, uint8_t loff_stat, uint32_t index)
+{
+    p_bms->lead_off[0] = loff_stat;
+    (void)uint16_encode((uint16_t)index, &p_bms->lead_off[1]);
+    status_update(p_bms, p_bms->lead_off_handles.value_handle, p_bms->lead_off, BLE_BMS_LEAD_OFF_LEN,
+                  &p_bms->lead_off_pending);
+}
+
+void ble_bms_beat_update (ble_bms_t *p_bms, uint8_t bpm, uint32_t index, uint16_t rr)
+{
+    p_bms->beat[0] = bpm;
+    (void)uint32_encode(index, &p_bms->beat[1]);
+    (void)uint16_encode(rr, &p_bms->beat[5]);
+    status_update(p_bms, p_bms->beat_handles.value_handle, p_bms->beat, BLE_BMS_BEAT_LEN,
+                  &p_bms->beat_pending);
+    if (p_bms->summary_beats < UINT8_MAX)
+    {
+        p_bms->summary_beats++;
+    }
+}
+
+bool ble_bms_log_take (ble_bms_t *p_bms, uint8_t *p_command)
+{
+    if (!p_bms->log_changed)
+    {
+        return false;
+    }
+    p_bms->log_changed = false;
+    *p_command = p_bms->log_command;
+    return true;
+}
+
+void ble_bms_log_status_update (ble_bms_t *p_bms, uint8_t state, uint32_t backlog)
+{
+    p_bms->log_status[0] = state;
+    (void)uint32_encode(backlog, &p_bms->log_status[1]);
+    status_update(p_bms, p_bms->log_handles.value_handle, p_bms->log_status, BLE_BMS_LOG_LEN,
+                  &p_bms->log_pending);
+}
+
+uint8_t ble_bms_record_start (ble_bms_t *p_bms, uint8_t *p_session)
+{
+    p_bms->mode        = BLE_BMS_MODE_STREAM;
+    p_bms->pending_len = 0;
+    // Starts with a timed key packet. A format or channel count the last client wrote is of
+    // no use now.
+    p_bms->format_changed   = false;
+    p_bms->channels_changed = false;
+    p_bms->mode_changed     = false;
+    p_bms->notify_started   = false;
+    bvm_format_set(p_bms, BLE_BMS_FORMAT_DELTA);
+    p_session[0] = BLE_BMS_LOG_SESSION;
+    p_session[1] = BLE_BMS_FORMAT_DELTA;
+    p_session[2] = p_bms->channels;
+    p_session[3] = p_bms->data_rate;
+    return BLE_BMS_LOG_SESSION_LEN;
+}
+
+uint8_t ble_bms_record_take (ble_bms_t *p_bms, uint8_t *p_packet)
+{
+    if ((p_bms->conn_handle != BLE_CONN_HANDLE_INVALID) || (bvm_count(p_bms) < bvm_samples_per_packet(p_bms)))
+    {
+        return 0;
+    }
+    return bvm_encode(p_bms, p_packet);
+}
+
+uint32_t ble_bms_log_send (ble_bms_t *p_bms, uint8_t const *p_data, uint8_t len)
+{
+    uint16_t hvx_len = len;
+    uint32_t err_code;
+
+    if (bvm_tx_free(p_bms) == 0)
+    {
+        return BLE_ERROR_NO_TX_PACKETS;
+    }
+    err_code = hal_gatt_notify(p_bms->conn_handle, p_bms->log_data_handles.value_handle, p_data, &hvx_len);
+    if (err_code == NRF_SUCCESS)
+    {
+        p_bms->tx_queued++;
+    }
+    else if (err_code == BLE_ERROR_NO_TX_PACKETS)
+    {
+        p_bms->tx_completed = p_bms->tx_queued - p_bms->tx_buffers;
+    }
+    return err_code;
+}
+
+bool ble_bms_samples_wanted (ble_bms_t const *p_bms)
+{
+    return p_bms->mode != BLE_BMS_MODE_BEATS;
+}
+
+void ble_bms_tx_shared (ble_bms_t *p_bms)
+{
+    p_bms->tx_queued++;
+}
+
+bool ble_bms_bvm_buffer_is_full(ble_bms_t * p_bms)
+{
+    if (p_bms->conn_handle != BLE_CONN_HANDLE_INVALID && !p_bms->bvm_notify)
+    {
+        // Nothing drains it yet; ble_bms_update() drops the oldest sample instead.
+        return false;
+    }
+    return bvm_count(p_bms) == BLE_BMS_MAX_BUFFERED_MEASUREMENTS;
+}
+
+bool ble_bms_data_rate_take(ble_bms_t * p_bms, uint8_t * p_data_rate)
+{
+    if (!p_bms->data_rate_changed)
+    {
+        return false;
+    }
+    p_bms->data_rate_changed = false;
+    *p_data_rate = p_bms->data_rate;
+    return true;
+}
+
+void ble_bms_config_apply(ble_bms_t * p_bms)
+{
+    if (p_bms->format_changed)
+    {
+        p_bms->format_changed = false;
+        bvm_format_set(p_bms, p_bms->format_written);
+        p_bms->pending_len = 0;
+    }
+    if (p_bms->channels_changed)
+    {
+        p_bms->channels_changed = false;
+        if (p_bms->channels_written != p_bms->channels)
+        {
+            bvm_channels_set(p_bms, p_bms->channels_written);
+            p_bms->bvm_tail    = p_bms->bvm_head;
+            p_bms->pending_len = 0;
+        }
+    }
+    if (p_bms->mode_changed)
+    {
+        p_bms->mode_changed = false;
+        if (p_bms->mode_written[0] == BLE_BMS_MODE_STREAM && p_bms->mode != BLE_BMS_MODE_STREAM)
+        {
+            bvm_format_set(p_bms, p_bms->format);
+        }
+        p_bms->mode             = p_bms->mode_written[0];
+        p_bms->summary_window_s = p_bms->mode_written[1];
+        p_bms->summary_restart  = true;
+    }
+    if (p_bms->notify_started)
+    {
+        p_bms->notify_started = false;
+        bvm_format_set(p_bms, p_bms->format);
+        p_bms->pending_len = 0;
+    }
+}
+
+bool ble_bms_filter_take(ble_bms_t * p_bms, uint8_t * p_filter)
+{
+    if (!p_bms->filter_changed)
+    {
+        return false;
+    }
+    p_bms->filter_changed = false;
+    *p_filter = p_bms->filter;
+    return true;
 }
 
 uint32_t ble_bms_send (ble_bms_t *p_bms) {
-	uint32_t 								err_code;
-	if (p_bms->conn_handle != BLE_CONN_HANDLE_INVALID) {
-			
-			uint8_t               	encoded_bvm[MAX_BVM_LENGTH];
-			uint16_t      					len;
+	uint32_t 								err_code = NRF_SUCCESS;
+	if (p_bms->conn_handle == BLE_CONN_HANDLE_INVALID) {
+			return NRF_ERROR_INVALID_STATE;
+	}
+	status_send(p_bms, p_bms->lead_off_handles.value_handle, p_bms->lead_off, BLE_BMS_LEAD_OFF_LEN,
+	            &p_bms->lead_off_pending);
+	status_send(p_bms, p_bms->beat_handles.value_handle, p_bms->beat, BLE_BMS_BEAT_LEN,
+	            &p_bms->beat_pending);
+	status_send(p_bms, p_bms->summary_handles.value_handle, p_bms->summary, p_bms->summary_len,
+	            &p_bms->summary_pending);
+	status_send(p_bms, p_bms->log_handles.value_handle, p_bms->log_status, BLE_BMS_LOG_LEN,
+	            &p_bms->log_pending);
+	if (p_bms->format_changed || p_bms->channels_changed || p_bms->mode_changed || p_bms->notify_started) {
+			// Wait for ble_bms_config_apply() rather than send a packet in the old format.
+			return NRF_SUCCESS;
+	}
+	if (p_bms->mode != BLE_BMS_MODE_STREAM) {
+			// Nothing is streamed: drop what was buffered before the mode changed.
+			p_bms->bvm_tail    = p_bms->bvm_head;
+			p_bms->pending_len = 0;
+			return NRF_SUCCESS;
+	}
+	if (!p_bms->bvm_notify) {
+			// Hold the newest samples so the stream starts with them once notifications are on.
+#if !defined(BLE_BMS_READ_AUTHORIZE)
+			// A full buffer still shows its oldest packet as the readable value, once per packet's
+			// worth of samples dropped, but keeps the samples.
+			if (p_bms->pending_len == 0 && bvm_count(p_bms) == BLE_BMS_MAX_BUFFERED_MEASUREMENTS &&
+			    (int16_t)(p_bms->bvm_tail - p_bms->bvm_value_end) >= 0) {
+					uint16_t	tail	= p_bms->bvm_tail;
+					uint8_t		len		= bvm_encode(p_bms, p_bms->pending);
+					p_bms->bvm_value_end	= p_bms->bvm_tail;
+					p_bms->bvm_tail				= tail;
+					bvm_value_set(p_bms, p_bms->pending, len);
+			}
+#endif
+			return NRF_SUCCESS;
+	}
+	// Queue as many packets as the SoftDevice has buffers for; the rest go out after
+	// BLE_EVT_TX_COMPLETE frees buffers again.
+	while (bvm_tx_free(p_bms) > 0) {
 			uint16_t 								hvx_len;
-			ble_gatts_hvx_params_t 	hvx_params;
-			len 							= bvm_encode(p_bms, encoded_bvm);
-			hvx_len						= len;
-			memset(&hvx_params, 0, sizeof(hvx_params));
-			hvx_params.handle = p_bms->bvm_handles.value_handle;
-			hvx_params.type   = BLE_GATT_HVX_NOTIFICATION;
-			hvx_params.offset = 0;
-			hvx_params.p_len  = &hvx_len;
-			hvx_params.p_data = encoded_bvm;
-			err_code = sd_ble_gatts_hvx(p_bms->conn_handle, &hvx_params);
+			if (p_bms->pending_len == 0) {
+					if (bvm_count(p_bms) < bvm_samples_per_packet(p_bms)) {
+							break;
+					}
+					uint16_t tail = p_bms->bvm_tail;
+					p_bms->pending_len			= bvm_encode(p_bms, p_bms->pending);
+					p_bms->pending_samples	= (uint8_t)(p_bms->bvm_tail - tail);
+			}
+			hvx_len						= p_bms->pending_len;
+			err_code = hal_gatt_notify(p_bms->conn_handle, p_bms->bvm_handles.value_handle, p_bms->pending, &hvx_len);
+			if (err_code == NRF_SUCCESS) {
+					p_bms->tx_queued++;
+					p_bms->samples_queued += p_bms->pending_samples;
+					p_bms->pending_len = 0;
+			} else if (err_code == BLE_ERROR_NO_TX_PACKETS) {
+					// Out of sync with the buffer count; keep the packet and retry on TX complete.
+					p_bms->tx_completed = p_bms->tx_queued - p_bms->tx_buffers;
+					break;
+			} else {
+					// Notifications disabled or no system attributes yet: discard the packet.
+#if !defined(BLE_BMS_READ_AUTHORIZE)
+					bvm_value_set(p_bms, p_bms->pending, p_bms->pending_len);
+#endif
+					p_bms->pending_len = 0;
+					break;
+			}
 	}
 	return err_code;
-	//Flush Data?
 }
 
 #endif// (defined(ADS1291) || defined(ADS1292) || defined(ADS1292R))
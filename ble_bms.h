@@ -38,10 +38,12 @@
 #include <stdint.h>
 #include "ble.h"
 #include "ble_srv_common.h"
+#include "bms_codec.h"
+#include "bms_format.h"
 //#include "ads1291-2.h"
 
-// Base UUID
-#define BMS_UUID_BASE {0x57, 0x80, 0xD2, 0x94, 0xA3, 0xB2, 0xFE, 0x39, 0x5F, 0x87, 0xFD, 0x35, 0x00, 0x00, 0x8B, 0x22};
+// Base UUID, initializer of a ble_uuid128_t
+#define BMS_UUID_BASE {{0x57, 0x80, 0xD2, 0x94, 0xA3, 0xB2, 0xFE, 0x39, 0x5F, 0x87, 0xFD, 0x35, 0x00, 0x00, 0x8B, 0x22}}
 
 // Service UUID
 #define BLE_UUID_BIOPOTENTIAL_MEASUREMENT_SERVICE	0x3260
@@ -49,10 +51,124 @@
 // Characteristic UUIDs
 #define BLE_UUID_BODY_VOLTAGE_MEASUREMENT_CHAR		0x3261
 
-#define BLE_UUID_SAMPLE_RATE_CHAR									0x3262
+#define BLE_UUID_SAMPLE_RATE_CHAR									0x3262				/**< CONFIG1.DR code (0 = 125 SPS ... 6 = 8000 SPS). Writable. */
 
-// Maximum number of body voltage measurement bytes buffered by the application
-#define BLE_BMS_MAX_BUFFERED_MEASUREMENTS					10//30
+#define BLE_UUID_DATA_FORMAT_CHAR									0x3263
+
+#define BLE_UUID_CHANNELS_CHAR										0x3264				/**< Channels interleaved in each notification, 1 or BLE_BMS_MAX_CHANNELS. Writable. */
+
+#define BLE_UUID_LEAD_OFF_CHAR										0x3265				/**< Lead-off status, notified when it changes. See BLE_BMS_LEAD_OFF_LEN. */
+
+#define BLE_UUID_FILTER_CHAR											0x3266				/**< BMS_FILTER_* stages applied before sending, 0 = none. Writable. */
+
+#define BLE_UUID_BEAT_CHAR												0x3267				/**< Last heart beat detected on the ECG channel, notified per beat. See BLE_BMS_BEAT_LEN. */
+
+#define BLE_UUID_MODE_CHAR												0x3268				/**< ble_bms_mode_t and the summary window in seconds. Writable. See BLE_BMS_MODE_LEN. */
+
+#define BLE_UUID_SUMMARY_CHAR											0x3269				/**< Statistics of each window in BLE_BMS_MODE_SUMMARY. See BLE_BMS_SUMMARY_LEN. */
+
+#define BLE_UUID_LOG_CHAR													0x326A				/**< Recording while disconnected: ble_bms_log_t and the backlog. Writable. See BLE_BMS_LOG_LEN. */
+
+#define BLE_UUID_LOG_DATA_CHAR										0x326B				/**< Recorded packets, notified during a download. See bms_format.h. */
+
+// Sample resolution. Define BLE_BMS_SAMPLE_24BIT in the project to carry the full 24-bit
+// ADS1291/2 conversion result; otherwise only the upper 16 bits are kept.
+#if defined(BLE_BMS_SAMPLE_24BIT)
+typedef int32_t body_voltage_t;																		/**< Sign-extended 24-bit sample. */
+#define BLE_BMS_SAMPLE_BYTES											3
+#else
+typedef int16_t body_voltage_t;
+#define BLE_BMS_SAMPLE_BYTES											2
+#endif
+
+// Channels the build can stream. On the ADS1292 these are CH1 and CH2; on the ADS1292R CH1
+// carries the demodulated respiration signal and CH2 the ECG. Samples of one conversion go
+// out together, CH1 first, in every format.
+#if defined(ADS1292) || defined(ADS1292R)
+#define BLE_BMS_MAX_CHANNELS											2
+#else
+#define BLE_BMS_MAX_CHANNELS											1
+#endif
+
+// Readable value of the Body Voltage Measurement characteristic. By default it is the last
+// packet sent (written once per packet, never per sample). Define BLE_BMS_READ_AUTHORIZE to
+// have reads authorized and answered with the newest sample instead.
+
+// Maximum size in bytes of a transmitted Body Voltage Measurement.
+#define BLE_BMS_MAX_BVM_LENGTH										BLE_BMS_PACKET_LEN
+
+// Maximum number of body voltage measurements buffered by the application. The buffer is
+// circular with free-running indexes, so this must be a power of two.
+#define BLE_BMS_MAX_BUFFERED_MEASUREMENTS					64
+#define BLE_BMS_BVM_BUFFER_MASK										(BLE_BMS_MAX_BUFFERED_MEASUREMENTS - 1)
+
+#if (BLE_BMS_MAX_BUFFERED_MEASUREMENTS & BLE_BMS_BVM_BUFFER_MASK) != 0
+#error "BLE_BMS_MAX_BUFFERED_MEASUREMENTS must be a power of two"
+#endif
+
+// A DELTA packet is assembled once this many samples are waiting. This bounds the samples
+// per compressed packet. At low data rates the batch is cut to about BLE_BMS_DELTA_BATCH_MS
+// of samples, but not below BLE_BMS_DELTA_BATCH_MIN, so packets do not wait too long.
+#define BLE_BMS_DELTA_BATCH												32
+#define BLE_BMS_DELTA_BATCH_MIN										8
+#define BLE_BMS_DELTA_BATCH_MS										40
+
+// Lead-off status value: LOFF_STAT[4:0] (bit 0 IN1P, 1 IN1N, 2 IN2P, 3 IN2N, 4 RLD; 1 = off)
+// followed by the low 16 bits of the conversion index it was first seen at, little endian,
+// so the client can line the event up with the header index of the samples.
+#define BLE_BMS_LEAD_OFF_LEN											3
+
+// Beat value: heart rate in beats per minute (0 until two beats were seen), the conversion
+// index of the R peak (32 bits, as a client that streams only beats has no header to extend
+// 16 bits against) and the R-R interval to the previous beat in 1/1024 s, the unit of the
+// Heart Rate Service (0 for the first beat), all little endian.
+#define BLE_BMS_BEAT_LEN													7
+
+/**@brief What the service sends, selected through the Mode characteristic.
+ *
+ * @details Lead-off and beat notifications go out in every mode, if the client enabled them.
+ *          Raw or compressed streaming is STREAM with the Data Format characteristic picking
+ *          the layout. The other modes stop the Body Voltage Measurement notifications, so the
+ *          link only wakes for the odd status packet. A new connection starts in STREAM.
+ */
+typedef enum
+{
+		BLE_BMS_MODE_STREAM						= 0x00,						/**< Every sample, in the Data Format selected. */
+		BLE_BMS_MODE_BEATS						= 0x01,						/**< No samples; beats and lead-off only. */
+		BLE_BMS_MODE_SUMMARY					= 0x02,						/**< No samples; a Summary notification per window. */
+} ble_bms_mode_t;
+
+// Mode value: ble_bms_mode_t, then the summary window in seconds (1-255), used in
+// BLE_BMS_MODE_SUMMARY.
+#define BLE_BMS_MODE_LEN													2
+#define BLE_BMS_SUMMARY_WINDOW_S									10
+
+// Summary value, all little endian: the conversion index the window starts at (32 bits), the
+// beats detected in it (saturating at 255) and the heart rate of the last of them (0 if none),
+// then for each streamed channel (Channels characteristic) the minimum, maximum and mean
+// sample as 16-bit values, the upper 16 bits of the code whatever BLE_BMS_SAMPLE_24BIT says.
+#define BLE_BMS_SUMMARY_LEN(CHANNELS)							(6 + 6 * (CHANNELS))
+
+/**@brief Recording to flash, the first byte of the Log characteristic.
+ *
+ * @details A client writes one of these. Armed, the AFE keeps converting after the link drops
+ *          and the samples go to the flash log (bms_log.h) until a client connects again. A
+ *          download notifies the backlog on Log Data, oldest first, after the live stream has
+ *          had its share of the TX buffers; the connection parameter controller asks for the
+ *          shortest interval meanwhile. When it is done the Log value is notified again with
+ *          the state before the download.
+ */
+typedef enum
+{
+		BLE_BMS_LOG_OFF								= 0x00,						/**< Nothing is recorded; the AFE sleeps while disconnected. */
+		BLE_BMS_LOG_ARMED							= 0x01,						/**< Record while no client is connected. */
+		BLE_BMS_LOG_DOWNLOAD					= 0x02,						/**< Notify the backlog on Log Data. */
+		BLE_BMS_LOG_ERASE							= 0x03,						/**< Command only: drop the backlog. */
+} ble_bms_log_t;
+
+// Log value: the state (ble_bms_log_t, never ERASE), then the backlog in bytes (32 bits, little
+// endian), session records and page headers included. Writes are the command byte alone.
+#define BLE_BMS_LOG_LEN														5
 
 
 /**@brief Biopotential Measurement Service init structure. This contains all options and data needed for
@@ -63,8 +179,70 @@ typedef struct
     uint16_t											service_handle; 				/**< Handle of ble Service (as provided by the BLE stack). */
 		ble_gatts_char_handles_t			bvm_handles;						/**< Handles related to the our body V measure characteristic. */
 		ble_gatts_char_handles_t			data_rate_handles;
-		uint16_t										 	bvm_buffer[BLE_BMS_MAX_BUFFERED_MEASUREMENTS];
-		uint8_t											 	bvm_count;	
+		ble_gatts_char_handles_t			format_handles;					/**< Handles related to the data format characteristic. */
+		ble_gatts_char_handles_t			channels_handles;				/**< Handles related to the channels characteristic. */
+		ble_gatts_char_handles_t			lead_off_handles;				/**< Handles related to the lead-off status characteristic. */
+		ble_gatts_char_handles_t			filter_handles;					/**< Handles related to the filter characteristic. */
+		ble_gatts_char_handles_t			beat_handles;						/**< Handles related to the beat characteristic. */
+		ble_gatts_char_handles_t			mode_handles;						/**< Handles related to the mode characteristic. */
+		ble_gatts_char_handles_t			summary_handles;				/**< Handles related to the summary characteristic. */
+		ble_gatts_char_handles_t			log_handles;						/**< Handles related to the log characteristic. */
+		ble_gatts_char_handles_t			log_data_handles;				/**< Handles related to the log data characteristic. */
+		body_voltage_t							 	bvm_buffer[BLE_BMS_MAX_BUFFERED_MEASUREMENTS][BLE_BMS_MAX_CHANNELS];	/**< Circular staging buffer of conversions, indexed with BLE_BMS_BVM_BUFFER_MASK. */
+		uint16_t											bvm_head;								/**< Free-running index of the next sample to store. */
+		uint16_t											bvm_tail;								/**< Free-running index of the oldest unsent sample. */
+		uint32_t											bvm_index[BLE_BMS_MAX_BUFFERED_MEASUREMENTS];	/**< Conversion index of each buffered sample. */
+		uint32_t											bvm_ticks[BLE_BMS_MAX_BUFFERED_MEASUREMENTS];	/**< RTC1 tick of each buffered sample. */
+		bool													bvm_settling[BLE_BMS_MAX_BUFFERED_MEASUREMENTS];	/**< Buffered sample was converted while the AFE settled. */
+		bool													bvm_notify;							/**< The client has enabled Body Voltage Measurement notifications. */
+		volatile bool									notify_started;					/**< bvm_notify turned on and the encoder has not restarted yet, see ble_bms_config_apply(). */
+		uint16_t											bvm_value_end;					/**< bvm_tail past the samples of the readable value written while notifications are off. */
+		uint8_t												format;									/**< Current ble_bms_format_t. */
+		uint8_t												format_written;					/**< ble_bms_format_t written by the client. */
+		volatile bool									format_changed;					/**< format_written has not been applied yet, see ble_bms_config_apply(). */
+		uint8_t												channels;								/**< Channels streamed, 1 to BLE_BMS_MAX_CHANNELS. */
+		uint8_t												channels_written;				/**< Channels written by the client. */
+		volatile bool									channels_changed;				/**< channels_written has not been applied yet, see ble_bms_config_apply(). */
+		uint8_t												data_rate;							/**< CONFIG1.DR code of the data rate characteristic. */
+		volatile bool									data_rate_changed;			/**< A client wrote data_rate and the application has not applied it yet. */
+		uint8_t												filter;									/**< BMS_FILTER_* selection of the filter characteristic. */
+		volatile bool									filter_changed;					/**< filter changed and the application has not applied it yet. */
+		uint8_t												delta_batch;						/**< Samples per DELTA packet at data_rate. */
+		uint8_t												seq;										/**< Sequence number of the next packet with a header. */
+		uint32_t											bvm_next_index;					/**< Conversion index following the last packet encoded. */
+		bms_codec_t										codec;									/**< Encoder state for BLE_BMS_FORMAT_DELTA. */
+		uint8_t												pending[BLE_BMS_MAX_BVM_LENGTH];	/**< Encoded packet the SoftDevice has not accepted yet. */
+		uint8_t												pending_len;						/**< Length of pending, 0 if none. */
+		uint8_t												pending_samples;				/**< Conversions encoded in pending. */
+		uint8_t												tx_buffers;							/**< SoftDevice TX buffers for this link. */
+		volatile uint32_t							tx_queued;							/**< Notifications accepted by sd_ble_gatts_hvx. Main context only. */
+		uint32_t											samples_queued;					/**< Conversions carried by those notifications. Main context only. */
+		volatile uint32_t							tx_completed;						/**< Notifications reported by BLE_EVT_TX_COMPLETE. BLE event context only. */
+		uint8_t												lead_off[BLE_BMS_LEAD_OFF_LEN];	/**< Current lead-off status value. */
+		bool													lead_off_pending;				/**< lead_off changed and has not been notified yet. */
+		uint8_t												beat[BLE_BMS_BEAT_LEN];	/**< Last beat value. */
+		bool													beat_pending;						/**< beat changed and has not been notified yet. */
+		uint8_t												mode;										/**< Current ble_bms_mode_t. */
+		uint8_t												summary_window_s;				/**< Summary window, seconds. */
+		uint8_t												mode_written[BLE_BMS_MODE_LEN];	/**< Mode value written by the client. */
+		volatile bool									mode_changed;						/**< mode_written has not been applied yet, see ble_bms_config_apply(). */
+		bool													summary_restart;				/**< Mode applied: start a new window at the next sample. */
+		uint32_t											summary_start;					/**< Conversion index the open window started at. */
+		uint32_t											summary_count;					/**< Samples in the open window, 0 if none is open. */
+		uint8_t												summary_beats;					/**< Beats since the open window started. */
+		int16_t												summary_min[BLE_BMS_MAX_CHANNELS];
+		int16_t												summary_max[BLE_BMS_MAX_CHANNELS];
+		int64_t												summary_sum[BLE_BMS_MAX_CHANNELS];
+		uint8_t												summary[BLE_BMS_SUMMARY_LEN(BLE_BMS_MAX_CHANNELS)];	/**< Last summary value. */
+		uint8_t												summary_len;
+		bool													summary_pending;				/**< summary changed and has not been notified yet. */
+		uint8_t												log_command;						/**< Last ble_bms_log_t written. */
+		volatile bool									log_changed;						/**< log_command has not been taken yet. */
+		uint8_t												log_status[BLE_BMS_LOG_LEN];	/**< Last log value. */
+		bool													log_pending;						/**< log_status changed and has not been notified yet. */
+#if defined(BLE_BMS_READ_AUTHORIZE)
+		body_voltage_t								bvm_latest[BLE_BMS_MAX_CHANNELS];	/**< Newest conversion, returned on an authorized read. */
+#endif
 } ble_bms_t;
 
 /**@brief Function for initiating our new service.
@@ -110,20 +288,173 @@ uint32_t ble_bms_body_voltage_measurement_send(ble_bms_t * p_bms);
 uint32_t ble_bms_bvm_add(ble_bms_t * p_bms, int16_t bvm_val);
 */
 /**@brief Function for checking if Body Voltage Measurement buffer is full.
+ *
+ * @details While connected the application should stop adding samples when this returns
+ *          true and leave them queued upstream until ble_bms_send() has made room. Before the
+ *          client enables notifications it never returns true: the buffer keeps the newest
+ *          samples, which the first notifications then carry.
  *
  * @param[in]   p_bms        Biopotential Measurement Service structure.
  *
  * @return      true if Body Voltage Measurement buffer is full, false otherwise.
- 
+ */
 bool ble_bms_bvm_buffer_is_full(ble_bms_t * p_bms);
-*/
+
 /**@brief function for updating/notifying BLE of new value.
 *
+* @param[in]   p_bms        Biopotential Measurement Service structure.
+* @param[in]   body_voltage New conversion: BLE_BMS_MAX_CHANNELS samples, CH1 first (get_bvm_sample()).
+* @param[in]   index        Conversion index of the sample (ads1291_2_frame_t index).
+* @param[in]   ticks        RTC1 tick of its DRDY edge (ads1291_2_frame_t ticks).
+* @param[in]   settling     Converted while the AFE settled (ads1291_2_frame_t settling); the
+*                           packet carrying it gets BLE_BMS_HEADER_FLAG_SETTLING.
+*/
+void ble_bms_update (ble_bms_t *p_bms, body_voltage_t *body_voltage, uint32_t index, uint32_t ticks, bool settling);
+
+/**@brief Function for reporting a change of lead-off status.
+*
+* @details The value is updated at once and notified ahead of any buffered measurement. A
+*          change that cannot be notified yet is sent by the next ble_bms_send(); if the
+*          status changes again before that, only the newest status goes out.
+*
+* @param[in]   p_bms        Biopotential Measurement Service structure.
+* @param[in]   loff_stat    LOFF_STAT[4:0] (ads1291_2_lead_off_update()).
+* @param[in]   index        Conversion index of the frame that changed it.
+*/
+void ble_bms_lead_off_update (ble_bms_t *p_bms, uint8_t loff_stat, uint32_t index);
+
+/**@brief Function for reporting a detected heart beat.
+*
+* @details Sent like a lead-off change: ahead of buffered measurements, and a beat that
+*          cannot be notified before the next one is replaced by it.
+*
+* @param[in]   p_bms        Biopotential Measurement Service structure.
+* @param[in]   bpm          Heart rate, 0 if not known yet.
+* @param[in]   index        Conversion index of the R peak.
+* @param[in]   rr           R-R interval to the previous beat in 1/1024 s, 0 for the first.
+*/
+void ble_bms_beat_update (ble_bms_t *p_bms, uint8_t bpm, uint32_t index, uint16_t rr);
+
+/**@brief Function for checking whether the application has to pass samples to ble_bms_update().
+*
+* @details Not in BLE_BMS_MODE_BEATS, where the samples would be thrown away. Skipping them
+*          also skips the filter stage and the conversion to body_voltage_t.
+*
+* @param[in]   p_bms        Biopotential Measurement Service structure.
 */
-void ble_bms_update (ble_bms_t *p_bms, int16_t *body_voltage);
+bool ble_bms_samples_wanted (ble_bms_t const *p_bms);
 
+/**@brief Function for getting a command written to the log characteristic.
+*
+* @param[in]   p_bms        Biopotential Measurement Service structure.
+* @param[out]  p_command    ble_bms_log_t written.
+*
+* @return      true once for every write.
+*/
+bool ble_bms_log_take (ble_bms_t *p_bms, uint8_t *p_command);
+
+/**@brief Function for setting and notifying the log value.
+*
+* @param[in]   p_bms        Biopotential Measurement Service structure.
+* @param[in]   state        BLE_BMS_LOG_OFF, BLE_BMS_LOG_ARMED or BLE_BMS_LOG_DOWNLOAD.
+* @param[in]   backlog      Bytes in the log not downloaded yet.
+*/
+void ble_bms_log_status_update (ble_bms_t *p_bms, uint8_t state, uint32_t backlog);
+
+/**@brief Function for starting a recording after the link dropped.
+*
+* @details Switches to BLE_BMS_FORMAT_DELTA and streaming, keeping the channels and the
+*          samples still buffered. The next client connection resets both as usual.
+*
+* @param[in]   p_bms        Biopotential Measurement Service structure.
+* @param[out]  p_session    The session record, BLE_BMS_LOG_SESSION_LEN bytes.
+*
+* @return      Its length.
+*/
+uint8_t ble_bms_record_start (ble_bms_t *p_bms, uint8_t *p_session);
+
+/**@brief Function for taking the next packet of a recording.
+*
+* @param[in]   p_bms        Biopotential Measurement Service structure.
+* @param[out]  p_packet     BLE_BMS_MAX_BVM_LENGTH bytes.
+*
+* @return      Its length, 0 if a client is connected or a packet is not full yet.
+*/
+uint8_t ble_bms_record_take (ble_bms_t *p_bms, uint8_t *p_packet);
+
+/**@brief Function for notifying a recorded packet on the log data characteristic.
+*
+* @return      NRF_SUCCESS, BLE_ERROR_NO_TX_PACKETS when every TX buffer is in use, otherwise
+*              the error from the stack: notifications disabled or no connection.
+*/
+uint32_t ble_bms_log_send (ble_bms_t *p_bms, uint8_t const *p_data, uint8_t len);
+
+/**@brief Function for counting a notification another service sent on the link.
+*
+* @details The service shares the SoftDevice TX buffers with everything else on the link and
+*          counts the ones in use itself. Call this when another service's notification (the
+*          Heart Rate Service, for instance) was accepted, so the count stays right.
+*
+* @param[in]   p_bms        Biopotential Measurement Service structure.
+*/
+void ble_bms_tx_shared (ble_bms_t *p_bms);
+
+/**@brief Function for sending buffered measurements.
+ *
+ * @details Encodes and queues notifications until either fewer than a packet's worth of
+ *          samples remain or every SoftDevice TX buffer is in use. A packet the SoftDevice
+ *          refused with BLE_ERROR_NO_TX_PACKETS is kept and sent first on the next call, so
+ *          nothing is lost; call this again after BLE_EVT_TX_COMPLETE. Nothing is encoded
+ *          until the client enables notifications, so the stream starts with the samples
+ *          buffered before that.
+ *
+ * @param[in]   p_bms        Biopotential Measurement Service structure.
+ *
+ * @return      NRF_SUCCESS, BLE_ERROR_NO_TX_PACKETS if sending stopped for lack of buffers,
+ *              otherwise the error from sd_ble_gatts_hvx.
+ */
 uint32_t ble_bms_send (ble_bms_t *p_bms);
 
+/**@brief Function for taking a data rate written by the client.
+ *
+ * @details The write is only accepted by the service; the application polls this from the
+ *          main loop and reprograms the ADS1291/2 (set_sampling_rate()), which cannot be done
+ *          from the BLE event handler.
+ *
+ * @param[in]   p_bms        Biopotential Measurement Service structure.
+ * @param[out]  p_data_rate  CONFIG1.DR code to apply.
+ *
+ * @return      true if a new data rate was written since the last call.
+ */
+bool ble_bms_data_rate_take(ble_bms_t * p_bms, uint8_t * p_data_rate);
+
+/**@brief Function for taking a filter selection written by the client.
+ *
+ * @details Like the data rate, the selection is applied by the application, which owns the
+ *          filter stage (bms_filter.h) between acquisition and ble_bms_update(). A new
+ *          connection selects no filtering, which is also reported here.
+ *
+ * @param[in]   p_bms        Biopotential Measurement Service structure.
+ * @param[out]  p_filter     BMS_FILTER_* selection to apply.
+ *
+ * @return      true if the selection changed since the last call.
+ */
+bool ble_bms_filter_take(ble_bms_t * p_bms, uint8_t * p_filter);
+
+/**@brief Function for applying the Data Format, channels and mode written by the client.
+ *
+ * @details The BLE event handler only latches the writes: the stream is encoded from the main
+ *          loop, and switching format under it could mix two layouts in one packet. Call this
+ *          from the main loop; ble_bms_send() holds the stream while a write waits. The packet
+ *          encoded in the old format and not sent yet is discarded. A new channel count also
+ *          drops the buffered samples, which were laid out for the old one. Enabling
+ *          notifications restarts the encoder too, so the first packet notified is a key packet
+ *          whatever was encoded for the readable value meanwhile.
+ *
+ * @param[in]   p_bms        Biopotential Measurement Service structure.
+ */
+void ble_bms_config_apply(ble_bms_t * p_bms);
+
 //void ble_bms_send (ble_bms_t *p_bms);
 #endif // BLE_BMS_H__
 
@@ -0,0 +1,268 @@
+/* Copyright (c) 2016 Musa Mahmood
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "bms_codec.h"
+#include <string.h>
+
+#define BMS_CODEC_K_MAX									23
+#define BMS_CODEC_KEY_MASK							((1UL << BMS_CODEC_KEY_BITS) - 1)
+
+/**@brief Write the n low bits of value, MSB first. The buffer must be zeroed beforehand. */
+static void bits_put(bms_codec_packet_t * p_pkt, uint32_t value, uint8_t n)
+{
+		while (n > 0) {
+				uint8_t room = 8 - (p_pkt->bit_pos & 7);
+				uint8_t take = (n < room) ? n : room;
+				uint8_t chunk = (uint8_t)((value >> (n - take)) & ((1UL << take) - 1));
+				p_pkt->p_buf[p_pkt->bit_pos >> 3] |= (uint8_t)(chunk << (room - take));
+				p_pkt->bit_pos += take;
+				n -= take;
+		}
+}
+
+/**@brief Read n bits, MSB first. Caller checks the bounds. */
+static uint32_t bits_get(uint8_t const * p_in, uint16_t * p_bit_pos, uint8_t n)
+{
+		uint32_t value = 0;
+		while (n > 0) {
+				uint8_t room = 8 - (*p_bit_pos & 7);
+				uint8_t take = (n < room) ? n : room;
+				uint8_t chunk = (uint8_t)(p_in[*p_bit_pos >> 3] >> (room - take)) & (uint8_t)((1UL << take) - 1);
+				value = (value << take) | chunk;
+				*p_bit_pos += take;
+				n -= take;
+		}
+		return value;
+}
+
+static int32_t predict(int32_t p1, int32_t p2, uint8_t order)
+{
+		return (order == 2) ? (2 * p1 - p2) : p1;
+}
+
+void bms_codec_init(bms_codec_t * p_codec, uint8_t order, uint8_t key_interval)
+{
+		memset(p_codec, 0, sizeof(*p_codec));
+		p_codec->order				= (order == 2) ? 2 : 1;
+		p_codec->key_interval	= (key_interval != 0) ? key_interval : BMS_CODEC_DEFAULT_KEY_INTERVAL;
+		p_codec->channels			= 1;
+		p_codec->k						= 4;
+}
+
+void bms_codec_reset(bms_codec_t * p_codec)
+{
+		p_codec->since_key = 0;
+}
+
+void bms_codec_channels_set(bms_codec_t * p_codec, uint8_t channels)
+{
+		p_codec->channels		= (channels == 2) ? 2 : 1;
+		p_codec->since_key	= 0;
+}
+
+void bms_codec_packet_begin(bms_codec_t const * p_codec, bms_codec_packet_t * p_pkt,
+                            uint8_t * p_out, uint8_t out_max)
+{
+		p_pkt->st				= *p_codec;
+		p_pkt->p_buf		= p_out;
+		p_pkt->bit_pos	= BMS_CODEC_HEADER_LEN * 8;
+		p_pkt->bit_max	= (uint16_t)out_max * 8;
+		p_pkt->zz_sum		= 0;
+		p_pkt->count		= 0;
+		p_pkt->key			= (p_codec->since_key == 0);
+		memset(p_out, 0, out_max);
+		p_out[0] = (p_pkt->key ? BMS_CODEC_FLAG_KEY : 0) |
+		           ((p_codec->order == 2) ? BMS_CODEC_FLAG_ORDER2 : 0) |
+		           ((p_codec->channels == 2) ? BMS_CODEC_FLAG_2CH : 0) |
+		           (p_codec->k & BMS_CODEC_K_MASK);
+}
+
+bool bms_codec_packet_put(bms_codec_packet_t * p_pkt, int32_t sample)
+{
+		bms_codec_t * p_st = &p_pkt->st;
+		uint8_t				ch   = p_pkt->count % p_st->channels;
+
+		if (p_pkt->count == UINT8_MAX) {
+				return false;
+		}
+		if (p_pkt->key && (p_pkt->count < p_st->channels)) {
+				if (p_pkt->bit_pos + BMS_CODEC_KEY_BITS > p_pkt->bit_max) {
+						return false;
+				}
+				bits_put(p_pkt, (uint32_t)sample & BMS_CODEC_KEY_MASK, BMS_CODEC_KEY_BITS);
+				p_st->p1[ch] = sample;
+				p_st->p2[ch] = sample;
+				p_pkt->count++;
+				return true;
+		}
+
+		int32_t		residual	= sample - predict(p_st->p1[ch], p_st->p2[ch], p_st->order);
+		uint32_t	zz				= ((uint32_t)residual << 1) ^ (uint32_t)(residual >> 31);
+		uint32_t	q					= zz >> p_st->k;
+		uint16_t	bits			= (q < BMS_CODEC_RICE_ESCAPE) ? (uint16_t)(q + 1 + p_st->k)
+		                                                : (BMS_CODEC_RICE_ESCAPE + BMS_CODEC_RAW_BITS);
+
+		if (p_pkt->bit_pos + bits > p_pkt->bit_max) {
+				return false;
+		}
+		if (q < BMS_CODEC_RICE_ESCAPE) {
+				bits_put(p_pkt, 0xFFFFFFFF, (uint8_t)q);
+				p_pkt->bit_pos++;														// Terminating zero, buffer is pre-zeroed.
+				bits_put(p_pkt, zz, p_st->k);
+		} else {
+				bits_put(p_pkt, 0xFFFFFFFF, BMS_CODEC_RICE_ESCAPE);
+				bits_put(p_pkt, zz, BMS_CODEC_RAW_BITS);
+		}
+		p_st->p2[ch] = p_st->p1[ch];
+		p_st->p1[ch] = sample;
+		p_pkt->zz_sum = (p_pkt->zz_sum + zz < p_pkt->zz_sum) ? UINT32_MAX : (p_pkt->zz_sum + zz);
+		p_pkt->count++;
+		return true;
+}
+
+bool bms_codec_packet_put_frame(bms_codec_packet_t * p_pkt, int32_t const * p_samples)
+{
+		bms_codec_packet_t	saved = *p_pkt;
+		uint8_t							ch;
+
+		for (ch = 0; ch < p_pkt->st.channels; ch++) {
+				if (!bms_codec_packet_put(p_pkt, p_samples[ch])) {
+						break;
+				}
+		}
+		if (ch == p_pkt->st.channels) {
+				return true;
+		}
+		// Roll back, clearing the bits written since: the buffer must stay zeroed past bit_pos.
+		uint16_t first	= saved.bit_pos >> 3;
+		uint16_t end		= (p_pkt->bit_pos + 7) >> 3;
+		if (end > first) {
+				p_pkt->p_buf[first] &= (uint8_t)(0xFF00 >> (saved.bit_pos & 7));
+				memset(&p_pkt->p_buf[first + 1], 0, end - first - 1);
+		}
+		*p_pkt = saved;
+		return false;
+}
+
+uint8_t bms_codec_packet_end(bms_codec_packet_t * p_pkt, bms_codec_t * p_codec)
+{
+		bms_codec_t *	p_st			= &p_pkt->st;
+		uint32_t			n_rice		= p_pkt->count - (p_pkt->key ? p_st->channels : 0);
+
+		if (p_pkt->count == 0) {
+				return 0;
+		}
+		p_pkt->p_buf[1] = p_pkt->count;
+
+		// Next k: smallest k with n * 2^k >= sum of residuals (mean residual ~ 2^k).
+		if (n_rice > 0) {
+				uint8_t k = 0;
+				while ((k < BMS_CODEC_K_MAX) && ((n_rice << k) < p_pkt->zz_sum)) {
+						k++;
+				}
+				p_st->k = k;
+		}
+		p_st->since_key = (uint8_t)((p_st->since_key + 1) % p_st->key_interval);
+		*p_codec = *p_st;
+		return (uint8_t)((p_pkt->bit_pos + 7) / 8);
+}
+
+void bms_decoder_init(bms_decoder_t * p_dec)
+{
+		memset(p_dec, 0, sizeof(*p_dec));
+}
+
+void bms_decoder_desync(bms_decoder_t * p_dec)
+{
+		p_dec->synced = false;
+}
+
+int bms_decoder_decode(bms_decoder_t * p_dec, uint8_t const * p_in, uint8_t len,
+                       int32_t * p_out, uint16_t max_out)
+{
+		uint8_t		flags;
+		uint8_t		count;
+		uint8_t		k;
+		uint8_t		order;
+		uint8_t		channels;
+		bool			key;
+		uint16_t	bit_pos		= BMS_CODEC_HEADER_LEN * 8;
+		uint16_t	bit_max		= (uint16_t)len * 8;
+		uint8_t		i;
+
+		if (len < BMS_CODEC_HEADER_LEN) {
+				return -1;
+		}
+		flags	= p_in[0];
+		count	= p_in[1];
+		k			= flags & BMS_CODEC_K_MASK;
+		order	= (flags & BMS_CODEC_FLAG_ORDER2) ? 2 : 1;
+		key		= (flags & BMS_CODEC_FLAG_KEY) != 0;
+		channels	= (flags & BMS_CODEC_FLAG_2CH) ? 2 : 1;
+		if (count > max_out || (count % channels) != 0) {
+				return -1;
+		}
+		if (!key && !p_dec->synced) {
+				return -2;
+		}
+
+		for (i = 0; i < count; i++) {
+				int32_t sample;
+				uint8_t ch = i % channels;
+				if (key && (i < channels)) {
+						if (bit_pos + BMS_CODEC_KEY_BITS > bit_max) {
+								return -1;
+						}
+						uint32_t raw = bits_get(p_in, &bit_pos, BMS_CODEC_KEY_BITS);
+						sample = (int32_t)((raw ^ (1UL << 23)) - (1UL << 23));
+						p_dec->p2[ch] = sample;
+				} else {
+						uint32_t q = 0;
+						uint32_t zz;
+						while (q < BMS_CODEC_RICE_ESCAPE) {
+								if (bit_pos >= bit_max) {
+										return -1;
+								}
+								if (bits_get(p_in, &bit_pos, 1) == 0) {
+										break;
+								}
+								q++;
+						}
+						if (q == BMS_CODEC_RICE_ESCAPE) {
+								if (bit_pos + BMS_CODEC_RAW_BITS > bit_max) {
+										return -1;
+								}
+								zz = bits_get(p_in, &bit_pos, BMS_CODEC_RAW_BITS);
+						} else {
+								if (bit_pos + k > bit_max) {
+										return -1;
+								}
+								zz = (q << k) | bits_get(p_in, &bit_pos, k);
+						}
+						sample = predict(p_dec->p1[ch], p_dec->p2[ch], order) + (int32_t)((zz >> 1) ^ (0U - (zz & 1)));
+						p_dec->p2[ch] = p_dec->p1[ch];
+				}
+				p_dec->p1[ch] = sample;
+				p_out[i] = sample;
+		}
+		p_dec->synced = true;
+		return count;
+}
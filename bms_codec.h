@@ -0,0 +1,154 @@
+/* Copyright (c) 2016 Musa Mahmood
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/** @file
+ *
+ * @brief Lossless delta/Rice codec for the Body Voltage Measurement stream.
+ *
+ * @details Each sample is predicted from the previous one (first order) or two (second order),
+ *          the residual is zig-zag mapped to an unsigned value and Rice coded with a parameter k
+ *          chosen per packet from the residual magnitudes of the previous packet. Residuals whose
+ *          quotient would exceed BMS_CODEC_RICE_ESCAPE are sent as an escape code followed by the
+ *          raw zig-zag value, so the worst case stays bounded.
+ *
+ *          Two channels can share a stream: samples then alternate CH1, CH2, CH1, ... and each
+ *          channel is predicted from its own history. A packet always ends on a whole pair.
+ *
+ *          Predictor state carries over from one packet to the next. Every key_interval packets
+ *          (and after bms_codec_reset()) a key packet restarts the predictor from an absolute
+ *          24-bit sample, so a receiver that lost a packet resynchronises at the next key packet.
+ *
+ *          Codec payload layout (follows the BMS header, see bms_format.h):
+ *            byte 0    flags: bit 7 key packet, bit 6 second-order predictor, bit 5 two
+ *                      interleaved channels, bits 4:0 Rice k
+ *            byte 1    number of samples in the packet, all channels
+ *            byte 2..  bitstream, MSB first. Key packets start with the first sample of each
+ *                      channel as a 24-bit two's complement value; every other sample is a
+ *                      Rice code.
+ *
+ *          The module has no SDK dependencies; the decoder is the reference used by host tools.
+ */
+
+#ifndef BMS_CODEC_H__
+#define BMS_CODEC_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define BMS_CODEC_HEADER_LEN						2								/**< Flags + sample count. */
+#define BMS_CODEC_FLAG_KEY							0x80
+#define BMS_CODEC_FLAG_ORDER2						0x40
+#define BMS_CODEC_FLAG_2CH							0x20
+#define BMS_CODEC_K_MASK								0x1F
+#define BMS_CODEC_RICE_ESCAPE						16							/**< Unary quotients this long are followed by a raw value instead. */
+#define BMS_CODEC_RAW_BITS							27							/**< Width of an escaped zig-zag residual (second-order residual of 24-bit data). */
+#define BMS_CODEC_KEY_BITS							24							/**< Width of the absolute sample starting a key packet. */
+#define BMS_CODEC_DEFAULT_KEY_INTERVAL	16							/**< Packets between key packets. */
+#define BMS_CODEC_MAX_CHANNELS					2
+
+/**@brief Persistent encoder state. */
+typedef struct
+{
+		int32_t			p1[BMS_CODEC_MAX_CHANNELS];		/**< Previous sample of each channel. */
+		int32_t			p2[BMS_CODEC_MAX_CHANNELS];		/**< Sample before p1. */
+		uint8_t			channels;								/**< Interleaved channels, 1 or 2. */
+		uint8_t			k;											/**< Rice parameter for the next packet. */
+		uint8_t			order;									/**< Predictor order, 1 or 2. */
+		uint8_t			key_interval;						/**< Packets between key packets. */
+		uint8_t			since_key;							/**< Packets sent since the last key packet. */
+} bms_codec_t;
+
+/**@brief One packet being assembled. Works on a copy of the encoder state so an abandoned
+ *        packet leaves the encoder untouched. */
+typedef struct
+{
+		bms_codec_t	st;
+		uint8_t *		p_buf;
+		uint16_t		bit_pos;
+		uint16_t		bit_max;
+		uint32_t		zz_sum;									/**< Sum of zig-zag residuals, drives the next k. */
+		uint8_t			count;
+		bool				key;
+} bms_codec_packet_t;
+
+/**@brief Decoder state. */
+typedef struct
+{
+		int32_t			p1[BMS_CODEC_MAX_CHANNELS];
+		int32_t			p2[BMS_CODEC_MAX_CHANNELS];
+		bool				synced;									/**< False until a key packet has been seen. */
+} bms_decoder_t;
+
+/**@brief Initialize an encoder. The first packet will be a key packet.
+ *
+ * @param[in]   order          Predictor order, 1 or 2.
+ * @param[in]   key_interval   Packets between key packets (0 selects the default).
+ */
+void bms_codec_init(bms_codec_t * p_codec, uint8_t order, uint8_t key_interval);
+
+/**@brief Force the next packet to be a key packet. */
+void bms_codec_reset(bms_codec_t * p_codec);
+
+/**@brief Select the number of interleaved channels (1 or 2). Forces a key packet. */
+void bms_codec_channels_set(bms_codec_t * p_codec, uint8_t channels);
+
+/**@brief Start a packet in p_out.
+ *
+ * @param[in]   out_max    Bytes available at p_out, including BMS_CODEC_HEADER_LEN.
+ */
+void bms_codec_packet_begin(bms_codec_t const * p_codec, bms_codec_packet_t * p_pkt,
+                            uint8_t * p_out, uint8_t out_max);
+
+/**@brief Append a sample.
+ *
+ * @return false if the sample does not fit; the packet is unchanged and should be ended.
+ */
+bool bms_codec_packet_put(bms_codec_packet_t * p_pkt, int32_t sample);
+
+/**@brief Append one sample of every channel, CH1 first, or none of them.
+ *
+ * @return false if they do not all fit; the packet is unchanged and should be ended.
+ */
+bool bms_codec_packet_put_frame(bms_codec_packet_t * p_pkt, int32_t const * p_samples);
+
+/**@brief Finish a packet and commit the encoder state.
+ *
+ * @return Number of bytes written at p_out.
+ */
+uint8_t bms_codec_packet_end(bms_codec_packet_t * p_pkt, bms_codec_t * p_codec);
+
+/**@brief Initialize a decoder. It waits for a key packet. */
+void bms_decoder_init(bms_decoder_t * p_dec);
+
+/**@brief Tell the decoder that packets were lost; it waits for the next key packet. */
+void bms_decoder_desync(bms_decoder_t * p_dec);
+
+/**@brief Decode one codec payload (the bytes after the BMS header).
+ *
+ * @details Two-channel payloads come out interleaved, CH1 first.
+ *
+ * @return Number of samples written to p_out, -1 if the payload is malformed or does not fit
+ *         in max_out, -2 if the decoder is waiting for a key packet.
+ */
+int bms_decoder_decode(bms_decoder_t * p_dec, uint8_t const * p_in, uint8_t len,
+                       int32_t * p_out, uint16_t max_out);
+
+#endif // BMS_CODEC_H__
@@ -0,0 +1,226 @@
+/* Copyright (c) 2016 Musa Mahmood
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "bms_conn_ctrl.h"
+#include <string.h>
+#include "nordic_common.h"
+#include "hal.h"
+#include "ads1291-2.h"
+
+#define MS_TO_TICKS(MS)							((uint32_t)(((uint64_t)(MS) * HAL_CLOCK_HZ) / 1000))
+
+static uint32_t ticks_since(uint32_t now, uint32_t then)
+{
+		return (now - then) & HAL_CLOCK_MASK;
+}
+
+/**@brief Conversions per notification before any have been sent in a layout. Errs low, so
+ *        the first interval is on the short side. */
+static uint16_t spp_q4_default(uint8_t format, uint8_t channels)
+{
+		if (format == BLE_BMS_FORMAT_RAW) {
+				return (BLE_BMS_MAX_BVM_LENGTH / (BLE_BMS_SAMPLE_BYTES * channels)) << 4;
+		}
+		return ((BLE_BMS_MAX_BVM_LENGTH - BLE_BMS_HEADER_LEN) / (BLE_BMS_SAMPLE_BYTES * channels)) << 4;
+}
+
+/**@brief Follow the samples per notification the service actually achieves. */
+static void density_update(bms_conn_ctrl_t * p_ctrl, ble_bms_t const * p_bms)
+{
+		uint32_t packets = p_bms->tx_queued - p_ctrl->packets;
+		uint32_t samples = p_bms->samples_queued - p_ctrl->samples;
+
+		if (p_bms->format != p_ctrl->format || p_bms->channels != p_ctrl->channels) {
+				p_ctrl->format		= p_bms->format;
+				p_ctrl->channels	= p_bms->channels;
+				p_ctrl->spp_q4		= spp_q4_default(p_bms->format, p_bms->channels);
+		} else if (packets >= 4) {
+				p_ctrl->spp_q4 = (uint16_t)((3 * p_ctrl->spp_q4 + (samples << 4) / packets) / 4);
+		} else {
+				return;
+		}
+		p_ctrl->packets = p_bms->tx_queued;
+		p_ctrl->samples = p_bms->samples_queued;
+}
+
+/**@brief Work out the parameters for the current data rate, density and level. */
+static void target_get(bms_conn_ctrl_t const * p_ctrl, ble_bms_t const * p_bms, ble_gap_conn_params_t * p_params)
+{
+		uint32_t per_event = MIN(BMS_CONN_CTRL_PACKETS_PER_EVENT, MAX(p_bms->tx_buffers, 1));
+		// 1.25 ms units: samples per event * 800 / SPS, with samples per notification in Q4.
+		uint32_t base      = (per_event * p_ctrl->spp_q4 * 50) / ADS1291_2_DR_TO_SPS(p_bms->data_rate);
+		uint32_t interval  = MIN(MAX(base, BMS_CONN_CTRL_MIN_INTERVAL), BMS_CONN_CTRL_MAX_INTERVAL);
+		uint32_t latency   = 0;
+
+		if (p_ctrl->download) {
+				interval = BMS_CONN_CTRL_MIN_INTERVAL;
+		} else if (p_bms->mode != BLE_BMS_MODE_STREAM) {
+				interval = BMS_CONN_CTRL_MAX_INTERVAL;
+				latency  = BMS_CONN_CTRL_IDLE_SLAVE_LATENCY;
+		} else if (p_ctrl->level == 0) {
+				if (base > BMS_CONN_CTRL_MAX_INTERVAL) {
+						latency = MIN(base / interval - 1, BMS_CONN_CTRL_MAX_SLAVE_LATENCY);
+				}
+		} else {
+				interval = MAX(interval >> p_ctrl->level, BMS_CONN_CTRL_MIN_INTERVAL);
+		}
+		p_params->max_conn_interval	= (uint16_t)interval;
+		p_params->min_conn_interval	= (uint16_t)MAX(interval - interval / 4, BMS_CONN_CTRL_MIN_INTERVAL);
+		p_params->slave_latency			= (uint16_t)latency;
+		p_params->conn_sup_timeout	= BMS_CONN_CTRL_SUP_TIMEOUT;
+}
+
+static bool params_ok(ble_gap_conn_params_t const * p_current, ble_gap_conn_params_t const * p_target)
+{
+		return (p_current->max_conn_interval >= p_target->min_conn_interval) &&
+		       (p_current->max_conn_interval <= p_target->max_conn_interval) &&
+		       (p_current->slave_latency == p_target->slave_latency);
+}
+
+/**@brief Move the level with the backlog. */
+static void level_update(bms_conn_ctrl_t * p_ctrl, uint32_t backlog, uint32_t now)
+{
+		uint32_t relax = MS_TO_TICKS(BMS_CONN_CTRL_RELAX_MS) << p_ctrl->relax_shift;
+
+		if (backlog >= BMS_CONN_CTRL_BACKLOG_HIGH) {
+				if (p_ctrl->level < BMS_CONN_CTRL_MAX_LEVEL &&
+				    p_ctrl->current.max_conn_interval > BMS_CONN_CTRL_MIN_INTERVAL &&
+				    ticks_since(now, p_ctrl->request_ticks) >= MS_TO_TICKS(BMS_CONN_CTRL_HOLDOFF_MS) &&
+				    (p_ctrl->declined_ticks == 0 ||
+				     ticks_since(now, p_ctrl->declined_ticks) >= MS_TO_TICKS(BMS_CONN_CTRL_RETRY_MS))) {
+						if (p_ctrl->relax_ticks != 0 && ticks_since(now, p_ctrl->relax_ticks) < relax) {
+								// Stepped back too early: wait longer next time.
+								p_ctrl->relax_shift = MIN(p_ctrl->relax_shift + 1, BMS_CONN_CTRL_RELAX_MAX_SHIFT);
+						}
+						p_ctrl->relax_ticks = 0;
+						p_ctrl->level++;
+				}
+				p_ctrl->idle_ticks = now;
+		} else if (backlog > BMS_CONN_CTRL_BACKLOG_LOW) {
+				p_ctrl->idle_ticks = now;
+		} else if (p_ctrl->level > 0 && ticks_since(now, p_ctrl->idle_ticks) >= relax) {
+				p_ctrl->level--;
+				p_ctrl->idle_ticks	= now;
+				p_ctrl->relax_ticks	= now | 1;
+		}
+}
+
+void bms_conn_ctrl_init(bms_conn_ctrl_t * p_ctrl)
+{
+		memset(p_ctrl, 0, sizeof(*p_ctrl));
+		p_ctrl->conn_handle	= BLE_CONN_HANDLE_INVALID;
+		p_ctrl->data_rate		= ADS1291_2_REGDEFAULT_CONFIG1 & ADS1291_2_REG_CONFIG1_DR_MASK;
+}
+
+void bms_conn_ctrl_on_ble_evt(bms_conn_ctrl_t * p_ctrl, ble_evt_t * p_ble_evt)
+{
+		switch (p_ble_evt->header.evt_id) {
+				case BLE_GAP_EVT_CONNECTED:
+						p_ctrl->conn_handle			= p_ble_evt->evt.gap_evt.conn_handle;
+						p_ctrl->current					= p_ble_evt->evt.gap_evt.params.connected.conn_params;
+						memset(&p_ctrl->requested, 0, sizeof(p_ctrl->requested));
+						p_ctrl->level						= 0;
+						p_ctrl->relax_shift			= 0;
+						p_ctrl->relax_ticks			= 0;
+						p_ctrl->declined				= false;
+						p_ctrl->declined_ticks	= 0;
+						p_ctrl->format					= BLE_BMS_FORMAT_RAW;
+						p_ctrl->channels				= 1;
+						p_ctrl->mode						= BLE_BMS_MODE_STREAM;
+						p_ctrl->download				= false;
+						p_ctrl->spp_q4					= spp_q4_default(BLE_BMS_FORMAT_RAW, 1);
+						// Leave the central alone for a moment after connecting.
+						p_ctrl->request_ticks		= hal_clock_ticks();
+						p_ctrl->eval_ticks			= p_ctrl->request_ticks;
+						p_ctrl->idle_ticks			= p_ctrl->request_ticks;
+						break;
+				case BLE_GAP_EVT_DISCONNECTED:
+						p_ctrl->conn_handle = BLE_CONN_HANDLE_INVALID;
+						break;
+				case BLE_GAP_EVT_CONN_PARAM_UPDATE:
+						p_ctrl->current = p_ble_evt->evt.gap_evt.params.conn_param_update.conn_params;
+						break;
+				default:
+						break;
+		}
+}
+
+void bms_conn_ctrl_on_declined(bms_conn_ctrl_t * p_ctrl)
+{
+		// From the Connection Parameters module's context; bms_conn_ctrl_update() acts on it.
+		p_ctrl->declined = true;
+}
+
+void bms_conn_ctrl_update(bms_conn_ctrl_t * p_ctrl, ble_bms_t const * p_bms, uint32_t backlog)
+{
+		ble_gap_conn_params_t	target;
+		uint32_t							now					= hal_clock_ticks();
+		bool									download		= (p_bms->log_status[0] == BLE_BMS_LOG_DOWNLOAD);
+		bool									rate_change	= (p_bms->data_rate != p_ctrl->data_rate) || (p_bms->mode != p_ctrl->mode) ||
+		                                    (download != p_ctrl->download);
+
+		if (p_ctrl->conn_handle == BLE_CONN_HANDLE_INVALID) {
+				return;
+		}
+		if (p_ctrl->declined) {
+				// Keep what the central runs; the same request is not repeated before
+				// BMS_CONN_CTRL_RETRY_MS, and a shorter one not asked for meanwhile.
+				p_ctrl->declined				= false;
+				p_ctrl->declined_ticks	= now | 1;
+				p_ctrl->request_ticks		= now;
+				if (p_ctrl->level > 0) {
+						p_ctrl->level--;
+				}
+		}
+		if (!rate_change && backlog < BMS_CONN_CTRL_BACKLOG_HIGH &&
+		    ticks_since(now, p_ctrl->eval_ticks) < MS_TO_TICKS(BMS_CONN_CTRL_PERIOD_MS)) {
+				return;
+		}
+		p_ctrl->eval_ticks	= now;
+		p_ctrl->data_rate		= p_bms->data_rate;
+		p_ctrl->mode				= p_bms->mode;
+		p_ctrl->download		= download;
+		if (download) {
+				// Log packets count in tx_queued but carry no live samples.
+				p_ctrl->packets = p_bms->tx_queued;
+				p_ctrl->samples = p_bms->samples_queued;
+		} else {
+				density_update(p_ctrl, p_bms);
+		}
+		level_update(p_ctrl, backlog, now);
+		target_get(p_ctrl, p_bms, &target);
+		if (params_ok(&p_ctrl->current, &target)) {
+				return;
+		}
+		if (!rate_change && ticks_since(now, p_ctrl->request_ticks) < MS_TO_TICKS(BMS_CONN_CTRL_HOLDOFF_MS)) {
+				return;
+		}
+		if (memcmp(&target, &p_ctrl->requested, sizeof(target)) == 0 &&
+		    ticks_since(now, p_ctrl->request_ticks) < MS_TO_TICKS(BMS_CONN_CTRL_RETRY_MS)) {
+				return;
+		}
+		// NRF_ERROR_BUSY: a procedure is in progress; try again after the holdoff.
+		if (hal_conn_params_request(p_ctrl->conn_handle, &target) == NRF_SUCCESS) {
+				p_ctrl->requested = target;
+		}
+		p_ctrl->request_ticks = now;
+}
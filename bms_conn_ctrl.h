@@ -0,0 +1,128 @@
+/* Copyright (c) 2016 Musa Mahmood
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/** @file
+ *
+ * @brief Connection parameter controller for the Biopotential Measurement Service.
+ *
+ * @details Picks the connection interval and slave latency from what the link has to carry
+ *          and asks the central for them through hal_conn_params_request():
+ *
+ *          - The base interval fits BMS_CONN_CTRL_PACKETS_PER_EVENT notifications per event
+ *            (fewer if the SoftDevice has fewer TX buffers) at the current data rate and the
+ *            measured samples per notification, so DELTA gets longer intervals than RAW.
+ *          - When that is longer than BMS_CONN_CTRL_MAX_INTERVAL the interval stays at the
+ *            maximum and slave latency lets the link skip events with nothing to send, which
+ *            cuts radio-on time at low data rates without delaying samples.
+ *          - In BLE_BMS_MODE_BEATS and BLE_BMS_MODE_SUMMARY nothing is streamed: the interval
+ *            is the maximum and slave latency BMS_CONN_CTRL_IDLE_SLAVE_LATENCY, so the link
+ *            is idle between the occasional status notification.
+ *          - While the log is downloading (BLE_BMS_LOG_DOWNLOAD) the interval is the minimum
+ *            with no slave latency, so the backlog drains as fast as the link allows.
+ *          - A frame ring backlog above BMS_CONN_CTRL_BACKLOG_HIGH raises the level: every
+ *            level halves the interval and drops slave latency. After the backlog has stayed
+ *            below BMS_CONN_CTRL_BACKLOG_LOW for BMS_CONN_CTRL_RELAX_MS the level steps back.
+ *            If the backlog returns soon after, the next step back waits twice as long, up to
+ *            BMS_CONN_CTRL_RELAX_MAX_SHIFT doublings, so a link that cannot carry the base
+ *            interval does not keep overflowing.
+ *
+ *          The central picks from a range; parameters already inside it are left alone. A new
+ *          data rate, mode or log state is acted on at once, other changes wait BMS_CONN_CTRL_HOLDOFF_MS after
+ *          the previous request. A central that declines a request keeps its parameters: the
+ *          controller steps back a level and does not raise it again for BMS_CONN_CTRL_RETRY_MS.
+ */
+
+#ifndef BMS_CONN_CTRL_H__
+#define BMS_CONN_CTRL_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ble.h"
+#include "ble_bms.h"
+#include "frame_ring.h"
+
+#define BMS_CONN_CTRL_PACKETS_PER_EVENT		3								/**< Notifications per event the base interval is sized for. */
+#define BMS_CONN_CTRL_MIN_INTERVAL				6								/**< 7.5 ms, the shortest interval allowed (1.25 ms units). */
+#define BMS_CONN_CTRL_MAX_INTERVAL				40							/**< 50 ms. Bounds the delay of writes from the central. */
+#define BMS_CONN_CTRL_MAX_SLAVE_LATENCY		4
+#define BMS_CONN_CTRL_IDLE_SLAVE_LATENCY	19							/**< Without samples to stream: attend one event a second at the maximum interval. */
+#define BMS_CONN_CTRL_SUP_TIMEOUT					400							/**< 4 s (10 ms units). */
+#define BMS_CONN_CTRL_MAX_LEVEL						3
+#define BMS_CONN_CTRL_BACKLOG_HIGH				(FRAME_RING_SIZE / 2)		/**< Queued frames that call for a shorter interval. */
+#define BMS_CONN_CTRL_BACKLOG_LOW					(FRAME_RING_SIZE / 8)		/**< Queued frames below which the link counts as idle. */
+#define BMS_CONN_CTRL_PERIOD_MS						250							/**< Evaluation period while the backlog is low. */
+#define BMS_CONN_CTRL_HOLDOFF_MS					1000						/**< Time for a request to take effect before the next one. */
+#define BMS_CONN_CTRL_RELAX_MS						10000						/**< Idle time before stepping a level back. */
+#define BMS_CONN_CTRL_RELAX_MAX_SHIFT			3
+#define BMS_CONN_CTRL_RETRY_MS						30000						/**< Repeat an unanswered request after this long. */
+
+typedef struct
+{
+		uint16_t								conn_handle;
+		ble_gap_conn_params_t		current;							/**< Parameters in use, from the last GAP event. */
+		ble_gap_conn_params_t		requested;						/**< Last request, min_conn_interval 0 if none. */
+		uint8_t									level;								/**< 0 follows the data rate, each level halves the interval. */
+		uint8_t									format;								/**< Format spp_q4 was measured for. */
+		uint8_t									channels;							/**< Channels spp_q4 was measured for. */
+		uint8_t									data_rate;						/**< Data rate of the last evaluation. */
+		uint8_t									mode;									/**< ble_bms_mode_t of the last evaluation. */
+		bool										download;							/**< The log was downloading at the last evaluation. */
+		uint16_t								spp_q4;								/**< Conversions per notification, Q4. */
+		uint32_t								samples;							/**< ble_bms_t samples_queued at the last evaluation. */
+		uint32_t								packets;							/**< ble_bms_t tx_queued at the last evaluation. */
+		uint32_t								eval_ticks;						/**< hal_clock_ticks() of the last evaluation. */
+		uint32_t								request_ticks;				/**< Of the last request, or of the connection. */
+		uint32_t								idle_ticks;						/**< Since when the backlog has been low. */
+		uint32_t								relax_ticks;					/**< Of the last step back. */
+		uint8_t									relax_shift;					/**< Doublings of BMS_CONN_CTRL_RELAX_MS. */
+		volatile bool						declined;							/**< The central declined the last request; not acted on yet. */
+		uint32_t								declined_ticks;				/**< When that was acted on (bit 0 set), 0 if never on this link. */
+} bms_conn_ctrl_t;
+
+/**@brief Function for initializing the controller. */
+void bms_conn_ctrl_init(bms_conn_ctrl_t * p_ctrl);
+
+/**@brief Function for tracking the connection and its parameters.
+ *
+ * @param[in]   p_ctrl       Controller.
+ * @param[in]   p_ble_evt    Event received from the BLE stack.
+ */
+void bms_conn_ctrl_on_ble_evt(bms_conn_ctrl_t * p_ctrl, ble_evt_t * p_ble_evt);
+
+/**@brief Function for reporting that the central declined the parameters requested.
+ *
+ * @details Call on BLE_CONN_PARAMS_EVT_FAILED, instead of disconnecting: the link stays up with
+ *          the parameters in use and bms_conn_ctrl_update() backs off.
+ *
+ * @param[in]   p_ctrl       Controller.
+ */
+void bms_conn_ctrl_on_declined(bms_conn_ctrl_t * p_ctrl);
+
+/**@brief Function for running the controller. Call from the main loop.
+ *
+ * @param[in]   p_ctrl       Controller.
+ * @param[in]   p_bms        Service whose data rate, format and counters drive the choice.
+ * @param[in]   backlog      Frames waiting upstream of the service (ads1291_2_frames_pending()).
+ */
+void bms_conn_ctrl_update(bms_conn_ctrl_t * p_ctrl, ble_bms_t const * p_bms, uint32_t backlog);
+
+#endif // BMS_CONN_CTRL_H__
@@ -0,0 +1,180 @@
+/* Copyright (c) 2016 Musa Mahmood
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "bms_filter.h"
+#include <string.h>
+
+#define BMS_FILTER_RATES								4								/**< 125, 250, 500 and 1000 SPS. */
+#define BMS_FILTER_Q_MASK								((1L << BMS_FILTER_Q) - 1)
+#define BMS_FILTER_CODE_MAX							0x7FFFFF
+#define BMS_FILTER_CODE_MIN							(-0x800000)
+
+/**@brief High-pass k per data rate: the corner fs / (2 pi 2^k) is 0.62-0.63 Hz at all four. */
+static const uint8_t m_hp_shift[BMS_FILTER_RATES] = {5, 6, 7, 8};
+
+/**@brief 50 Hz notch, Q = 4. */
+static const bms_biquad_t m_notch_50hz[BMS_FILTER_RATES] = {
+		{ 15263,  24695,  15263,  24695,  14141},		//  125 SPS
+		{ 14643,  -9050,  14643,  -9050,  12902},		//  250 SPS
+		{ 15263, -24695,  15263, -24695,  14141},		//  500 SPS
+		{ 15775, -30005,  15775, -30005,  15165},		// 1000 SPS
+};
+
+/**@brief 60 Hz notch, Q = 4. */
+static const bms_biquad_t m_notch_60hz[BMS_FILTER_RATES] = {
+		{ 16131,  32008,  16131,  32008,  15879},		//  125 SPS
+		{ 14567,  -1829,  14567,  -1829,  12749},		//  250 SPS
+		{ 15093, -22004,  15093, -22004,  13801},		//  500 SPS
+		{ 15663, -29127,  15663, -29127,  14942},		// 1000 SPS
+};
+
+/**@brief 40 Hz second-order Butterworth low-pass. b1 is rounded so the DC gain is exactly 1. */
+static const bms_biquad_t m_lowpass[BMS_FILTER_RATES] = {
+		{  7123,  14245,   7123,   8508,   3599},		//  125 SPS
+		{  2381,   4762,   2381, -10994,   4134},		//  250 SPS
+		{   756,   1511,    756, -21419,   8058},		//  500 SPS
+		{   219,    437,    219, -26992,  11483},		// 1000 SPS
+};
+
+/**@brief One biquad step.
+ *
+ * @details c * v is computed as c * (v >> 14) + c * (v & 0x3FFF) / 2^14. The high parts are
+ *          whole output units; the low parts, with |c| < 2 and the tables above, sum to less
+ *          than 2^31, so both fit 32 bits. The fraction of the low sum is carried in *p_err.
+ */
+static int32_t biquad_run(bms_biquad_t const * p_bq, int32_t * p_x, int32_t * p_y, uint32_t * p_err, int32_t in)
+{
+		int32_t hi =   p_bq->b0 * (in     >> BMS_FILTER_Q)
+		             + p_bq->b1 * (p_x[0] >> BMS_FILTER_Q)
+		             + p_bq->b2 * (p_x[1] >> BMS_FILTER_Q)
+		             - p_bq->a1 * (p_y[0] >> BMS_FILTER_Q)
+		             - p_bq->a2 * (p_y[1] >> BMS_FILTER_Q);
+		int32_t lo =   p_bq->b0 * (in     & BMS_FILTER_Q_MASK)
+		             + p_bq->b1 * (p_x[0] & BMS_FILTER_Q_MASK)
+		             + p_bq->b2 * (p_x[1] & BMS_FILTER_Q_MASK)
+		             - p_bq->a1 * (p_y[0] & BMS_FILTER_Q_MASK)
+		             - p_bq->a2 * (p_y[1] & BMS_FILTER_Q_MASK)
+		             + (int32_t)*p_err;
+		int32_t out = hi + (lo >> BMS_FILTER_Q);
+
+		*p_err	= (uint32_t)lo & BMS_FILTER_Q_MASK;
+		p_x[1]	= p_x[0];
+		p_x[0]	= in;
+		p_y[1]	= p_y[0];
+		p_y[0]	= out;
+		return out;
+}
+
+/**@brief One high-pass step: y = x - x[-1] + y[-1] - y[-1] / 2^k. */
+static int32_t highpass_run(bms_filter_channel_t * p_ch, uint8_t shift, int32_t in)
+{
+		int32_t leak	= p_ch->hp_y1 + (int32_t)p_ch->hp_err;
+		int32_t out		= in - p_ch->hp_x1 + p_ch->hp_y1 - (leak >> shift);
+
+		p_ch->hp_err	= (uint32_t)leak & ((1UL << shift) - 1);
+		p_ch->hp_x1		= in;
+		p_ch->hp_y1		= out;
+		return out;
+}
+
+/**@brief Set the state of a channel as if sample had always been its input. */
+static void channel_prime(bms_filter_t const * p_filter, bms_filter_channel_t * p_ch, int32_t sample)
+{
+		int32_t settled = (p_filter->hp_shift != 0) ? 0 : sample;
+
+		memset(p_ch, 0, sizeof(*p_ch));
+		p_ch->hp_x1 = sample;
+		for (uint8_t i = 0; i < p_filter->biquads; i++) {
+				// Unity DC gain: the output settles at the input.
+				p_ch->x[i][0] = p_ch->x[i][1] = settled;
+				p_ch->y[i][0] = p_ch->y[i][1] = settled;
+		}
+		p_ch->primed = true;
+}
+
+/**@brief Coefficient table row of a data rate, BMS_FILTER_RATES if there is none. */
+static uint8_t rate_index(uint32_t sps)
+{
+		uint8_t rate = 0;
+		while (rate < BMS_FILTER_RATES && (125u << rate) != sps) {
+				rate++;
+		}
+		return rate;
+}
+
+void bms_filter_init(bms_filter_t * p_filter)
+{
+		memset(p_filter, 0, sizeof(*p_filter));
+}
+
+bool bms_filter_config(bms_filter_t * p_filter, uint8_t selection, uint32_t sps)
+{
+		uint8_t rate = rate_index(sps);
+
+		memset(p_filter, 0, sizeof(*p_filter));
+		p_filter->selection = selection & BMS_FILTER_ALL;
+		if (rate == BMS_FILTER_RATES) {
+				return false;
+		}
+		if (selection & BMS_FILTER_HIGHPASS) {
+				p_filter->hp_shift = m_hp_shift[rate];
+		}
+		if (selection & BMS_FILTER_NOTCH) {
+				p_filter->p_biquad[p_filter->biquads++] = (selection & BMS_FILTER_NOTCH_60HZ) ? &m_notch_60hz[rate]
+				                                                                              : &m_notch_50hz[rate];
+		}
+		if (selection & BMS_FILTER_LOWPASS) {
+				p_filter->p_biquad[p_filter->biquads++] = &m_lowpass[rate];
+		}
+		return bms_filter_active(p_filter);
+}
+
+bool bms_filter_active(bms_filter_t const * p_filter)
+{
+		return (p_filter->hp_shift != 0) || (p_filter->biquads != 0);
+}
+
+int32_t bms_filter_run(bms_filter_t * p_filter, uint8_t channel, int32_t sample)
+{
+		bms_filter_channel_t * p_ch;
+		int32_t                v    = sample;
+
+		if (!bms_filter_active(p_filter) || channel >= BMS_FILTER_MAX_CHANNELS) {
+				return sample;
+		}
+		p_ch = &p_filter->ch[channel];
+		if (!p_ch->primed) {
+				channel_prime(p_filter, p_ch, sample);
+		}
+		if (p_filter->hp_shift != 0) {
+				v = highpass_run(p_ch, p_filter->hp_shift, v);
+		}
+		for (uint8_t i = 0; i < p_filter->biquads; i++) {
+				v = biquad_run(p_filter->p_biquad[i], p_ch->x[i], p_ch->y[i], &p_ch->err[i], v);
+		}
+		if (v > BMS_FILTER_CODE_MAX) {
+				v = BMS_FILTER_CODE_MAX;
+		} else if (v < BMS_FILTER_CODE_MIN) {
+				v = BMS_FILTER_CODE_MIN;
+		}
+		return v;
+}
@@ -0,0 +1,127 @@
+/* Copyright (c) 2016 Musa Mahmood
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/** @file
+ *
+ * @brief Fixed-point filter stage for the Body Voltage Measurement stream.
+ *
+ * @details Up to three stages run on each channel's 24-bit codes, in this order:
+ *
+ *            high-pass  0.6 Hz first order, removes baseline wander and the electrode offset
+ *            notch      50 or 60 Hz mains, Q = 4
+ *            low-pass   40 Hz second-order Butterworth
+ *
+ *          Everything is 32-bit integer arithmetic for a Cortex-M0 without FPU. The high-pass
+ *          stage is a DC blocker, y = x - x[-1] + y[-1] - y[-1] / 2^k, with k picked per data
+ *          rate so the corner stays at about 0.6 Hz; it needs no multiply, and a 0.6 Hz pole
+ *          pair would not fit Q14 coefficients above 250 SPS. The notch and low-pass stages are
+ *          direct form I biquads with Q14 coefficients. Each product is split into two 32-bit
+ *          multiplies (the M0 has no 64-bit multiply instruction), so a biquad costs ten MULS.
+ *          Both stage types carry the bits their shifts drop into the next sample (error
+ *          feedback), so truncation does not build up a DC error or noise near the poles.
+ *
+ *          Coefficients exist for 125 to BMS_FILTER_MAX_SPS. Above that the stage passes
+ *          samples through unchanged.
+ *
+ *          The module has no SDK dependencies.
+ */
+
+#ifndef BMS_FILTER_H__
+#define BMS_FILTER_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define BMS_FILTER_HIGHPASS							0x01						/**< 0.6 Hz high-pass. */
+#define BMS_FILTER_NOTCH								0x02						/**< Mains notch, 50 Hz unless BMS_FILTER_NOTCH_60HZ. */
+#define BMS_FILTER_NOTCH_60HZ						0x04						/**< The notch is at 60 Hz. */
+#define BMS_FILTER_LOWPASS							0x08						/**< 40 Hz low-pass. */
+#define BMS_FILTER_ALL									0x0F						/**< Every valid bit of a filter selection. */
+
+#define BMS_FILTER_MAX_SPS							1000						/**< Highest data rate with coefficients. */
+#define BMS_FILTER_MAX_CHANNELS					2
+#define BMS_FILTER_MAX_BIQUADS					2
+#define BMS_FILTER_Q										14							/**< Fraction bits of the biquad coefficients. */
+
+/**@brief Biquad coefficients, Q14, normalised to a0 = 1:
+ *        y = b0 x + b1 x[-1] + b2 x[-2] - a1 y[-1] - a2 y[-2]. */
+typedef struct
+{
+		int16_t			b0;
+		int16_t			b1;
+		int16_t			b2;
+		int16_t			a1;
+		int16_t			a2;
+} bms_biquad_t;
+
+/**@brief State of one channel. */
+typedef struct
+{
+		int32_t			hp_x1;									/**< High-pass: previous input. */
+		int32_t			hp_y1;									/**< High-pass: previous output. */
+		uint32_t		hp_err;									/**< High-pass: bits of y[-1] / 2^k dropped so far. */
+		int32_t			x[BMS_FILTER_MAX_BIQUADS][2];			/**< Biquad inputs, x[-1] first. */
+		int32_t			y[BMS_FILTER_MAX_BIQUADS][2];			/**< Biquad outputs, y[-1] first. */
+		uint32_t		err[BMS_FILTER_MAX_BIQUADS];			/**< Biquad accumulator bits dropped by the last shift. */
+		bool				primed;									/**< State has been set from the first sample. */
+} bms_filter_channel_t;
+
+/**@brief Filter stage. */
+typedef struct
+{
+		uint8_t									selection;				/**< BMS_FILTER_* bits asked for. */
+		uint8_t									hp_shift;					/**< k of the high-pass stage, 0 when it is off. */
+		uint8_t									biquads;					/**< Biquads in use. */
+		bms_biquad_t const *		p_biquad[BMS_FILTER_MAX_BIQUADS];
+		bms_filter_channel_t		ch[BMS_FILTER_MAX_CHANNELS];
+} bms_filter_t;
+
+/**@brief Initialize a filter stage with every stage off. */
+void bms_filter_init(bms_filter_t * p_filter);
+
+/**@brief Select stages and the data rate. Restarts every channel.
+ *
+ * @param[in]   selection  BMS_FILTER_* bits; unknown bits are ignored.
+ * @param[in]   sps        Data rate of the samples.
+ *
+ * @return false if no stage runs: nothing was selected or there are no coefficients for sps.
+ */
+bool bms_filter_config(bms_filter_t * p_filter, uint8_t selection, uint32_t sps);
+
+/**@brief Check whether samples are changed at all.
+ */
+bool bms_filter_active(bms_filter_t const * p_filter);
+
+/**@brief Filter one sample of a channel.
+ *
+ * @details The first sample after bms_filter_config() sets the state as if the input had
+ *          always been at that value, so the high-pass stage starts at 0 rather than ringing
+ *          from the electrode offset.
+ *
+ * @param[in]   channel    0 to BMS_FILTER_MAX_CHANNELS - 1.
+ * @param[in]   sample     24-bit code, sign-extended.
+ *
+ * @return Filtered code, saturated to 24 bits.
+ */
+int32_t bms_filter_run(bms_filter_t * p_filter, uint8_t channel, int32_t sample);
+
+#endif // BMS_FILTER_H__
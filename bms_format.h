@@ -0,0 +1,91 @@
+/* Copyright (c) 2016 Musa Mahmood
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/** @file
+ *
+ * @brief On-air layout of Body Voltage Measurement notifications.
+ *
+ * @details Shared by the service (ble_bms.c) and the host reassembler (bms_rx.c); no SDK
+ *          dependencies.
+ */
+
+#ifndef BMS_FORMAT_H__
+#define BMS_FORMAT_H__
+
+/**@brief Notification payload formats, selected by the client through the Data Format characteristic.
+ *
+ * @details RAW is the headerless legacy layout: BLE_BMS_SAMPLE_BYTES per sample, little endian.
+ *          With more than one channel selected (Channels characteristic) every format carries
+ *          whole conversions, the samples of one conversion interleaved CH1 first, and the
+ *          sample counts below are shared between the channels.
+ *          PACKED16 and DELTA start with a BLE_BMS_HEADER_LEN header:
+ *            byte 0    format id, with BLE_BMS_HEADER_FLAG_TIME set on timed packets and
+ *                      BLE_BMS_HEADER_FLAG_SETTLING on packets carrying a conversion made
+ *                      while the ADS1291/2 was settling after a wake-up
+ *            byte 1    8-bit rolling sequence number
+ *            byte 2-3  low 16 bits of the first sample's conversion index, little endian
+ *          A timed packet continues with BLE_BMS_HEADER_TIME_LEN bytes: the RTC1 tick
+ *          (32768 Hz, 24 bits, little endian) of the first sample's DRDY edge. The first
+ *          packet and every BLE_BMS_TIME_INTERVAL-th after it are timed.
+ *
+ *          PACKED24 keeps the index off most packets so they still hold as many samples as RAW:
+ *            byte 0    as above
+ *            byte 1    8-bit rolling sequence number
+ *          A timed packet continues with the low 16 bits of the first sample's conversion index
+ *          and the BLE_BMS_HEADER_TIME_LEN time bytes, laid out like bytes 2-6 above. Besides the
+ *          BLE_BMS_TIME_INTERVAL cadence, a packet whose first conversion does not follow the
+ *          previous packet's is timed. Untimed packets are always BLE_BMS_PACKET_LEN bytes, so
+ *          the receiver counts the conversions of untimed and lost packets from the sequence
+ *          number alone.
+ *
+ *          The sequence number restarts on connection and on every format or channel change.
+ *          A gap in the sequence number is a lost notification; a gap in the index that the
+ *          sequence number does not explain is samples dropped before the radio.
+ *          bms_rx.h reassembles the stream on the host.
+ */
+typedef enum
+{
+		BLE_BMS_FORMAT_RAW						= 0x00,						/**< Headerless samples, 10 x 16-bit or 6 x 24-bit. */
+		BLE_BMS_FORMAT_PACKED24				= 0x01,						/**< Short header + 6 x 24-bit samples (4 if timed). Requires BLE_BMS_SAMPLE_24BIT. */
+		BLE_BMS_FORMAT_DELTA					= 0x02,						/**< Header + lossless delta/Rice payload, see bms_codec.h. */
+		BLE_BMS_FORMAT_PACKED16				= 0x03,						/**< Header + 8 x 16-bit samples (6 if timed). 16-bit builds only. */
+} ble_bms_format_t;
+
+#define BLE_BMS_PACKET_LEN												20						/**< Bytes in a full Body Voltage Measurement notification. */
+#define BLE_BMS_HEADER_LEN												4
+#define BLE_BMS_PACKED24_HEADER_LEN								2
+#define BLE_BMS_PACKED24_INDEX_LEN								2						/**< Conversion index of a timed PACKED24 packet. */
+#define BLE_BMS_HEADER_TIME_LEN										3
+#define BLE_BMS_HEADER_FLAG_TIME									0x80
+#define BLE_BMS_HEADER_FLAG_SETTLING							0x20
+#define BLE_BMS_HEADER_FORMAT_MASK								0x0F
+#define BLE_BMS_TIME_INTERVAL											16						/**< Packets from one timed packet to the next. */
+
+// Log Data notifications replay the packets recorded while no client was connected, which are
+// always BLE_BMS_FORMAT_DELTA. A recording, and every flash page of it, starts with a session
+// record instead: BLE_BMS_LOG_SESSION, then the format, the channel count and the data rate
+// (CONFIG1.DR code) of the packets after it. No packet has bit 6 set in its first byte. The
+// record repeats unchanged on every page, so a reader only restarts decoding when it changes.
+#define BLE_BMS_LOG_SESSION												0x40
+#define BLE_BMS_LOG_SESSION_LEN										4
+
+#endif // BMS_FORMAT_H__
@@ -0,0 +1,385 @@
+/* Copyright (c) 2016 Musa Mahmood
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "bms_log.h"
+#include <string.h>
+#include "nordic_common.h"
+#include "nrf_error.h"
+#include "app_util.h"
+
+#define BMS_LOG_NONE										BMS_LOG_PAGES		/**< No page. */
+
+static __INLINE uint16_t page_next(uint16_t page)
+{
+		return (page + 1 == BMS_LOG_PAGES) ? 0 : (uint16_t)(page + 1);
+}
+
+static __INLINE uint16_t batch_end(uint16_t offset)
+{
+		return (uint16_t)((offset / BMS_LOG_BATCH + 1) * BMS_LOG_BATCH);
+}
+
+static bool page_blank(uint16_t page)
+{
+		uint32_t const * p_word = (uint32_t const *)hal_flash_page(page);
+		for (uint16_t i = 0; i < HAL_FLASH_PAGE_SIZE / 4; i++) {
+				if (p_word[i] != 0xFFFFFFFF) {
+						return false;
+				}
+		}
+		return true;
+}
+
+static __INLINE uint32_t page_seq(uint16_t page)
+{
+		return *(uint32_t const *)hal_flash_page(page);
+}
+
+/**@brief Find where writing stopped in a page: the first batch that starts erased. */
+static uint16_t page_end(uint16_t page)
+{
+		uint8_t const *	p_page = hal_flash_page(page);
+		uint16_t				offset = BMS_LOG_PAGE_HEADER;
+
+		while (offset < HAL_FLASH_PAGE_SIZE) {
+				uint8_t len = p_page[offset];
+				if (len == BMS_LOG_EMPTY && (offset % BMS_LOG_BATCH) == 0) {
+						break;
+				}
+				if (len == 0 || len > BMS_LOG_RECORD_MAX) {
+						// Flushed batch or a write cut short by a reset.
+						offset = batch_end(offset);
+				} else {
+						offset += 1 + len;
+				}
+		}
+		return MIN(offset, HAL_FLASH_PAGE_SIZE);
+}
+
+/**@brief Schedule the erase of a page. Once the log has wrapped it holds the oldest records,
+ *        which are given up. */
+static void erase_request(bms_log_t * p_log, uint16_t page)
+{
+		if (p_log->tail_offset >= HAL_FLASH_PAGE_SIZE && bms_log_size(p_log) != 0) {
+				// At the end of a page is at the start of the next one.
+				p_log->tail_page		= page_next(p_log->tail_page);
+				p_log->tail_offset	= BMS_LOG_PAGE_HEADER;
+		}
+		if (p_log->tail_page == page && bms_log_size(p_log) != 0) {
+				p_log->tail_page		= page_next(page);
+				p_log->tail_offset	= BMS_LOG_PAGE_HEADER;
+		}
+		p_log->erase_page = page;
+		p_log->ready_page = BMS_LOG_NONE;
+}
+
+/**@brief Make sure the page after the head is erased by the time it is needed. */
+static void ahead_prepare(bms_log_t * p_log)
+{
+		uint16_t next = page_next(p_log->head_page);
+		if (page_blank(next)) {
+				p_log->ready_page = next;
+		} else {
+				erase_request(p_log, next);
+		}
+}
+
+static __INLINE uint8_t batches_free(bms_log_t const * p_log)
+{
+		return (uint8_t)(BMS_LOG_BUFFERS - (uint8_t)(p_log->batch_head - p_log->batch_tail) - (p_log->batch_open ? 1 : 0));
+}
+
+/**@brief Check that the batches len bytes at the head span are available. */
+static bool batches_available(bms_log_t const * p_log, uint16_t len)
+{
+		uint16_t first	= p_log->head_offset / BMS_LOG_BATCH;
+		uint16_t last		= (p_log->head_offset + len - 1) / BMS_LOG_BATCH;
+		return (last - first + 1 - (p_log->batch_open ? 1 : 0)) <= batches_free(p_log);
+}
+
+static void batch_close(bms_log_t * p_log)
+{
+		if (p_log->batch_open) {
+				p_log->batch_open = false;
+				p_log->batch_head++;
+		}
+}
+
+/**@brief Copy bytes to the head, sending each batch to the flash once full. The batches must
+ *        be available. */
+static void batch_put(bms_log_t * p_log, uint8_t const * p_data, uint16_t len)
+{
+		while (len > 0) {
+				bms_log_batch_t *	p_batch = &p_log->batch[p_log->batch_head % BMS_LOG_BUFFERS];
+				uint16_t					at;
+				uint16_t					n;
+
+				if (!p_log->batch_open) {
+						memset(p_batch->data, 0xFF, sizeof(p_batch->data));
+						p_batch->page				= p_log->head_page;
+						p_batch->offset			= p_log->head_offset - p_log->head_offset % BMS_LOG_BATCH;
+						p_log->batch_open		= true;
+				}
+				at = p_log->head_offset - p_batch->offset;
+				n  = MIN(len, BMS_LOG_BATCH - at);
+				memcpy((uint8_t *)p_batch->data + at, p_data, n);
+				p_data						+= n;
+				len								-= n;
+				p_log->head_offset	+= n;
+				if ((p_log->head_offset % BMS_LOG_BATCH) == 0) {
+						batch_close(p_log);
+				}
+		}
+}
+
+static void record_put(bms_log_t * p_log, uint8_t const * p_data, uint8_t len)
+{
+		batch_put(p_log, &len, 1);
+		batch_put(p_log, p_data, len);
+}
+
+/**@brief Move the head to the erased page after it: sequence number, then the session record.
+ *        Everything opening a page, and the record that did not fit before, go in one batch.
+ */
+static bool page_open(bms_log_t * p_log)
+{
+		uint16_t	next = page_next(p_log->head_page);
+		uint8_t		seq[BMS_LOG_PAGE_HEADER];
+
+		if (p_log->ready_page != next || batches_free(p_log) == 0) {
+				// Still erasing, or the flash is behind.
+				return false;
+		}
+		batch_close(p_log);
+		p_log->head_page		= next;
+		p_log->head_offset	= 0;
+		p_log->head_seq++;
+		p_log->ready_page		= BMS_LOG_NONE;
+		(void)uint32_encode(p_log->head_seq, seq);
+		batch_put(p_log, seq, sizeof(seq));
+		if (p_log->session_len != 0) {
+				record_put(p_log, p_log->session, p_log->session_len);
+		}
+		ahead_prepare(p_log);
+		return true;
+}
+
+/**@brief Append a record, opening a page if it does not fit the head page.
+ *
+ * @param[in] session  The record is the session record, which a new page starts with anyway.
+ */
+static bool append(bms_log_t * p_log, uint8_t const * p_data, uint8_t len, bool session)
+{
+		if (len == 0 || len > BMS_LOG_RECORD_MAX || p_log->wipe_page != BMS_LOG_NONE) {
+				p_log->dropped++;
+				return false;
+		}
+		if (p_log->head_offset + 1 + len > HAL_FLASH_PAGE_SIZE) {
+				if (!page_open(p_log)) {
+						p_log->dropped++;
+						return false;
+				}
+				if (session) {
+						return true;
+				}
+		} else if (!batches_available(p_log, 1 + len)) {
+				p_log->dropped++;
+				return false;
+		}
+		record_put(p_log, p_data, len);
+		return true;
+}
+
+void bms_log_init(bms_log_t * p_log)
+{
+		uint16_t	newest	= BMS_LOG_NONE;
+		uint16_t	oldest	= BMS_LOG_NONE;
+		uint32_t	seq;
+
+		memset(p_log, 0, sizeof(*p_log));
+		for (uint16_t page = 0; page < BMS_LOG_PAGES; page++) {
+				seq = page_seq(page);
+				if (seq == 0xFFFFFFFF) {
+						continue;
+				}
+				if (newest == BMS_LOG_NONE || seq > page_seq(newest)) {
+						newest = page;
+				}
+				if (oldest == BMS_LOG_NONE || seq < page_seq(oldest)) {
+						oldest = page;
+				}
+		}
+		p_log->erase_page	= BMS_LOG_NONE;
+		p_log->wipe_page	= BMS_LOG_NONE;
+		p_log->ready_page	= BMS_LOG_NONE;
+		if (newest == BMS_LOG_NONE) {
+				// Empty: the first record opens page 0.
+				p_log->head_page		= BMS_LOG_PAGES - 1;
+				p_log->head_offset	= HAL_FLASH_PAGE_SIZE;
+				p_log->tail_page		= p_log->head_page;
+				p_log->tail_offset	= p_log->head_offset;
+		} else {
+				p_log->head_page		= newest;
+				p_log->head_offset	= page_end(newest);
+				p_log->head_seq			= page_seq(newest);
+				p_log->tail_page		= oldest;
+				p_log->tail_offset	= BMS_LOG_PAGE_HEADER;
+		}
+		ahead_prepare(p_log);
+}
+
+bool bms_log_append(bms_log_t * p_log, uint8_t const * p_data, uint8_t len)
+{
+		return append(p_log, p_data, len, false);
+}
+
+void bms_log_session_set(bms_log_t * p_log, uint8_t const * p_data, uint8_t len)
+{
+		len = MIN(len, BMS_LOG_RECORD_MAX);
+		memcpy(p_log->session, p_data, len);
+		p_log->session_len = len;
+		(void)append(p_log, p_data, len, true);
+}
+
+void bms_log_flush(bms_log_t * p_log)
+{
+		if (p_log->batch_open) {
+				batch_close(p_log);
+				// The rest of the batch stays erased; the next record starts a new one.
+				p_log->head_offset = MIN(batch_end(p_log->head_offset - 1), HAL_FLASH_PAGE_SIZE);
+		}
+		p_log->session_len = 0;
+}
+
+void bms_log_clear(bms_log_t * p_log)
+{
+		// A write in flight still retires its batch, see bms_log_run().
+		p_log->batch_open		= false;
+		p_log->batch_head		= p_log->batch_tail;
+		p_log->session_len	= 0;
+		p_log->erase_page		= BMS_LOG_NONE;
+		p_log->ready_page		= BMS_LOG_NONE;
+		p_log->wipe_page		= 0;
+		p_log->head_page		= BMS_LOG_PAGES - 1;
+		p_log->head_offset	= HAL_FLASH_PAGE_SIZE;
+		p_log->tail_page		= p_log->head_page;
+		p_log->tail_offset	= p_log->head_offset;
+}
+
+void bms_log_run(bms_log_t * p_log)
+{
+		bms_log_batch_t const *	p_batch;
+
+		if (p_log->busy) {
+				if (!p_log->done) {
+						return;
+				}
+				p_log->busy = false;
+				p_log->done = false;
+				if (!p_log->done_ok) {
+						// Start it again below.
+						p_log->errors++;
+				} else if (!p_log->busy_erase) {
+						if (p_log->batch_tail != p_log->batch_head) {
+								p_log->batch_tail++;
+						}
+				} else if (p_log->wipe_page != BMS_LOG_NONE) {
+						p_log->wipe_page++;
+				} else {
+						p_log->ready_page = p_log->erase_page;
+						p_log->erase_page = BMS_LOG_NONE;
+				}
+		}
+		if (p_log->wipe_page != BMS_LOG_NONE) {
+				while (p_log->wipe_page < BMS_LOG_PAGES && page_blank(p_log->wipe_page)) {
+						p_log->wipe_page++;
+				}
+				if (p_log->wipe_page == BMS_LOG_PAGES) {
+						p_log->wipe_page = BMS_LOG_NONE;
+						ahead_prepare(p_log);
+				} else if (hal_flash_erase(p_log->wipe_page) == NRF_SUCCESS) {
+						p_log->busy				= true;
+						p_log->busy_erase	= true;
+				}
+				return;
+		}
+		// NRF_ERROR_NO_MEM: the pstorage queue is full; try again on the next pass.
+		if (p_log->erase_page != BMS_LOG_NONE) {
+				if (hal_flash_erase(p_log->erase_page) == NRF_SUCCESS) {
+						p_log->busy				= true;
+						p_log->busy_erase	= true;
+				}
+				return;
+		}
+		if (p_log->batch_tail != p_log->batch_head) {
+				p_batch = &p_log->batch[p_log->batch_tail % BMS_LOG_BUFFERS];
+				if (hal_flash_write(p_batch->page, p_batch->offset, p_batch->data, BMS_LOG_BATCH) == NRF_SUCCESS) {
+						p_log->busy				= true;
+						p_log->busy_erase	= false;
+				}
+		}
+}
+
+void bms_log_on_flash(bms_log_t * p_log, bool success)
+{
+		p_log->done_ok	= success;
+		p_log->done			= true;
+}
+
+uint8_t bms_log_peek(bms_log_t * p_log, uint8_t const ** pp_data)
+{
+		uint8_t const *	p_page;
+		uint8_t					len;
+
+		if (p_log->batch_open || p_log->batch_tail != p_log->batch_head || p_log->wipe_page != BMS_LOG_NONE) {
+				return 0;
+		}
+		for (;;) {
+				if (p_log->tail_page == p_log->head_page && p_log->tail_offset >= p_log->head_offset) {
+						return 0;
+				}
+				if (p_log->tail_offset >= HAL_FLASH_PAGE_SIZE) {
+						p_log->tail_page		= page_next(p_log->tail_page);
+						p_log->tail_offset	= BMS_LOG_PAGE_HEADER;
+						continue;
+				}
+				p_page	= hal_flash_page(p_log->tail_page);
+				len			= p_page[p_log->tail_offset];
+				if (len == 0 || len > BMS_LOG_RECORD_MAX) {
+						// The rest of a flushed batch.
+						p_log->tail_offset = batch_end(p_log->tail_offset);
+						continue;
+				}
+				*pp_data = &p_page[p_log->tail_offset + 1];
+				return len;
+		}
+}
+
+void bms_log_consume(bms_log_t * p_log)
+{
+		p_log->tail_offset += 1 + hal_flash_page(p_log->tail_page)[p_log->tail_offset];
+}
+
+uint32_t bms_log_size(bms_log_t const * p_log)
+{
+		uint32_t pages = (uint32_t)(p_log->head_page + BMS_LOG_PAGES - p_log->tail_page) % BMS_LOG_PAGES;
+		return pages * HAL_FLASH_PAGE_SIZE + p_log->head_offset - p_log->tail_offset;
+}
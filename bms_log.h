@@ -0,0 +1,148 @@
+/* Copyright (c) 2016 Musa Mahmood
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/** @file
+ *
+ * @brief Circular log of notifications in internal flash, for recording while disconnected.
+ *
+ * @details The log holds records of up to BMS_LOG_RECORD_MAX bytes, normally Body Voltage
+ *          Measurement packets exactly as they would have been notified, in BMS_LOG_PAGES
+ *          pages reserved with hal_flash_init(). Each page starts with a 32-bit sequence
+ *          number, so the oldest and newest pages are found again after a reset, followed by
+ *          records: a length byte and the record bytes. Records do not cross pages.
+ *
+ *          Records are gathered in RAM batches of BMS_LOG_BATCH bytes, aligned in the page,
+ *          and each batch is written with one hal_flash_write(). BMS_LOG_BUFFERS batches can
+ *          wait for the flash; beyond that new records are dropped and counted. The page after
+ *          the one being written is erased ahead of time, overwriting the oldest page once the
+ *          log has wrapped. bms_log_flush() writes a partial batch; the rest of it stays
+ *          erased, and a 0xFF length byte sends a reader to the next batch.
+ *
+ *          A session record set with bms_log_session_set() is written again at the start of
+ *          every page, so a reader starting at any page knows how to decode what follows.
+ *
+ *          Everything but bms_log_on_flash() runs in the main loop. Flash is only read while
+ *          no batch is waiting, so a reader never sees a half-written one.
+ */
+
+#ifndef BMS_LOG_H__
+#define BMS_LOG_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "hal.h"
+
+#define BMS_LOG_PAGES										64							/**< Flash pages, HAL_FLASH_PAGE_SIZE each. Keep PSTORAGE_NUM_OF_PAGES in step. */
+#define BMS_LOG_BATCH										64							/**< Bytes per flash write: 0.7 ms with the CPU halted. Divides HAL_FLASH_PAGE_SIZE. */
+#define BMS_LOG_BUFFERS									4								/**< RAM batches, the one being filled included. */
+#define BMS_LOG_RECORD_MAX							20							/**< Longest record, one notification. */
+#define BMS_LOG_PAGE_HEADER							4								/**< Sequence number at the start of each page. */
+#define BMS_LOG_EMPTY										0xFF						/**< Length byte of erased flash. */
+
+#if (HAL_FLASH_PAGE_SIZE % BMS_LOG_BATCH) != 0 || (BMS_LOG_BATCH % 4) != 0
+#error "BMS_LOG_BATCH must be a multiple of 4 dividing HAL_FLASH_PAGE_SIZE"
+#endif
+#if (BMS_LOG_PAGE_HEADER + 2 * (1 + BMS_LOG_RECORD_MAX)) > BMS_LOG_BATCH
+#error "A page header, the session record and a record must fit the first batch of a page"
+#endif
+
+/**@brief A batch of records on its way to the flash. */
+typedef struct
+{
+		uint32_t		data[BMS_LOG_BATCH / 4];
+		uint16_t		page;
+		uint16_t		offset;									/**< Of data[0] in the page, a multiple of BMS_LOG_BATCH. */
+} bms_log_batch_t;
+
+/**@brief Log state. Positions are a page and a byte offset in it. */
+typedef struct
+{
+		uint16_t					head_page;						/**< Page being written. */
+		uint16_t					head_offset;					/**< Next byte to write in it; HAL_FLASH_PAGE_SIZE once full. */
+		uint32_t					head_seq;							/**< Sequence number of head_page. */
+		uint16_t					tail_page;						/**< Oldest record not yet read out. */
+		uint16_t					tail_offset;
+		uint16_t					ready_page;						/**< Erased and next to be written, BMS_LOG_PAGES if none yet. */
+		uint16_t					erase_page;						/**< Erase to start, BMS_LOG_PAGES if none. */
+		uint16_t					wipe_page;						/**< Next page bms_log_clear() erases, BMS_LOG_PAGES when done. */
+		bms_log_batch_t		batch[BMS_LOG_BUFFERS];
+		uint8_t						batch_head;						/**< Batch being filled, if batch_open. */
+		uint8_t						batch_tail;						/**< Oldest batch not yet written. */
+		bool							batch_open;
+		bool							busy;									/**< An erase or write has been started. */
+		bool							busy_erase;						/**< ...and it is an erase. */
+		volatile bool			done;									/**< Set by bms_log_on_flash(). */
+		volatile bool			done_ok;
+		uint8_t						session[BMS_LOG_RECORD_MAX];
+		uint8_t						session_len;
+		uint32_t					dropped;							/**< Records lost because the flash fell behind. */
+		uint32_t					errors;								/**< Failed flash operations, retried. */
+} bms_log_t;
+
+/**@brief Function for finding the log left in flash. Call after hal_flash_init().
+ */
+void bms_log_init(bms_log_t * p_log);
+
+/**@brief Function for adding a record.
+ *
+ * @return false if the record was dropped.
+ */
+bool bms_log_append(bms_log_t * p_log, uint8_t const * p_data, uint8_t len);
+
+/**@brief Function for starting a session: the record is appended now and at every new page.
+ */
+void bms_log_session_set(bms_log_t * p_log, uint8_t const * p_data, uint8_t len);
+
+/**@brief Function for sending a partial batch to the flash, ending the session.
+ */
+void bms_log_flush(bms_log_t * p_log);
+
+/**@brief Function for dropping every record and erasing the pages that held them, one per
+ *        bms_log_run(). Records appended meanwhile are dropped.
+ */
+void bms_log_clear(bms_log_t * p_log);
+
+/**@brief Function for starting the next erase or write and retiring finished ones. Call from
+ *        the main loop.
+ */
+void bms_log_run(bms_log_t * p_log);
+
+/**@brief Function for reporting the end of a flash operation, from the hal_flash_handler_t.
+ */
+void bms_log_on_flash(bms_log_t * p_log, bool success);
+
+/**@brief Function for getting the oldest record not read out yet.
+ *
+ * @param[out] pp_data  Set to the record, in flash.
+ *
+ * @return Its length, or 0 if there is none or a batch is still on its way to the flash.
+ */
+uint8_t bms_log_peek(bms_log_t * p_log, uint8_t const ** pp_data);
+
+/**@brief Function for releasing the record returned by bms_log_peek().
+ */
+void bms_log_consume(bms_log_t * p_log);
+
+/**@brief Function for getting the bytes between the oldest record and the newest, flushed or not.
+ */
+uint32_t bms_log_size(bms_log_t const * p_log);
+
+#endif // BMS_LOG_H__
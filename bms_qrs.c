@@ -0,0 +1,352 @@
+/* Copyright (c) 2016 Musa Mahmood
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "bms_qrs.h"
+#include <string.h>
+
+#define BMS_QRS_RATE_UNIT								125							/**< Internal rate per unit of scale, Hz. */
+#define BMS_QRS_IN_SHIFT								6								/**< Input codes are scaled down by 2^6 ahead of the band-pass. */
+#define BMS_QRS_SLOPE_MAX								8191						/**< Derivative clamp: a window of squares stays within 32 bits. */
+#define BMS_QRS_LEARN_SHIFT							10
+
+#define BMS_QRS_LEARN_MS								2000
+#define BMS_QRS_MWI_MS									150
+#define BMS_QRS_REFRACTORY_MS						200
+#define BMS_QRS_TWAVE_MS								360
+#define BMS_QRS_RELEARN_MS							5000
+#define BMS_QRS_SEARCHBACK_PERCENT			166
+
+/**@brief Internal samples in a span of milliseconds. */
+#define BMS_QRS_SAMPLES(P_QRS, MS)			((uint32_t)(MS) * BMS_QRS_RATE_UNIT * (P_QRS)->scale / 1000)
+
+/**@brief Ring slot of internal sample N. */
+#define BMS_QRS_SLOT(N, LEN)						((N) & ((LEN) - 1))
+
+/**@brief Clear the detector, keeping the rate. */
+static void detector_restart(bms_qrs_t * p_qrs)
+{
+		uint8_t scale      = p_qrs->scale;
+		uint8_t decim_log2 = p_qrs->decim_log2;
+
+		memset(p_qrs, 0, sizeof(*p_qrs));
+		p_qrs->scale      = scale;
+		p_qrs->decim_log2 = decim_log2;
+}
+
+/**@brief Start a learning phase at the next internal sample. */
+static void learn_restart(bms_qrs_t * p_qrs)
+{
+		p_qrs->learn_start = p_qrs->n + 1;
+		p_qrs->learn_max   = 0;
+		p_qrs->learn_sum   = 0;
+		p_qrs->peak        = 0;
+		p_qrs->sb_peak     = 0;
+		p_qrs->have_beat   = false;
+		p_qrs->rr_sum      = 0;
+}
+
+/**@brief Set the band-pass state as if the input had always been at x. */
+static void bandpass_prime(bms_qrs_t * p_qrs, int32_t x)
+{
+		uint8_t lp_shift = 2 * (1 + p_qrs->scale);
+
+		for (uint8_t i = 0; i < BMS_QRS_X_LEN; i++) {
+				p_qrs->x[i] = x;
+		}
+		// DC gain of the low-pass is (4s)^2.
+		p_qrs->lp_y[0] = p_qrs->lp_y[1] = x * (1 << lp_shift);
+		for (uint8_t i = 0; i < BMS_QRS_LP_LEN; i++) {
+				p_qrs->lp[i] = x;
+		}
+		p_qrs->lp_sum = x * 16 * p_qrs->scale;
+		p_qrs->primed = true;
+}
+
+/**@brief Run the band-pass on one internal sample.
+ *
+ * @details Low-pass y = 2 y[-1] - y[-2] + x - 2 x[-4s] + x[-8s], zeros at multiples of f / 4s,
+ *          delay 4s - 1. High-pass: the sample 8s back less the mean of the last 16s, delay 8s.
+ */
+static int32_t bandpass_run(bms_qrs_t * p_qrs, int32_t x)
+{
+		uint32_t n       = p_qrs->n;
+		uint8_t  s       = p_qrs->scale;
+		int32_t  lp;
+		int32_t  mid;
+
+		lp = 2 * p_qrs->lp_y[0] - p_qrs->lp_y[1] + x
+		     - 2 * p_qrs->x[BMS_QRS_SLOT(n - 4 * s, BMS_QRS_X_LEN)]
+		     + p_qrs->x[BMS_QRS_SLOT(n - 8 * s, BMS_QRS_X_LEN)];
+		p_qrs->x[BMS_QRS_SLOT(n, BMS_QRS_X_LEN)] = x;
+		p_qrs->lp_y[1] = p_qrs->lp_y[0];
+		p_qrs->lp_y[0] = lp;
+		lp >>= 2 * (1 + s);
+
+		p_qrs->lp_sum += lp - p_qrs->lp[BMS_QRS_SLOT(n - 16 * s, BMS_QRS_LP_LEN)];
+		mid = p_qrs->lp[BMS_QRS_SLOT(n - 8 * s, BMS_QRS_LP_LEN)];
+		p_qrs->lp[BMS_QRS_SLOT(n, BMS_QRS_LP_LEN)] = lp;
+		return mid - (p_qrs->lp_sum >> (3 + s));
+}
+
+/**@brief Internal sample of the R peak under an integrator peak at t: the largest band-passed
+ *        sample the integrator window saw, less the band-pass delay.
+ */
+static uint32_t r_locate(bms_qrs_t const * p_qrs, uint32_t t)
+{
+		uint8_t  s      = p_qrs->scale;
+		uint32_t span   = BMS_QRS_SAMPLES(p_qrs, BMS_QRS_MWI_MS) + 4 * s;
+		uint32_t oldest = p_qrs->n - (BMS_QRS_BP_LEN - 1);
+		uint32_t best   = t;
+		int32_t  best_v = -1;
+
+		for (uint32_t i = 0; i <= span && (int32_t)(t - i - oldest) >= 0; i++) {
+				int32_t v = p_qrs->bp[BMS_QRS_SLOT(t - i, BMS_QRS_BP_LEN)];
+
+				if (v < 0) {
+						v = -v;
+				}
+				if (v > best_v) {
+						best_v = v;
+						best   = t - i;
+				}
+		}
+		return best - (12 * s - 1);
+}
+
+static void threshold_update(bms_qrs_t * p_qrs)
+{
+		p_qrs->threshold = p_qrs->npki;
+		if (p_qrs->spki > p_qrs->npki) {
+				p_qrs->threshold += (p_qrs->spki - p_qrs->npki) / 4;
+		}
+}
+
+/**@brief Record a beat and describe it in *p_beat. */
+static void beat_record(bms_qrs_t * p_qrs, uint32_t peak_n, uint32_t r_n, uint32_t slope, bms_qrs_beat_t * p_beat)
+{
+		uint32_t rate = BMS_QRS_RATE_UNIT * p_qrs->scale;
+		uint32_t rr   = 0;
+
+		if (p_qrs->have_beat) {
+				rr = r_n - p_qrs->r_n;
+				if (p_qrs->rr_sum == 0) {
+						p_qrs->rr_sum = rr * BMS_QRS_RR_AVERAGE;
+				} else if (rr * BMS_QRS_RR_AVERAGE * 100 <= p_qrs->rr_sum * BMS_QRS_SEARCHBACK_PERCENT) {
+						// Longer intervals span a missed beat.
+						p_qrs->rr_sum += rr - p_qrs->rr_sum / BMS_QRS_RR_AVERAGE;
+				}
+		}
+		p_qrs->have_beat  = true;
+		p_qrs->beat_n     = peak_n;
+		p_qrs->beat_slope = slope;
+		p_qrs->r_n        = r_n;
+		p_qrs->sb_peak    = 0;
+
+		p_beat->index = p_qrs->last_index - ((p_qrs->n - r_n) << p_qrs->decim_log2)
+		                - (((1u << p_qrs->decim_log2) - 1) >> 1);
+		rr = rr * 1024 / rate;
+		p_beat->rr  = (rr > UINT16_MAX) ? UINT16_MAX : (uint16_t)rr;
+		p_beat->bpm = 0;
+		if (p_qrs->rr_sum != 0) {
+				uint32_t bpm = (60 * rate * BMS_QRS_RR_AVERAGE + p_qrs->rr_sum / 2) / p_qrs->rr_sum;
+				p_beat->bpm = (bpm > UINT8_MAX) ? UINT8_MAX : (uint8_t)bpm;
+		}
+}
+
+/**@brief Classify the integrator peak being followed as a beat or noise. */
+static bool peak_classify(bms_qrs_t * p_qrs, bms_qrs_beat_t * p_beat)
+{
+		uint32_t peak  = p_qrs->peak;
+		uint32_t t     = p_qrs->peak_n;
+		uint32_t slope = p_qrs->slope;
+		bool     qrs;
+
+		p_qrs->peak  = 0;
+		p_qrs->slope = 0;
+		if (p_qrs->have_beat && (t - p_qrs->beat_n) < BMS_QRS_SAMPLES(p_qrs, BMS_QRS_REFRACTORY_MS)) {
+				return false;
+		}
+		qrs = (peak > p_qrs->threshold);
+		// Squared slopes: half the slope is a quarter of the square.
+		if (qrs && p_qrs->have_beat && (t - p_qrs->beat_n) < BMS_QRS_SAMPLES(p_qrs, BMS_QRS_TWAVE_MS)
+		    && slope < p_qrs->beat_slope / 4) {
+				qrs = false;
+		}
+		if (qrs) {
+				p_qrs->spki += peak / 8 - p_qrs->spki / 8;
+				beat_record(p_qrs, t, r_locate(p_qrs, t), slope, p_beat);
+		} else {
+				p_qrs->npki += peak / 8 - p_qrs->npki / 8;
+				if (peak > p_qrs->sb_peak) {
+						p_qrs->sb_peak  = peak;
+						p_qrs->sb_n     = t;
+						p_qrs->sb_r     = r_locate(p_qrs, t);
+						p_qrs->sb_slope = slope;
+				}
+		}
+		threshold_update(p_qrs);
+		return qrs;
+}
+
+/**@brief Run one internal sample through the detector. */
+static bool internal_run(bms_qrs_t * p_qrs, int32_t x, bms_qrs_beat_t * p_beat)
+{
+		uint32_t n      = p_qrs->n;
+		uint8_t  s      = p_qrs->scale;
+		uint32_t window = BMS_QRS_SAMPLES(p_qrs, BMS_QRS_MWI_MS);
+		uint32_t learn  = BMS_QRS_SAMPLES(p_qrs, BMS_QRS_LEARN_MS);
+		bool     found  = false;
+		int32_t  bp;
+		int32_t  d;
+		uint32_t sq;
+
+		if (!p_qrs->primed) {
+				bandpass_prime(p_qrs, x);
+		}
+		bp = bandpass_run(p_qrs, x);
+		if (bp > INT16_MAX) {
+				bp = INT16_MAX;
+		} else if (bp < INT16_MIN) {
+				bp = INT16_MIN;
+		}
+		p_qrs->bp[BMS_QRS_SLOT(n, BMS_QRS_BP_LEN)] = (int16_t)bp;
+
+		d =   2 * bp
+		    + p_qrs->bp[BMS_QRS_SLOT(n - s, BMS_QRS_BP_LEN)]
+		    - p_qrs->bp[BMS_QRS_SLOT(n - 3 * s, BMS_QRS_BP_LEN)]
+		    - 2 * p_qrs->bp[BMS_QRS_SLOT(n - 4 * s, BMS_QRS_BP_LEN)];
+		if (d > BMS_QRS_SLOPE_MAX) {
+				d = BMS_QRS_SLOPE_MAX;
+		} else if (d < -BMS_QRS_SLOPE_MAX) {
+				d = -BMS_QRS_SLOPE_MAX;
+		}
+		sq = (uint32_t)(d * d);
+		p_qrs->mwi += sq - p_qrs->sq[BMS_QRS_SLOT(n - window, BMS_QRS_SQ_LEN)];
+		p_qrs->sq[BMS_QRS_SLOT(n, BMS_QRS_SQ_LEN)] = sq;
+		if (sq > p_qrs->slope) {
+				p_qrs->slope = sq;
+		}
+
+		if (n - p_qrs->learn_start < learn) {
+				// Learning: the signal level starts at a third of the largest peak, the noise
+				// level at half the mean.
+				if (p_qrs->mwi > p_qrs->learn_max) {
+						p_qrs->learn_max = p_qrs->mwi;
+				}
+				p_qrs->learn_sum += p_qrs->mwi >> BMS_QRS_LEARN_SHIFT;
+				if (n - p_qrs->learn_start == learn - 1) {
+						p_qrs->spki   = p_qrs->learn_max / 3;
+						p_qrs->npki   = (p_qrs->learn_sum / learn) << (BMS_QRS_LEARN_SHIFT - 1);
+						p_qrs->slope  = 0;
+						p_qrs->beat_n = n;
+						threshold_update(p_qrs);
+				}
+		} else {
+				if (p_qrs->mwi >= p_qrs->mwi_prev) {
+						if (p_qrs->mwi > p_qrs->peak) {
+								p_qrs->peak   = p_qrs->mwi;
+								p_qrs->peak_n = n;
+						}
+				} else if (p_qrs->peak != 0 && p_qrs->mwi <= p_qrs->peak / 2) {
+						found = peak_classify(p_qrs, p_beat);
+				}
+
+				if (!found && p_qrs->rr_sum != 0 && p_qrs->sb_peak > p_qrs->threshold / 2
+				    && (n - p_qrs->beat_n) * BMS_QRS_RR_AVERAGE * 100 > p_qrs->rr_sum * BMS_QRS_SEARCHBACK_PERCENT) {
+						// Searchback: take the largest noise peak since the last beat.
+						p_qrs->spki += p_qrs->sb_peak / 4 - p_qrs->spki / 4;
+						beat_record(p_qrs, p_qrs->sb_n, p_qrs->sb_r, p_qrs->sb_slope, p_beat);
+						threshold_update(p_qrs);
+						found = true;
+				}
+
+				if (!found && (n - p_qrs->beat_n) > BMS_QRS_SAMPLES(p_qrs, BMS_QRS_RELEARN_MS)) {
+						learn_restart(p_qrs);
+				}
+		}
+		p_qrs->mwi_prev = p_qrs->mwi;
+		p_qrs->n++;
+		return found;
+}
+
+void bms_qrs_init(bms_qrs_t * p_qrs)
+{
+		memset(p_qrs, 0, sizeof(*p_qrs));
+}
+
+bool bms_qrs_config(bms_qrs_t * p_qrs, uint32_t sps)
+{
+		uint8_t k = 0;
+
+		memset(p_qrs, 0, sizeof(*p_qrs));
+		while ((BMS_QRS_MIN_SPS << k) < BMS_QRS_MAX_SPS && (BMS_QRS_MIN_SPS << k) != sps) {
+				k++;
+		}
+		if ((BMS_QRS_MIN_SPS << k) != sps) {
+				return false;
+		}
+		p_qrs->scale      = (k == 0) ? 1 : 2;
+		p_qrs->decim_log2 = (k == 0) ? 0 : k - 1;
+		return true;
+}
+
+/**@brief Add one input sample to the block being averaged, running the detector when it is full. */
+static bool input_add(bms_qrs_t * p_qrs, int32_t sample, bms_qrs_beat_t * p_beat)
+{
+		int32_t x;
+
+		p_qrs->decim_sum += sample;
+		if (++p_qrs->decim_count < (1u << p_qrs->decim_log2)) {
+				return false;
+		}
+		x = p_qrs->decim_sum >> (p_qrs->decim_log2 + BMS_QRS_IN_SHIFT);
+		p_qrs->decim_sum   = 0;
+		p_qrs->decim_count = 0;
+		return internal_run(p_qrs, x, p_beat);
+}
+
+bool bms_qrs_run(bms_qrs_t * p_qrs, int32_t sample, uint32_t index, bms_qrs_beat_t * p_beat)
+{
+		bool           found = false;
+		bms_qrs_beat_t later;
+		uint32_t       gap;
+
+		if (p_qrs->scale == 0) {
+				return false;
+		}
+		if (p_qrs->primed || p_qrs->decim_count != 0) {
+				gap = index - p_qrs->last_index - 1;
+				if (gap >= ((uint32_t)BMS_QRS_RATE_UNIT * p_qrs->scale << p_qrs->decim_log2)) {
+						detector_restart(p_qrs);
+				} else {
+						// Hold the last sample over frames lost before the detector, so the R-R
+						// intervals keep counting time. The first beat found is the one reported.
+						for (; gap > 0; gap--) {
+								p_qrs->last_index++;
+								found |= input_add(p_qrs, p_qrs->last_sample, found ? &later : p_beat);
+						}
+				}
+		}
+		p_qrs->last_index  = index;
+		p_qrs->last_sample = sample;
+		return input_add(p_qrs, sample, found ? &later : p_beat) || found;
+}
@@ -0,0 +1,141 @@
+/* Copyright (c) 2016 Musa Mahmood
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/** @file
+ *
+ * @brief Real-time QRS detector for the ECG channel.
+ *
+ * @details A Pan-Tompkins detector in 32-bit integer arithmetic. Input samples are averaged
+ *          down to an internal rate of 125 Hz (125 SPS) or 250 Hz (250 SPS and up), then run
+ *          through:
+ *
+ *            band-pass   integer low-pass (zero at f/4s) and high-pass (16s-sample moving
+ *                        average subtracted), about 5 to 15 Hz; s = f / 125
+ *            derivative  five-point, then squared
+ *            integrator  150 ms moving window
+ *
+ *          Peaks of the integrator output are classified against adaptive signal and noise
+ *          levels (SPKI, NPKI): threshold NPKI + (SPKI - NPKI) / 4 after a 2 s learning phase,
+ *          a 200 ms refractory period, a T-wave check on peaks within 360 ms of the last beat
+ *          (the slope must reach half of the beat's) and a searchback at half the threshold
+ *          when no beat has been found for 166% of the average R-R interval. The R peak is the
+ *          largest band-passed sample under the integrator window, less the band-pass delay,
+ *          so R-R intervals do not carry the jitter of the integrator peak.
+ *
+ *          A beat is reported when the integrator has fallen to half its peak, about a quarter
+ *          of a second after the R peak. After 5 s without a beat the levels are learnt again,
+ *          which also recovers from lead-off.
+ *
+ *          The module has no SDK dependencies.
+ */
+
+#ifndef BMS_QRS_H__
+#define BMS_QRS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define BMS_QRS_MIN_SPS									125u							/**< Lowest data rate; the rate must be 125 x 2^k. */
+#define BMS_QRS_MAX_SPS									8000u
+#define BMS_QRS_RR_AVERAGE							8								/**< R-R intervals in the heart rate average. */
+
+#define BMS_QRS_X_LEN										16							/**< Low-pass input history, 8s. */
+#define BMS_QRS_LP_LEN									32							/**< High-pass window, 16s. */
+#define BMS_QRS_BP_LEN									128							/**< Band-passed history searched for the R peak. */
+#define BMS_QRS_SQ_LEN									64							/**< Integrator window, 150 ms. */
+
+/**@brief A detected beat. */
+typedef struct
+{
+		uint32_t		index;									/**< Sample index of the R peak. */
+		uint16_t		rr;											/**< R-R interval to the previous beat in 1/1024 s, 0 for the first beat. */
+		uint8_t			bpm;										/**< Heart rate over the last BMS_QRS_RR_AVERAGE intervals, 0 until known. */
+} bms_qrs_beat_t;
+
+/**@brief Detector state, about 1 kB. */
+typedef struct
+{
+		uint8_t			scale;									/**< s: the internal rate is 125 s Hz; 0 when stopped. */
+		uint8_t			decim_log2;							/**< Input samples per internal sample, log2. */
+		uint8_t			decim_count;
+		int32_t			decim_sum;
+		uint32_t		last_index;							/**< Index of the last input sample. */
+		int32_t			last_sample;
+		uint32_t		n;											/**< Internal samples since bms_qrs_config(). */
+		bool				primed;
+
+		int32_t			x[BMS_QRS_X_LEN];				/**< Low-pass inputs. */
+		int32_t			lp_y[2];								/**< Low-pass outputs, y[-1] first. */
+		int32_t			lp[BMS_QRS_LP_LEN];			/**< Low-pass outputs scaled back to input units. */
+		int32_t			lp_sum;
+		int16_t			bp[BMS_QRS_BP_LEN];			/**< Band-pass outputs. */
+		uint32_t		sq[BMS_QRS_SQ_LEN];			/**< Squared derivative. */
+		uint32_t		mwi;										/**< Integrator output: sum of the last window of sq. */
+		uint32_t		mwi_prev;
+
+		uint32_t		learn_start;						/**< n where the current learning phase began. */
+		uint32_t		learn_max;
+		uint32_t		learn_sum;							/**< Sum of mwi / 2^10 over the learning phase. */
+		uint32_t		spki;										/**< Signal level. */
+		uint32_t		npki;										/**< Noise level. */
+		uint32_t		threshold;
+
+		uint32_t		peak;										/**< Integrator peak being followed, 0 if none. */
+		uint32_t		peak_n;
+		uint32_t		slope;									/**< Largest sq since the last classified peak. */
+
+		bool				have_beat;
+		uint32_t		beat_n;									/**< Integrator peak of the last beat. */
+		uint32_t		beat_slope;
+		uint32_t		r_n;										/**< R peak of the last beat. */
+		uint32_t		rr_sum;									/**< Average R-R interval in internal samples, times BMS_QRS_RR_AVERAGE. */
+
+		uint32_t		sb_peak;								/**< Largest noise peak since the last beat, for searchback. */
+		uint32_t		sb_n;
+		uint32_t		sb_r;
+		uint32_t		sb_slope;
+} bms_qrs_t;
+
+/**@brief Initialize a stopped detector. */
+void bms_qrs_init(bms_qrs_t * p_qrs);
+
+/**@brief Set the data rate and restart detection, with a new learning phase.
+ *
+ * @return false if the rate is not 125 x 2^k between BMS_QRS_MIN_SPS and BMS_QRS_MAX_SPS;
+ *         the detector is stopped then.
+ */
+bool bms_qrs_config(bms_qrs_t * p_qrs, uint32_t sps);
+
+/**@brief Feed one ECG sample.
+ *
+ * @param[in]   sample     24-bit code, sign-extended.
+ * @param[in]   index      Sample index, as in ads1291_2_frame_t. Skipped indices are filled
+ *                         with the previous sample; a jump of more than a second restarts
+ *                         detection.
+ * @param[out]  p_beat     Filled when a beat is detected.
+ *
+ * @return true if a beat was detected. Should filling a gap turn up a beat, *p_beat describes
+ *         it and any later one is not reported.
+ */
+bool bms_qrs_run(bms_qrs_t * p_qrs, int32_t sample, uint32_t index, bms_qrs_beat_t * p_beat);
+
+#endif // BMS_QRS_H__
@@ -0,0 +1,199 @@
+/* Copyright (c) 2016 Musa Mahmood
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/** @file
+ *
+ * @brief Host-side reassembler for Body Voltage Measurement notifications.
+ */
+
+#include "bms_rx.h"
+#include <string.h>
+
+#define BMS_RX_MIN(a, b)								((a) < (b) ? (a) : (b))
+
+/**@brief Little endian two's complement sample of the given width. */
+static int32_t sample_get(uint8_t const * p_src, uint8_t bytes)
+{
+		uint32_t value = 0;
+		for (uint8_t i = 0; i < bytes; i++) {
+				value |= (uint32_t)p_src[i] << (8 * i);
+		}
+		return (int32_t)(value << (32 - 8 * bytes)) >> (32 - 8 * bytes);
+}
+
+/**@brief Whole conversions of fixed-width samples. */
+static int samples_get(bms_rx_t const * p_rx, uint8_t const * p_in, uint16_t len, uint8_t bytes,
+                       int32_t * p_out, uint16_t max)
+{
+		uint16_t conversions	= BMS_RX_MIN(len / (bytes * p_rx->channels), max / p_rx->channels);
+		int			 count				= conversions * p_rx->channels;
+		for (int i = 0; i < count; i++) {
+				p_out[i] = sample_get(&p_in[i * bytes], bytes);
+		}
+		return count;
+}
+
+/**@brief Conversions in lost PACKED24 packets, from their sequence numbers. */
+static uint32_t packed24_skipped(bms_rx_t const * p_rx, uint8_t seq, uint8_t lost)
+{
+		uint8_t		bytes			= 3 * p_rx->channels;
+		uint32_t	skipped		= 0;
+		for (; lost > 0; lost--, seq++) {
+				// A packet timed off the cadence is not foreseen; the next timed packet corrects for it.
+				skipped += (seq % BLE_BMS_TIME_INTERVAL == 0)
+				         ? (BLE_BMS_PACKET_LEN - BLE_BMS_PACKED24_HEADER_LEN - BLE_BMS_PACKED24_INDEX_LEN -
+				            BLE_BMS_HEADER_TIME_LEN) / bytes
+				         : (BLE_BMS_PACKET_LEN - BLE_BMS_PACKED24_HEADER_LEN) / bytes;
+		}
+		return skipped;
+}
+
+void bms_rx_init(bms_rx_t * p_rx, uint8_t format, uint8_t raw_bytes, uint8_t channels)
+{
+		memset(p_rx, 0, sizeof(*p_rx));
+		p_rx->format		= format;
+		p_rx->raw_bytes	= raw_bytes;
+		p_rx->channels	= (channels == 2) ? 2 : 1;
+		bms_decoder_init(&p_rx->decoder);
+}
+
+int bms_rx_packet(bms_rx_t * p_rx, uint8_t const * p_data, uint16_t len,
+                  int32_t * p_samples, uint16_t max, bms_rx_packet_t * p_info)
+{
+		bms_rx_packet_t	info;
+		uint16_t				hdr_len;
+		uint16_t				idx16	= 0;
+		bool						indexed;
+		int							count;
+
+		memset(&info, 0, sizeof(info));
+		if (p_rx->format == BLE_BMS_FORMAT_RAW) {
+				count = samples_get(p_rx, p_data, len, p_rx->raw_bytes, p_samples, max);
+				info.index				= p_rx->next_index;
+				p_rx->next_index += (uint32_t)count / p_rx->channels;
+				p_rx->synced			= true;
+				p_rx->stats.packets++;
+				p_rx->stats.samples += (uint32_t)count / p_rx->channels;
+				if (p_info != NULL) {
+						*p_info = info;
+				}
+				return count;
+		}
+
+		info.timed	= (len > 0) && (p_data[0] & BLE_BMS_HEADER_FLAG_TIME);
+		info.settling	= (len > 0) && (p_data[0] & BLE_BMS_HEADER_FLAG_SETTLING);
+		indexed			= info.timed || (p_rx->format != BLE_BMS_FORMAT_PACKED24);
+		if (p_rx->format == BLE_BMS_FORMAT_PACKED24) {
+				hdr_len	= BLE_BMS_PACKED24_HEADER_LEN +
+				          (info.timed ? BLE_BMS_PACKED24_INDEX_LEN + BLE_BMS_HEADER_TIME_LEN : 0);
+		} else {
+				hdr_len	= BLE_BMS_HEADER_LEN + (info.timed ? BLE_BMS_HEADER_TIME_LEN : 0);
+		}
+		if (len < hdr_len || (p_data[0] & BLE_BMS_HEADER_FORMAT_MASK) != p_rx->format) {
+				p_rx->stats.bad++;
+				return BMS_RX_BAD_PACKET;
+		}
+		if (indexed) {
+				idx16 = (uint16_t)(p_data[2] | (p_data[3] << 8));
+		}
+		if (info.timed) {
+				info.ticks = (uint32_t)p_data[4] | ((uint32_t)p_data[5] << 8) | ((uint32_t)p_data[6] << 16);
+		}
+
+		if (!p_rx->synced) {
+				if (!indexed) {
+						// An untimed PACKED24 packet cannot be placed; wait for a timed one.
+						p_rx->stats.undecodable++;
+						return BMS_RX_WAIT_KEY;
+				}
+				info.index = idx16;
+		} else {
+				if (p_data[1] != p_rx->next_seq) {
+						uint8_t lost = (uint8_t)(p_data[1] - p_rx->next_seq);
+						p_rx->stats.seq_gaps++;
+						p_rx->stats.packets_lost += lost;
+						bms_decoder_desync(&p_rx->decoder);
+						if (!indexed) {
+								info.gap = packed24_skipped(p_rx, p_rx->next_seq, lost);
+								p_rx->stats.samples_lost += info.gap;
+						}
+				}
+				if (indexed) {
+						// The nearest index with these low 16 bits; a jump backwards means acquisition restarted.
+						info.index = p_rx->next_index + (uint32_t)(int32_t)(int16_t)(idx16 - (uint16_t)p_rx->next_index);
+						if ((int32_t)(info.index - p_rx->next_index) > 0) {
+								info.gap = info.index - p_rx->next_index;
+								p_rx->stats.samples_lost += info.gap;
+						}
+				} else {
+						info.index = p_rx->next_index + info.gap;
+				}
+		}
+		// Past the header the stream position is known even if the payload turns out bad; its
+		// samples then show up as the next packet's gap.
+		p_rx->synced			= true;
+		p_rx->next_seq		= (uint8_t)(p_data[1] + 1);
+		p_rx->next_index	= info.index;
+		p_data	+= hdr_len;
+		len			-= hdr_len;
+
+		switch (p_rx->format) {
+				case BLE_BMS_FORMAT_PACKED16:
+						count = samples_get(p_rx, p_data, len, 2, p_samples, max);
+						break;
+				case BLE_BMS_FORMAT_PACKED24:
+						count = samples_get(p_rx, p_data, len, 3, p_samples, max);
+						break;
+				case BLE_BMS_FORMAT_DELTA:
+						if (len > 0 && ((p_data[0] & BMS_CODEC_FLAG_2CH) != 0) != (p_rx->channels == 2)) {
+								count = -1;
+								break;
+						}
+						count = bms_decoder_decode(&p_rx->decoder, p_data, (uint8_t)len, p_samples, max);
+						break;
+				default:
+						count = -1;
+						break;
+		}
+		if (count == -2) {
+				// The codec header still says how many conversions the packet covered.
+				uint8_t skipped = (len >= BMS_CODEC_HEADER_LEN) ? p_data[1] / p_rx->channels : 0;
+				p_rx->next_index					+= skipped;
+				p_rx->stats.samples_lost	+= skipped;
+				p_rx->stats.undecodable++;
+				return BMS_RX_WAIT_KEY;
+		}
+		if (count < 0) {
+				p_rx->stats.bad++;
+				return BMS_RX_BAD_PACKET;
+		}
+		p_rx->next_index += (uint32_t)count / p_rx->channels;
+		p_rx->stats.packets++;
+		p_rx->stats.samples += (uint32_t)count / p_rx->channels;
+		if (info.settling) {
+				p_rx->stats.settling++;
+		}
+		if (p_info != NULL) {
+				*p_info = info;
+		}
+		return count;
+}
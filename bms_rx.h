@@ -0,0 +1,113 @@
+/* Copyright (c) 2016 Musa Mahmood
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/** @file
+ *
+ * @brief Host-side reassembler for Body Voltage Measurement notifications.
+ *
+ * @details Feed every notification to bms_rx_packet() in the order it arrived. The header
+ *          sequence number reveals lost notifications and the conversion index of the first
+ *          sample places every sample on the ADS1291/2 conversion timeline, so samples dropped
+ *          anywhere between DRDY and the peer show up as a gap in the index. Timed packets
+ *          carry the RTC1 tick of their first sample for alignment with other sensors.
+ *
+ *          RAW notifications have no header; they are assumed contiguous and only counted. Untimed
+ *          PACKED24 notifications carry no index; they are placed after the previous packet and
+ *          any lost in between, and the stream only starts at a timed one.
+ *
+ *          With two channels selected, samples come out interleaved CH1 first and indices count
+ *          conversions, not samples.
+ *
+ *          The module has no SDK dependencies; it is the reference receiver for host tools.
+ */
+
+#ifndef BMS_RX_H__
+#define BMS_RX_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "bms_codec.h"
+#include "bms_format.h"
+
+#define BMS_RX_BAD_PACKET								-1							/**< Malformed notification, or not in the expected format. */
+#define BMS_RX_WAIT_KEY									-2							/**< DELTA notification skipped while waiting for a key packet. */
+
+/**@brief Running totals since bms_rx_init(). */
+typedef struct
+{
+		uint32_t		packets;								/**< Notifications accepted. */
+		uint32_t		samples;								/**< Conversions delivered to the caller. */
+		uint32_t		seq_gaps;								/**< Breaks in the header sequence number. */
+		uint32_t		packets_lost;						/**< Notifications missing according to the sequence number. */
+		uint32_t		samples_lost;						/**< Conversions never delivered: index gaps and undecodable packets. */
+		uint32_t		bad;										/**< Malformed notifications. */
+		uint32_t		undecodable;						/**< DELTA notifications skipped while waiting for a key packet. */
+		uint32_t		settling;								/**< Accepted notifications flagged BLE_BMS_HEADER_FLAG_SETTLING. */
+} bms_rx_stats_t;
+
+/**@brief Where the samples of one notification belong. */
+typedef struct
+{
+		uint32_t		index;									/**< Conversion index of the first sample, unwrapped to 32 bits. */
+		uint32_t		gap;										/**< Conversions missing right before this packet. */
+		bool				timed;									/**< ticks is valid. */
+		uint32_t		ticks;									/**< RTC1 tick (24 bits) of the first sample's DRDY edge. */
+		bool				settling;								/**< Some samples were converted while the ADS1291/2 settled after a wake-up. */
+} bms_rx_packet_t;
+
+/**@brief Receiver state. */
+typedef struct
+{
+		uint8_t					format;						/**< ble_bms_format_t the client selected. */
+		uint8_t					raw_bytes;				/**< Bytes per RAW sample: 2, or 3 with BLE_BMS_SAMPLE_24BIT firmware. */
+		uint8_t					channels;					/**< Samples per conversion, the Channels characteristic. */
+		bool						synced;						/**< A packet has been seen; next_seq and next_index are valid. */
+		uint8_t					next_seq;
+		uint32_t				next_index;
+		bms_decoder_t		decoder;
+		bms_rx_stats_t	stats;
+} bms_rx_t;
+
+/**@brief Start a new stream, on connection or after writing the Data Format characteristic.
+ *
+ * @param[out]  p_rx       Receiver.
+ * @param[in]   format     Format the notifications will arrive in.
+ * @param[in]   raw_bytes  Bytes per RAW sample in the firmware build (2 or 3).
+ * @param[in]   channels   Channels selected, 1 or 2.
+ */
+void bms_rx_init(bms_rx_t * p_rx, uint8_t format, uint8_t raw_bytes, uint8_t channels);
+
+/**@brief Reassemble one notification.
+ *
+ * @param[in]   p_rx       Receiver.
+ * @param[in]   p_data     Notification value.
+ * @param[in]   len        Length of the value.
+ * @param[out]  p_samples  Decoded samples, in conversion order, channels interleaved.
+ * @param[in]   max        Room at p_samples, in samples.
+ * @param[out]  p_info     Position of the samples. May be NULL.
+ *
+ * @return Number of samples, BMS_RX_BAD_PACKET or BMS_RX_WAIT_KEY.
+ */
+int bms_rx_packet(bms_rx_t * p_rx, uint8_t const * p_data, uint16_t len,
+                  int32_t * p_samples, uint16_t max, bms_rx_packet_t * p_info);
+
+#endif // BMS_RX_H__
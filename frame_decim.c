@@ -0,0 +1,120 @@
+/* Copyright (c) 2016 Musa Mahmood
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "frame_decim.h"
+#include <string.h>
+
+/**@brief Reset a channel to a steady input at sample. */
+static void channel_prime(frame_decim_channel_t * p_ch, int32_t sample)
+{
+		memset(p_ch, 0, sizeof(*p_ch));
+		p_ch->offset	= sample;
+		p_ch->last		= sample;
+}
+
+static void channel_integrate(frame_decim_channel_t * p_ch, int32_t sample)
+{
+		p_ch->integ[0] += (uint64_t)(int64_t)(sample - p_ch->offset);
+		p_ch->integ[1] += p_ch->integ[0];
+		p_ch->integ[2] += p_ch->integ[1];
+		p_ch->last = sample;
+}
+
+/**@brief End a block: run the combs and scale the result back to a 24-bit code. */
+static int32_t channel_dump(frame_decim_channel_t * p_ch, uint8_t log2_ratio)
+{
+		uint8_t		shift = FRAME_DECIM_ORDER * log2_ratio;
+		uint64_t	v     = p_ch->integ[FRAME_DECIM_ORDER - 1];
+		int64_t		y;
+		for (uint8_t i = 0; i < FRAME_DECIM_ORDER; i++) {
+				uint64_t d = v - p_ch->comb[i];
+				p_ch->comb[i] = v;
+				v = d;
+		}
+		y = ((int64_t)v + ((int64_t)1 << (shift - 1))) >> shift;
+		return p_ch->offset + (int32_t)y;
+}
+
+void frame_decim_init(frame_decim_t * p_decim, uint8_t log2_ratio)
+{
+		p_decim->log2_ratio	= log2_ratio;
+		p_decim->primed			= false;
+		p_decim->next				= 0;
+		p_decim->base				= 0;
+}
+
+void frame_decim_config(frame_decim_t * p_decim, uint8_t log2_ratio, uint32_t conversion)
+{
+		uint32_t mask = (1u << p_decim->log2_ratio) - 1;
+		// Output index the next conversion would start with at the old ratio.
+		uint32_t next_out = p_decim->base + (conversion >> p_decim->log2_ratio) + ((conversion & mask) != 0);
+
+		p_decim->log2_ratio	= log2_ratio;
+		p_decim->base				= next_out - (conversion >> log2_ratio);
+		p_decim->primed			= false;
+}
+
+bool frame_decim_push(frame_decim_t * p_decim, ads1291_2_frame_t * p_frame)
+{
+		uint32_t	conversion	= p_frame->index;
+		uint32_t	mask				= (1u << p_decim->log2_ratio) - 1;
+		int32_t		in[FRAME_DECIM_CHANNELS];
+		uint8_t		ch;
+
+		if (p_decim->log2_ratio == 0) {
+				p_frame->index = p_decim->base + conversion;
+				return true;
+		}
+		in[0] = p_frame->ch1;
+#if (FRAME_DECIM_CHANNELS > 1)
+		in[1] = p_frame->ch2;
+#endif
+		if (!p_decim->primed || (conversion - p_decim->next) > FRAME_DECIM_MAX_HOLD) {
+				for (ch = 0; ch < FRAME_DECIM_CHANNELS; ch++) {
+						channel_prime(&p_decim->ch[ch], in[ch]);
+				}
+				p_decim->primed = true;
+		} else {
+				// Hold the last input over missed conversions so the block keeps its length.
+				for (uint32_t missed = p_decim->next; missed != conversion; missed++) {
+						for (ch = 0; ch < FRAME_DECIM_CHANNELS; ch++) {
+								channel_integrate(&p_decim->ch[ch], p_decim->ch[ch].last);
+								if ((missed & mask) == mask) {
+										(void)channel_dump(&p_decim->ch[ch], p_decim->log2_ratio);
+								}
+						}
+				}
+		}
+		for (ch = 0; ch < FRAME_DECIM_CHANNELS; ch++) {
+				channel_integrate(&p_decim->ch[ch], in[ch]);
+		}
+		p_decim->next = conversion + 1;
+		if ((conversion & mask) != mask) {
+				return false;
+		}
+		p_frame->ch1 = channel_dump(&p_decim->ch[0], p_decim->log2_ratio);
+#if (FRAME_DECIM_CHANNELS > 1)
+		p_frame->ch2 = channel_dump(&p_decim->ch[1], p_decim->log2_ratio);
+#endif
+		p_frame->index = p_decim->base + (conversion >> p_decim->log2_ratio);
+		return true;
+}
@@ -0,0 +1,104 @@
+/* Copyright (c) 2016 Musa Mahmood
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/** @file
+ *
+ * @brief Decimator between the ADS1291/2 and the frame ring, so the converter can oversample.
+ *
+ * @details The converter runs at 2^k times the output data rate and every 2^k conversions are
+ *          reduced to one output frame by a third-order CIC (sinc^3) filter, which averages
+ *          the converter's wideband noise down. Run from the SPI event handler, ahead of the
+ *          frame ring, so everything after it (ring, BMS, connection parameters) sees only
+ *          the output rate.
+ *
+ *          A CIC needs no multiplies. Its gain, 2^(3k), is removed with a shift, and the
+ *          first conversion after priming is subtracted from every input, so the filter
+ *          starts as if the input had always been at that level. The integrators are 64 bits
+ *          wide (24 bits plus 18 bits of gain for k = 6) and wrap; the result is exact
+ *          because the combs undo the wrap. At 8000 SPS on the nRF51 (2000 cycles per
+ *          conversion) a hand count of the Thumb code gives about 100 cycles per conversion
+ *          and 250 more at the end of each block, for two channels. Build with
+ *          ADS1291_2_PROFILE to measure it, see ads1291_2_decim_cycles().
+ *
+ *          The sinc^3 response droops towards the output Nyquist rate: about 1 dB at 16% of
+ *          the output rate (40 Hz at 250 SPS), the ECG band, and 4 dB at 25%.
+ *
+ *          Conversions the driver missed are filled with the previous input when at most
+ *          FRAME_DECIM_MAX_HOLD are missing in a row; a longer gap primes the filter again.
+ *          An output whose block ended inside a gap is not produced, so its index is
+ *          skipped like a missed frame.
+ */
+
+#ifndef FRAME_DECIM_H__
+#define FRAME_DECIM_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ads1291-2.h"
+
+#define FRAME_DECIM_ORDER							3													/**< CIC stages. */
+#define FRAME_DECIM_MAX_LOG2					ADS1291_2_REG_CONFIG1_DR_MAX			/**< Largest k: 8000 SPS to 125 SPS. */
+#define FRAME_DECIM_MAX_HOLD					2													/**< Missed conversions filled in before priming again. */
+#define FRAME_DECIM_CHANNELS					BLE_BMS_MAX_CHANNELS
+
+/**@brief CIC state of one channel. */
+typedef struct
+{
+		int32_t							offset;												/**< Input at priming, subtracted from every input. */
+		int32_t							last;													/**< Last input, held over missed conversions. */
+		uint64_t						integ[FRAME_DECIM_ORDER];						/**< Integrators, wrapping. */
+		uint64_t						comb[FRAME_DECIM_ORDER];						/**< Comb inputs at the end of the previous block. */
+} frame_decim_channel_t;
+
+typedef struct
+{
+		uint8_t							log2_ratio;										/**< k; 0 passes frames through. */
+		bool								primed;
+		uint32_t						next;													/**< Conversion expected next. */
+		uint32_t						base;													/**< Output index of block 0 of this ratio. */
+		frame_decim_channel_t		ch[FRAME_DECIM_CHANNELS];
+} frame_decim_t;
+
+/**@brief Reset the decimator with the given ratio. Output indexes restart at 0. */
+void frame_decim_init(frame_decim_t * p_decim, uint8_t log2_ratio);
+
+/**@brief Change the ratio. Must not race with frame_decim_push().
+ *
+ * @details Output indexes continue where the old ratio left off: an unfinished block counts
+ *          as one missed output.
+ *
+ * @param[in]   log2_ratio   k, 0 to FRAME_DECIM_MAX_LOG2.
+ * @param[in]   conversion   Index of the next conversion from the driver.
+ */
+void frame_decim_config(frame_decim_t * p_decim, uint8_t log2_ratio, uint32_t conversion);
+
+/**@brief Feed one conversion.
+ *
+ * @param[in,out] p_frame  A conversion, index counting conversions. When the function
+ *                         returns true it holds the output frame instead, index counting
+ *                         output frames, and STAT and ticks of the block's last conversion.
+ *
+ * @return true if a block ended and p_frame is an output frame.
+ */
+bool frame_decim_push(frame_decim_t * p_decim, ads1291_2_frame_t * p_frame);
+
+#endif // FRAME_DECIM_H__
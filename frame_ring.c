@@ -0,0 +1,81 @@
+/* Copyright (c) 2016 Musa Mahmood
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "frame_ring.h"
+#include "nrf.h"
+
+void frame_ring_init(frame_ring_t * p_ring)
+{
+		p_ring->head			= 0;
+		p_ring->tail			= 0;
+		p_ring->overruns	= 0;
+}
+
+ads1291_2_frame_t * frame_ring_alloc(frame_ring_t * p_ring)
+{
+		uint32_t head = p_ring->head;
+		if ((head - p_ring->tail) >= FRAME_RING_SIZE) {
+				p_ring->overruns++;
+				return NULL;
+		}
+		return &p_ring->buf[head & FRAME_RING_MASK];
+}
+
+void frame_ring_commit(frame_ring_t * p_ring)
+{
+		// Slot contents must be visible before the consumer sees the new head.
+		__DMB();
+		p_ring->head = p_ring->head + 1;
+}
+
+bool frame_ring_push(frame_ring_t * p_ring, ads1291_2_frame_t const * p_frame)
+{
+		ads1291_2_frame_t * p_slot = frame_ring_alloc(p_ring);
+		if (p_slot == NULL) {
+				return false;
+		}
+		*p_slot = *p_frame;
+		frame_ring_commit(p_ring);
+		return true;
+}
+
+uint32_t frame_ring_peek(frame_ring_t * p_ring, ads1291_2_frame_t const ** pp_frames)
+{
+		uint32_t tail		= p_ring->tail;
+		uint32_t count	= p_ring->head - tail;
+		uint32_t to_end	= FRAME_RING_SIZE - (tail & FRAME_RING_MASK);
+		// Do not read slot contents ahead of the head load.
+		__DMB();
+		*pp_frames = &p_ring->buf[tail & FRAME_RING_MASK];
+		return (count < to_end) ? count : to_end;
+}
+
+void frame_ring_consume(frame_ring_t * p_ring, uint32_t count)
+{
+		// Reads of the released slots must complete before the producer may reuse them.
+		__DMB();
+		p_ring->tail = p_ring->tail + count;
+}
+
+uint32_t frame_ring_count(frame_ring_t const * p_ring)
+{
+		return p_ring->head - p_ring->tail;
+}
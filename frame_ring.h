@@ -0,0 +1,85 @@
+/* Copyright (c) 2016 Musa Mahmood
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/** @file
+ *
+ * @brief Lock-free single-producer/single-consumer ring of ADS1291/2 frames.
+ *
+ * @details The producer is the acquisition path (SPI event handler), the consumer is the
+ *          main loop feeding the Biopotential Measurement Service. Head and tail are
+ *          free-running 32-bit counters written by one side only, so no critical region is
+ *          needed on the Cortex-M0: aligned word loads/stores are atomic and the barrier
+ *          orders the slot write before the index update. The element count is their
+ *          difference; slots are addressed with (index & FRAME_RING_MASK).
+ */
+
+#ifndef FRAME_RING_H__
+#define FRAME_RING_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ads1291-2.h"
+
+#define FRAME_RING_SIZE								64																/**< Number of frames. Must be a power of two. */
+#define FRAME_RING_MASK								(FRAME_RING_SIZE - 1)
+
+#if (FRAME_RING_SIZE & FRAME_RING_MASK) != 0
+#error "FRAME_RING_SIZE must be a power of two"
+#endif
+
+typedef struct
+{
+		ads1291_2_frame_t					buf[FRAME_RING_SIZE];
+		volatile uint32_t					head;									/**< Next slot to write. Producer only. */
+		volatile uint32_t					tail;									/**< Next slot to read. Consumer only. */
+		volatile uint32_t					overruns;							/**< Frames dropped because the ring was full. Producer only. */
+} frame_ring_t;
+
+/**@brief Reset the ring. Must not race with either side. */
+void frame_ring_init(frame_ring_t * p_ring);
+
+/**@brief Producer: get the slot the next frame should be written to.
+ *
+ * @return Pointer to a free slot, or NULL if the ring is full (counted as an overrun).
+ */
+ads1291_2_frame_t * frame_ring_alloc(frame_ring_t * p_ring);
+
+/**@brief Producer: publish the slot returned by frame_ring_alloc(). */
+void frame_ring_commit(frame_ring_t * p_ring);
+
+/**@brief Producer: copy one frame in. Returns false and counts an overrun if full. */
+bool frame_ring_push(frame_ring_t * p_ring, ads1291_2_frame_t const * p_frame);
+
+/**@brief Consumer: get the longest contiguous run of readable frames.
+ *
+ * @param[out] pp_frames  Set to the first readable frame.
+ *
+ * @return Number of frames readable at *pp_frames (stops at the wrap point).
+ */
+uint32_t frame_ring_peek(frame_ring_t * p_ring, ads1291_2_frame_t const ** pp_frames);
+
+/**@brief Consumer: release frames obtained from frame_ring_peek(). */
+void frame_ring_consume(frame_ring_t * p_ring, uint32_t count);
+
+/**@brief Number of frames currently queued. Safe from either side. */
+uint32_t frame_ring_count(frame_ring_t const * p_ring);
+
+#endif // FRAME_RING_H__
@@ -0,0 +1,188 @@
+/* Copyright (c) 2016 Musa Mahmood
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/** @file
+ *
+ * @brief Hardware abstraction for the ADS1291/2 data path.
+ *
+ * @details The driver and the Biopotential Measurement Service reach the hardware only
+ *          through these functions. hal_nrf51.c implements them on the nRF51 with the
+ *          SoftDevice; sim/hal_sim.c implements them on a host against a simulated
+ *          ADS1291 and SoftDevice.
+ *
+ *          Handlers are called from interrupt context on the target. The simulator calls
+ *          them from inside HAL functions that let time pass (hal_delay_*, hal_yield,
+ *          hal_wait_for_event), which keeps a simulated run deterministic.
+ */
+
+#ifndef HAL_H__
+#define HAL_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ble.h"
+
+#define HAL_CLOCK_HZ										32768				/**< Rate of hal_clock_ticks() (RTC1, prescaler 0). */
+#define HAL_CLOCK_MASK									0x00FFFFFF	/**< hal_clock_ticks() is 24 bits wide. */
+
+#define HAL_CYCLES_HZ										16000000		/**< Rate of hal_cycles(), the CPU clock. */
+
+#define HAL_STAMP_HZ										1000000			/**< Rate of the DRDY edge capture from hal_drdy_time(). */
+
+#define HAL_SPI_INIT_HZ									1000000			/**< SCLK after hal_spi_init(). */
+
+#define HAL_FLASH_PAGE_SIZE							1024				/**< nRF51 flash page, the unit hal_flash_erase() works on. */
+
+/**@brief Convert a tick difference to microseconds. */
+#define HAL_TICKS_TO_US(TICKS)					((uint32_t)(((uint64_t)(TICKS) * 1000000UL) / HAL_CLOCK_HZ))
+
+/**@brief Convert microseconds to ticks, rounded up. */
+#define HAL_US_TO_TICKS(US)							((uint32_t)(((uint64_t)(US) * HAL_CLOCK_HZ + 999999UL) / 1000000UL))
+
+typedef void (*hal_spi_handler_t)(void);					/**< A transfer started with hal_spi_transfer() has completed. */
+typedef void (*hal_drdy_handler_t)(void);					/**< Falling edge on the ADS1291/2 DRDY pin. */
+typedef void (*hal_flash_handler_t)(bool success);	/**< An erase or write started with hal_flash_* has finished. */
+typedef void (*hal_timer_handler_t)(void);				/**< The time given to hal_timer_start() has passed. */
+
+/**@brief Configure the SPI master wired to the ADS1291/2, at SCLK = HAL_SPI_INIT_HZ.
+ *
+ * @param[in] handler  Called when each transfer completes.
+ */
+void hal_spi_init(hal_spi_handler_t handler);
+
+/**@brief Set SCLK for the transfers that follow. Call while no transfer is running.
+ *
+ * @return NRF_SUCCESS, or NRF_ERROR_INVALID_PARAM if the master cannot run at hz.
+ */
+uint32_t hal_spi_frequency_set(uint32_t hz);
+
+/**@brief Start a full-duplex transfer. Returns immediately.
+ *
+ * @return NRF_SUCCESS, or NRF_ERROR_BUSY if a transfer is already running.
+ */
+uint32_t hal_spi_transfer(uint8_t const * p_tx, uint8_t tx_len, uint8_t * p_rx, uint8_t rx_len);
+
+/**@brief Configure the DRDY input and PWDN output and enable the DRDY edge event.
+ *
+ * @details In ADS1291_2_DRDY_CAPTURE builds the edge event also captures TIMER1, a free-running
+ *          16-bit count at HAL_STAMP_HZ, through PPI, so the time of the edge does not depend on
+ *          when the handler gets to run. TIMER1 keeps the 16 MHz clock running.
+ */
+void hal_drdy_init(hal_drdy_handler_t handler);
+
+/**@brief Time of the DRDY edge being handled. Call from the DRDY handler.
+ *
+ * @param[out] p_ticks  hal_clock_ticks() at the edge, within a tick. Without ADS1291_2_DRDY_CAPTURE,
+ *                      the time of the call instead. The capture wraps, so a handler held off for
+ *                      more than 65 ms gets a time a multiple of 65.536 ms too late.
+ * @param[out] p_stamp  TIMER1 captured at the edge, HAL_STAMP_HZ and wrapping at 16 bits, 0
+ *                      without ADS1291_2_DRDY_CAPTURE.
+ */
+void hal_drdy_time(uint32_t * p_ticks, uint16_t * p_stamp);
+
+/**@brief Drive the ADS1291/2 PWDN/RESET pin. false holds the device powered down.
+ */
+void hal_pwdn_set(bool level);
+
+void hal_delay_ms(uint32_t ms);
+void hal_delay_us(uint32_t us);
+
+/**@brief Set up the one-shot timer of the ADS1291/2 driver. Needs the app_timer module.
+ *
+ * @param[in] handler  Called when a timer started with hal_timer_start() expires, at
+ *                     app_timer priority (APP_IRQ_PRIORITY_LOW).
+ */
+void hal_timer_init(hal_timer_handler_t handler);
+
+/**@brief Start the one-shot timer, or restart it if it is running. Returns immediately.
+ */
+void hal_timer_start(uint32_t ms);
+
+/**@brief Free-running time base, HAL_CLOCK_HZ ticks wrapping at HAL_CLOCK_MASK.
+ */
+uint32_t hal_clock_ticks(void);
+
+/**@brief Free-running 16-bit CPU cycle count, for profiling.
+ *
+ * @details TIMER2 on the target. It keeps the 16 MHz clock running, so it is only started in
+ *          ADS1291_2_PROFILE builds and reads 0 otherwise. The simulator counts host nanoseconds.
+ */
+uint16_t hal_cycles(void);
+
+/**@brief Called in busy-wait loops while an interrupt is expected to end the wait.
+ */
+void hal_yield(void);
+
+/**@brief Sleep until the next event. Called from the main loop when there is nothing to do.
+ */
+void hal_wait_for_event(void);
+
+/**@brief Queue a notification.
+ *
+ * @return NRF_SUCCESS, BLE_ERROR_NO_TX_PACKETS when every TX buffer is in use, otherwise
+ *         the error from the stack.
+ */
+uint32_t hal_gatt_notify(uint16_t conn_handle, uint16_t value_handle, uint8_t const * p_data, uint16_t * p_len);
+
+/**@brief Get the number of notifications the stack can hold for a link.
+ */
+uint32_t hal_gatt_tx_buffers(uint16_t conn_handle, uint8_t * p_count);
+
+/**@brief Ask the central for new connection parameters.
+ *
+ * @details On the target they also become the preferred parameters the Connection Parameters
+ *          module negotiates towards.
+ *
+ * @return NRF_SUCCESS, NRF_ERROR_BUSY while a procedure is in progress, otherwise the error
+ *         from the stack.
+ */
+uint32_t hal_conn_params_request(uint16_t conn_handle, ble_gap_conn_params_t const * p_params);
+
+/**@brief Reserve pages of flash for the application.
+ *
+ * @details On the target they are registered with pstorage, one block per page, so erases and
+ *          writes queue behind those of the Device Manager. Call after pstorage_init(). The
+ *          CPU halts while the flash is busy: about 22 ms for an erase and 46 us per word
+ *          written, during which no interrupt is serviced.
+ *
+ * @param[in] handler  Called from the SoftDevice event interrupt when an operation completes.
+ * @param[in] pages    Pages to reserve, numbered from 0 in the functions below.
+ */
+void hal_flash_init(hal_flash_handler_t handler, uint16_t pages);
+
+/**@brief Start erasing a page. Returns immediately.
+ *
+ * @return NRF_SUCCESS, or NRF_ERROR_NO_MEM when the operation cannot be queued yet.
+ */
+uint32_t hal_flash_erase(uint16_t page);
+
+/**@brief Start writing len bytes, a multiple of 4, at a word-aligned offset in a page. p_data
+ *        must stay untouched until the handler is called.
+ *
+ * @return NRF_SUCCESS, or NRF_ERROR_NO_MEM when the operation cannot be queued yet.
+ */
+uint32_t hal_flash_write(uint16_t page, uint16_t offset, uint32_t const * p_data, uint16_t len);
+
+/**@brief Get a page for reading. Flash is memory mapped, so this is a pointer into it.
+ */
+uint8_t const * hal_flash_page(uint16_t page);
+
+#endif // HAL_H__
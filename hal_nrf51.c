@@ -0,0 +1,295 @@
+/* Copyright (c) 2016 Musa Mahmood
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "hal.h"
+#include <string.h>
+#include "app_error.h"
+#include "app_timer.h"
+#include "app_util_platform.h"
+#include "ble.h"
+#include "ble_conn_params.h"
+#include "nrf_delay.h"
+#include "nrf_drv_gpiote.h"
+#include "nrf_drv_spi.h"
+#include "nrf_gpio.h"
+#include "nrf_log.h"
+#include "nrf_soc.h"
+#include "pstorage.h"
+#include "ads1291-2.h"
+
+/**@SPI STUFF*/
+#define SPIM0_SCK_PIN      	13
+#define SPIM0_MOSI_PIN      14
+#define SPIM0_MISO_PIN      12
+#define SPIM0_SS_PIN        15
+
+#define DRDY_PPI_CHANNEL		0		/**< DRDY edge to TIMER1 capture, see hal_drdy_init(). Open to the application under S130. */
+#define DRDY_CC_EDGE				0		/**< TIMER1 CC register the edge is captured in. */
+#define DRDY_CC_NOW					1		/**< TIMER1 CC register hal_drdy_time() captures the present in. */
+
+static const nrf_drv_spi_t	spi = NRF_DRV_SPI_INSTANCE(0); //SPI INSTANCE
+static hal_spi_handler_t		m_spi_handler;
+static hal_drdy_handler_t		m_drdy_handler;
+static hal_flash_handler_t		m_flash_handler;
+static hal_timer_handler_t		m_timer_handler;
+APP_TIMER_DEF(m_timer_id);
+static pstorage_handle_t		m_flash_base;
+
+static void spi_event_handler(nrf_drv_spi_evt_t const * p_event)
+{
+		if (p_event->type == NRF_DRV_SPI_EVENT_DONE) {
+				m_spi_handler();
+		}
+}
+
+static void in_pin_handler(nrf_drv_gpiote_pin_t pin, nrf_gpiote_polarity_t action)
+{
+		UNUSED_PARAMETER(pin);
+		UNUSED_PARAMETER(action);
+		m_drdy_handler();
+}
+
+void hal_spi_init(hal_spi_handler_t handler) {
+		nrf_drv_spi_config_t spi_config = NRF_DRV_SPI_DEFAULT_CONFIG(0);
+		m_spi_handler										= handler;
+		spi_config.bit_order						= NRF_DRV_SPI_BIT_ORDER_MSB_FIRST;
+		// HAL_SPI_INIT_HZ. SCLK is independent of the ADS1291/2 conversion clock, see ADS1291_2_SPI_HZ.
+		spi_config.frequency						=	NRF_DRV_SPI_FREQ_1M;
+		//spi_config.irq_priority					= APP_IRQ_PRIORITY_LOW;
+		spi_config.irq_priority					= APP_IRQ_PRIORITY_HIGHEST;
+		spi_config.mode									= NRF_DRV_SPI_MODE_1; //CPOL = 0 (Active High); CPHA = TRAILING (1)
+		spi_config.miso_pin 						= SPIM0_MISO_PIN;
+		spi_config.sck_pin 							= SPIM0_SCK_PIN;
+		spi_config.mosi_pin 						= SPIM0_MOSI_PIN;
+		spi_config.ss_pin								= SPIM0_SS_PIN;
+		spi_config.orc									= 0x55;
+		APP_ERROR_CHECK(nrf_drv_spi_init(&spi, &spi_config, spi_event_handler));
+		NRF_LOG_PRINTF(" SPI Initialized..\r\n");
+#if defined(ADS1291_2_PROFILE)
+		// Cycle counter for hal_cycles().
+		NRF_TIMER2->MODE			= TIMER_MODE_MODE_Timer;
+		NRF_TIMER2->BITMODE		= TIMER_BITMODE_BITMODE_16Bit;
+		NRF_TIMER2->PRESCALER	= 0;
+		NRF_TIMER2->TASKS_START	= 1;
+#endif
+}
+
+uint32_t hal_spi_frequency_set(uint32_t hz) {
+		nrf_drv_spi_frequency_t frequency;
+		switch (hz) {
+				case 125000:	frequency = NRF_DRV_SPI_FREQ_125K;	break;
+				case 250000:	frequency = NRF_DRV_SPI_FREQ_250K;	break;
+				case 500000:	frequency = NRF_DRV_SPI_FREQ_500K;	break;
+				case 1000000:	frequency = NRF_DRV_SPI_FREQ_1M;		break;
+				case 2000000:	frequency = NRF_DRV_SPI_FREQ_2M;		break;
+				case 4000000:	frequency = NRF_DRV_SPI_FREQ_4M;		break;
+				case 8000000:	frequency = NRF_DRV_SPI_FREQ_8M;		break;
+				default:
+						return NRF_ERROR_INVALID_PARAM;
+		}
+		// The driver has no setter; FREQUENCY can be written while SPI0 is enabled and idle.
+		nrf_spi_frequency_set(NRF_SPI0, (nrf_spi_frequency_t)frequency);
+		return NRF_SUCCESS;
+}
+
+uint32_t hal_spi_transfer(uint8_t const * p_tx, uint8_t tx_len, uint8_t * p_rx, uint8_t rx_len) {
+		return nrf_drv_spi_transfer(&spi, p_tx, tx_len, p_rx, rx_len);
+}
+
+void hal_drdy_init(hal_drdy_handler_t handler) {
+		uint32_t err_code = NRF_SUCCESS;
+		m_drdy_handler = handler;
+		nrf_gpio_pin_dir_set(ADS1291_2_DRDY_PIN, NRF_GPIO_PIN_DIR_INPUT); //sets 'direction' = input/output
+		nrf_gpio_pin_dir_set(ADS1291_2_PWDN_PIN, NRF_GPIO_PIN_DIR_OUTPUT);
+		if(!nrf_drv_gpiote_is_init())
+		{
+				err_code = nrf_drv_gpiote_init();
+		}
+		NRF_LOG_PRINTF("nrf_drv_gpiote_init: %d\r\n",err_code);
+    APP_ERROR_CHECK(err_code);
+		bool is_high_accuracy = true;
+		nrf_drv_gpiote_in_config_t in_config = GPIOTE_CONFIG_IN_SENSE_HITOLO(is_high_accuracy);
+		in_config.is_watcher = true;
+		in_config.pull = NRF_GPIO_PIN_NOPULL;
+		err_code = nrf_drv_gpiote_in_init(ADS1291_2_DRDY_PIN, &in_config, in_pin_handler);
+		NRF_LOG_PRINTF(" nrf_drv_gpiote_in_init: %d: \r\n",err_code);
+		APP_ERROR_CHECK(err_code);
+		nrf_drv_gpiote_in_event_enable(ADS1291_2_DRDY_PIN, true);
+#if defined(ADS1291_2_DRDY_CAPTURE)
+		// 1 MHz time base for hal_drdy_time(). TIMER0 belongs to the SoftDevice and TIMER2 to
+		// hal_cycles(); the nRF51 TIMER1 and TIMER2 are 16 bits wide at most.
+		NRF_TIMER1->MODE			= TIMER_MODE_MODE_Timer;
+		NRF_TIMER1->BITMODE		= TIMER_BITMODE_BITMODE_16Bit;
+		NRF_TIMER1->PRESCALER	= 4;	// 16 MHz / 2^4 = HAL_STAMP_HZ
+		NRF_TIMER1->TASKS_CLEAR	= 1;
+		NRF_TIMER1->TASKS_START	= 1;
+		// The SoftDevice is enabled by now, so PPI goes through it.
+		err_code = sd_ppi_channel_assign(DRDY_PPI_CHANNEL,
+																		 (const volatile void *)nrf_drv_gpiote_in_event_addr_get(ADS1291_2_DRDY_PIN),
+																		 &NRF_TIMER1->TASKS_CAPTURE[DRDY_CC_EDGE]);
+		APP_ERROR_CHECK(err_code);
+		APP_ERROR_CHECK(sd_ppi_channel_enable_set(1UL << DRDY_PPI_CHANNEL));
+#endif
+}
+
+void hal_drdy_time(uint32_t * p_ticks, uint16_t * p_stamp) {
+#if defined(ADS1291_2_DRDY_CAPTURE)
+		uint32_t ticks;
+		uint32_t later;
+		uint16_t age;
+		// Read RTC1 and capture TIMER1 back to back. If the SoftDevice got in between, the two
+		// no longer describe the same moment; take them again.
+		do {
+				ticks = hal_clock_ticks();
+				NRF_TIMER1->TASKS_CAPTURE[DRDY_CC_NOW] = 1;
+				later = hal_clock_ticks();
+		} while (((later - ticks) & HAL_CLOCK_MASK) > 1);
+		*p_stamp = (uint16_t)NRF_TIMER1->CC[DRDY_CC_EDGE];
+		age = (uint16_t)(NRF_TIMER1->CC[DRDY_CC_NOW] - *p_stamp);
+		// Rounded to the nearest tick; age < 2^16 us keeps the product within 32 bits.
+		*p_ticks = (ticks - (((uint32_t)age * HAL_CLOCK_HZ + HAL_STAMP_HZ / 2) / HAL_STAMP_HZ)) & HAL_CLOCK_MASK;
+#else
+		*p_ticks = hal_clock_ticks();
+		*p_stamp = 0;
+#endif
+}
+
+void hal_pwdn_set(bool level) {
+		if (level) {
+				nrf_gpio_pin_set(ADS1291_2_PWDN_PIN);
+		} else {
+				nrf_gpio_pin_clear(ADS1291_2_PWDN_PIN);
+		}
+}
+
+void hal_delay_ms(uint32_t ms) {
+		nrf_delay_ms(ms);
+}
+
+void hal_delay_us(uint32_t us) {
+		nrf_delay_us(us);
+}
+
+static void timer_timeout_handler(void * p_context)
+{
+		UNUSED_PARAMETER(p_context);
+		m_timer_handler();
+}
+
+void hal_timer_init(hal_timer_handler_t handler) {
+		if (m_timer_handler == NULL) {
+				APP_ERROR_CHECK(app_timer_create(&m_timer_id, APP_TIMER_MODE_SINGLE_SHOT, timer_timeout_handler));
+		}
+		m_timer_handler = handler;
+}
+
+void hal_timer_start(uint32_t ms) {
+		APP_ERROR_CHECK(app_timer_stop(m_timer_id));
+		// RTC1 runs with prescaler 0, see HAL_CLOCK_HZ.
+		APP_ERROR_CHECK(app_timer_start(m_timer_id, APP_TIMER_TICKS(ms, 0), NULL));
+}
+
+uint32_t hal_clock_ticks(void) {
+		uint32_t ticks;
+		APP_ERROR_CHECK(app_timer_cnt_get(&ticks));
+		return ticks;
+}
+
+uint16_t hal_cycles(void) {
+#if defined(ADS1291_2_PROFILE)
+		NRF_TIMER2->TASKS_CAPTURE[0] = 1;
+		return (uint16_t)NRF_TIMER2->CC[0];
+#else
+		return 0;
+#endif
+}
+
+void hal_yield(void) {
+		// The SPI and GPIOTE interrupts preempt the wait; nothing to do.
+}
+
+void hal_wait_for_event(void) {
+		APP_ERROR_CHECK(sd_app_evt_wait());
+}
+
+uint32_t hal_gatt_notify(uint16_t conn_handle, uint16_t value_handle, uint8_t const * p_data, uint16_t * p_len) {
+		ble_gatts_hvx_params_t hvx_params;
+		memset(&hvx_params, 0, sizeof(hvx_params));
+		hvx_params.handle = value_handle;
+		hvx_params.type   = BLE_GATT_HVX_NOTIFICATION;
+		hvx_params.offset = 0;
+		hvx_params.p_len  = p_len;
+		hvx_params.p_data = (uint8_t *)p_data;
+		return sd_ble_gatts_hvx(conn_handle, &hvx_params);
+}
+
+uint32_t hal_gatt_tx_buffers(uint16_t conn_handle, uint8_t * p_count) {
+		return sd_ble_tx_packet_count_get(conn_handle, p_count);
+}
+
+uint32_t hal_conn_params_request(uint16_t conn_handle, ble_gap_conn_params_t const * p_params) {
+		ble_gap_conn_params_t conn_params = *p_params;
+		UNUSED_PARAMETER(conn_handle);
+		return ble_conn_params_change_conn_params(&conn_params);
+}
+
+static void flash_cb(pstorage_handle_t * p_handle, uint8_t op_code, uint32_t result, uint8_t * p_data, uint32_t data_len)
+{
+		UNUSED_PARAMETER(p_handle);
+		UNUSED_PARAMETER(p_data);
+		UNUSED_PARAMETER(data_len);
+		if (op_code == PSTORAGE_STORE_OP_CODE || op_code == PSTORAGE_CLEAR_OP_CODE) {
+				m_flash_handler(result == NRF_SUCCESS);
+		}
+}
+
+void hal_flash_init(hal_flash_handler_t handler, uint16_t pages) {
+		pstorage_module_param_t param;
+		m_flash_handler		= handler;
+		param.block_size	= HAL_FLASH_PAGE_SIZE;
+		param.block_count	= pages;
+		param.cb					= flash_cb;
+		APP_ERROR_CHECK(pstorage_register(&param, &m_flash_base));
+}
+
+uint32_t hal_flash_erase(uint16_t page) {
+		pstorage_handle_t block;
+		uint32_t err_code = pstorage_block_identifier_get(&m_flash_base, page, &block);
+		if (err_code != NRF_SUCCESS) {
+				return err_code;
+		}
+		return pstorage_clear(&block, HAL_FLASH_PAGE_SIZE);
+}
+
+uint32_t hal_flash_write(uint16_t page, uint16_t offset, uint32_t const * p_data, uint16_t len) {
+		pstorage_handle_t block;
+		uint32_t err_code = pstorage_block_identifier_get(&m_flash_base, page, &block);
+		if (err_code != NRF_SUCCESS) {
+				return err_code;
+		}
+		return pstorage_store(&block, (uint8_t *)p_data, len, offset);
+}
+
+uint8_t const * hal_flash_page(uint16_t page) {
+		pstorage_handle_t block;
+		APP_ERROR_CHECK(pstorage_block_identifier_get(&m_flash_base, page, &block));
+		return (uint8_t const *)block.block_id;
+}
@@ -49,12 +49,17 @@
 #include "ble_advertising.h"
 #include "ble_dis.h"
 #include "ble_bms.h"
+#include "bms_conn_ctrl.h"
+#include "bms_filter.h"
+#include "bms_qrs.h"
+#include "bms_log.h"
 #include "app_util_platform.h"
 #include "nrf_log.h"
 #include "nrf_drv_clock.h"
 #include "nrf_delay.h"
 /**@ADS1291: **/
 #include "ads1291-2.h" /*< For the ADS1291 ECG Chip */
+#include "hal.h"
 #include "nrf_drv_gpiote.h"
 #include "nrf_gpio.h"
 /**@BAS: **/
@@ -62,6 +67,10 @@
 #include "ble_bas.h"
 #include "nrf_adc.h"
 #endif
+/**@HRS: **/
+#if (defined(BLE_HRS))
+#include "ble_hrs.h"
+#endif
 
 //#include "bsp.h"
 //#include "bsp_btn_ble.h"
@@ -109,13 +118,33 @@ static dm_application_instance_t         m_app_handle;
 static uint16_t                          m_conn_handle = BLE_CONN_HANDLE_INVALID;   /**< Handle of the current connection. */
 /**@BMS STUFF */
 ble_bms_t 															 m_bms;
+static bms_conn_ctrl_t									 m_conn_ctrl;															/**< Connection parameters for the BMS stream. */
+static bms_filter_t											 m_filter;																/**< Filter stage ahead of the BMS, off until a client selects it. */
+static bms_qrs_t												 m_qrs;																		/**< QRS detector on the raw ECG channel. */
+static bms_log_t												 m_log;																		/**< Recording made while disconnected. */
+static bool															 m_log_armed;															/**< Record when the link drops. Off after a reset. */
+static bool															 m_log_download;													/**< A client asked for the log and it is not empty yet. */
+static bool															 m_recording;															/**< Samples go to m_log instead of the link. */
+static bool															 m_afe_ready;															/**< afe_startup_run() has configured the ADS1291/2. */
+static uint32_t													 m_boot_ticks;															/**< hal_clock_ticks() when the ADS1291/2 startup began. */
+static uint32_t													 m_connect_ticks;														/**< hal_clock_ticks() at BLE_GAP_EVT_CONNECTED. */
+static uint32_t													 m_connect_samples;													/**< m_bms.samples_queued then; the first notification moves it. */
+static bool															 m_first_notification_pending;							/**< Connected, no sample notified yet. */
+#if defined(ADS1291_2_PROFILE)
+static uint64_t													 m_acq_latency_sum;													/**< DRDY edge to ble_bms_update(), in us, since the last disconnect. */
+static uint32_t													 m_acq_latency_count;
+static uint32_t													 m_acq_latency_max;
+#endif
 /**@BAS STUFF */
 #if (defined(BLE_BAS))
 ble_bas_t																 m_bas;
 #endif
+/**@HRS STUFF */
+#if (defined(BLE_HRS))
+ble_hrs_t																 m_hrs;
+#endif
 /**@GPIOTE */
 #if (defined(ADS1291) || defined(ADS1292) || defined(ADS1292R))
-static bool															m_drdy = false;
 #define DRDY_GPIO_PIN_IN 11
 #endif //(defined(ADS1291) || defined(ADS1292) || defined(ADS1292R))
 /**@TIMER: -Timer Stuff- */
@@ -134,6 +163,9 @@ static ble_uuid_t m_adv_uuids[] =
 		#if defined(BLE_BAS)
 			{BLE_UUID_BATTERY_SERVICE, 									BLE_UUID_TYPE_BLE},
 		#endif
+		#if defined(BLE_HRS)
+			{BLE_UUID_HEART_RATE_SERVICE, 							BLE_UUID_TYPE_BLE},
+		#endif
 		{BLE_UUID_DEVICE_INFORMATION_SERVICE, 			BLE_UUID_TYPE_BLE}
 }; /**< Universally unique service identifiers. */
 
@@ -342,6 +374,10 @@ static void services_init(void)
 		ble_bas_init(&m_bas, &m_bas_init); 
 		#endif
     ble_ecg_service_init(&m_bms);
+		bms_conn_ctrl_init(&m_conn_ctrl);
+		bms_filter_init(&m_filter);
+		bms_qrs_init(&m_qrs);
+		(void)bms_qrs_config(&m_qrs, ADS1291_2_DR_TO_SPS(m_bms.data_rate));
 		//ble_mpu_service_init(&m_mpu);
 		/**@Device Information Service:*/
 		uint32_t err_code;
@@ -355,26 +391,40 @@ static void services_init(void)
     BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&dis_init.dis_attr_md.write_perm);
 		err_code = ble_dis_init(&dis_init);
     APP_ERROR_CHECK(err_code);
+		#if defined(BLE_HRS)
+		/**@Heart Rate Service, fed by the QRS detector:*/
+		ble_hrs_init_t													 m_hrs_init;
+		uint8_t																	 body_sensor_location = BLE_HRS_BODY_SENSOR_LOCATION_CHEST;
+		memset(&m_hrs_init, 0, sizeof(m_hrs_init));
+		m_hrs_init.evt_handler                 = NULL;
+		m_hrs_init.is_sensor_contact_supported = true;
+		m_hrs_init.p_body_sensor_location      = &body_sensor_location;
+		BLE_GAP_CONN_SEC_MODE_SET_OPEN(&m_hrs_init.hrs_hrm_attr_md.cccd_write_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&m_hrs_init.hrs_hrm_attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&m_hrs_init.hrs_hrm_attr_md.write_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&m_hrs_init.hrs_bsl_attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&m_hrs_init.hrs_bsl_attr_md.write_perm);
+		err_code = ble_hrs_init(&m_hrs, &m_hrs_init);
+    APP_ERROR_CHECK(err_code);
+		#endif
 }
 
 /**@brief Function for handling the Connection Parameters Module.
  *
  * @details This function will be called for all events in the Connection Parameters Module which
  *          are passed to the application.
- *          @note All this function does is to disconnect. This could have been done by simply
- *                setting the disconnect_on_fail config parameter, but instead we use the event
- *                handler mechanism to demonstrate its use.
+ *          The connection parameter controller moves the preferred parameters with the data
+ *          rate and the backlog, so a central declining one of its requests is no reason to
+ *          drop the link: the parameters in use are kept and the controller backs off
+ *          (disconnect_on_fail is false for the same reason).
  *
  * @param[in] p_evt  Event received from the Connection Parameters Module.
  */
 static void on_conn_params_evt(ble_conn_params_evt_t * p_evt)
 {
-    uint32_t err_code;
-
     if (p_evt->evt_type == BLE_CONN_PARAMS_EVT_FAILED)
     {
-        err_code = sd_ble_gap_disconnect(m_conn_handle, BLE_HCI_CONN_INTERVAL_UNACCEPTABLE);
-        APP_ERROR_CHECK(err_code);
+        bms_conn_ctrl_on_declined(&m_conn_ctrl);
     }
 }
 
@@ -469,12 +519,44 @@ static void on_ble_evt(ble_evt_t * p_ble_evt)
 				case BLE_EVT_TX_COMPLETE:
             break;
         case BLE_GAP_EVT_CONNECTED:
-						ads1291_2_wake();
+						#if !defined(ADS1291_2_PREROLL)
+						// Before afe_startup_run() the AFE cannot take commands; it starts awake then.
+						// The wake-up does not wait: the first frames come marked as settling.
+						if (!m_log_armed && m_afe_ready) {
+								ads1291_2_wake();
+						}
+						#endif
+						m_connect_ticks								= hal_clock_ticks();
+						m_connect_samples							= m_bms.samples_queued;
+						m_first_notification_pending	= true;
             m_conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
             break;
 
         case BLE_GAP_EVT_DISCONNECTED:
-						ads1291_2_standby();
+						// Armed: keep converting, log_run() starts recording. With ADS1291_2_PREROLL the
+						// AFE keeps converting anyway and the BMS buffer holds the newest samples for the
+						// next client.
+						#if !defined(ADS1291_2_PREROLL)
+						if (!m_log_armed && m_afe_ready) {
+								ads1291_2_standby();
+						}
+						#endif
+						m_first_notification_pending = false;
+						#if defined(ADS1291_2_PROFILE)
+						{
+								uint32_t mean, max;
+								ads1291_2_decim_cycles(&mean, &max);
+								NRF_LOG_PRINTF(" Decimator: %d cycles per conversion, %d max..\r\n", mean, max);
+								ads1291_2_frame_cycles(&mean, &max);
+								NRF_LOG_PRINTF(" Frame read: %d cycles, %d max, %d ns of SCLK..\r\n", mean, max, ads1291_2_frame_bus_ns());
+								// From the captured edge with ADS1291_2_DRDY_CAPTURE, from the DRDY handler otherwise.
+								NRF_LOG_PRINTF(" Acquisition: %d us from DRDY to the BMS, %d max..\r\n",
+								               m_acq_latency_count ? (uint32_t)(m_acq_latency_sum / m_acq_latency_count) : 0, m_acq_latency_max);
+								m_acq_latency_sum		= 0;
+								m_acq_latency_count	= 0;
+								m_acq_latency_max		= 0;
+						}
+						#endif
             m_conn_handle = BLE_CONN_HANDLE_INVALID;
             break;
         default:
@@ -498,9 +580,13 @@ static void ble_evt_dispatch(ble_evt_t * p_ble_evt)
     on_ble_evt(p_ble_evt);
     ble_advertising_on_ble_evt(p_ble_evt);
 		ble_bms_on_ble_evt(&m_bms, p_ble_evt);
+		bms_conn_ctrl_on_ble_evt(&m_conn_ctrl, p_ble_evt);
 		#if defined(BLE_BAS)
 		ble_bas_on_ble_evt(&m_bas, p_ble_evt);
 		#endif
+		#if defined(BLE_HRS)
+		ble_hrs_on_ble_evt(&m_hrs, p_ble_evt);
+		#endif
 }
 
 
@@ -632,15 +718,6 @@ static void power_manage(void)
     uint32_t err_code = sd_app_evt_wait();
     APP_ERROR_CHECK(err_code);
 }
-#if (defined(ADS1291) || defined(ADS1292) || defined(ADS1292R))
-void in_pin_handler(nrf_drv_gpiote_pin_t pin, nrf_gpiote_polarity_t action)
-{
-		UNUSED_PARAMETER(pin);
-		UNUSED_PARAMETER(action);
-    m_drdy = true;
-}
-#endif //(defined(ADS1291) || defined(ADS1292) || defined(ADS1292R))
-
 /**@OLD GPIO INIT (ALSO WORKS FINE!)*/
 /*static void gpio_init(void) {
 		nrf_gpio_pin_dir_set(ADS1291_2_DRDY_PIN, NRF_GPIO_PIN_DIR_INPUT);
@@ -659,25 +736,260 @@ void in_pin_handler(nrf_drv_gpiote_pin_t pin, nrf_gpiote_polarity_t action)
 		nrf_drv_gpiote_in_event_enable(DRDY_GPIO_PIN_IN, true);
 }*/
 #if (defined(ADS1291) || defined(ADS1292) || defined(ADS1292R))
+/**@brief Function for applying a data rate written to the Biopotential Measurement Service.
+ *
+ * @details Reprograms CONFIG1; the connection parameter controller follows the new rate.
+ *          Frames already in the ring are still sent.
+ */
+static void data_rate_apply(void)
+{
+    uint8_t data_rate;
+
+    // A rate written before the AFE is up waits for it.
+    if (m_afe_ready && ble_bms_data_rate_take(&m_bms, &data_rate))
+    {
+        set_sampling_rate(data_rate);
+        // Coefficients depend on the rate.
+        bms_filter_config(&m_filter, m_bms.filter, ADS1291_2_DR_TO_SPS(data_rate));
+        (void)bms_qrs_config(&m_qrs, ADS1291_2_DR_TO_SPS(data_rate));
+    }
+}
+
+/**@brief Function for applying a filter selection written to the Biopotential Measurement Service.
+ */
+static void filter_apply(void)
+{
+    uint8_t filter;
+
+    if (ble_bms_filter_take(&m_bms, &filter))
+    {
+        bms_filter_config(&m_filter, filter, ADS1291_2_DR_TO_SPS(m_bms.data_rate));
+    }
+}
+
+/**@brief Function for running the filter stage on the ECG channels of a frame.
+ */
+static void filter_frame(ads1291_2_frame_t * p_frame)
+{
+#if (ADS1291_2_ECG_CHANNELS & 0x01)
+    p_frame->ch1 = bms_filter_run(&m_filter, 0, p_frame->ch1);
+#endif
+#if (ADS1291_2_ECG_CHANNELS & 0x02)
+    p_frame->ch2 = bms_filter_run(&m_filter, 1, p_frame->ch2);
+#endif
+}
+
+/**@brief Function for publishing a detected beat on the BMS and, if built in, the Heart Rate Service.
+ */
+static void beat_publish(bms_qrs_beat_t const * p_beat)
+{
+    ble_bms_beat_update(&m_bms, p_beat->bpm, p_beat->index, p_beat->rr);
+#if defined(BLE_HRS)
+    uint32_t err_code;
+
+    if (p_beat->rr != 0)
+    {
+        ble_hrs_rr_interval_add(&m_hrs, p_beat->rr);
+    }
+    if (p_beat->bpm != 0)
+    {
+        err_code = ble_hrs_heart_rate_measurement_send(&m_hrs, p_beat->bpm);
+        if (err_code == NRF_SUCCESS)
+        {
+            // The measurement holds one of the TX buffers the BMS counts.
+            ble_bms_tx_shared(&m_bms);
+        }
+        else if (
+            (err_code != NRF_ERROR_INVALID_STATE)
+            &&
+            (err_code != BLE_ERROR_NO_TX_PACKETS)
+            &&
+            (err_code != BLE_ERROR_GATTS_SYS_ATTR_MISSING)
+           )
+        {
+            APP_ERROR_HANDLER(err_code);
+        }
+    }
+#endif
+}
+
+/**@brief Function for running the QRS detector on the raw ECG channel of a frame.
+ */
+static void qrs_frame(ads1291_2_frame_t const * p_frame)
+{
+    bms_qrs_beat_t beat;
+#if (ADS1291_2_ECG_CHANNELS & 0x01)
+    int32_t        sample = p_frame->ch1;
+#else
+    int32_t        sample = p_frame->ch2;
+#endif
+
+    if (bms_qrs_run(&m_qrs, sample, p_frame->index, &beat))
+    {
+        beat_publish(&beat);
+    }
+}
+
+/**@brief Function for reporting the log state and backlog on the log characteristic.
+ */
+static void log_status_update(void)
+{
+    uint8_t state = m_log_download ? BLE_BMS_LOG_DOWNLOAD : (m_log_armed ? BLE_BMS_LOG_ARMED : BLE_BMS_LOG_OFF);
+
+    ble_bms_log_status_update(&m_bms, state, bms_log_size(&m_log));
+}
+
+/**@brief Function for carrying out a command written to the log characteristic.
+ */
+static void log_apply(void)
+{
+    uint8_t command;
+
+    if (!ble_bms_log_take(&m_bms, &command))
+    {
+        return;
+    }
+    switch (command)
+    {
+        case BLE_BMS_LOG_OFF:
+            m_log_armed    = false;
+            m_log_download = false;
+            break;
+        case BLE_BMS_LOG_ARMED:
+            m_log_armed    = true;
+            m_log_download = false;
+            break;
+        case BLE_BMS_LOG_DOWNLOAD:
+            m_log_download = true;
+            break;
+        default:
+            m_log_download = false;
+            bms_log_clear(&m_log);
+            break;
+    }
+    log_status_update();
+}
+
+/**@brief Function for recording while disconnected and downloading the log once connected.
+ *
+ * @details Recorded packets are DELTA packets as the BMS would have notified them. The
+ *          live stream keeps priority: the download only takes the TX buffers left after
+ *          ble_bms_send(), and only once every frame in the ring has reached the BMS.
+ */
+static void log_run(void)
+{
+    uint8_t         packet[BLE_BMS_MAX_BVM_LENGTH];
+    uint8_t const * p_record;
+    uint8_t         len;
+    uint32_t        err_code;
+
+    if (m_conn_handle == BLE_CONN_HANDLE_INVALID)
+    {
+        if (!m_recording && m_log_armed)
+        {
+            len = ble_bms_record_start(&m_bms, packet);
+            bms_log_session_set(&m_log, packet, len);
+            m_recording = true;
+        }
+        if (m_log_download)
+        {
+            m_log_download = false;
+            log_status_update();
+        }
+    }
+    else if (m_recording)
+    {
+        bms_log_flush(&m_log);
+        m_recording = false;
+        log_status_update();
+    }
+    if (m_recording)
+    {
+        while ((len = ble_bms_record_take(&m_bms, packet)) > 0)
+        {
+            (void)bms_log_append(&m_log, packet, len);
+        }
+    }
+    if (m_log_download && ads1291_2_frames_pending() == 0)
+    {
+        while ((len = bms_log_peek(&m_log, &p_record)) > 0)
+        {
+            err_code = ble_bms_log_send(&m_bms, p_record, len);
+            if (err_code != NRF_SUCCESS)
+            {
+                if (err_code != BLE_ERROR_NO_TX_PACKETS)
+                {
+                    // Notifications off: stop until asked again.
+                    m_log_download = false;
+                    log_status_update();
+                }
+                break;
+            }
+            bms_log_consume(&m_log);
+        }
+        if (m_log_download && bms_log_size(&m_log) == 0)
+        {
+            m_log_download = false;
+            log_status_update();
+        }
+    }
+    bms_log_run(&m_log);
+}
+
+/**@brief Function for passing the end of a flash operation to the log.
+ */
+static void flash_handler(bool success)
+{
+    bms_log_on_flash(&m_log, success);
+}
+
 static void gpio_init(void) {
-		nrf_gpio_pin_dir_set(ADS1291_2_DRDY_PIN, NRF_GPIO_PIN_DIR_INPUT); //sets 'direction' = input/output
-		nrf_gpio_pin_dir_set(ADS1291_2_PWDN_PIN, NRF_GPIO_PIN_DIR_OUTPUT);
-		uint32_t err_code;
-		if(!nrf_drv_gpiote_is_init())
-		{
-				err_code = nrf_drv_gpiote_init();
+		hal_drdy_init(ads1291_2_drdy_handler);
+}
+
+/**@brief Function for finishing the ADS1291/2 bring-up once its power-on reset is over.
+ *
+ * @details ads1291_2_startup_begin() runs the reset on a timer from early in main(), so the
+ *          stack comes up and advertises meanwhile. The AFE is left in standby unless a
+ *          client connected (or the log was armed) while it was starting, or the build
+ *          keeps it converting while advertising (ADS1291_2_PREROLL).
+ */
+static void afe_startup_run(void)
+{
+		if (m_afe_ready || !ads1291_2_startup_done()) {
+				return;
+		}
+		// Stop continuous data conversion and initialize registers to default values
+		ads1291_2_stop_rdatac();
+		ads1291_2_init_regs();
+		ads1291_2_soft_start_conversion();
+		ads1291_2_check_id();
+		ads1291_2_start_rdatac();
+		#if defined(ADS1291_2_OVERSAMPLE)
+		// Run the converter at 8 kSPS and decimate to the data rate characteristic.
+		ads1291_2_oversample_set(ADS1291_2_REG_CONFIG1_8000_SPS);
+		set_sampling_rate(m_bms.data_rate);
+		#endif
+		#if !defined(ADS1291_2_PREROLL)
+		// Put AFE to sleep while we're not connected
+		if (m_conn_handle == BLE_CONN_HANDLE_INVALID && !m_log_armed) {
+				ads1291_2_standby();
+		}
+		#endif
+		m_afe_ready = true;
+		NRF_LOG_PRINTF(" AFE ready %d ms after boot..\r\n",
+		               HAL_TICKS_TO_US((hal_clock_ticks() - m_boot_ticks) & HAL_CLOCK_MASK) / 1000);
+}
+
+/**@brief Function for reporting the time from connecting to the first sample notification.
+ */
+static void first_notification_check(void)
+{
+		if (m_first_notification_pending && m_bms.samples_queued != m_connect_samples) {
+				m_first_notification_pending = false;
+				NRF_LOG_PRINTF(" First samples notified %d ms after connecting..\r\n",
+				               HAL_TICKS_TO_US((hal_clock_ticks() - m_connect_ticks) & HAL_CLOCK_MASK) / 1000);
 		}
-		NRF_LOG_PRINTF("nrf_drv_gpiote_init: %d\r\n",err_code);
-    APP_ERROR_CHECK(err_code);/**/
-		bool is_high_accuracy = true;
-		nrf_drv_gpiote_in_config_t in_config = GPIOTE_CONFIG_IN_SENSE_HITOLO(is_high_accuracy);
-		in_config.is_watcher = true;
-		in_config.pull = NRF_GPIO_PIN_NOPULL;
-		err_code = nrf_drv_gpiote_in_init(DRDY_GPIO_PIN_IN, &in_config, in_pin_handler);
-		NRF_LOG_PRINTF(" nrf_drv_gpiote_in_init: %d: \r\n",err_code);
-		APP_ERROR_CHECK(err_code);
-		nrf_drv_gpiote_in_event_enable(DRDY_GPIO_PIN_IN, true);
-		ads1291_2_powerdn();
 }
 #endif //(defined(ADS1291) || defined(ADS1292) || defined(ADS1292R))
 
@@ -696,8 +1008,16 @@ int main(void)
 		APP_ERROR_CHECK(err_code);
 		#if (defined(ADS1291) || defined(ADS1292) || defined(ADS1292R))
 		gpio_init();
+		ads_spi_init();
+		// The power-on reset overlaps the rest of the initialization and advertising.
+		ads1291_2_startup_begin();
+		m_boot_ticks = hal_clock_ticks();
 		#endif //(defined(ADS1291) || defined(ADS1292) || defined(ADS1292R))
     device_manager_init(erase_bonds);
+		#if (defined(ADS1291) || defined(ADS1292) || defined(ADS1292R))
+		hal_flash_init(flash_handler, BMS_LOG_PAGES);
+		bms_log_init(&m_log);
+		#endif //(defined(ADS1291) || defined(ADS1292) || defined(ADS1292R))
     gap_params_init();
     advertising_init();
     services_init();
@@ -706,30 +1026,22 @@ int main(void)
 		#endif
 	  conn_params_init();
 
-		//SPI STUFF FOR ADS:.
 		#if (defined(ADS1291) || defined(ADS1292) || defined(ADS1292R))
-		ads1291_2_powerup();
-		ads_spi_init();		
-		
-		//init_buf(m_tx_data_spi, m_rx_data_spi, TX_RX_MSG_LENGTH);
-		// Stop continuous data conversion and initialize registers to default values
-		ads1291_2_stop_rdatac();
-		ads1291_2_init_regs();
-					
-		ads1291_2_soft_start_conversion();
-			ads1291_2_check_id();
-		ads1291_2_start_rdatac();
-			
-		// Put AFE to sleep while we're not connected
-		ads1291_2_standby();
-		body_voltage_t body_voltage;
+		body_voltage_t    body_voltage[BLE_BMS_MAX_CHANNELS];
+		uint8_t           loff_stat = 0;
+		ads1291_2_frame_t frame;
 		#endif //(defined(ADS1291) || defined(ADS1292) || defined(ADS1292R))
 					
     // Start execution.
     application_timers_start();
     err_code = ble_advertising_start(BLE_ADV_MODE_FAST);
     APP_ERROR_CHECK(err_code);
+		#if (defined(ADS1291) || defined(ADS1292) || defined(ADS1292R))
+		NRF_LOG_PRINTF(" BLE Advertising Start! %d ms after boot \r\n",
+		               HAL_TICKS_TO_US((hal_clock_ticks() - m_boot_ticks) & HAL_CLOCK_MASK) / 1000);
+		#else
 		NRF_LOG_PRINTF(" BLE Advertising Start! \r\n");
+		#endif
 		
 		//ble_bmsdr_update(&m_bms, ADS1291_2_REGDEFAULT_CONFIG1);
 		// Enter main loop.
@@ -737,15 +1049,64 @@ int main(void)
     {
 				#if (defined(ADS1291) || defined(ADS1292) || defined(ADS1292R))
 				/**@For testing
-				body_voltage = 0xFF;
-				ble_bms_update(&m_bms, &body_voltage);
+				body_voltage[0] = 0xFF;
+				ble_bms_update(&m_bms, body_voltage, 0, 0, false);
 				*/
+				afe_startup_run();
+				ble_bms_config_apply(&m_bms);
 				/**@Data Acq. */
-				if(m_drdy) {
-						m_drdy = false;
-						get_bvm_sample(&body_voltage);
-						ble_bms_update(&m_bms, &body_voltage);
+				ads1291_2_frame_t const *p_frames;
+				uint32_t									n_frames;
+				while ((n_frames = ads1291_2_frames_peek(&p_frames)) > 0) {
+						uint32_t i;
+						for (i = 0; i < n_frames; i++) {
+								// Backpressure: leave frames in the ring until TX buffers free up.
+								if ((m_conn_handle != BLE_CONN_HANDLE_INVALID || m_recording) && ble_bms_bvm_buffer_is_full(&m_bms)) {
+										break;
+								}
+								if (ads1291_2_lead_off_update(&p_frames[i], &loff_stat)) {
+										ble_bms_lead_off_update(&m_bms, loff_stat, p_frames[i].index);
+										#if defined(BLE_HRS)
+										(void)ble_hrs_sensor_contact_detected_update(&m_hrs, loff_stat == 0);
+										#endif
+								}
+								// Rail-to-rail steps from a loose electrode look like beats; a gap of
+								// more than a second restarts detection when the leads are back on.
+								if (loff_stat == 0) {
+										qrs_frame(&p_frames[i]);
+								}
+								// Beats-only mode needs nothing past the detector.
+								if (ble_bms_samples_wanted(&m_bms)) {
+										frame = p_frames[i];
+										if (bms_filter_active(&m_filter)) {
+												filter_frame(&frame);
+										}
+										get_bvm_sample(&frame, body_voltage);
+										#if defined(ADS1291_2_PROFILE)
+										{
+												uint32_t latency = HAL_TICKS_TO_US((hal_clock_ticks() - p_frames[i].ticks) & HAL_CLOCK_MASK);
+												m_acq_latency_sum += latency;
+												m_acq_latency_count++;
+												m_acq_latency_max = MAX(m_acq_latency_max, latency);
+										}
+										#endif
+										ble_bms_update(&m_bms, body_voltage, p_frames[i].index, p_frames[i].ticks,
+										               p_frames[i].settling);
+								}
+						}
+						ads1291_2_frames_consume(i);
+						if (i < n_frames) {
+								break;
+						}
 				}
+				// Resume after BLE_EVT_TX_COMPLETE even if no new frame arrived.
+				ble_bms_send(&m_bms);
+				first_notification_check();
+				data_rate_apply();
+				filter_apply();
+				log_apply();
+				log_run();
+				bms_conn_ctrl_update(&m_conn_ctrl, &m_bms, ads1291_2_frames_pending());
 				#endif //(defined(ADS1291) || defined(ADS1292) || defined(ADS1292R))
 				power_manage();
     }
@@ -0,0 +1,442 @@
+/* Copyright (c) 2016 Musa Mahmood
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/** @file
+ *
+ * @brief HAL backend for the host simulator, and the simulator's clock and interrupts.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "hal.h"
+#include "sim.h"
+#include "app_error.h"
+
+#define THREAD_LEVEL										4					/**< Priority of the main loop; every interrupt preempts it. */
+#define FLASH_PAGES											64				/**< Pages hal_flash_init() can reserve. */
+#define FLASH_ERASE_NS									(22 * SIM_NS_PER_MS)
+#define FLASH_WORD_NS										46000
+
+static const uint8_t				m_irq_prio[SIM_IRQ_COUNT] = {APP_IRQ_PRIORITY_HIGHEST, APP_IRQ_PRIORITY_LOW, APP_IRQ_PRIORITY_LOW,
+                                                           APP_IRQ_PRIORITY_LOW};
+static bool									m_irq_pending[SIM_IRQ_COUNT];
+static uint8_t							m_level = THREAD_LEVEL;
+
+static sim_config_t					m_config;
+static uint64_t							m_now;
+static uint64_t							m_horizon;
+static uint64_t							m_cpu_ns;
+
+static hal_spi_handler_t		m_spi_handler;
+static hal_drdy_handler_t		m_drdy_handler;
+static uint64_t							m_drdy_edge;													/**< Last DRDY edge, as TIMER1 captures it through PPI. */
+static uint64_t							m_spi_done_at = SIM_TIME_NEVER;
+static uint32_t							m_spi_hz = HAL_SPI_INIT_HZ;
+static uint32_t							m_spi_conversion = SIM_NO_CONVERSION;		/**< Frame in the transfer in progress. */
+static sim_frame_handler_t	m_frame_handler;
+
+static uint32_t							m_flash[FLASH_PAGES][HAL_FLASH_PAGE_SIZE / 4];	/**< Kept across sim_init(), like flash across a reset. */
+static bool									m_flash_formatted;
+static uint16_t							m_flash_pages;
+static hal_flash_handler_t	m_flash_handler;
+static uint64_t							m_flash_busy_until;										/**< The CPU is halted until then. */
+static bool									m_flash_done;													/**< An operation ended; report it from SWI2. */
+static hal_timer_handler_t	m_timer_handler;
+static uint64_t							m_timer_at = SIM_TIME_NEVER;						/**< hal_timer_start() expiry. */
+
+void sim_config_default(sim_config_t * p_config)
+{
+		memset(p_config, 0, sizeof(*p_config));
+		p_config->spi_hz						= ADS1291_2_SPI_HZ;
+		p_config->heart_rate_bpm		= 72;
+		p_config->noise_uv					= 20;
+		p_config->seed							= 1;
+		p_config->tx_buffers				= 7;
+		p_config->packets_per_event	= 4;
+		p_config->conn_interval_us	= 15000;
+		p_config->cccd_delay_ms			= 30;
+}
+
+void sim_init(sim_config_t const * p_config)
+{
+		m_config				= *p_config;
+		m_now						= 0;
+		m_horizon				= SIM_TIME_NEVER;
+		m_cpu_ns				= 0;
+		m_level					= THREAD_LEVEL;
+		m_spi_done_at		= SIM_TIME_NEVER;
+		m_spi_hz				= HAL_SPI_INIT_HZ;
+		m_spi_handler		= NULL;
+		m_drdy_handler	= NULL;
+		m_drdy_edge			= 0;
+		m_frame_handler	= NULL;
+		m_flash_handler	= NULL;
+		m_timer_handler	= NULL;
+		m_timer_at			= SIM_TIME_NEVER;
+		m_flash_pages		= 0;
+		m_flash_busy_until	= 0;
+		m_flash_done		= false;
+		memset(m_irq_pending, 0, sizeof(m_irq_pending));
+		sim_ads1291_init();
+}
+
+sim_config_t const * sim_config(void)
+{
+		return &m_config;
+}
+
+uint64_t sim_now_ns(void)
+{
+		return m_now;
+}
+
+void sim_set_horizon(uint64_t t_ns)
+{
+		m_horizon = t_ns;
+}
+
+void sim_irq_set_pending(sim_irq_t irq)
+{
+		m_irq_pending[irq] = true;
+}
+
+void sim_drdy_edge(uint64_t t_ns)
+{
+		// PPI captures every edge, the CPU halted by flash or not.
+		m_drdy_edge = t_ns;
+		sim_irq_set_pending(SIM_IRQ_GPIOTE);
+}
+
+void sim_set_frame_handler(sim_frame_handler_t handler)
+{
+		m_frame_handler = handler;
+}
+
+uint64_t sim_host_ns(void)
+{
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void sim_cpu_add(uint64_t ns)
+{
+		m_cpu_ns += ns;
+}
+
+uint64_t sim_cpu_ns(void)
+{
+		return m_cpu_ns;
+}
+
+/**@brief Run pending interrupts that may preempt the current level, most urgent first. */
+static void irq_dispatch(void)
+{
+		if (m_now < m_flash_busy_until) {
+				// The CPU is halted; interrupts wait, and repeated edges of one merge.
+				return;
+		}
+		for (;;) {
+				int 		irq  = -1;
+				uint8_t	prio = m_level;
+				for (int i = 0; i < SIM_IRQ_COUNT; i++) {
+						if (m_irq_pending[i] && m_irq_prio[i] < prio) {
+								irq  = i;
+								prio = m_irq_prio[i];
+						}
+				}
+				if (irq < 0) {
+						return;
+				}
+				uint8_t  saved = m_level;
+				uint64_t t0    = sim_host_ns();
+				m_irq_pending[irq] = false;
+				m_level = prio;
+				// Neither data path handler lets simulated time pass, so timing them is exact.
+				switch (irq) {
+						case SIM_IRQ_SPI:
+								m_spi_done_at = SIM_TIME_NEVER;
+								if (m_spi_handler != NULL) {
+										m_spi_handler();
+								}
+								m_cpu_ns += sim_host_ns() - t0;
+								if (m_spi_conversion != SIM_NO_CONVERSION && m_frame_handler != NULL) {
+										m_frame_handler(m_spi_conversion);
+								}
+								break;
+						case SIM_IRQ_GPIOTE:
+								if (m_drdy_handler != NULL) {
+										m_drdy_handler();
+								}
+								m_cpu_ns += sim_host_ns() - t0;
+								break;
+						case SIM_IRQ_RTC1:
+								if (m_timer_handler != NULL) {
+										m_timer_handler();
+								}
+								break;
+						default:
+								sim_sd_evt_dispatch();
+								if (m_flash_done) {
+										m_flash_done = false;
+										if (m_flash_handler != NULL) {
+												m_flash_handler(true);
+										}
+								}
+								break;
+				}
+				m_level = saved;
+		}
+}
+
+static uint64_t next_event(void)
+{
+		uint64_t t = m_spi_done_at;
+		t = MIN(t, m_timer_at);
+		t = MIN(t, sim_ads1291_next_event());
+		t = MIN(t, sim_sd_next_event());
+		return t;
+}
+
+void sim_advance(uint64_t t_ns)
+{
+		irq_dispatch();
+		for (;;) {
+				uint64_t t = next_event();
+				if (t > t_ns) {
+						break;
+				}
+				m_now = MAX(m_now, t);
+				if (t == m_spi_done_at) {
+						m_spi_done_at = SIM_TIME_NEVER;
+						sim_irq_set_pending(SIM_IRQ_SPI);
+				} else if (t == m_timer_at) {
+						m_timer_at = SIM_TIME_NEVER;
+						sim_irq_set_pending(SIM_IRQ_RTC1);
+				} else if (t == sim_ads1291_next_event()) {
+						sim_ads1291_run(m_now);
+				} else {
+						sim_sd_run(m_now);
+				}
+				irq_dispatch();
+		}
+		if (t_ns != SIM_TIME_NEVER) {
+				m_now = MAX(m_now, t_ns);
+		}
+}
+
+void app_error_handler(uint32_t error_code, uint32_t line_num, const uint8_t * p_file_name)
+{
+		fprintf(stderr, "%s:%u: error 0x%X at t=%.6f s\n", (char const *)p_file_name, line_num,
+		        error_code, (double)m_now / 1e9);
+		exit(EXIT_FAILURE);
+}
+
+void sim_log(const char * p_fmt, ...)
+{
+		if (m_config.verbose) {
+				va_list args;
+				va_start(args, p_fmt);
+				vfprintf(stderr, p_fmt, args);
+				va_end(args);
+		}
+}
+
+/* HAL ******************************************************************************************/
+
+void hal_spi_init(hal_spi_handler_t handler)
+{
+		m_spi_handler = handler;
+		m_spi_hz			= HAL_SPI_INIT_HZ;
+}
+
+uint32_t hal_spi_frequency_set(uint32_t hz)
+{
+		// The nRF51 rates, 125 kHz to 8 MHz in powers of two.
+		if (hz < 125000 || hz > 8000000 || (hz / 125000) * 125000 != hz || ((hz / 125000) & (hz / 125000 - 1)) != 0) {
+				return NRF_ERROR_INVALID_PARAM;
+		}
+		m_spi_hz = hz;
+		return NRF_SUCCESS;
+}
+
+uint32_t hal_spi_transfer(uint8_t const * p_tx, uint8_t tx_len, uint8_t * p_rx, uint8_t rx_len)
+{
+		if (m_spi_done_at != SIM_TIME_NEVER || m_irq_pending[SIM_IRQ_SPI]) {
+				return NRF_ERROR_BUSY;
+		}
+		m_spi_conversion = sim_ads1291_spi(p_tx, tx_len, p_rx, rx_len);
+		m_spi_done_at = m_now + ((uint64_t)MAX(tx_len, rx_len) * 8 * 1000000000ULL) / m_spi_hz;
+		return NRF_SUCCESS;
+}
+
+void hal_drdy_init(hal_drdy_handler_t handler)
+{
+		m_drdy_handler = handler;
+}
+
+void hal_drdy_time(uint32_t * p_ticks, uint16_t * p_stamp)
+{
+#if defined(ADS1291_2_DRDY_CAPTURE)
+		*p_ticks = (uint32_t)((m_drdy_edge * HAL_CLOCK_HZ) / 1000000000ULL) & HAL_CLOCK_MASK;
+		*p_stamp = (uint16_t)((m_drdy_edge * HAL_STAMP_HZ) / 1000000000ULL);
+#else
+		*p_ticks = hal_clock_ticks();
+		*p_stamp = 0;
+#endif
+}
+
+void hal_pwdn_set(bool level)
+{
+		sim_ads1291_pwdn(level);
+}
+
+void hal_flash_init(hal_flash_handler_t handler, uint16_t pages)
+{
+		if (pages > FLASH_PAGES) {
+				APP_ERROR_HANDLER(NRF_ERROR_NO_MEM);
+		}
+		if (!m_flash_formatted) {
+				memset(m_flash, 0xFF, sizeof(m_flash));
+				m_flash_formatted = true;
+		}
+		m_flash_handler	= handler;
+		m_flash_pages		= pages;
+}
+
+/**@brief Run an erase or write: the CPU, main loop included, stops for duration_ns while the
+ *        radio carries on, then the result is reported through the SoftDevice event interrupt.
+ */
+static void flash_busy(uint64_t duration_ns)
+{
+		m_flash_busy_until = m_now + duration_ns;
+		sim_advance(m_flash_busy_until);
+		m_flash_done = true;
+		sim_irq_set_pending(SIM_IRQ_SWI2);
+		irq_dispatch();
+}
+
+uint32_t hal_flash_erase(uint16_t page)
+{
+		if (page >= m_flash_pages) {
+				return NRF_ERROR_INVALID_ADDR;
+		}
+		if (m_flash_done) {
+				return NRF_ERROR_NO_MEM;
+		}
+		memset(m_flash[page], 0xFF, sizeof(m_flash[page]));
+		flash_busy(FLASH_ERASE_NS);
+		return NRF_SUCCESS;
+}
+
+uint32_t hal_flash_write(uint16_t page, uint16_t offset, uint32_t const * p_data, uint16_t len)
+{
+		if (page >= m_flash_pages || (offset % 4) != 0 || (len % 4) != 0 || offset + len > HAL_FLASH_PAGE_SIZE) {
+				return NRF_ERROR_INVALID_ADDR;
+		}
+		if (m_flash_done) {
+				return NRF_ERROR_NO_MEM;
+		}
+		for (uint16_t i = 0; i < len / 4; i++) {
+				// Programming only clears bits.
+				m_flash[page][offset / 4 + i] &= p_data[i];
+		}
+		flash_busy((uint64_t)(len / 4) * FLASH_WORD_NS);
+		return NRF_SUCCESS;
+}
+
+uint8_t const * hal_flash_page(uint16_t page)
+{
+		if (page >= m_flash_pages) {
+				APP_ERROR_HANDLER(NRF_ERROR_INVALID_ADDR);
+		}
+		return (uint8_t const *)m_flash[page];
+}
+
+void hal_delay_ms(uint32_t ms)
+{
+		sim_advance(m_now + (uint64_t)ms * SIM_NS_PER_MS);
+}
+
+void hal_delay_us(uint32_t us)
+{
+		sim_advance(m_now + (uint64_t)us * 1000);
+}
+
+void hal_timer_init(hal_timer_handler_t handler)
+{
+		m_timer_handler = handler;
+}
+
+void hal_timer_start(uint32_t ms)
+{
+		m_timer_at = m_now + (uint64_t)ms * SIM_NS_PER_MS;
+}
+
+uint32_t hal_clock_ticks(void)
+{
+		return (uint32_t)((m_now * HAL_CLOCK_HZ) / 1000000000ULL) & HAL_CLOCK_MASK;
+}
+
+uint16_t hal_cycles(void)
+{
+		// Host nanoseconds: the host is far faster than the target, so only relative costs carry over.
+		return (uint16_t)sim_host_ns();
+}
+
+void hal_yield(void)
+{
+		uint64_t t = next_event();
+		if (t == SIM_TIME_NEVER) {
+				// The wait can never end: nothing is scheduled that could raise an interrupt.
+				APP_ERROR_HANDLER(NRF_ERROR_INVALID_STATE);
+		}
+		sim_advance(t);
+}
+
+void hal_wait_for_event(void)
+{
+		sim_advance(MIN(next_event(), m_horizon));
+}
+
+uint32_t hal_gatt_notify(uint16_t conn_handle, uint16_t value_handle, uint8_t const * p_data, uint16_t * p_len)
+{
+		ble_gatts_hvx_params_t hvx_params;
+		memset(&hvx_params, 0, sizeof(hvx_params));
+		hvx_params.handle = value_handle;
+		hvx_params.type   = BLE_GATT_HVX_NOTIFICATION;
+		hvx_params.offset = 0;
+		hvx_params.p_len  = p_len;
+		hvx_params.p_data = (uint8_t *)p_data;
+		return sd_ble_gatts_hvx(conn_handle, &hvx_params);
+}
+
+uint32_t hal_gatt_tx_buffers(uint16_t conn_handle, uint8_t * p_count)
+{
+		return sd_ble_tx_packet_count_get(conn_handle, p_count);
+}
+
+uint32_t hal_conn_params_request(uint16_t conn_handle, ble_gap_conn_params_t const * p_params)
+{
+		return sd_ble_gap_conn_param_update(conn_handle, p_params);
+}
@@ -0,0 +1,2 @@
+/* Host stand-in for the nRF51 SDK header of the same name. See sim_sdk.h. */
+#include "sim_sdk.h"
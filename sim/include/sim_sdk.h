@@ -0,0 +1,403 @@
+/* Copyright (c) 2016 Musa Mahmood
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/** @file
+ *
+ * @brief The subset of the nRF51 SDK 11 / S130 API used by the data path, for host builds.
+ *
+ * @details The SDK header names used by the firmware (ble.h, app_error.h, nrf_log.h, ...)
+ *          are one-line stand-ins in this directory that include this file. Names, layouts
+ *          and error values follow the SDK; only what the shared sources use is declared.
+ *          The sd_* functions are implemented by sim_softdevice.c.
+ */
+
+#ifndef SIM_SDK_H__
+#define SIM_SDK_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+/* compiler_abstraction.h / nrf.h ****************************************************************/
+#define __INLINE												inline
+#define __STATIC_INLINE									static inline
+#define __DMB()													__sync_synchronize()
+
+/* nordic_common.h / app_util.h ****************************************************************/
+#define UNUSED_VARIABLE(X)							((void)(X))
+#define UNUSED_PARAMETER(X)							UNUSED_VARIABLE(X)
+#ifndef MIN
+#define MIN(a, b)												((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b)												((a) < (b) ? (b) : (a))
+#endif
+#define ROUNDED_DIV(A, B)								(((A) + ((B) / 2)) / (B))
+#define CEIL_DIV(A, B)									(((A) + (B) - 1) / (B))
+
+enum
+{
+		UNIT_0_625_MS = 625,
+		UNIT_1_25_MS  = 1250,
+		UNIT_10_MS    = 10000
+};
+#define MSEC_TO_UNITS(TIME, RESOLUTION)	(((TIME) * 1000) / (RESOLUTION))
+
+static inline uint8_t uint16_encode(uint16_t value, uint8_t * p_encoded_data)
+{
+		p_encoded_data[0] = (uint8_t) ((value & 0x00FF) >> 0);
+		p_encoded_data[1] = (uint8_t) ((value & 0xFF00) >> 8);
+		return sizeof(uint16_t);
+}
+
+static inline uint8_t uint32_encode(uint32_t value, uint8_t * p_encoded_data)
+{
+		p_encoded_data[0] = (uint8_t) ((value & 0x000000FF) >> 0);
+		p_encoded_data[1] = (uint8_t) ((value & 0x0000FF00) >> 8);
+		p_encoded_data[2] = (uint8_t) ((value & 0x00FF0000) >> 16);
+		p_encoded_data[3] = (uint8_t) ((value & 0xFF000000) >> 24);
+		return sizeof(uint32_t);
+}
+
+static inline uint16_t uint16_decode(const uint8_t * p_encoded_data)
+{
+		return (uint16_t)(((uint16_t)p_encoded_data[0]) | (((uint16_t)p_encoded_data[1]) << 8));
+}
+
+static inline uint32_t uint32_decode(const uint8_t * p_encoded_data)
+{
+		return ((((uint32_t)p_encoded_data[0]) << 0)  |
+		        (((uint32_t)p_encoded_data[1]) << 8)  |
+		        (((uint32_t)p_encoded_data[2]) << 16) |
+		        (((uint32_t)p_encoded_data[3]) << 24));
+}
+
+/* nrf_error.h *********************************************************************************/
+#define NRF_SUCCESS											0
+#define NRF_ERROR_INTERNAL							3
+#define NRF_ERROR_NO_MEM								4
+#define NRF_ERROR_NOT_FOUND							5
+#define NRF_ERROR_NOT_SUPPORTED					6
+#define NRF_ERROR_INVALID_PARAM					7
+#define NRF_ERROR_INVALID_STATE					8
+#define NRF_ERROR_INVALID_LENGTH				9
+#define NRF_ERROR_DATA_SIZE							12
+#define NRF_ERROR_NULL									14
+#define NRF_ERROR_INVALID_ADDR					16
+#define NRF_ERROR_BUSY									17
+
+#define BLE_ERROR_INVALID_CONN_HANDLE		0x3002
+#define BLE_ERROR_INVALID_ATTR_HANDLE		0x3003
+#define BLE_ERROR_NO_TX_PACKETS					0x3004
+#define BLE_ERROR_GATTS_SYS_ATTR_MISSING	0x3401
+
+typedef uint32_t ret_code_t;
+
+/* app_error.h *********************************************************************************/
+void app_error_handler(uint32_t error_code, uint32_t line_num, const uint8_t * p_file_name);
+
+#define APP_ERROR_HANDLER(ERR_CODE)																					\
+		do																																			\
+		{																																				\
+				app_error_handler((ERR_CODE), __LINE__, (uint8_t*) __FILE__);				\
+		} while (0)
+
+#define APP_ERROR_CHECK(ERR_CODE)																						\
+		do																																			\
+		{																																				\
+				const uint32_t LOCAL_ERR_CODE = (ERR_CODE);													\
+				if (LOCAL_ERR_CODE != NRF_SUCCESS)																	\
+				{																																		\
+						APP_ERROR_HANDLER(LOCAL_ERR_CODE);															\
+				}																																		\
+		} while (0)
+
+/* app_util_platform.h *************************************************************************/
+// Simulated interrupts only run from inside HAL calls that let time pass, never between two
+// instructions of the main loop, so a critical region needs no locking. The braces keep the
+// SDK macros' scoping.
+#define CRITICAL_REGION_ENTER()					{
+#define CRITICAL_REGION_EXIT()					}
+
+#define APP_IRQ_PRIORITY_HIGHEST				1
+#define APP_IRQ_PRIORITY_HIGH						1
+#define APP_IRQ_PRIORITY_LOW						3
+
+/* nrf_log.h ***********************************************************************************/
+void sim_log(const char * p_fmt, ...) __attribute__((format(printf, 1, 2)));
+#define NRF_LOG_PRINTF(...)							sim_log(__VA_ARGS__)
+
+/* ble_types.h / ble_gap.h *********************************************************************/
+#define BLE_CONN_HANDLE_INVALID					0xFFFF
+#define BLE_GATT_HANDLE_INVALID					0x0000
+
+#define BLE_UUID_TYPE_UNKNOWN						0x00
+#define BLE_UUID_TYPE_BLE								0x01
+#define BLE_UUID_TYPE_VENDOR_BEGIN			0x02
+
+typedef struct
+{
+		uint16_t	uuid;
+		uint8_t		type;
+} ble_uuid_t;
+
+typedef struct
+{
+		uint8_t		uuid128[16];
+} ble_uuid128_t;
+
+#define BLE_UUID_BLE_ASSIGN(instance, value)																\
+		do																																			\
+		{																																				\
+				instance.type = BLE_UUID_TYPE_BLE;																	\
+				instance.uuid = value;																							\
+		} while (0)
+
+typedef struct
+{
+		uint8_t sm : 4;
+		uint8_t lv : 4;
+} ble_gap_conn_sec_mode_t;
+
+#define BLE_GAP_CONN_SEC_MODE_SET_OPEN(ptr)					do { (ptr)->sm = 1; (ptr)->lv = 1; } while (0)
+#define BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(ptr)		do { (ptr)->sm = 0; (ptr)->lv = 0; } while (0)
+
+typedef struct
+{
+		uint16_t min_conn_interval;
+		uint16_t max_conn_interval;
+		uint16_t slave_latency;
+		uint16_t conn_sup_timeout;
+} ble_gap_conn_params_t;
+
+/* ble_gatt.h / ble_gatts.h ********************************************************************/
+#define BLE_GATT_HVX_NOTIFICATION						0x01
+#define BLE_GATT_STATUS_SUCCESS							0x0000
+#define BLE_GATT_STATUS_ATTERR_APP_BEGIN		0x0180
+
+#define BLE_GATTS_SRVC_TYPE_PRIMARY					0x01
+#define BLE_GATTS_VLOC_STACK								0x01
+#define BLE_GATTS_AUTHORIZE_TYPE_READ				0x01
+#define BLE_GATTS_AUTHORIZE_TYPE_WRITE			0x02
+#define BLE_GATTS_OP_WRITE_REQ							0x01
+
+#define BLE_GATTS_VAR_ATTR_LEN_MAX					20					/**< Enough for every attribute the service defines. */
+
+typedef struct
+{
+		uint8_t broadcast      : 1;
+		uint8_t read           : 1;
+		uint8_t write_wo_resp  : 1;
+		uint8_t write          : 1;
+		uint8_t notify         : 1;
+		uint8_t indicate       : 1;
+		uint8_t auth_signed_wr : 1;
+} ble_gatt_char_props_t;
+
+typedef struct
+{
+		ble_gap_conn_sec_mode_t read_perm;
+		ble_gap_conn_sec_mode_t write_perm;
+		uint8_t                 vlen    : 1;
+		uint8_t                 vloc    : 2;
+		uint8_t                 rd_auth : 1;
+		uint8_t                 wr_auth : 1;
+} ble_gatts_attr_md_t;
+
+typedef struct
+{
+		ble_gatt_char_props_t   char_props;
+		uint8_t *               p_char_user_desc;
+		uint16_t                char_user_desc_max_size;
+		uint16_t                char_user_desc_size;
+		void *                  p_char_pf;
+		ble_gatts_attr_md_t *   p_user_desc_md;
+		ble_gatts_attr_md_t *   p_cccd_md;
+		ble_gatts_attr_md_t *   p_sccd_md;
+} ble_gatts_char_md_t;
+
+typedef struct
+{
+		ble_uuid_t *            p_uuid;
+		ble_gatts_attr_md_t *   p_attr_md;
+		uint16_t                init_len;
+		uint16_t                init_offs;
+		uint16_t                max_len;
+		uint8_t *               p_value;
+} ble_gatts_attr_t;
+
+typedef struct
+{
+		uint16_t                value_handle;
+		uint16_t                user_desc_handle;
+		uint16_t                cccd_handle;
+		uint16_t                sccd_handle;
+} ble_gatts_char_handles_t;
+
+typedef struct
+{
+		uint16_t                len;
+		uint16_t                offset;
+		uint8_t *               p_value;
+} ble_gatts_value_t;
+
+typedef struct
+{
+		uint16_t                handle;
+		uint8_t                 type;
+		uint16_t                offset;
+		uint16_t *              p_len;
+		uint8_t *               p_data;
+} ble_gatts_hvx_params_t;
+
+typedef struct
+{
+		uint16_t                handle;
+		ble_uuid_t              uuid;
+		uint8_t                 op;
+		uint8_t                 auth_required;
+		uint16_t                offset;
+		uint16_t                len;
+		uint8_t                 data[BLE_GATTS_VAR_ATTR_LEN_MAX];
+} ble_gatts_evt_write_t;
+
+typedef struct
+{
+		uint16_t                handle;
+		ble_uuid_t              uuid;
+		uint16_t                offset;
+} ble_gatts_evt_read_t;
+
+typedef struct
+{
+		uint8_t                 type;
+		union
+		{
+				ble_gatts_evt_read_t  read;
+				ble_gatts_evt_write_t write;
+		} request;
+} ble_gatts_evt_rw_authorize_request_t;
+
+typedef struct
+{
+		uint16_t                gatt_status;
+		uint8_t                 update : 1;
+		uint16_t                offset;
+		uint16_t                len;
+		const uint8_t *         p_data;
+} ble_gatts_authorize_params_t;
+
+typedef struct
+{
+		uint8_t                 type;
+		union
+		{
+				ble_gatts_authorize_params_t read;
+				ble_gatts_authorize_params_t write;
+		} params;
+} ble_gatts_rw_authorize_reply_params_t;
+
+/* ble.h ***************************************************************************************/
+enum
+{
+		BLE_EVT_TX_COMPLETE                 = 0x01,
+		BLE_GAP_EVT_CONNECTED               = 0x10,
+		BLE_GAP_EVT_DISCONNECTED            = 0x11,
+		BLE_GAP_EVT_CONN_PARAM_UPDATE       = 0x12,
+		BLE_GAP_EVT_CONN_SEC_UPDATE         = 0x1A,
+		BLE_GATTS_EVT_WRITE                 = 0x50,
+		BLE_GATTS_EVT_RW_AUTHORIZE_REQUEST  = 0x51,
+		BLE_GATTS_EVT_SYS_ATTR_MISSING      = 0x52
+};
+
+typedef struct
+{
+		uint16_t                conn_handle;
+		union
+		{
+				struct
+				{
+						uint8_t count;
+				} tx_complete;
+		} params;
+} ble_common_evt_t;
+
+typedef struct
+{
+		uint16_t                conn_handle;
+		union
+		{
+				struct
+				{
+						ble_gap_conn_params_t conn_params;
+				} connected;
+				struct
+				{
+						uint8_t reason;
+				} disconnected;
+				struct
+				{
+						ble_gap_conn_params_t conn_params;
+				} conn_param_update;
+		} params;
+} ble_gap_evt_t;
+
+typedef struct
+{
+		uint16_t                conn_handle;
+		union
+		{
+				ble_gatts_evt_write_t                write;
+				ble_gatts_evt_rw_authorize_request_t authorize_request;
+		} params;
+} ble_gatts_evt_t;
+
+typedef struct
+{
+		struct
+		{
+				uint16_t evt_id;
+				uint16_t evt_len;
+		} header;
+		union
+		{
+				ble_common_evt_t common_evt;
+				ble_gap_evt_t    gap_evt;
+				ble_gatts_evt_t  gatts_evt;
+		} evt;
+} ble_evt_t;
+
+uint32_t sd_ble_uuid_vs_add(ble_uuid128_t const * p_vs_uuid, uint8_t * p_uuid_type);
+uint32_t sd_ble_tx_packet_count_get(uint16_t conn_handle, uint8_t * p_count);
+uint32_t sd_ble_gap_conn_param_update(uint16_t conn_handle, ble_gap_conn_params_t const * p_conn_params);
+uint32_t sd_ble_gatts_service_add(uint8_t type, ble_uuid_t const * p_uuid, uint16_t * p_handle);
+uint32_t sd_ble_gatts_characteristic_add(uint16_t service_handle,
+                                         ble_gatts_char_md_t const * p_char_md,
+                                         ble_gatts_attr_t const * p_attr_char_value,
+                                         ble_gatts_char_handles_t * p_handles);
+uint32_t sd_ble_gatts_value_set(uint16_t conn_handle, uint16_t handle, ble_gatts_value_t * p_value);
+uint32_t sd_ble_gatts_value_get(uint16_t conn_handle, uint16_t handle, ble_gatts_value_t * p_value);
+uint32_t sd_ble_gatts_hvx(uint16_t conn_handle, ble_gatts_hvx_params_t const * p_hvx_params);
+uint32_t sd_ble_gatts_rw_authorize_reply(uint16_t conn_handle,
+                                         ble_gatts_rw_authorize_reply_params_t const * p_rw_authorize_reply_params);
+
+#endif // SIM_SDK_H__
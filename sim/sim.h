@@ -0,0 +1,327 @@
+/* Copyright (c) 2016 Musa Mahmood
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/** @file
+ *
+ * @brief Host simulator for the ADS1291/2 data path.
+ *
+ * @details Time is virtual and advances only inside HAL calls (hal_delay_*, hal_yield,
+ *          hal_wait_for_event). Three models produce timed events: the ADS1291 conversion
+ *          clock, the SPI bus and the BLE connection events. Their effects reach the firmware
+ *          as simulated interrupts with nRF51 priorities, so a handler only preempts code of
+ *          lower priority and same-priority work is deferred, as on the target:
+ *
+ *          SIM_IRQ_SPI     priority 1  SPI0 transfer complete
+ *          SIM_IRQ_GPIOTE  priority 3  DRDY falling edge
+ *          SIM_IRQ_SWI2    priority 3  SoftDevice event (BLE_EVT_*)
+ *          SIM_IRQ_RTC1    priority 3  hal_timer_start() expired (app_timer)
+ */
+
+#ifndef SIM_H__
+#define SIM_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ble.h"
+#include "ble_bms.h"
+#include "ads1291-2.h"
+#include "bms_log.h"
+
+#define SIM_NS_PER_MS										1000000ULL
+#define SIM_TIME_NEVER									UINT64_MAX
+#define SIM_NO_CONVERSION								UINT32_MAX
+
+typedef struct
+{
+		uint32_t	sps;										/**< Output data rate. 0 follows CONFIG1 like the device. */
+		uint32_t	spi_hz;									/**< SCLK of frame reads, handed to ads1291_2_sclk_set(). */
+		uint32_t	heart_rate_bpm;					/**< Rate of the synthetic ECG. */
+		uint32_t	noise_uv;								/**< Peak amplitude of the added noise, in microvolts. */
+		uint32_t	seed;										/**< Noise generator seed. */
+		uint8_t		tx_buffers;							/**< Notifications the SoftDevice can hold. */
+		uint8_t		packets_per_event;			/**< Notifications the link moves per connection event. */
+		uint32_t	conn_interval_us;				/**< Connection interval until the firmware requests another. */
+		bool			adaptive;								/**< Run the connection parameter controller (bms_conn_ctrl.c). */
+		uint8_t		oversample_dr;					/**< ads1291_2_oversample_set() at bring-up, CONFIG1.DR code. 0 = off. */
+		uint32_t	lead_off_at_ms;					/**< Electrodes come off this long after sim_app_connect(). 0 = never. */
+		uint32_t	lead_off_ms;						/**< How long they stay off. */
+		bool			connect_at_boot;				/**< sim_app_init() returns once advertising starts, during the ADS1291 power-on reset. */
+		bool			preroll;								/**< Keep converting while disconnected, as an ADS1291_2_PREROLL build does. */
+		uint32_t	cccd_delay_ms;					/**< From selecting the format to enabling notifications, as ATT round trips take. */
+		bool			verbose;								/**< Print NRF_LOG_PRINTF output. */
+} sim_config_t;
+
+typedef enum
+{
+		SIM_IRQ_SPI,
+		SIM_IRQ_GPIOTE,
+		SIM_IRQ_SWI2,
+		SIM_IRQ_RTC1,
+		SIM_IRQ_COUNT
+} sim_irq_t;
+
+/**@brief A conversion as the device produced it. */
+typedef struct
+{
+		uint64_t	t_ns;										/**< DRDY falling edge. */
+		int32_t		ch1;										/**< CH1 code. */
+		int32_t		ch2;										/**< CH2 code. */
+} sim_conversion_t;
+
+/**@brief What the simulated peer received on the Body Voltage Measurement characteristic. */
+typedef struct
+{
+		uint32_t	packets;
+		uint32_t	bytes;
+		uint32_t	samples;								/**< Decoded samples, one per conversion whatever the channel count. */
+		uint32_t	traced;									/**< Samples traced back to their conversion. */
+		uint32_t	lost;										/**< Conversions between traced samples that never arrived. */
+		uint32_t	corrupt;								/**< Samples or packets that match no conversion. */
+		uint32_t	undecodable;						/**< Delta packets skipped while waiting for a key packet. */
+		uint32_t	seq_gaps;								/**< Breaks in the header sequence number. */
+		uint32_t	index_lost;							/**< Conversions the header indices say never arrived (bms_rx). */
+		uint32_t	settling;								/**< Notifications flagged BLE_BMS_HEADER_FLAG_SETTLING (bms_rx). */
+		uint64_t	hole_max_ns;						/**< Longest time between the DRDY edges of consecutive traced samples. */
+		uint32_t	max_per_event;					/**< Most notifications in one connection event. */
+		uint32_t	lead_off_events;				/**< Lead-off status notifications. */
+		uint8_t		lead_off_stat;					/**< LOFF_STAT of the last one. */
+		uint64_t	lead_off_t_ns;					/**< First notification reporting a lead off, SIM_TIME_NEVER if none. */
+		uint64_t	lead_on_t_ns;						/**< First notification reporting all leads on after that. */
+		uint32_t	beats;									/**< Beat notifications. */
+		uint8_t		beat_bpm;								/**< Heart rate of the last one. */
+		uint32_t	rr_count;								/**< Beats that carried an R-R interval. */
+		double		rr_sum_ms;
+		double		rr_max_error_ms;				/**< Largest distance of an R-R interval from the synthetic ECG period. */
+		uint32_t	summaries;							/**< Summary notifications. */
+		uint32_t	summary_beats;					/**< Beats they counted, all windows. */
+		uint8_t		summary_bpm;						/**< Heart rate in the last one. */
+		int16_t		summary_min;						/**< First channel minimum, maximum and mean in the last one. */
+		int16_t		summary_max;
+		int16_t		summary_mean;
+		uint32_t	status_packets;					/**< Lead-off, beat, summary and log status notifications. */
+		uint32_t	status_bytes;
+		uint8_t		log_state;							/**< ble_bms_log_t in the last log status notification. */
+		uint32_t	log_backlog;						/**< Bytes it reported waiting. */
+		uint32_t	log_packets;						/**< Log Data notifications, session records included. */
+		uint32_t	log_bytes;
+		uint32_t	log_sessions;
+		uint32_t	log_samples;						/**< Decoded from the log. */
+		uint32_t	log_traced;							/**< ...and found among the samples passed to ble_bms_update(). */
+		uint32_t	log_lost;								/**< Samples skipped between traced log samples. */
+		uint32_t	log_corrupt;
+		uint64_t	log_first_t_ns;					/**< First Log Data notification, SIM_TIME_NEVER if none. */
+		uint64_t	log_last_t_ns;
+} sim_peer_stats_t;
+
+/**@brief A frame read completed and the SPI handler has run. */
+typedef void (*sim_frame_handler_t)(uint32_t conversion);
+
+/**@brief Notification received by the simulated peer. */
+typedef void (*sim_notify_handler_t)(uint16_t handle, uint8_t const * p_data, uint16_t len, uint64_t t_ns);
+
+/**@brief Fill in the defaults: 1 MHz SCLK, 72 bpm, 7 TX buffers, 4 packets per 15 ms event. */
+void sim_config_default(sim_config_t * p_config);
+
+/**@brief Reset time and all models. */
+void sim_init(sim_config_t const * p_config);
+
+sim_config_t const * sim_config(void);
+
+uint64_t sim_now_ns(void);
+
+/**@brief Stop hal_wait_for_event() from sleeping past this time. */
+void sim_set_horizon(uint64_t t_ns);
+
+/**@brief Run every model event and interrupt up to and including t_ns. */
+void sim_advance(uint64_t t_ns);
+
+void sim_irq_set_pending(sim_irq_t irq);
+
+/**@brief Falling edge on DRDY: capture it for hal_drdy_time() and raise the GPIOTE interrupt. */
+void sim_drdy_edge(uint64_t t_ns);
+
+void sim_set_frame_handler(sim_frame_handler_t handler);
+
+/**@brief Host monotonic clock, for timing firmware code. */
+uint64_t sim_host_ns(void);
+
+/**@brief Charge host time to the firmware. */
+void sim_cpu_add(uint64_t ns);
+
+/**@brief Host time spent in firmware since sim_init(): the SPI and GPIOTE handlers and
+ *        whatever the application charged with sim_cpu_add(). */
+uint64_t sim_cpu_ns(void);
+
+/* Simulated ADS1291 (sim_ads1291.c) ************************************************************/
+
+void sim_ads1291_init(void);
+
+/**@brief Clock one SPI transfer through the device.
+ *
+ * @return The conversion whose frame was shifted out, SIM_NO_CONVERSION for a command.
+ */
+uint32_t sim_ads1291_spi(uint8_t const * p_tx, uint8_t tx_len, uint8_t * p_rx, uint8_t rx_len);
+
+void sim_ads1291_pwdn(bool level);
+
+uint64_t sim_ads1291_next_event(void);
+
+/**@brief Complete a conversion. Latches the frame and drives DRDY low. */
+void sim_ads1291_run(uint64_t now_ns);
+
+/**@brief Conversions completed since sim_init(). */
+uint32_t sim_ads1291_conversions(void);
+
+/**@brief Conversion number index since sim_init(), NULL if it has not happened yet. */
+sim_conversion_t const * sim_ads1291_history(uint32_t index);
+
+uint32_t sim_ads1291_sps(void);
+
+/**@brief Electrodes are off from start_ns until end_ns. */
+void sim_ads1291_lead_off(uint64_t start_ns, uint64_t end_ns);
+
+/* Simulated SoftDevice (sim_softdevice.c) ******************************************************/
+
+void sim_sd_init(void (*evt_handler)(ble_evt_t * p_ble_evt));
+
+/**@brief Deliver queued BLE events. Runs as SIM_IRQ_SWI2. */
+void sim_sd_evt_dispatch(void);
+
+uint64_t sim_sd_next_event(void);
+
+/**@brief Run a connection event: transmit up to packets_per_event notifications. */
+void sim_sd_run(uint64_t now_ns);
+
+/**@brief Peer connects. Connection events start one interval later. */
+void sim_sd_connect(void);
+
+void sim_sd_disconnect(void);
+
+/**@brief Peer writes an attribute, a CCCD included. Authorized writes raise an authorize request. */
+void sim_sd_client_write(uint16_t handle, uint8_t const * p_data, uint16_t len);
+
+void sim_sd_set_notify_handler(sim_notify_handler_t handler);
+
+/**@brief Notifications accepted by sd_ble_gatts_hvx and transmitted so far. */
+uint32_t sim_sd_notifications_sent(void);
+
+/**@brief Connection events the peripheral took part in since sim_sd_init(). */
+uint32_t sim_sd_conn_events(void);
+
+/**@brief SoftDevice API calls since sim_sd_init(). Each is an SVC trap on the target. */
+uint32_t sim_sd_svc_calls(void);
+
+/**@brief Connection interval in use, after any sd_ble_gap_conn_param_update(). */
+uint32_t sim_sd_conn_interval_us(void);
+
+/**@brief Slave latency in use. */
+uint16_t sim_sd_slave_latency(void);
+
+/**@brief Connection events the peripheral skipped under slave latency since sim_sd_init(). */
+uint32_t sim_sd_conn_events_skipped(void);
+
+/* Simulated peer (sim_peer.c) ****************************************************************/
+
+/**@brief Start scoring notifications of value_handle, sent in format with channels interleaved,
+ *        and recording those of lead_off_handle, beat_handle and summary_handle. Installs the
+ *        notify handler. */
+void sim_peer_init(uint16_t value_handle, uint16_t lead_off_handle, uint16_t beat_handle, uint16_t summary_handle,
+                   uint8_t format, uint8_t channels);
+
+/**@brief Also decode the log: status on log_handle, recorded packets on log_data_handle. */
+void sim_peer_log_init(uint16_t log_handle, uint16_t log_data_handle);
+
+/**@brief The live stream resumes at sample or later, after a reconnection. Samples before it
+ *        that were not delivered count as lost. */
+void sim_peer_live_skip(uint32_t sample);
+
+void sim_peer_on_notify(uint16_t handle, uint8_t const * p_data, uint16_t len, uint64_t t_ns);
+
+sim_peer_stats_t const * sim_peer_stats(void);
+
+/**@brief DRDY-to-peer latency of the traced samples at a percentile (0-100), in microseconds. */
+double sim_peer_latency_us(double percentile);
+
+/* Firmware application (sim_app.c) ************************************************************/
+
+/**@brief sim_init(), then the service setup and ADS1291 bring-up of main(). Runs the main loop
+ *        until the power-on reset is over and the device is configured and in standby (still
+ *        converting with preroll), unless connect_at_boot is set. */
+void sim_app_init(sim_config_t const * p_config);
+
+/**@brief Time from sim_app_init() until the main loop had configured the ADS1291, in ns.
+ *        SIM_TIME_NEVER if it has not yet. */
+uint64_t sim_app_afe_ready_ns(void);
+
+/**@brief Time from the last connection to the first sample notification queued, in ns.
+ *        SIM_TIME_NEVER if none has been yet. */
+uint64_t sim_app_first_notification_ns(void);
+
+/**@brief Peer connects, enables measurement, lead-off, beat and summary notifications and
+ *        selects format and channels. Starts sim_peer scoring. */
+void sim_app_connect(uint8_t format, uint8_t channels);
+
+/**@brief Run the main loop for duration_ns of simulated time. */
+void sim_app_run(uint64_t duration_ns);
+
+/**@brief Peer writes the data rate characteristic (CONFIG1.DR code). Needs sps = 0 in the config. */
+void sim_app_write_data_rate(uint8_t data_rate);
+
+/**@brief Peer writes the filter characteristic (BMS_FILTER_* bits). With a forced sps the data
+ *        rate characteristic is written first, so the coefficients match. */
+void sim_app_write_filter(uint8_t filter);
+
+/**@brief Peer writes the mode characteristic (ble_bms_mode_t and summary window in seconds). */
+void sim_app_write_mode(uint8_t mode, uint8_t window_s);
+
+/**@brief Peer writes the log characteristic (ble_bms_log_t command). */
+void sim_app_write_log(uint8_t command);
+
+/**@brief Link drops for down_ns while the main loop runs on, then the peer reconnects and
+ *        enables notifications and selects format and channels as sim_app_connect() did. The
+ *        peer's scoring carries on. */
+void sim_app_drop(uint64_t down_ns);
+
+/**@brief Peer disconnects and acquisition stops, leaving the driver ready for sim_app_init(). */
+void sim_app_stop(void);
+
+/**@brief Conversion behind the sample-th sample passed to ble_bms_update() since sim_app_init(),
+ *        SIM_NO_CONVERSION if there is no such sample yet. */
+uint32_t sim_app_sample_conversion(uint32_t sample);
+
+/**@brief Samples passed to ble_bms_update() since sim_app_init(). */
+uint32_t sim_app_sample_count(void);
+
+/**@brief ads1291_2_frame_t.ticks of the sample-th sample, the time the firmware gave it. */
+uint32_t sim_app_sample_ticks(uint32_t sample);
+
+/**@brief Values of the sample-th sample after decimation and the filter stage, NULL if it is
+ *        the conversion as read. */
+ads1291_2_frame_t const * sim_app_sample_frame(uint32_t sample);
+
+/**@brief Conversions per sample: the decimation ratio when oversampling, otherwise 1. */
+uint32_t sim_app_decimation(void);
+
+ble_bms_t const * sim_app_bms(void);
+
+bms_log_t const * sim_app_log(void);
+
+#endif // SIM_H__
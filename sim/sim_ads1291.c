@@ -0,0 +1,329 @@
+/* Copyright (c) 2016 Musa Mahmood
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/** @file
+ *
+ * @brief Simulated ADS1291/2: register file, command decoder and RDATAC frames.
+ *
+ * @details Models what the driver relies on: opcodes, RREG/WREG (ignored in RDATAC mode
+ *          like the device), START/STOP, STANDBY/WAKEUP, PWDN, the data rate in CONFIG1 and
+ *          the PGA gain and VREF used to scale the input. CH1 carries a synthetic ECG (P, QRS
+ *          and T waves as Gaussians, baseline wander and noise), CH2 a slow respiration-like
+ *          sine. With RESP1 demodulation on (ADS1292R) the two trade places, as the
+ *          respiration signal takes CH1. In the lead-off window (sim_ads1291_lead_off()) the
+ *          inputs sensed in LOFF_SENS report off in LOFF_STAT, if the comparators are on, and
+ *          their channel rails to full scale as the DC lead-off current pulls it. Power-up and wake-up settling times are not modeled.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include "sim.h"
+#include "ads1291-2.h"
+#include "app_error.h"
+
+#define CONFIG1_DR_MASK									0x07
+#define CONFIG2_VREF_4V									0x20
+#define CONFIG2_PDB_LOFF_COMP						0x40
+#define LOFF_STAT_OFF_MASK							0x1F
+#define LOFF_IN1_MASK										0x03			// IN1P, IN1N in LOFF_SENS and LOFF_STAT
+#define LOFF_IN2_MASK										0x0C			// IN2P, IN2N
+#define CHNSET_PD												0x80
+#define CHNSET_GAIN_POS									4
+#define CHNSET_GAIN_MASK								0x70
+#define FULL_SCALE_CODE									0x7FFFFF
+#define RESP1_DEMOD_EN									0x80
+
+#if defined(ADS1292R)
+#define SIM_DEVICE_ID										ADS1292R_DEVICE_ID
+#elif defined(ADS1292)
+#define SIM_DEVICE_ID										ADS1292_DEVICE_ID
+#else
+#define SIM_DEVICE_ID										ADS1291_DEVICE_ID
+#endif
+
+/**@brief Register values after power-on reset (datasheet, Register Map). */
+static const uint8_t m_reset_regs[ADS1291_2_NUM_REGS] = {
+		SIM_DEVICE_ID, 0x02, 0x80, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x0C
+};
+
+static const uint8_t m_pga_gain[8] = {6, 1, 2, 3, 4, 8, 12, 6};
+
+static uint8_t		m_regs[ADS1291_2_NUM_REGS];
+static bool				m_powered;
+static bool				m_rdatac;
+static bool				m_started;
+static bool				m_standby;
+static uint64_t		m_next_conv = SIM_TIME_NEVER;
+static uint64_t		m_lead_off_start = SIM_TIME_NEVER;
+static uint64_t		m_lead_off_end;
+static uint32_t		m_conversions;
+static uint32_t		m_noise_state;
+static uint8_t		m_frame[ADS1291_2_FRAME_LEN];
+
+static sim_conversion_t *	m_history;									/**< Every conversion since sim_ads1291_init(). */
+static uint32_t						m_history_size;
+
+/**@brief LOFF_STAT[4:0] at a time: the sensed inputs while the electrodes are off. */
+static uint8_t lead_off_stat(uint64_t now_ns)
+{
+		if (now_ns < m_lead_off_start || now_ns >= m_lead_off_end ||
+		    (m_regs[ADS1291_2_REGADDR_CONFIG2] & CONFIG2_PDB_LOFF_COMP) == 0) {
+				return 0;
+		}
+		return m_regs[ADS1291_2_REGADDR_LOFF_SENS] & (LOFF_IN1_MASK | LOFF_IN2_MASK);
+}
+
+static uint32_t noise_next(void)
+{
+		// xorshift32
+		m_noise_state ^= m_noise_state << 13;
+		m_noise_state ^= m_noise_state >> 17;
+		m_noise_state ^= m_noise_state << 5;
+		return m_noise_state;
+}
+
+static double gaussian(double t, double center, double width)
+{
+		double x = (t - center) / width;
+		return exp(-0.5 * x * x);
+}
+
+/**@brief Synthetic lead I ECG in microvolts. */
+static double ecg_uv(double t)
+{
+		double period = 60.0 / sim_config()->heart_rate_bpm;
+		double phase  = fmod(t, period) / period;
+		double uv     =   150.0 * gaussian(phase, 0.20, 0.025)		// P
+		                - 100.0 * gaussian(phase, 0.345, 0.008)		// Q
+		                + 1200.0 * gaussian(phase, 0.37, 0.010)		// R
+		                - 250.0 * gaussian(phase, 0.395, 0.010)		// S
+		                + 300.0 * gaussian(phase, 0.60, 0.040);		// T
+		uv += 100.0 * sin(2.0 * M_PI * 0.3 * t);										// Baseline wander
+		if (sim_config()->noise_uv > 0) {
+				uv += (double)(int32_t)(noise_next() % (2 * sim_config()->noise_uv + 1)) - sim_config()->noise_uv;
+		}
+		return uv;
+}
+
+static int32_t uv_to_code(double uv, uint8_t chnset)
+{
+		double vref = (m_regs[ADS1291_2_REGADDR_CONFIG2] & CONFIG2_VREF_4V) ? 4.033 : 2.42;
+		double gain = m_pga_gain[(chnset & CHNSET_GAIN_MASK) >> CHNSET_GAIN_POS];
+		double code = uv * 1e-6 * gain * FULL_SCALE_CODE / vref;
+		if (chnset & CHNSET_PD) {
+				return 0;
+		}
+		code = MAX(code, -(double)FULL_SCALE_CODE - 1);
+		code = MIN(code, (double)FULL_SCALE_CODE);
+		return (int32_t)lround(code);
+}
+
+static void put24(uint8_t * p_dst, uint32_t value)
+{
+		p_dst[0] = (uint8_t)(value >> 16);
+		p_dst[1] = (uint8_t)(value >> 8);
+		p_dst[2] = (uint8_t)value;
+}
+
+static bool converting(void)
+{
+		return m_powered && m_started && !m_standby;
+}
+
+static uint64_t conversion_period_ns(void)
+{
+		return 1000000000ULL / sim_ads1291_sps();
+}
+
+static void conversions_update(void)
+{
+		if (!converting()) {
+				m_next_conv = SIM_TIME_NEVER;
+		} else if (m_next_conv == SIM_TIME_NEVER) {
+				m_next_conv = sim_now_ns() + conversion_period_ns();
+		}
+}
+
+static void command(uint8_t opcode, uint8_t const * p_tx, uint8_t tx_len, uint8_t * p_rx, uint8_t rx_len)
+{
+		uint8_t addr  = opcode & 0x1F;
+		uint8_t count = (tx_len > 1) ? (uint8_t)(p_tx[1] + 1) : 0;
+
+		switch (opcode & 0xE0) {
+				case ADS1291_2_OPC_RREG:
+						if (!m_rdatac) {
+								for (uint8_t i = 0; i < count && (2 + i) < rx_len && (addr + i) < ADS1291_2_NUM_REGS; i++) {
+										p_rx[2 + i] = m_regs[addr + i];
+								}
+						}
+						return;
+				case ADS1291_2_OPC_WREG:
+						if (!m_rdatac) {
+								for (uint8_t i = 0; i < count && (2 + i) < tx_len && (addr + i) < ADS1291_2_NUM_REGS; i++) {
+										if (addr + i == ADS1291_2_REGADDR_LOFF_STAT) {
+												// The lead-off bits are read-only.
+												m_regs[addr + i] = (p_tx[2 + i] & ~LOFF_STAT_OFF_MASK) | (m_regs[addr + i] & LOFF_STAT_OFF_MASK);
+										} else if (addr + i != ADS1291_2_REGADDR_ID) {
+												m_regs[addr + i] = p_tx[2 + i];
+										}
+								}
+						}
+						return;
+				default:
+						break;
+		}
+
+		switch (opcode) {
+				case ADS1291_2_OPC_WAKEUP:		m_standby = false;	break;
+				case ADS1291_2_OPC_STANDBY:		m_standby = true;		break;
+				case ADS1291_2_OPC_START:			m_started = true;		break;
+				case ADS1291_2_OPC_STOP:			m_started = false;	break;
+				case ADS1291_2_OPC_RDATAC:		m_rdatac  = true;		break;
+				case ADS1291_2_OPC_SDATAC:		m_rdatac  = false;	break;
+				case ADS1291_2_OPC_RESET:
+						memcpy(m_regs, m_reset_regs, sizeof(m_regs));
+						m_started = false;
+						break;
+				default:
+						break;
+		}
+		conversions_update();
+}
+
+/**@brief Power-on reset. */
+static void device_reset(void)
+{
+		memcpy(m_regs, m_reset_regs, sizeof(m_regs));
+		memset(m_frame, 0, sizeof(m_frame));
+		m_powered			= false;
+		m_rdatac			= true;			// The device powers up in RDATAC mode.
+		m_started			= false;
+		m_standby			= false;
+		m_next_conv		= SIM_TIME_NEVER;
+}
+
+static void history_add(uint64_t t_ns, int32_t ch1, int32_t ch2)
+{
+		if (m_conversions == m_history_size) {
+				m_history_size = m_history_size ? 2 * m_history_size : 4096;
+				m_history = realloc(m_history, m_history_size * sizeof(*m_history));
+				if (m_history == NULL) {
+						APP_ERROR_HANDLER(NRF_ERROR_NO_MEM);
+				}
+		}
+		m_history[m_conversions].t_ns	= t_ns;
+		m_history[m_conversions].ch1	= ch1;
+		m_history[m_conversions].ch2	= ch2;
+}
+
+void sim_ads1291_init(void)
+{
+		device_reset();
+		m_conversions	= 0;
+		m_lead_off_start	= SIM_TIME_NEVER;
+		m_noise_state	= sim_config()->seed ? sim_config()->seed : 1;
+}
+
+uint32_t sim_ads1291_spi(uint8_t const * p_tx, uint8_t tx_len, uint8_t * p_rx, uint8_t rx_len)
+{
+		bool command_sent = (tx_len > 0 && p_tx[0] != 0x00);
+		bool frame_read   = m_rdatac && !command_sent && rx_len >= ADS1291_2_FRAME_LEN && m_conversions > 0;
+
+		if (!m_powered) {
+				memset(p_rx, 0, rx_len);
+				return SIM_NO_CONVERSION;
+		}
+		// In RDATAC mode DOUT shifts out the latched frame whatever is on DIN.
+		for (uint8_t i = 0; i < rx_len; i++) {
+				p_rx[i] = (m_rdatac && i < ADS1291_2_FRAME_LEN) ? m_frame[i] : 0;
+		}
+		if (command_sent) {
+				command(p_tx[0], p_tx, tx_len, p_rx, rx_len);
+		}
+		return frame_read ? m_conversions - 1 : SIM_NO_CONVERSION;
+}
+
+void sim_ads1291_pwdn(bool level)
+{
+		if (level && !m_powered) {
+				device_reset();
+				m_powered = true;
+		} else if (!level) {
+				m_powered = false;
+		}
+		conversions_update();
+}
+
+uint64_t sim_ads1291_next_event(void)
+{
+		return m_next_conv;
+}
+
+void sim_ads1291_run(uint64_t now_ns)
+{
+		double   t    = (double)now_ns / 1e9;
+		double   ecg  = ecg_uv(t);
+		double   resp = 200.0 * sin(2.0 * M_PI * 0.25 * t);
+		bool     swap = (m_regs[ADS1291_2_REGADDR_RESP1] & RESP1_DEMOD_EN) != 0;
+		int32_t  ch1  = uv_to_code(swap ? resp : ecg, m_regs[ADS1291_2_REGADDR_CH1SET]);
+		int32_t  ch2  = uv_to_code(swap ? ecg : resp, m_regs[ADS1291_2_REGADDR_CH2SET]);
+		uint8_t  loff = lead_off_stat(now_ns);
+		if (loff & LOFF_IN1_MASK) {
+				ch1 = FULL_SCALE_CODE;
+		}
+		if (loff & LOFF_IN2_MASK) {
+				ch2 = FULL_SCALE_CODE;
+		}
+		m_regs[ADS1291_2_REGADDR_LOFF_STAT] = (m_regs[ADS1291_2_REGADDR_LOFF_STAT] & ~LOFF_STAT_OFF_MASK) | loff;
+		uint32_t stat = 0xC00000 | ((uint32_t)(m_regs[ADS1291_2_REGADDR_LOFF_STAT] & 0x1F) << 15)
+		                         | ((uint32_t)(m_regs[ADS1291_2_REGADDR_GPIO] & 0x03) << 13);
+		put24(&m_frame[0], stat);
+		put24(&m_frame[3], (uint32_t)ch1);
+		put24(&m_frame[6], (uint32_t)ch2);
+		history_add(now_ns, ch1, ch2);
+		m_conversions++;
+		m_next_conv = now_ns + conversion_period_ns();
+		sim_drdy_edge(now_ns);
+}
+
+uint32_t sim_ads1291_conversions(void)
+{
+		return m_conversions;
+}
+
+sim_conversion_t const * sim_ads1291_history(uint32_t index)
+{
+		return (index < m_conversions) ? &m_history[index] : NULL;
+}
+
+void sim_ads1291_lead_off(uint64_t start_ns, uint64_t end_ns)
+{
+		m_lead_off_start	= start_ns;
+		m_lead_off_end		= end_ns;
+}
+
+uint32_t sim_ads1291_sps(void)
+{
+		if (sim_config()->sps != 0) {
+				return sim_config()->sps;
+		}
+		return 125u << MIN(m_regs[ADS1291_2_REGADDR_CONFIG1] & CONFIG1_DR_MASK, 6);
+}
@@ -0,0 +1,541 @@
+/* Copyright (c) 2016 Musa Mahmood
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/** @file
+ *
+ * @brief The firmware application on the simulator.
+ *
+ * @details The ADS1291 bring-up, the BLE event handling and the main loop follow main.c;
+ *          only the SDK modules that do not touch the data path (device manager, advertising,
+ *          connection parameters, DIS, BAS) are left out. The connection parameter controller
+ *          only runs when the configuration asks for it. Shared by the single-run simulator
+ *          and the benchmark.
+ *
+ *          Alongside, the conversion behind every frame is followed through the frame ring
+ *          into ble_bms_update(), so the peer can tell which conversion each sample it
+ *          receives came from (with oversampling, the last one of its block) and, when
+ *          oversampling or filtering, which values it was given.
+ */
+
+#include <stdlib.h>
+#include "sim.h"
+#include "hal.h"
+#include "ble_bms.h"
+#include "bms_conn_ctrl.h"
+#include "bms_filter.h"
+#include "bms_qrs.h"
+#include "bms_log.h"
+#include "ads1291-2.h"
+#include "frame_ring.h"
+#include "app_error.h"
+
+#define SIM_APP_RING_SIZE								FRAME_RING_SIZE
+
+/**@brief A sample passed to ble_bms_update(). */
+typedef struct
+{
+		uint32_t						conversion;
+		bool								processed;									/**< frame holds decimated or filtered values. */
+		ads1291_2_frame_t		frame;
+} sim_app_sample_t;
+
+static ble_bms_t				m_bms;
+static bms_conn_ctrl_t	m_conn_ctrl;
+static bms_filter_t			m_filter;
+static bms_qrs_t				m_qrs;
+static uint16_t					m_conn_handle = BLE_CONN_HANDLE_INVALID;
+static uint8_t					m_loff_stat;														/**< LOFF_STAT as of the last frame taken from the ring. */
+static bms_log_t				m_log;
+static bool							m_log_armed;
+static bool							m_log_download;
+static bool							m_recording;
+static bool							m_afe_ready;														/**< afe_startup_run() has configured the device. */
+static uint64_t					m_boot_ns;															/**< sim_app_init() began the startup. */
+static uint64_t					m_afe_ready_ns;
+static uint64_t					m_connect_ns;														/**< BLE_GAP_EVT_CONNECTED. */
+static uint32_t					m_connect_samples;											/**< m_bms.samples_queued then. */
+static uint64_t					m_first_notification_ns;								/**< First samples notified after m_connect_ns. */
+static uint8_t					m_format;																/**< Selected by the peer in sim_app_connect(). */
+static uint8_t					m_channels;
+
+static uint32_t					m_ring_conv[SIM_APP_RING_SIZE];					/**< Conversions of the frames in the ring, oldest first. */
+static uint32_t					m_ring_head;
+static uint32_t					m_ring_tail;
+static uint32_t					m_ring_produced;												/**< Frames the driver has put in the ring. */
+static uint32_t					m_ring_consumed;												/**< Frames data_path_run() has taken out. */
+static sim_app_sample_t *	m_samples;												/**< Every sample passed to ble_bms_update(). */
+static uint32_t					m_sample_count;
+static uint32_t					m_sample_size;
+
+/**@brief A frame read finished: note its conversion if the driver put a frame in the ring,
+ *        which it does not when the ring is full or a decimation block is still open. */
+static void on_frame(uint32_t conversion)
+{
+		uint32_t produced = m_ring_consumed + ads1291_2_frames_pending();
+		if (produced != m_ring_produced) {
+				m_ring_conv[m_ring_head++ % SIM_APP_RING_SIZE] = conversion;
+		}
+		m_ring_produced = produced;
+}
+
+static void sample_conv_add(ads1291_2_frame_t const * p_frame, bool processed)
+{
+		uint32_t conversion = (m_ring_tail != m_ring_head) ? m_ring_conv[m_ring_tail++ % SIM_APP_RING_SIZE]
+		                                                   : SIM_NO_CONVERSION;
+		if (m_sample_count == m_sample_size) {
+				m_sample_size = m_sample_size ? 2 * m_sample_size : 4096;
+				m_samples = realloc(m_samples, m_sample_size * sizeof(*m_samples));
+				if (m_samples == NULL) {
+						APP_ERROR_HANDLER(NRF_ERROR_NO_MEM);
+				}
+		}
+		m_samples[m_sample_count].conversion	= conversion;
+		m_samples[m_sample_count].processed		= processed;
+		m_samples[m_sample_count].frame				= *p_frame;
+		m_sample_count++;
+}
+
+static void on_ble_evt(ble_evt_t * p_ble_evt)
+{
+		switch (p_ble_evt->header.evt_id) {
+				case BLE_GAP_EVT_CONNECTED:
+						if (!sim_config()->preroll && !m_log_armed && m_afe_ready) {
+								ads1291_2_wake();
+						}
+						m_connect_ns						= sim_now_ns();
+						m_connect_samples				= m_bms.samples_queued;
+						m_first_notification_ns	= SIM_TIME_NEVER;
+						m_conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
+						break;
+				case BLE_GAP_EVT_DISCONNECTED:
+						if (!sim_config()->preroll && !m_log_armed && m_afe_ready) {
+								ads1291_2_standby();
+						}
+						m_conn_handle = BLE_CONN_HANDLE_INVALID;
+						break;
+				default:
+						break;
+		}
+}
+
+static void ble_evt_dispatch(ble_evt_t * p_ble_evt)
+{
+		on_ble_evt(p_ble_evt);
+		ble_bms_on_ble_evt(&m_bms, p_ble_evt);
+		bms_conn_ctrl_on_ble_evt(&m_conn_ctrl, p_ble_evt);
+}
+
+/**@brief data_rate_apply() of main.c. */
+static void data_rate_apply(void)
+{
+		uint8_t data_rate;
+
+		if (m_afe_ready && ble_bms_data_rate_take(&m_bms, &data_rate)) {
+				set_sampling_rate(data_rate);
+				bms_filter_config(&m_filter, m_bms.filter, ADS1291_2_DR_TO_SPS(data_rate));
+				(void)bms_qrs_config(&m_qrs, ADS1291_2_DR_TO_SPS(data_rate));
+		}
+}
+
+/**@brief filter_apply() of main.c. */
+static void filter_apply(void)
+{
+		uint8_t filter;
+
+		if (ble_bms_filter_take(&m_bms, &filter)) {
+				bms_filter_config(&m_filter, filter, ADS1291_2_DR_TO_SPS(m_bms.data_rate));
+		}
+}
+
+/**@brief filter_frame() of main.c. */
+static void filter_frame(ads1291_2_frame_t * p_frame)
+{
+#if (ADS1291_2_ECG_CHANNELS & 0x01)
+		p_frame->ch1 = bms_filter_run(&m_filter, 0, p_frame->ch1);
+#endif
+#if (ADS1291_2_ECG_CHANNELS & 0x02)
+		p_frame->ch2 = bms_filter_run(&m_filter, 1, p_frame->ch2);
+#endif
+}
+
+/**@brief qrs_frame() of main.c, without the Heart Rate Service. */
+static void qrs_frame(ads1291_2_frame_t const * p_frame)
+{
+		bms_qrs_beat_t beat;
+#if (ADS1291_2_ECG_CHANNELS & 0x01)
+		int32_t        sample = p_frame->ch1;
+#else
+		int32_t        sample = p_frame->ch2;
+#endif
+
+		if (bms_qrs_run(&m_qrs, sample, p_frame->index, &beat)) {
+				ble_bms_beat_update(&m_bms, beat.bpm, beat.index, beat.rr);
+		}
+}
+
+/**@brief log_status_update() of main.c. */
+static void log_status_update(void)
+{
+		uint8_t state = m_log_download ? BLE_BMS_LOG_DOWNLOAD : (m_log_armed ? BLE_BMS_LOG_ARMED : BLE_BMS_LOG_OFF);
+
+		ble_bms_log_status_update(&m_bms, state, bms_log_size(&m_log));
+}
+
+/**@brief log_apply() of main.c. */
+static void log_apply(void)
+{
+		uint8_t command;
+
+		if (!ble_bms_log_take(&m_bms, &command)) {
+				return;
+		}
+		switch (command) {
+				case BLE_BMS_LOG_OFF:
+						m_log_armed			= false;
+						m_log_download	= false;
+						break;
+				case BLE_BMS_LOG_ARMED:
+						m_log_armed			= true;
+						m_log_download	= false;
+						break;
+				case BLE_BMS_LOG_DOWNLOAD:
+						m_log_download	= true;
+						break;
+				default:
+						m_log_download	= false;
+						bms_log_clear(&m_log);
+						break;
+		}
+		log_status_update();
+}
+
+/**@brief log_run() of main.c. */
+static void log_run(void)
+{
+		uint8_t					packet[BLE_BMS_MAX_BVM_LENGTH];
+		uint8_t const *	p_record;
+		uint8_t					len;
+		uint32_t				err_code;
+
+		if (m_conn_handle == BLE_CONN_HANDLE_INVALID) {
+				if (!m_recording && m_log_armed) {
+						len = ble_bms_record_start(&m_bms, packet);
+						bms_log_session_set(&m_log, packet, len);
+						m_recording = true;
+				}
+				if (m_log_download) {
+						m_log_download = false;
+						log_status_update();
+				}
+		} else if (m_recording) {
+				bms_log_flush(&m_log);
+				m_recording = false;
+				log_status_update();
+		}
+		if (m_recording) {
+				while ((len = ble_bms_record_take(&m_bms, packet)) > 0) {
+						(void)bms_log_append(&m_log, packet, len);
+				}
+		}
+		if (m_log_download && ads1291_2_frames_pending() == 0) {
+				while ((len = bms_log_peek(&m_log, &p_record)) > 0) {
+						err_code = ble_bms_log_send(&m_bms, p_record, len);
+						if (err_code != NRF_SUCCESS) {
+								if (err_code != BLE_ERROR_NO_TX_PACKETS) {
+										m_log_download = false;
+										log_status_update();
+								}
+								break;
+						}
+						bms_log_consume(&m_log);
+				}
+				if (m_log_download && bms_log_size(&m_log) == 0) {
+						m_log_download = false;
+						log_status_update();
+				}
+		}
+		bms_log_run(&m_log);
+}
+
+static void flash_handler(bool success)
+{
+		bms_log_on_flash(&m_log, success);
+}
+
+/**@brief The main loop body of main.c. */
+/**@brief afe_startup_run() of main.c. */
+static void afe_startup_run(void)
+{
+		if (m_afe_ready || !ads1291_2_startup_done()) {
+				return;
+		}
+		ads1291_2_stop_rdatac();
+		ads1291_2_init_regs();
+		ads1291_2_soft_start_conversion();
+		ads1291_2_check_id();
+		ads1291_2_start_rdatac();
+		if (sim_config()->oversample_dr != 0) {
+				ads1291_2_oversample_set(sim_config()->oversample_dr);
+				set_sampling_rate(m_bms.data_rate);
+		}
+		if (!sim_config()->preroll && m_conn_handle == BLE_CONN_HANDLE_INVALID && !m_log_armed) {
+				ads1291_2_standby();
+		}
+		m_afe_ready			= true;
+		m_afe_ready_ns	= sim_now_ns();
+}
+
+static void data_path_run(void)
+{
+		body_voltage_t						body_voltage[BLE_BMS_MAX_CHANNELS];
+		ads1291_2_frame_t					frame;
+		ads1291_2_frame_t const *	p_frames;
+		uint32_t									n_frames;
+		afe_startup_run();
+		ble_bms_config_apply(&m_bms);
+		while ((n_frames = ads1291_2_frames_peek(&p_frames)) > 0) {
+				uint32_t i;
+				for (i = 0; i < n_frames; i++) {
+						if ((m_conn_handle != BLE_CONN_HANDLE_INVALID || m_recording) && ble_bms_bvm_buffer_is_full(&m_bms)) {
+								break;
+						}
+						if (ads1291_2_lead_off_update(&p_frames[i], &m_loff_stat)) {
+								ble_bms_lead_off_update(&m_bms, m_loff_stat, p_frames[i].index);
+						}
+						if (m_loff_stat == 0) {
+								qrs_frame(&p_frames[i]);
+						}
+						frame = p_frames[i];
+						bool filtered = false;
+						if (ble_bms_samples_wanted(&m_bms)) {
+								filtered = bms_filter_active(&m_filter);
+								if (filtered) {
+										filter_frame(&frame);
+								}
+								get_bvm_sample(&frame, body_voltage);
+								ble_bms_update(&m_bms, body_voltage, p_frames[i].index, p_frames[i].ticks, p_frames[i].settling);
+						}
+						sample_conv_add(&frame, filtered || sim_config()->oversample_dr != 0);
+				}
+				ads1291_2_frames_consume(i);
+				m_ring_consumed += i;
+				if (i < n_frames) {
+						break;
+				}
+		}
+		ble_bms_send(&m_bms);
+		if (m_first_notification_ns == SIM_TIME_NEVER && m_conn_handle != BLE_CONN_HANDLE_INVALID &&
+		    m_bms.samples_queued != m_connect_samples) {
+				m_first_notification_ns = sim_now_ns();
+		}
+		data_rate_apply();
+		filter_apply();
+		log_apply();
+		log_run();
+		if (sim_config()->adaptive) {
+				bms_conn_ctrl_update(&m_conn_ctrl, &m_bms, ads1291_2_frames_pending());
+		}
+}
+
+void sim_app_init(sim_config_t const * p_config)
+{
+		sim_init(p_config);
+		sim_set_frame_handler(on_frame);
+		m_ring_head			= 0;
+		m_ring_tail			= 0;
+		m_ring_produced	= 0;
+		m_ring_consumed	= 0;
+		m_sample_count	= 0;
+		m_loff_stat			= 0;
+		m_log_armed			= false;
+		m_log_download	= false;
+		m_recording			= false;
+		m_afe_ready			= false;
+		m_first_notification_ns	= SIM_TIME_NEVER;
+		sim_sd_init(ble_evt_dispatch);
+		hal_flash_init(flash_handler, BMS_LOG_PAGES);
+		bms_log_init(&m_log);
+		ble_ecg_service_init(&m_bms);
+		bms_conn_ctrl_init(&m_conn_ctrl);
+		bms_filter_init(&m_filter);
+		bms_qrs_init(&m_qrs);
+		(void)bms_qrs_config(&m_qrs, ADS1291_2_DR_TO_SPS(m_bms.data_rate));
+
+		// Bring-up, as in main(): advertising starts now, afe_startup_run() finishes it.
+		hal_drdy_init(ads1291_2_drdy_handler);
+		ads_spi_init();
+		APP_ERROR_CHECK(ads1291_2_sclk_set(p_config->spi_hz));
+		ads1291_2_startup_begin();
+		m_boot_ns = sim_now_ns();
+		while (!p_config->connect_at_boot && !m_afe_ready) {
+				sim_app_run(SIM_NS_PER_MS);
+		}
+}
+
+uint64_t sim_app_afe_ready_ns(void)
+{
+		return m_afe_ready ? m_afe_ready_ns - m_boot_ns : SIM_TIME_NEVER;
+}
+
+uint64_t sim_app_first_notification_ns(void)
+{
+		return (m_first_notification_ns != SIM_TIME_NEVER) ? m_first_notification_ns - m_connect_ns : SIM_TIME_NEVER;
+}
+
+/**@brief Peer connects, selects format and channels and enables every notification.
+ *
+ * @details Notifications come last, so the samples the service buffered before go out in
+ *          the selected format. Like a real client, the peer enables them cccd_delay_ms later,
+ *          and the firmware keeps running meanwhile.
+ */
+static void link_open(uint8_t format, uint8_t channels)
+{
+		uint8_t cccd[2] = {BLE_GATT_HVX_NOTIFICATION, 0};
+		sim_sd_connect();
+		sim_sd_client_write(m_bms.format_handles.value_handle, &format, sizeof(format));
+		if (channels != 1) {
+				// ATT allows one request at a time: let the firmware answer the format write first.
+				sim_advance(sim_now_ns());
+				sim_sd_client_write(m_bms.channels_handles.value_handle, &channels, sizeof(channels));
+		}
+		sim_advance(sim_now_ns());
+		sim_app_run((uint64_t)sim_config()->cccd_delay_ms * SIM_NS_PER_MS);
+		sim_sd_client_write(m_bms.bvm_handles.cccd_handle, cccd, sizeof(cccd));
+		sim_sd_client_write(m_bms.lead_off_handles.cccd_handle, cccd, sizeof(cccd));
+		sim_sd_client_write(m_bms.beat_handles.cccd_handle, cccd, sizeof(cccd));
+		sim_sd_client_write(m_bms.summary_handles.cccd_handle, cccd, sizeof(cccd));
+		sim_sd_client_write(m_bms.log_handles.cccd_handle, cccd, sizeof(cccd));
+		sim_sd_client_write(m_bms.log_data_handles.cccd_handle, cccd, sizeof(cccd));
+}
+
+void sim_app_connect(uint8_t format, uint8_t channels)
+{
+		sim_peer_init(m_bms.bvm_handles.value_handle, m_bms.lead_off_handles.value_handle, m_bms.beat_handles.value_handle,
+		              m_bms.summary_handles.value_handle, format, channels);
+		sim_peer_log_init(m_bms.log_handles.value_handle, m_bms.log_data_handles.value_handle);
+		m_format		= format;
+		m_channels	= channels;
+		if (sim_config()->lead_off_at_ms != 0) {
+				uint64_t start = sim_now_ns() + (uint64_t)sim_config()->lead_off_at_ms * SIM_NS_PER_MS;
+				sim_ads1291_lead_off(start, start + (uint64_t)sim_config()->lead_off_ms * SIM_NS_PER_MS);
+		}
+		link_open(format, channels);
+		if (sim_config()->sps != 0) {
+				// Tell the firmware the rate the device is forced to: the connection parameter
+				// controller, the filter coefficients and the QRS detector follow it.
+				for (uint8_t dr = 0; dr <= ADS1291_2_REG_CONFIG1_DR_MAX; dr++) {
+						if (ADS1291_2_DR_TO_SPS(dr) == sim_config()->sps) {
+								sim_app_write_data_rate(dr);
+						}
+				}
+		}
+}
+
+void sim_app_run(uint64_t duration_ns)
+{
+		uint64_t end = sim_now_ns() + duration_ns;
+		sim_set_horizon(end);
+		while (sim_now_ns() < end) {
+				uint64_t t0 = sim_host_ns();
+				data_path_run();
+				sim_cpu_add(sim_host_ns() - t0);
+				hal_wait_for_event();
+		}
+}
+
+void sim_app_write_data_rate(uint8_t data_rate)
+{
+		// ATT allows one request at a time: let the firmware answer earlier writes first.
+		sim_advance(sim_now_ns());
+		sim_sd_client_write(m_bms.data_rate_handles.value_handle, &data_rate, sizeof(data_rate));
+}
+
+void sim_app_write_filter(uint8_t filter)
+{
+		sim_advance(sim_now_ns());
+		sim_sd_client_write(m_bms.filter_handles.value_handle, &filter, sizeof(filter));
+}
+
+void sim_app_write_mode(uint8_t mode, uint8_t window_s)
+{
+		uint8_t value[BLE_BMS_MODE_LEN] = {mode, window_s};
+		sim_advance(sim_now_ns());
+		sim_sd_client_write(m_bms.mode_handles.value_handle, value, sizeof(value));
+}
+
+void sim_app_write_log(uint8_t command)
+{
+		sim_advance(sim_now_ns());
+		sim_sd_client_write(m_bms.log_handles.value_handle, &command, sizeof(command));
+}
+
+void sim_app_drop(uint64_t down_ns)
+{
+		sim_sd_disconnect();
+		sim_app_run(down_ns);
+		// Samples still buffered in the service go out live after reconnecting.
+		sim_peer_live_skip(m_sample_count - MIN(m_sample_count, BLE_BMS_MAX_BUFFERED_MEASUREMENTS));
+		link_open(m_format, m_channels);
+}
+
+void sim_app_stop(void)
+{
+		sim_sd_disconnect();
+		sim_advance(sim_now_ns());
+		ads1291_2_stop_rdatac();
+}
+
+uint32_t sim_app_sample_conversion(uint32_t sample)
+{
+		return (sample < m_sample_count) ? m_samples[sample].conversion : SIM_NO_CONVERSION;
+}
+
+uint32_t sim_app_sample_count(void)
+{
+		return m_sample_count;
+}
+
+uint32_t sim_app_sample_ticks(uint32_t sample)
+{
+		return (sample < m_sample_count) ? m_samples[sample].frame.ticks : 0;
+}
+
+ads1291_2_frame_t const * sim_app_sample_frame(uint32_t sample)
+{
+		return (sample < m_sample_count && m_samples[sample].processed) ? &m_samples[sample].frame : NULL;
+}
+
+uint32_t sim_app_decimation(void)
+{
+		uint32_t sps = ADS1291_2_DR_TO_SPS(m_bms.data_rate);
+		return (sim_config()->oversample_dr != 0 && sim_ads1291_sps() > sps) ? sim_ads1291_sps() / sps : 1;
+}
+
+ble_bms_t const * sim_app_bms(void)
+{
+		return &m_bms;
+}
+
+bms_log_t const * sim_app_log(void)
+{
+		return &m_log;
+}
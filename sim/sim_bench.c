@@ -0,0 +1,300 @@
+/* Copyright (c) 2016 Musa Mahmood
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/** @file
+ *
+ * @brief Throughput, drop and latency benchmark of the data path on the simulator.
+ *
+ * @details Sweeps the output data rate, connection interval, SoftDevice TX buffer count and
+ *          notification format, running the firmware from bring-up for every point, and
+ *          prints one row per point:
+ *
+ *          deliv%    samples traced to their conversion, of the conversions while connected
+ *          lost      conversions that never reached the peer (between delivered samples)
+ *          missed    DRDY edges dropped because the bus was busy
+ *          ovr       frames dropped because the ring was full
+ *          bad       samples that arrived with the wrong value (codec or framing error)
+ *          pk/ev     mean and maximum notifications per connection event
+ *          p50..max  DRDY-to-peer latency in milliseconds
+ *          ns/smp    host time in the firmware (handlers and main loop) per conversion
+ *          svc/smp   SoftDevice calls per conversion, each an SVC trap on the target
+ *          ev/s      connection events the peripheral took part in per second (radio-on)
+ *          end_us sl connection interval and slave latency at the end of the run
+ *
+ *          With --adaptive the connection parameter controller runs and the interval list
+ *          only sets the interval the central first connects with.
+ *
+ *          Host time is not nRF51 time: use it to compare points and formats, not as a
+ *          cycle budget for the Cortex-M0.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "sim.h"
+#include "ads1291-2.h"
+#include "bms_filter.h"
+
+#define BENCH_MAX_VALUES								16
+
+typedef struct
+{
+		uint32_t	values[BENCH_MAX_VALUES];
+		uint8_t		count;
+} bench_list_t;
+
+static bool			m_csv;
+static uint8_t	m_channels = 1;
+static uint8_t	m_filter;
+
+static char const * format_name(uint8_t format)
+{
+		switch (format) {
+				case BLE_BMS_FORMAT_RAW:				return "raw";
+				case BLE_BMS_FORMAT_PACKED24:		return "packed24";
+				case BLE_BMS_FORMAT_DELTA:			return "delta";
+				case BLE_BMS_FORMAT_PACKED16:		return "packed16";
+				default:												return "?";
+		}
+}
+
+static bool format_parse(char const * p_str, uint32_t * p_format)
+{
+		for (uint32_t format = BLE_BMS_FORMAT_RAW; format <= BLE_BMS_FORMAT_PACKED16; format++) {
+				if (strcmp(p_str, format_name((uint8_t)format)) == 0) {
+						*p_format = format;
+						return true;
+				}
+		}
+		return false;
+}
+
+/**@brief Parse a comma separated list, of numbers or of format names. */
+static bool list_parse(char const * p_str, bench_list_t * p_list, bool formats)
+{
+		char	buf[256];
+		char *	p_save;
+
+		if (strlen(p_str) >= sizeof(buf)) {
+				return false;
+		}
+		strcpy(buf, p_str);
+		p_list->count = 0;
+		for (char * p_tok = strtok_r(buf, ",", &p_save); p_tok != NULL; p_tok = strtok_r(NULL, ",", &p_save)) {
+				uint32_t value;
+				if (p_list->count == BENCH_MAX_VALUES) {
+						return false;
+				}
+				if (formats) {
+						if (!format_parse(p_tok, &value)) {
+								return false;
+						}
+				} else {
+						char * p_end;
+						value = (uint32_t)strtoul(p_tok, &p_end, 10);
+						if (*p_end != '\0' || value == 0) {
+								return false;
+						}
+				}
+				p_list->values[p_list->count++] = value;
+		}
+		return p_list->count > 0;
+}
+
+static void header_print(void)
+{
+		if (m_csv) {
+				printf("format,sps,interval_us,tx_buffers,conversions,delivered_pct,lost,missed,overruns,corrupt,"
+				       "samples_per_s,bytes_per_s,packets_per_event,max_packets_per_event,"
+				       "p50_ms,p90_ms,p99_ms,max_ms,host_ns_per_sample,svc_per_sample,"
+				       "events_per_s,end_interval_us,end_slave_latency\n");
+		} else {
+				printf("%-8s %5s %6s %2s | %6s %6s %6s %6s %3s | %7s %6s %4s %3s | %6s %6s %6s %6s | %6s %7s | %5s %6s %2s\n",
+				       "format", "sps", "int_us", "tx", "deliv%", "lost", "missed", "ovr", "bad",
+				       "smp/s", "B/s", "pk/ev", "max", "p50", "p90", "p99", "max", "ns/smp", "svc/smp",
+				       "ev/s", "end_us", "sl");
+		}
+}
+
+static void point_run(sim_config_t const * p_config, uint8_t format, double seconds)
+{
+		sim_app_init(p_config);
+		sim_app_connect(format, m_channels);
+		if (m_filter != 0) {
+				sim_app_write_filter(m_filter);
+		}
+
+		uint32_t conv0		= sim_ads1291_conversions();
+		uint32_t svc0			= sim_sd_svc_calls();
+		uint32_t events0	= sim_sd_conn_events();
+		uint32_t missed0	= ads1291_2_frames_missed();
+		uint64_t cpu0			= sim_cpu_ns();
+		uint64_t start		= sim_now_ns();
+		sim_app_run((uint64_t)(seconds * 1e9));
+
+		sim_peer_stats_t const * p_rx		= sim_peer_stats();
+		double		elapsed				= (double)(sim_now_ns() - start) / 1e9;
+		uint32_t	conversions		= sim_ads1291_conversions() - conv0;
+		uint32_t	events				= sim_sd_conn_events() - events0;
+		uint32_t	missed				= ads1291_2_frames_missed() - missed0;
+		uint32_t	overruns			= ads1291_2_frames_overrun();
+		double		per_conv			= conversions ? 1.0 / conversions : 0.0;
+		double		delivered			= 100.0 * p_rx->traced * per_conv;
+		double		ns_per_smp		= (double)(sim_cpu_ns() - cpu0) * per_conv;
+		double		svc_per_smp		= (double)(sim_sd_svc_calls() - svc0) * per_conv;
+		double		pk_per_event	= events ? (double)p_rx->packets / events : 0.0;
+		uint32_t	end_us				= sim_sd_conn_interval_us();
+		uint16_t	end_latency		= sim_sd_slave_latency();
+
+		if (m_csv) {
+				printf("%s,%u,%u,%u,%u,%.2f,%u,%u,%u,%u,%.1f,%.1f,%.2f,%u,%.2f,%.2f,%.2f,%.2f,%.0f,%.3f,%.1f,%u,%u\n",
+				       format_name(format), sim_ads1291_sps(), p_config->conn_interval_us, p_config->tx_buffers,
+				       conversions, delivered, p_rx->lost, missed, overruns, p_rx->corrupt,
+				       p_rx->traced / elapsed, p_rx->bytes / elapsed, pk_per_event, p_rx->max_per_event,
+				       sim_peer_latency_us(50) / 1000, sim_peer_latency_us(90) / 1000,
+				       sim_peer_latency_us(99) / 1000, sim_peer_latency_us(100) / 1000,
+				       ns_per_smp, svc_per_smp, events / elapsed, end_us, end_latency);
+		} else {
+				printf("%-8s %5u %6u %2u | %6.1f %6u %6u %6u %3u | %7.0f %6.0f %4.1f %3u | %6.1f %6.1f %6.1f %6.1f | %6.0f %7.3f | %5.1f %6u %2u\n",
+				       format_name(format), sim_ads1291_sps(), p_config->conn_interval_us, p_config->tx_buffers,
+				       delivered, p_rx->lost, missed, overruns, p_rx->corrupt,
+				       p_rx->traced / elapsed, p_rx->bytes / elapsed, pk_per_event, p_rx->max_per_event,
+				       sim_peer_latency_us(50) / 1000, sim_peer_latency_us(90) / 1000,
+				       sim_peer_latency_us(99) / 1000, sim_peer_latency_us(100) / 1000,
+				       ns_per_smp, svc_per_smp, events / elapsed, end_us, end_latency);
+		}
+		fflush(stdout);
+		sim_app_stop();
+}
+
+static void usage(char const * p_name)
+{
+		fprintf(stderr,
+		        "usage: %s [options]\n"
+		        "  -t, --seconds N          streaming time per point (default 5)\n"
+		        "  -r, --sps LIST           data rates (default 125,250,500,1000,2000,4000,8000)\n"
+		        "  -i, --interval-us LIST   connection intervals (default 7500,15000,30000,50000)\n"
+		        "  -b, --tx-buffers LIST    SoftDevice TX buffers (default 1,3,7)\n"
+		        "  -f, --format LIST        raw,packed16,packed24,delta (default raw,packed16,delta;\n"
+		        "                           raw,packed24,delta in 24-bit builds)\n"
+		        "  -C, --channels N         channels per notification, 2 on ADS1292/R builds (default 1)\n"
+		        "  -F, --filter N           filter stages, BMS_FILTER_* bits (default 0)\n"
+		        "  -p, --per-event N        notifications per connection event (default 4)\n"
+		        "  -s, --spi-hz N           SCLK of frame reads, 1-8 MHz (default %u)\n"
+		        "  -S, --seed N             noise seed (default 1)\n"
+		        "  -a, --adaptive           run the connection parameter controller\n"
+		        "  -c, --csv                comma separated output\n",
+		        p_name, ADS1291_2_SPI_HZ);
+}
+
+int main(int argc, char * argv[])
+{
+		static const struct option options[] = {
+				{"seconds",			required_argument,	NULL, 't'},
+				{"sps",					required_argument,	NULL, 'r'},
+				{"interval-us",	required_argument,	NULL, 'i'},
+				{"tx-buffers",	required_argument,	NULL, 'b'},
+				{"format",			required_argument,	NULL, 'f'},
+				{"channels",		required_argument,	NULL, 'C'},
+				{"filter",			required_argument,	NULL, 'F'},
+				{"per-event",		required_argument,	NULL, 'p'},
+				{"spi-hz",			required_argument,	NULL, 's'},
+				{"seed",				required_argument,	NULL, 'S'},
+				{"adaptive",		no_argument,				NULL, 'a'},
+				{"csv",					no_argument,				NULL, 'c'},
+				{"help",				no_argument,				NULL, 'h'},
+				{NULL, 0, NULL, 0}
+		};
+		bench_list_t	sps					= {{125, 250, 500, 1000, 2000, 4000, 8000}, 7};
+		bench_list_t	intervals		= {{7500, 15000, 30000, 50000}, 4};
+		bench_list_t	tx_buffers	= {{1, 3, 7}, 3};
+#if defined(BLE_BMS_SAMPLE_24BIT)
+		bench_list_t	formats			= {{BLE_BMS_FORMAT_RAW, BLE_BMS_FORMAT_PACKED24, BLE_BMS_FORMAT_DELTA}, 3};
+#else
+		bench_list_t	formats			= {{BLE_BMS_FORMAT_RAW, BLE_BMS_FORMAT_PACKED16, BLE_BMS_FORMAT_DELTA}, 3};
+#endif
+		sim_config_t	config;
+		double				seconds = 5.0;
+		bool					ok			= true;
+		int						opt;
+
+		sim_config_default(&config);
+		while ((opt = getopt_long(argc, argv, "t:r:i:b:f:C:F:p:s:S:ach", options, NULL)) != -1) {
+				switch (opt) {
+						case 't': seconds									= atof(optarg);									break;
+						case 'r': ok = list_parse(optarg, &sps, false);										break;
+						case 'i': ok = list_parse(optarg, &intervals, false);							break;
+						case 'b': ok = list_parse(optarg, &tx_buffers, false);						break;
+						case 'f': ok = list_parse(optarg, &formats, true);								break;
+						case 'C': m_channels								= (uint8_t)atoi(optarg);				break;
+						case 'F': m_filter									= (uint8_t)strtoul(optarg, NULL, 0);	break;
+						case 'p': config.packets_per_event	= (uint8_t)atoi(optarg);				break;
+						case 's': config.spi_hz						= (uint32_t)atoi(optarg);				break;
+						case 'S': config.seed							= (uint32_t)atoi(optarg);				break;
+						case 'a': config.adaptive					= true;													break;
+						case 'c': m_csv										= true;													break;
+						case 'h':
+								usage(argv[0]);
+								return EXIT_SUCCESS;
+						default:
+								ok = false;
+								break;
+				}
+				if (!ok) {
+						usage(argv[0]);
+						return EXIT_FAILURE;
+				}
+		}
+		if (ads1291_2_sclk_set(config.spi_hz) != NRF_SUCCESS || config.packets_per_event == 0 || seconds <= 0 ||
+		    m_channels == 0 || m_channels > BLE_BMS_MAX_CHANNELS || (m_filter & ~BMS_FILTER_ALL) != 0) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+		for (uint8_t f = 0; f < formats.count; f++) {
+#if defined(BLE_BMS_SAMPLE_24BIT)
+				if (formats.values[f] == BLE_BMS_FORMAT_PACKED16) {
+						fprintf(stderr, "packed16 needs a 16-bit build\n");
+						return EXIT_FAILURE;
+				}
+#else
+				if (formats.values[f] == BLE_BMS_FORMAT_PACKED24) {
+						fprintf(stderr, "packed24 needs a SAMPLE_24BIT=1 build\n");
+						return EXIT_FAILURE;
+				}
+#endif
+		}
+
+		header_print();
+		for (uint8_t f = 0; f < formats.count; f++) {
+				for (uint8_t r = 0; r < sps.count; r++) {
+						for (uint8_t i = 0; i < intervals.count; i++) {
+								for (uint8_t b = 0; b < tx_buffers.count; b++) {
+										config.sps							= sps.values[r];
+										config.conn_interval_us	= intervals.values[i];
+										config.tx_buffers				= (uint8_t)tx_buffers.values[b];
+										point_run(&config, (uint8_t)formats.values[f], seconds);
+								}
+						}
+				}
+		}
+		return EXIT_SUCCESS;
+}
@@ -0,0 +1,236 @@
+/* Copyright (c) 2016 Musa Mahmood
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+
+/** @file
+ *
+ * @brief Round trip of the DELTA codec (bms_codec.c) through its own decoder.
+ *
+ * @details Encodes test signals into packets sized like a BMS notification, decodes them and
+ *          compares every sample: both predictor orders, escape codes, full-scale steps,
+ *          resynchronisation at the next key packet after a lost packet, and two interleaved
+ *          channels. Prints each failure and exits non-zero if there was one; `make test`
+ *          runs it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bms_codec.h"
+
+#define TEST_SAMPLES										2000
+#define TEST_PACKET_LEN									16							/**< Codec payload of a BMS notification with a 4-byte header. */
+#define TEST_MAX_PACKETS								TEST_SAMPLES					/**< Every packet carries at least one frame. */
+#define FULL_SCALE_MAX									8388607
+#define FULL_SCALE_MIN									(-8388608)
+
+typedef struct
+{
+		uint8_t			data[TEST_PACKET_LEN];
+		uint8_t			len;
+		uint8_t			frames;
+} test_packet_t;
+
+static test_packet_t	m_packets[TEST_MAX_PACKETS];
+static int32_t				m_signal[TEST_SAMPLES * BMS_CODEC_MAX_CHANNELS];
+static int32_t				m_decoded[TEST_SAMPLES * BMS_CODEC_MAX_CHANNELS];
+static unsigned				m_failures;
+static uint32_t				m_seed = 1;
+
+static void fail(char const * p_case, char const * p_what, long at)
+{
+		printf("FAIL %-28s %s at %ld\n", p_case, p_what, at);
+		m_failures++;
+}
+
+static int32_t rand_range(int32_t lo, int32_t hi)
+{
+		m_seed = m_seed * 1103515245UL + 12345UL;
+		return lo + (int32_t)((m_seed >> 8) % (uint32_t)(hi - lo + 1));
+}
+
+/**@brief Encode frames of m_signal into m_packets. @return Number of packets. */
+static unsigned encode(uint8_t order, uint8_t channels, uint8_t key_interval, unsigned frames)
+{
+		bms_codec_t		codec;
+		unsigned			n = 0;
+		unsigned			f = 0;
+
+		bms_codec_init(&codec, order, key_interval);
+		bms_codec_channels_set(&codec, channels);
+		while (f < frames) {
+				bms_codec_packet_t pkt;
+				bms_codec_packet_begin(&codec, &pkt, m_packets[n].data, TEST_PACKET_LEN);
+				m_packets[n].frames = 0;
+				while (f < frames && bms_codec_packet_put_frame(&pkt, &m_signal[f * channels])) {
+						m_packets[n].frames++;
+						f++;
+				}
+				m_packets[n].len = bms_codec_packet_end(&pkt, &codec);
+				if (m_packets[n].frames == 0) {
+						return 0;
+				}
+				n++;
+		}
+		return n;
+}
+
+/**@brief Decode packets [0, n) except lost, check every sample that comes out.
+ *
+ * @return Packets the decoder skipped waiting for a key packet.
+ */
+static unsigned decode_check(char const * p_case, uint8_t channels, unsigned n, unsigned lost)
+{
+		bms_decoder_t	dec;
+		unsigned			frame   = 0;
+		unsigned			skipped = 0;
+
+		bms_decoder_init(&dec);
+		for (unsigned p = 0; p < n; p++) {
+				if (p == lost) {
+						bms_decoder_desync(&dec);
+						frame += m_packets[p].frames;
+						continue;
+				}
+				int count = bms_decoder_decode(&dec, m_packets[p].data, m_packets[p].len, m_decoded,
+				                               TEST_SAMPLES * BMS_CODEC_MAX_CHANNELS);
+				if (count == -2) {
+						skipped++;
+				} else if (count != m_packets[p].frames * channels) {
+						fail(p_case, "sample count", (long)p);
+				} else if (memcmp(m_decoded, &m_signal[frame * channels], (size_t)count * sizeof(int32_t)) != 0) {
+						fail(p_case, "sample value", (long)p);
+				}
+				frame += m_packets[p].frames;
+		}
+		return skipped;
+}
+
+static void round_trip(char const * p_case, uint8_t order, uint8_t channels, unsigned frames)
+{
+		unsigned n = encode(order, channels, 0, frames);
+		if (n == 0) {
+				fail(p_case, "frame does not fit a packet", 0);
+				return;
+		}
+		if (decode_check(p_case, channels, n, n) != 0) {
+				fail(p_case, "decoder lost sync", 0);
+		}
+}
+
+/**@brief An ECG-like random walk around a slow baseline, 24-bit codes. */
+static void signal_walk(uint8_t channels, unsigned frames)
+{
+		int32_t v[BMS_CODEC_MAX_CHANNELS] = {0, -200000};
+		for (unsigned f = 0; f < frames; f++) {
+				for (uint8_t ch = 0; ch < channels; ch++) {
+						v[ch] += rand_range(-300, 300) + ((f % 200 < 5) ? 20000 : 0) - ((f % 200 >= 5 && f % 200 < 10) ? 20000 : 0);
+						m_signal[f * channels + ch] = v[ch];
+				}
+		}
+}
+
+static void test_orders(void)
+{
+		signal_walk(1, TEST_SAMPLES);
+		round_trip("first order", 1, 1, TEST_SAMPLES);
+		round_trip("second order", 2, 1, TEST_SAMPLES);
+}
+
+/**@brief Quiet stretches bring k down, so the jumps after them need escape codes. */
+static void test_escapes(void)
+{
+		for (unsigned f = 0; f < TEST_SAMPLES; f++) {
+				m_signal[f] = ((f / 40) % 2) ? 1000000 + rand_range(-1, 1) : -1000000 + rand_range(-1, 1);
+		}
+		for (uint8_t order = 1; order <= 2; order++) {
+				round_trip((order == 1) ? "escapes, first order" : "escapes, second order", order, 1, TEST_SAMPLES);
+				// The packet with the first jump (frame 40) must code its 2e6 residual as an escape.
+				unsigned p   = 0;
+				unsigned end = m_packets[0].frames;
+				while (end <= 40) {
+						end += m_packets[++p].frames;
+				}
+				if ((4000000UL >> (m_packets[p].data[0] & BMS_CODEC_K_MASK)) < BMS_CODEC_RICE_ESCAPE) {
+						fail("escapes", "jump fits a Rice code, escape not exercised", (long)p);
+				}
+		}
+}
+
+/**@brief Rail to rail every sample: the largest residuals the predictors can produce. */
+static void test_full_scale(void)
+{
+		for (unsigned f = 0; f < TEST_SAMPLES; f++) {
+				m_signal[f] = (f % 3 == 0) ? FULL_SCALE_MAX : FULL_SCALE_MIN;
+		}
+		round_trip("full scale, first order", 1, 1, TEST_SAMPLES);
+		round_trip("full scale, second order", 2, 1, TEST_SAMPLES);
+}
+
+/**@brief Drop a packet between key packets: the decoder must refuse what follows until the
+ *        next key packet, then decode correctly again.
+ */
+static void test_resync(void)
+{
+		uint8_t		key_interval = 4;
+		signal_walk(1, TEST_SAMPLES);
+		for (uint8_t order = 1; order <= 2; order++) {
+				unsigned n       = encode(order, 1, key_interval, TEST_SAMPLES);
+				unsigned lost    = key_interval + 1;
+				unsigned skipped = decode_check((order == 1) ? "resync, first order" : "resync, second order", 1, n, lost);
+				if (n < 2 * key_interval || !(m_packets[2 * key_interval].data[0] & BMS_CODEC_FLAG_KEY)) {
+						fail("resync", "no key packet where expected", (long)(2 * key_interval));
+				}
+				if (skipped != (unsigned)(key_interval - 2)) {
+						fail("resync", "packets skipped before the key packet", (long)skipped);
+				}
+		}
+}
+
+/**@brief Two channels far apart with different dynamics, interleaved CH1, CH2. */
+static void test_two_channels(void)
+{
+		signal_walk(2, TEST_SAMPLES);
+		for (unsigned f = 0; f < TEST_SAMPLES; f += 97) {
+				m_signal[f * 2 + 1] = (f % 2) ? FULL_SCALE_MAX : FULL_SCALE_MIN;
+		}
+		round_trip("two channels, first order", 1, 2, TEST_SAMPLES);
+		round_trip("two channels, second order", 2, 2, TEST_SAMPLES);
+		if (!(m_packets[0].data[0] & BMS_CODEC_FLAG_2CH) || (m_packets[0].data[1] % 2) != 0) {
+				fail("two channels", "packet not marked two-channel or split pair", 0);
+		}
+}
+
+int main(void)
+{
+		test_orders();
+		test_escapes();
+		test_full_scale();
+		test_resync();
+		test_two_channels();
+		if (m_failures != 0) {
+				printf("bms_codec: %u failures\n", m_failures);
+				return EXIT_FAILURE;
+		}
+		printf("bms_codec: round trip ok\n");
+		return EXIT_SUCCESS;
+}
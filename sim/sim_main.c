@@ -0,0 +1,403 @@
+/* Copyright (c) 2016 Musa Mahmood
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/** @file
+ *
+ * @brief Runs the firmware data path against the simulated ADS1291 and SoftDevice.
+ *
+ * @details The simulated peer connects, enables notifications and selects the data format,
+ *          then the run continues for the requested time and a summary is printed. With
+ *          --drop the peer arms the log, the link drops for a while and the peer downloads
+ *          what was recorded once it is back; --reconnect drops it without the log. See
+ *          sim_bench.c for sweeps over the link and data rate parameters.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "sim.h"
+#include "ads1291-2.h"
+#include "bms_filter.h"
+
+static void usage(char const * p_name)
+{
+		fprintf(stderr,
+		        "usage: %s [options]\n"
+		        "  -t, --seconds N        simulated streaming time (default 10)\n"
+		        "  -r, --sps N            output data rate, 0 = from CONFIG1 (default 0)\n"
+		        "  -d, --data-rate N      peer writes this rate (125-8000 SPS) after connecting\n"
+		        "  -O, --oversample N     converter runs at N SPS (125-8000) and decimates to the data rate\n"
+		        "  -s, --spi-hz N         SCLK of frame reads, 1-8 MHz (default %u)\n"
+		        "  -b, --tx-buffers N     SoftDevice TX buffers (default 7)\n"
+		        "  -p, --per-event N      notifications per connection event (default 4)\n"
+		        "  -i, --interval-us N    connection interval (default 15000)\n"
+		        "  -a, --adaptive         run the connection parameter controller\n"
+		        "  -f, --format F         raw | packed16 | packed24 | delta (default raw)\n"
+		        "  -C, --channels N       channels per notification, 2 on ADS1292/R builds (default 1)\n"
+		        "  -F, --filter N         filter stages, BMS_FILTER_* bits (default 0)\n"
+		        "  -M, --mode M[:S]       stream | beats | summary, summary window S seconds (default stream)\n"
+		        "  -L, --lead-off MS:MS   electrodes come off this long after connecting, for this long\n"
+		        "  -D, --drop MS:MS       arm the log, drop the link this long after connecting, for this long\n"
+		        "  -R, --reconnect MS:MS  drop the link this long after connecting, for this long, log off\n"
+		        "  -P, --preroll          keep converting while disconnected (ADS1291_2_PREROLL) instead of standby\n"
+		        "  -W, --cccd-delay MS    peer enables notifications this long after selecting the format (default 30)\n"
+		        "  -H, --heart-rate N     synthetic ECG rate in bpm (default 72)\n"
+		        "  -n, --noise-uv N       noise amplitude (default 20)\n"
+		        "  -S, --seed N           noise seed (default 1)\n"
+		        "  -B, --connect-at-boot  connect as soon as the device advertises, during the ADS1291 reset\n"
+		        "  -v, --verbose          print firmware log output\n",
+		        p_name, ADS1291_2_SPI_HZ);
+}
+
+static bool format_parse(char const * p_str, uint8_t * p_format)
+{
+		if (strcmp(p_str, "raw") == 0) {
+				*p_format = BLE_BMS_FORMAT_RAW;
+		} else if (strcmp(p_str, "packed24") == 0) {
+				*p_format = BLE_BMS_FORMAT_PACKED24;
+		} else if (strcmp(p_str, "packed16") == 0) {
+				*p_format = BLE_BMS_FORMAT_PACKED16;
+		} else if (strcmp(p_str, "delta") == 0) {
+				*p_format = BLE_BMS_FORMAT_DELTA;
+		} else {
+				return false;
+		}
+		return true;
+}
+
+static bool mode_parse(char const * p_str, uint8_t * p_mode, uint8_t * p_window_s)
+{
+		char const *	p_colon = strchr(p_str, ':');
+		size_t				len     = p_colon ? (size_t)(p_colon - p_str) : strlen(p_str);
+
+		if (len == 6 && strncmp(p_str, "stream", len) == 0) {
+				*p_mode = BLE_BMS_MODE_STREAM;
+		} else if (len == 5 && strncmp(p_str, "beats", len) == 0) {
+				*p_mode = BLE_BMS_MODE_BEATS;
+		} else if (len == 7 && strncmp(p_str, "summary", len) == 0) {
+				*p_mode = BLE_BMS_MODE_SUMMARY;
+		} else {
+				return false;
+		}
+		if (p_colon != NULL) {
+				int window_s = atoi(p_colon + 1);
+				if (window_s <= 0 || window_s > UINT8_MAX) {
+						return false;
+				}
+				*p_window_s = (uint8_t)window_s;
+		}
+		return true;
+}
+
+/**@brief Get the CONFIG1.DR code of a rate in SPS. */
+static bool dr_parse(uint32_t sps, uint8_t * p_data_rate)
+{
+		for (uint8_t dr = 0; dr <= ADS1291_2_REG_CONFIG1_DR_MAX; dr++) {
+				if (ADS1291_2_DR_TO_SPS(dr) == sps) {
+						*p_data_rate = dr;
+						return true;
+				}
+		}
+		return false;
+}
+
+int main(int argc, char * argv[])
+{
+		static const struct option options[] = {
+				{"seconds",			required_argument,	NULL, 't'},
+				{"sps",					required_argument,	NULL, 'r'},
+				{"data-rate",		required_argument,	NULL, 'd'},
+				{"oversample",	required_argument,	NULL, 'O'},
+				{"spi-hz",			required_argument,	NULL, 's'},
+				{"tx-buffers",	required_argument,	NULL, 'b'},
+				{"per-event",		required_argument,	NULL, 'p'},
+				{"interval-us",	required_argument,	NULL, 'i'},
+				{"adaptive",		no_argument,				NULL, 'a'},
+				{"format",			required_argument,	NULL, 'f'},
+				{"channels",		required_argument,	NULL, 'C'},
+				{"filter",			required_argument,	NULL, 'F'},
+				{"mode",				required_argument,	NULL, 'M'},
+				{"lead-off",		required_argument,	NULL, 'L'},
+				{"drop",				required_argument,	NULL, 'D'},
+				{"reconnect",		required_argument,	NULL, 'R'},
+				{"preroll",			no_argument,				NULL, 'P'},
+				{"cccd-delay",	required_argument,	NULL, 'W'},
+				{"heart-rate",	required_argument,	NULL, 'H'},
+				{"noise-uv",		required_argument,	NULL, 'n'},
+				{"seed",				required_argument,	NULL, 'S'},
+				{"connect-at-boot",	no_argument,			NULL, 'B'},
+				{"verbose",			no_argument,				NULL, 'v'},
+				{"help",				no_argument,				NULL, 'h'},
+				{NULL, 0, NULL, 0}
+		};
+		sim_config_t	config;
+		double				seconds = 10.0;
+		uint8_t				format  = BLE_BMS_FORMAT_RAW;
+		uint32_t			data_rate_sps = 0;
+		uint32_t			oversample_sps = 0;
+		uint8_t				channels = 1;
+		uint8_t				filter   = 0;
+		uint8_t				mode     = BLE_BMS_MODE_STREAM;
+		uint8_t				window_s = BLE_BMS_SUMMARY_WINDOW_S;
+		uint32_t			drop_at_ms = 0;
+		uint32_t			drop_ms    = 0;
+		bool					drop_log   = false;
+		int						opt;
+
+		sim_config_default(&config);
+		while ((opt = getopt_long(argc, argv, "t:r:d:O:s:b:p:i:af:C:F:M:L:D:R:PW:H:n:S:Bvh", options, NULL)) != -1) {
+				switch (opt) {
+						case 't': seconds									= atof(optarg);									break;
+						case 'r': config.sps							= (uint32_t)atoi(optarg);				break;
+						case 'd': data_rate_sps						= (uint32_t)atoi(optarg);				break;
+						case 'O': oversample_sps					= (uint32_t)atoi(optarg);				break;
+						case 's': config.spi_hz						= (uint32_t)atoi(optarg);				break;
+						case 'b': config.tx_buffers				= (uint8_t)atoi(optarg);				break;
+						case 'p': config.packets_per_event	= (uint8_t)atoi(optarg);				break;
+						case 'i': config.conn_interval_us	= (uint32_t)atoi(optarg);				break;
+						case 'a': config.adaptive					= true;													break;
+						case 'C': channels								= (uint8_t)atoi(optarg);				break;
+						case 'F': filter									= (uint8_t)strtoul(optarg, NULL, 0);	break;
+						case 'H': config.heart_rate_bpm		= (uint32_t)atoi(optarg);				break;
+						case 'n': config.noise_uv					= (uint32_t)atoi(optarg);				break;
+						case 'S': config.seed							= (uint32_t)atoi(optarg);				break;
+						case 'B': config.connect_at_boot	= true;													break;
+						case 'P': config.preroll					= true;													break;
+						case 'W': config.cccd_delay_ms		= (uint32_t)atoi(optarg);				break;
+						case 'v': config.verbose					= true;													break;
+						case 'h':
+								usage(argv[0]);
+								return EXIT_SUCCESS;
+						case 'L':
+								if (sscanf(optarg, "%u:%u", &config.lead_off_at_ms, &config.lead_off_ms) != 2 ||
+								    config.lead_off_at_ms == 0) {
+										usage(argv[0]);
+										return EXIT_FAILURE;
+								}
+								break;
+						case 'D':
+						case 'R':
+								if (sscanf(optarg, "%u:%u", &drop_at_ms, &drop_ms) != 2 || drop_ms == 0) {
+										usage(argv[0]);
+										return EXIT_FAILURE;
+								}
+								drop_log = (opt == 'D');
+								break;
+						case 'M':
+								if (!mode_parse(optarg, &mode, &window_s)) {
+										usage(argv[0]);
+										return EXIT_FAILURE;
+								}
+								break;
+						case 'f':
+								if (!format_parse(optarg, &format)) {
+										usage(argv[0]);
+										return EXIT_FAILURE;
+								}
+								break;
+						default:
+								usage(argv[0]);
+								return EXIT_FAILURE;
+				}
+		}
+		if (ads1291_2_sclk_set(config.spi_hz) != NRF_SUCCESS || config.heart_rate_bpm == 0 || config.tx_buffers == 0 ||
+		    config.packets_per_event == 0 || config.conn_interval_us == 0 || seconds <= 0 ||
+		    channels == 0 || channels > BLE_BMS_MAX_CHANNELS || (filter & ~BMS_FILTER_ALL) != 0) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+
+#if defined(BLE_BMS_SAMPLE_24BIT)
+		if (format == BLE_BMS_FORMAT_PACKED16) {
+				fprintf(stderr, "packed16 needs a 16-bit build\n");
+				return EXIT_FAILURE;
+		}
+#else
+		if (format == BLE_BMS_FORMAT_PACKED24) {
+				fprintf(stderr, "packed24 needs a SAMPLE_24BIT=1 build\n");
+				return EXIT_FAILURE;
+		}
+#endif
+
+		uint8_t data_rate = 0;
+		if (data_rate_sps != 0 && !dr_parse(data_rate_sps, &data_rate)) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+		if (oversample_sps != 0 && !dr_parse(oversample_sps, &config.oversample_dr)) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+		if ((data_rate_sps != 0 || oversample_sps != 0) && config.sps != 0) {
+				fprintf(stderr, "--data-rate and --oversample need the rate to follow CONFIG1, not --sps\n");
+				return EXIT_FAILURE;
+		}
+
+		sim_app_init(&config);
+		uint64_t connected = sim_now_ns();
+		sim_app_connect(format, channels);
+		if (data_rate_sps != 0) {
+				sim_app_write_data_rate(data_rate);
+		}
+		if (filter != 0) {
+				sim_app_write_filter(filter);
+		}
+		if (mode != BLE_BMS_MODE_STREAM) {
+				sim_app_write_mode(mode, window_s);
+		}
+		uint32_t conversions_start = sim_ads1291_conversions();
+		uint32_t svc_start         = sim_sd_svc_calls();
+		uint64_t start             = sim_now_ns();
+		uint32_t down_conversions  = 0;
+		uint64_t first_ns          = SIM_TIME_NEVER;
+		uint32_t settling          = 0;
+		if (drop_ms != 0) {
+				if (drop_log) {
+						sim_app_write_log(BLE_BMS_LOG_ARMED);
+				}
+				sim_app_run((uint64_t)drop_at_ms * SIM_NS_PER_MS);
+				first_ns         = sim_app_first_notification_ns();
+				settling         = sim_peer_stats()->settling;
+				down_conversions = sim_ads1291_conversions();
+				sim_app_drop((uint64_t)drop_ms * SIM_NS_PER_MS);
+				down_conversions = sim_ads1291_conversions() - down_conversions;
+				if (drop_log) {
+						sim_app_write_log(BLE_BMS_LOG_DOWNLOAD);
+				}
+		}
+		sim_app_run((uint64_t)MAX(seconds * 1e9 - (sim_now_ns() - start), 0.0));
+
+		sim_peer_stats_t const * p_rx        = sim_peer_stats();
+		double                   elapsed     = (double)(sim_now_ns() - start) / 1e9;
+		uint32_t                 conversions = sim_ads1291_conversions() - conversions_start;
+		printf("format            %s\n", (format == BLE_BMS_FORMAT_RAW) ? "raw" :
+		                                 (format == BLE_BMS_FORMAT_DELTA) ? "delta" :
+		                                 (format == BLE_BMS_FORMAT_PACKED16) ? "packed16" : "packed24");
+		printf("channels          %u\n", channels);
+		printf("filter            0x%02X\n", filter);
+		printf("mode              %s\n", (mode == BLE_BMS_MODE_STREAM) ? "stream" :
+		                                 (mode == BLE_BMS_MODE_BEATS) ? "beats" : "summary");
+		if (config.oversample_dr != 0) {
+				uint32_t mean, max;
+				ads1291_2_decim_cycles(&mean, &max);
+				printf("data rate         %u SPS, converter %u SPS\n", ADS1291_2_DR_TO_SPS(sim_app_bms()->data_rate),
+				       sim_ads1291_sps());
+				// The worst case on a host is scheduling noise; hal_cycles() gives it on the target.
+				printf("decimator         %u host ns/conversion\n", mean);
+		} else {
+				printf("data rate         %u SPS\n", sim_ads1291_sps());
+		}
+		printf("startup           AFE ready %.1f ms after boot, first samples notified %.1f ms after connecting\n",
+		       (double)sim_app_afe_ready_ns() / SIM_NS_PER_MS,
+		       (double)((drop_ms != 0) ? first_ns : sim_app_first_notification_ns()) / SIM_NS_PER_MS);
+		printf("spi               %u kHz SCLK, %.1f us per frame read\n", ads1291_2_sclk_get() / 1000,
+		       ads1291_2_frame_bus_ns() / 1000.0);
+		printf("link              %u us interval, slave latency %u, %u packets/event, %u TX buffers\n",
+		       sim_sd_conn_interval_us(), sim_sd_slave_latency(), config.packets_per_event, config.tx_buffers);
+		printf("connection events %u attended, %u skipped\n", sim_sd_conn_events(), sim_sd_conn_events_skipped());
+		printf("conversions       %u\n", conversions);
+		printf("frames missed     %u, %u out of sync\n", ads1291_2_frames_missed(), ads1291_2_frames_unsynced());
+		printf("ring overruns     %u\n", ads1291_2_frames_overrun());
+		printf("notifications     %u (at most %u per event)\n", p_rx->packets, p_rx->max_per_event);
+		uint32_t                 samples     = conversions / sim_app_decimation();
+		printf("samples received  %u (%.1f%%), %u traced, %u lost, %u corrupt\n", p_rx->samples,
+		       samples ? 100.0 * p_rx->samples / samples : 0.0, p_rx->traced, p_rx->lost, p_rx->corrupt);
+		if (format != BLE_BMS_FORMAT_RAW) {
+				printf("header gaps       %u notifications, %u conversions lost, %u undecodable\n",
+				       p_rx->seq_gaps, p_rx->index_lost, p_rx->undecodable);
+		}
+		if (config.lead_off_at_ms != 0) {
+				double off_ms = connected / 1e6 + config.lead_off_at_ms;
+				double on_ms  = off_ms + config.lead_off_ms;
+				printf("lead-off          %u notifications, off reported after %.1f ms, on after %.1f ms\n",
+				       p_rx->lead_off_events,
+				       (p_rx->lead_off_t_ns != SIM_TIME_NEVER) ? p_rx->lead_off_t_ns / 1e6 - off_ms : -1.0,
+				       (p_rx->lead_on_t_ns != SIM_TIME_NEVER) ? p_rx->lead_on_t_ns / 1e6 - on_ms : -1.0);
+		}
+		printf("beats             %u notifications, last %u bpm, mean R-R %.1f ms (ECG %u bpm), worst %.1f ms off\n",
+		       p_rx->beats, p_rx->beat_bpm, p_rx->rr_count ? p_rx->rr_sum_ms / p_rx->rr_count : 0.0,
+		       config.heart_rate_bpm, p_rx->rr_max_error_ms);
+		if (mode == BLE_BMS_MODE_SUMMARY) {
+				printf("summaries         %u notifications (%u s), %u beats, last %u bpm, CH1 %d to %d mean %d\n",
+				       p_rx->summaries, window_s, p_rx->summary_beats, p_rx->summary_bpm, p_rx->summary_min,
+				       p_rx->summary_max, p_rx->summary_mean);
+		}
+		if (drop_ms != 0 && !drop_log) {
+				printf("reconnect         %s, first samples notified %.1f ms after reconnecting, %u settling "
+				       "notifications, widest hole %.1f ms\n", config.preroll ? "pre-roll" : "standby",
+				       (double)sim_app_first_notification_ns() / SIM_NS_PER_MS, p_rx->settling - settling,
+				       p_rx->hole_max_ns / 1e6);
+		}
+		if (drop_ms != 0 && drop_log) {
+				bms_log_t const * p_log = sim_app_log();
+				printf("log               %u conversions while down, %u records dropped, %u flash errors\n",
+				       down_conversions, p_log->dropped, p_log->errors);
+				printf("download          %u notifications (%u sessions), %u samples, %u traced, %u lost, %u corrupt, "
+				       "%.1f ms, %u bytes left\n", p_rx->log_packets, p_rx->log_sessions, p_rx->log_samples,
+				       p_rx->log_traced, p_rx->log_lost, p_rx->log_corrupt,
+				       (p_rx->log_first_t_ns != SIM_TIME_NEVER) ? (p_rx->log_last_t_ns - p_rx->log_first_t_ns) / 1e6 : 0.0,
+				       p_rx->log_backlog);
+		}
+		{
+				// Each sample's time against the edge of its conversion, both in RTC1 ticks.
+				uint32_t stamped = 0;
+				uint32_t late    = 0;
+				for (uint32_t sample = 0; sample < sim_app_sample_count(); sample++) {
+						sim_conversion_t const * p_conv = sim_ads1291_history(sim_app_sample_conversion(sample));
+						if (p_conv != NULL) {
+								uint32_t edge = (uint32_t)((p_conv->t_ns * HAL_CLOCK_HZ) / 1000000000ULL);
+								late = MAX(late, (sim_app_sample_ticks(sample) - edge) & HAL_CLOCK_MASK);
+								stamped++;
+						}
+				}
+				printf("timestamps        %s, %u samples, worst %.1f us after the DRDY edge\n",
+#if defined(ADS1291_2_DRDY_CAPTURE)
+				       "edge capture",
+#else
+				       "DRDY handler",
+#endif
+				       stamped, (double)HAL_TICKS_TO_US(late));
+		}
+		printf("latency           p50 %.1f ms, p99 %.1f ms, max %.1f ms\n", sim_peer_latency_us(50) / 1000,
+		       sim_peer_latency_us(99) / 1000, sim_peer_latency_us(100) / 1000);
+		printf("throughput        %.0f bytes/s, status %u notifications, %.0f bytes/s\n", p_rx->bytes / elapsed,
+		       p_rx->status_packets, p_rx->status_bytes / elapsed);
+		printf("firmware cost     %.0f host ns/sample, %.2f SVC calls/sample\n",
+		       conversions ? (double)sim_cpu_ns() / conversions : 0.0,
+		       conversions ? (double)(sim_sd_svc_calls() - svc_start) / conversions : 0.0);
+		// Loss follows from the link settings; wrong values, a gap report that disagrees with
+		// the trace, packets the peer cannot decode or a pre-roll that loses more than the time
+		// the link was down are bugs.
+		if (p_rx->corrupt != 0 || p_rx->log_corrupt != 0 ||
+		    (format != BLE_BMS_FORMAT_RAW && p_rx->index_lost > p_rx->lost)) {
+				printf("FAIL              corrupt samples or loss the trace does not account for\n");
+				return EXIT_FAILURE;
+		}
+		if (p_rx->undecodable != 0) {
+				printf("FAIL              %u notifications the peer could not decode\n", p_rx->undecodable);
+				return EXIT_FAILURE;
+		}
+		if (config.preroll && drop_ms != 0 && !drop_log && p_rx->hole_max_ns > (uint64_t)drop_ms * SIM_NS_PER_MS) {
+				printf("FAIL              pre-roll hole of %.1f ms for a %u ms drop\n", p_rx->hole_max_ns / 1e6, drop_ms);
+				return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
+}
@@ -0,0 +1,449 @@
+/* Copyright (c) 2016 Musa Mahmood
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/** @file
+ *
+ * @brief Simulated peer: decodes Body Voltage Measurement notifications and scores delivery.
+ *
+ * @details sim_app.c follows every frame from the SPI bus into ble_bms_update(), so the peer
+ *          knows which conversion each sample it receives should come from and checks the
+ *          value against the conversion history, converted with get_bvm_sample() like the
+ *          firmware does; a mismatch is a codec or framing error. Samples skipped between
+ *          delivered ones are counted as lost, and the time from DRDY to the notification
+ *          reaching the peer is the delivery latency. Conversions before the first delivered
+ *          sample are not counted as lost.
+ *
+ *          Notifications go through the bms_rx reassembler like on a real host, so its gap
+ *          report, taken from the packet headers alone, can be checked against the trace.
+ *
+ *          Log Data notifications go through a second reassembler, restarted by every session
+ *          record, and their samples are traced the same way but without latency: a recording
+ *          is placed by searching all samples for its first run.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "sim.h"
+#include "ble_bms.h"
+#include "bms_rx.h"
+#include "ads1291-2.h"
+#include "app_error.h"
+
+#define SIM_PEER_SEARCH_WINDOW					4096				/**< Samples searched for a lost packet before a sample counts as corrupt. */
+#define SIM_PEER_MATCH_RUN							4						/**< Samples compared to place one. */
+#define SIM_PEER_MAX_SAMPLES						64					/**< Values a single notification can carry, all channels. */
+
+static uint16_t						m_value_handle;
+static uint16_t						m_lead_off_handle;
+static uint16_t						m_beat_handle;
+static uint16_t						m_summary_handle;
+static uint16_t						m_log_handle = BLE_GATT_HANDLE_INVALID;
+static uint16_t						m_log_data_handle = BLE_GATT_HANDLE_INVALID;
+static bms_rx_t					m_log_rx;
+static bool								m_log_synced;							/**< m_log_next_sample is valid. */
+static uint32_t						m_log_next_sample;
+static uint8_t						m_log_session[BLE_BMS_LOG_SESSION_LEN];	/**< Last session record. */
+static sim_peer_stats_t		m_stats;
+static bms_rx_t					m_rx;
+static bool								m_traced;									/**< A sample has been traced; m_next_conv is valid. */
+static uint32_t						m_next_conv;							/**< Conversion after the last one delivered. */
+static uint64_t						m_last_t_ns;							/**< DRDY edge of the last one delivered. */
+static uint32_t						m_next_sample;						/**< Sample expected next, see sim_app_sample_conversion(). */
+static uint8_t						m_channels;								/**< Values per sample in a notification. */
+static uint64_t						m_event_t_ns;
+static uint32_t						m_event_packets;
+static uint32_t *					m_latency_ns;
+static uint32_t						m_latency_size;
+static bool								m_latency_sorted;
+
+static void conversion_sample(sim_conversion_t const * p_conv, body_voltage_t * p_sample)
+{
+		ads1291_2_frame_t	frame;
+		memset(&frame, 0, sizeof(frame));
+		frame.ch1 = p_conv->ch1;
+		frame.ch2 = p_conv->ch2;
+		get_bvm_sample(&frame, p_sample);
+}
+
+static void latency_add(uint64_t ns)
+{
+		if (m_stats.traced == m_latency_size) {
+				m_latency_size = m_latency_size ? 2 * m_latency_size : 4096;
+				m_latency_ns = realloc(m_latency_ns, m_latency_size * sizeof(*m_latency_ns));
+				if (m_latency_ns == NULL) {
+						APP_ERROR_HANDLER(NRF_ERROR_NO_MEM);
+				}
+		}
+		m_latency_ns[m_stats.traced] = (uint32_t)MIN(ns, UINT32_MAX);
+		m_latency_sorted = false;
+}
+
+/**@brief Values (one per channel) the sample-th sample passed to ble_bms_update() should arrive with. */
+static bool expected_sample(uint32_t sample, body_voltage_t * p_value)
+{
+		uint32_t									conversion = sim_app_sample_conversion(sample);
+		sim_conversion_t const *	p_conv;
+		ads1291_2_frame_t const *	p_frame;
+		if (conversion == SIM_NO_CONVERSION || (p_conv = sim_ads1291_history(conversion)) == NULL) {
+				return false;
+		}
+		if ((p_frame = sim_app_sample_frame(sample)) != NULL) {
+				get_bvm_sample(p_frame, p_value);
+		} else {
+				conversion_sample(p_conv, p_value);
+		}
+		return true;
+}
+
+static bool sample_matches(body_voltage_t const * p_value, int32_t const * p_received)
+{
+		for (uint8_t ch = 0; ch < m_channels; ch++) {
+				if (p_value[ch] != (body_voltage_t)p_received[ch]) {
+						return false;
+				}
+		}
+		return true;
+}
+
+/**@brief Number of samples at p_samples, up to run, that match the samples starting at sample. */
+static uint32_t match_length(uint32_t sample, int32_t const * p_samples, uint32_t run)
+{
+		body_voltage_t	value[BLE_BMS_MAX_CHANNELS];
+		uint32_t				n;
+		for (n = 0; n < run; n++) {
+				if (!expected_sample(sample + n, value) || !sample_matches(value, &p_samples[n * m_channels])) {
+						break;
+				}
+		}
+		return n;
+}
+
+/**@brief Find the sample behind received p_samples[0] and score it.
+ *
+ * @details Normally it is the next sample the firmware buffered. If not, a packet was lost
+ *          after ble_bms_update(); the earliest sample starting the longest match with
+ *          p_samples[0..run), the samples after it in the same notification, is taken.
+ */
+static bool sample_trace(int32_t const * p_samples, uint32_t run, uint64_t t_ns)
+{
+		uint32_t									best		= m_next_sample;
+		uint32_t									best_n	= match_length(m_next_sample, p_samples, 1);
+		uint32_t									conversion;
+		sim_conversion_t const *	p_conv;
+
+		if (best_n == 0) {
+				for (uint32_t i = m_next_sample + 1; i < m_next_sample + SIM_PEER_SEARCH_WINDOW; i++) {
+						uint32_t n = match_length(i, p_samples, run);
+						if (n > best_n) {
+								best		= i;
+								best_n	= n;
+								if (n == run) {
+										break;
+								}
+						}
+				}
+				if (best_n == 0) {
+						return false;
+				}
+		}
+		conversion	= sim_app_sample_conversion(best);
+		p_conv			= sim_ads1291_history(conversion);
+		if (m_traced) {
+				m_stats.lost += (conversion - m_next_conv) / sim_app_decimation();
+				if (p_conv->t_ns > m_last_t_ns) {
+						m_stats.hole_max_ns = MAX(m_stats.hole_max_ns, p_conv->t_ns - m_last_t_ns);
+				}
+		}
+		latency_add(t_ns - p_conv->t_ns);
+		m_stats.traced++;
+		m_traced			= true;
+		m_next_conv		= conversion + sim_app_decimation();
+		m_last_t_ns		= p_conv->t_ns;
+		m_next_sample	= best + 1;
+		return true;
+}
+
+/**@brief Find the sample behind p_samples[0] of a Log Data notification.
+ *
+ * @details Searches onwards from the sample after the last one found or, after a session
+ *          record, through every sample for all of p_samples[0..run): a short run can match
+ *          the flat start of the recording by chance.
+ */
+static bool log_trace(int32_t const * p_samples, uint32_t run)
+{
+		uint32_t	end = m_log_synced ? m_log_next_sample + SIM_PEER_SEARCH_WINDOW : sim_app_sample_count();
+		uint32_t	first = m_log_synced ? m_log_next_sample : 0;
+
+		if (m_log_synced) {
+				run = MIN(run, SIM_PEER_MATCH_RUN);
+		}
+
+		if (m_log_synced && match_length(first, p_samples, 1) == 1) {
+				m_log_next_sample = first + 1;
+				return true;
+		}
+		for (uint32_t i = first; i < end; i++) {
+				if (match_length(i, p_samples, run) == run) {
+						if (m_log_synced) {
+								m_stats.log_lost += i - m_log_next_sample;
+						}
+						m_log_synced			= true;
+						m_log_next_sample	= i + 1;
+						return true;
+				}
+		}
+		return false;
+}
+
+/**@brief A Log Data notification: a session record or a recorded packet. */
+static void on_log_data(uint8_t const * p_data, uint16_t len, uint64_t t_ns)
+{
+		int32_t	samples[SIM_PEER_MAX_SAMPLES];
+		int			count;
+
+		m_stats.log_packets++;
+		m_stats.log_bytes += len;
+		if (m_stats.log_first_t_ns == SIM_TIME_NEVER) {
+				m_stats.log_first_t_ns = t_ns;
+		}
+		m_stats.log_last_t_ns = t_ns;
+		if (len >= 1 && (p_data[0] & BLE_BMS_LOG_SESSION) != 0) {
+				if (len != BLE_BMS_LOG_SESSION_LEN || p_data[2] != m_channels) {
+						m_stats.log_corrupt++;
+						return;
+				}
+				m_stats.log_sessions++;
+				// Repeated at every page: only a different session restarts decoding. A new
+				// recording starts with a key packet and the index gap shows in the trace.
+				if (memcmp(p_data, m_log_session, BLE_BMS_LOG_SESSION_LEN) != 0) {
+						memcpy(m_log_session, p_data, BLE_BMS_LOG_SESSION_LEN);
+						m_log_synced = false;
+						bms_rx_init(&m_log_rx, p_data[1], BLE_BMS_SAMPLE_BYTES, p_data[2]);
+				}
+				return;
+		}
+		count = bms_rx_packet(&m_log_rx, p_data, len, samples, SIM_PEER_MAX_SAMPLES, NULL);
+		if (count == BMS_RX_WAIT_KEY) {
+				return;
+		}
+		if (count < 0) {
+				m_stats.log_corrupt++;
+				return;
+		}
+		count /= m_channels;
+		m_stats.log_samples += (uint32_t)count;
+		for (int i = 0; i < count; i++) {
+				if (log_trace(&samples[i * m_channels], (uint32_t)(count - i))) {
+						m_stats.log_traced++;
+				} else {
+						m_stats.log_corrupt++;
+				}
+		}
+}
+
+/**@brief A lead-off status notification: note when the peer first learns of each change. */
+static void on_lead_off(uint8_t const * p_data, uint16_t len, uint64_t t_ns)
+{
+		if (len != BLE_BMS_LEAD_OFF_LEN) {
+				m_stats.corrupt++;
+				return;
+		}
+		m_stats.lead_off_events++;
+		m_stats.lead_off_stat = p_data[0];
+		if (p_data[0] != 0 && m_stats.lead_off_t_ns == SIM_TIME_NEVER) {
+				m_stats.lead_off_t_ns = t_ns;
+		} else if (p_data[0] == 0 && m_stats.lead_off_t_ns != SIM_TIME_NEVER && m_stats.lead_on_t_ns == SIM_TIME_NEVER) {
+				m_stats.lead_on_t_ns = t_ns;
+		}
+}
+
+/**@brief A beat notification: compare its R-R interval with the period of the synthetic ECG. */
+static void on_beat(uint8_t const * p_data, uint16_t len)
+{
+		double rr_ms;
+		double error_ms;
+
+		if (len != BLE_BMS_BEAT_LEN) {
+				m_stats.corrupt++;
+				return;
+		}
+		m_stats.beats++;
+		m_stats.beat_bpm = p_data[0];
+		if (uint16_decode(&p_data[5]) == 0) {
+				return;
+		}
+		rr_ms    = uint16_decode(&p_data[5]) * 1000.0 / 1024;
+		error_ms = fabs(rr_ms - 60000.0 / sim_config()->heart_rate_bpm);
+		m_stats.rr_count++;
+		m_stats.rr_sum_ms += rr_ms;
+		if (error_ms > m_stats.rr_max_error_ms) {
+				m_stats.rr_max_error_ms = error_ms;
+		}
+}
+
+/**@brief A summary notification: keep the first channel statistics of the last window. */
+static void on_summary(uint8_t const * p_data, uint16_t len)
+{
+		if (len != BLE_BMS_SUMMARY_LEN(m_channels)) {
+				m_stats.corrupt++;
+				return;
+		}
+		m_stats.summaries++;
+		m_stats.summary_beats += p_data[4];
+		m_stats.summary_bpm		 = p_data[5];
+		m_stats.summary_min		 = (int16_t)uint16_decode(&p_data[6]);
+		m_stats.summary_max		 = (int16_t)uint16_decode(&p_data[8]);
+		m_stats.summary_mean	 = (int16_t)uint16_decode(&p_data[10]);
+}
+
+void sim_peer_init(uint16_t value_handle, uint16_t lead_off_handle, uint16_t beat_handle, uint16_t summary_handle,
+                   uint8_t format, uint8_t channels)
+{
+		m_value_handle		= value_handle;
+		m_lead_off_handle	= lead_off_handle;
+		m_beat_handle			= beat_handle;
+		m_summary_handle	= summary_handle;
+		m_channels			= channels;
+		m_traced				= false;
+		m_next_conv			= 0;
+		m_next_sample		= 0;
+		m_event_t_ns		= SIM_TIME_NEVER;
+		m_event_packets	= 0;
+		memset(&m_stats, 0, sizeof(m_stats));
+		m_stats.lead_off_t_ns	= SIM_TIME_NEVER;
+		m_stats.lead_on_t_ns	= SIM_TIME_NEVER;
+		m_stats.log_first_t_ns	= SIM_TIME_NEVER;
+		m_log_handle			= BLE_GATT_HANDLE_INVALID;
+		m_log_data_handle	= BLE_GATT_HANDLE_INVALID;
+		bms_rx_init(&m_rx, format, BLE_BMS_SAMPLE_BYTES, channels);
+		sim_sd_set_notify_handler(sim_peer_on_notify);
+}
+
+void sim_peer_log_init(uint16_t log_handle, uint16_t log_data_handle)
+{
+		m_log_handle			= log_handle;
+		m_log_data_handle	= log_data_handle;
+		m_log_synced			= false;
+		memset(m_log_session, 0, sizeof(m_log_session));
+		bms_rx_init(&m_log_rx, BLE_BMS_FORMAT_DELTA, BLE_BMS_SAMPLE_BYTES, m_channels);
+}
+
+void sim_peer_live_skip(uint32_t sample)
+{
+		m_next_sample = MAX(m_next_sample, sample);
+}
+
+void sim_peer_on_notify(uint16_t handle, uint8_t const * p_data, uint16_t len, uint64_t t_ns)
+{
+		int32_t	samples[SIM_PEER_MAX_SAMPLES];
+		int			count;
+
+		if (handle == m_lead_off_handle || handle == m_beat_handle || handle == m_summary_handle ||
+		    handle == m_log_handle) {
+				m_stats.status_packets++;
+				m_stats.status_bytes += len;
+		}
+		if (handle == m_lead_off_handle) {
+				on_lead_off(p_data, len, t_ns);
+				return;
+		}
+		if (handle == m_beat_handle) {
+				on_beat(p_data, len);
+				return;
+		}
+		if (handle == m_summary_handle) {
+				on_summary(p_data, len);
+				return;
+		}
+		if (handle == m_log_handle) {
+				if (len == BLE_BMS_LOG_LEN) {
+						m_stats.log_state		= p_data[0];
+						m_stats.log_backlog	= uint32_decode(&p_data[1]);
+				} else {
+						m_stats.corrupt++;
+				}
+				return;
+		}
+		if (handle == m_log_data_handle) {
+				on_log_data(p_data, len, t_ns);
+				return;
+		}
+		if (handle != m_value_handle) {
+				return;
+		}
+		m_stats.packets++;
+		m_stats.bytes += len;
+		// Notifications of one connection event arrive with the same timestamp.
+		m_event_packets = (t_ns == m_event_t_ns) ? m_event_packets + 1 : 1;
+		m_event_t_ns		= t_ns;
+		m_stats.max_per_event = MAX(m_stats.max_per_event, m_event_packets);
+
+		count = bms_rx_packet(&m_rx, p_data, len, samples, SIM_PEER_MAX_SAMPLES, NULL);
+		m_stats.undecodable	= m_rx.stats.undecodable;
+		m_stats.seq_gaps		= m_rx.stats.seq_gaps;
+		m_stats.index_lost	= m_rx.stats.samples_lost;
+		m_stats.settling		= m_rx.stats.settling;
+		if (count == BMS_RX_WAIT_KEY) {
+				return;
+		}
+		if (count < 0) {
+				m_stats.corrupt++;
+				return;
+		}
+		count /= m_channels;
+		m_stats.samples += (uint32_t)count;
+		for (int i = 0; i < count; i++) {
+				uint32_t run = MIN((uint32_t)(count - i), SIM_PEER_MATCH_RUN);
+				if (!sample_trace(&samples[i * m_channels], run, t_ns)) {
+						m_stats.corrupt++;
+				}
+		}
+}
+
+sim_peer_stats_t const * sim_peer_stats(void)
+{
+		return &m_stats;
+}
+
+static int latency_cmp(void const * p_a, void const * p_b)
+{
+		uint32_t a = *(uint32_t const *)p_a;
+		uint32_t b = *(uint32_t const *)p_b;
+		return (a > b) - (a < b);
+}
+
+double sim_peer_latency_us(double percentile)
+{
+		uint32_t index;
+		if (m_stats.traced == 0) {
+				return 0.0;
+		}
+		if (!m_latency_sorted) {
+				qsort(m_latency_ns, m_stats.traced, sizeof(*m_latency_ns), latency_cmp);
+				m_latency_sorted = true;
+		}
+		// Nearest rank.
+		index = (uint32_t)(percentile / 100.0 * m_stats.traced + 0.5);
+		index = MIN(MAX(index, 1), m_stats.traced) - 1;
+		return m_latency_ns[index] / 1000.0;
+}
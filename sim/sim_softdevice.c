@@ -0,0 +1,436 @@
+/* Copyright (c) 2016 Musa Mahmood
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/** @file
+ *
+ * @brief Simulated S130 SoftDevice: GATT server, notification queue and connection events.
+ *
+ * @details One peripheral link. sd_ble_gatts_hvx() queues into tx_buffers slots; every
+ *          connection event moves up to packets_per_event of them to the peer and reports
+ *          them with BLE_EVT_TX_COMPLETE. Under slave latency the peripheral skips events while
+ *          it has nothing queued. Events are queued and delivered from SIM_IRQ_SWI2, like the
+ *          SoftDevice event interrupt.
+ */
+
+#include "sim.h"
+
+#define SIM_SD_MAX_ATTRS								48
+#define SIM_SD_EVT_QUEUE_SIZE						16
+#define SIM_SD_MAX_TX_BUFFERS						16
+#define SIM_SD_CONN_HANDLE							0
+
+typedef struct
+{
+		uint8_t		value[BLE_GATTS_VAR_ATTR_LEN_MAX];
+		uint16_t	len;
+		uint16_t	max_len;
+		uint16_t	cccd_handle;						/**< For a notifiable value, its CCCD. */
+		bool			is_cccd;
+		bool			rd_auth;
+		bool			wr_auth;
+} sim_attr_t;
+
+typedef struct
+{
+		uint16_t	handle;
+		uint16_t	len;
+		uint8_t		data[BLE_GATTS_VAR_ATTR_LEN_MAX];
+} sim_packet_t;
+
+static sim_attr_t							m_attrs[SIM_SD_MAX_ATTRS];
+static uint16_t								m_attr_count;
+
+static void										(*m_evt_handler)(ble_evt_t * p_ble_evt);
+static ble_evt_t							m_evt_queue[SIM_SD_EVT_QUEUE_SIZE];
+static uint32_t								m_evt_head;
+static uint32_t								m_evt_tail;
+
+static uint16_t								m_conn_handle = BLE_CONN_HANDLE_INVALID;
+static uint64_t								m_next_conn_event = SIM_TIME_NEVER;
+static uint32_t								m_conn_interval_us;				/**< sim_config() value until the peripheral requests another. */
+static uint16_t								m_slave_latency;
+static uint16_t								m_skipped;								/**< Events skipped in a row. */
+static uint32_t								m_skipped_total;
+static sim_packet_t						m_tx_queue[SIM_SD_MAX_TX_BUFFERS];
+static uint32_t								m_tx_head;
+static uint32_t								m_tx_tail;
+static uint32_t								m_sent;
+static uint32_t								m_conn_events;
+static uint32_t								m_svc_calls;
+static sim_notify_handler_t		m_notify_handler;
+static bool										m_auth_pending;
+static ble_gatts_evt_write_t	m_auth_write;						/**< Write waiting for sd_ble_gatts_rw_authorize_reply(). */
+
+static ble_evt_t * evt_alloc(uint16_t evt_id)
+{
+		if (m_evt_head - m_evt_tail >= SIM_SD_EVT_QUEUE_SIZE) {
+				APP_ERROR_HANDLER(NRF_ERROR_NO_MEM);
+		}
+		ble_evt_t * p_evt = &m_evt_queue[m_evt_head++ % SIM_SD_EVT_QUEUE_SIZE];
+		memset(p_evt, 0, sizeof(*p_evt));
+		p_evt->header.evt_id  = evt_id;
+		p_evt->header.evt_len = sizeof(*p_evt);
+		sim_irq_set_pending(SIM_IRQ_SWI2);
+		return p_evt;
+}
+
+static sim_attr_t * attr_get(uint16_t handle)
+{
+		if (handle == BLE_GATT_HANDLE_INVALID || handle > m_attr_count) {
+				return NULL;
+		}
+		return &m_attrs[handle - 1];
+}
+
+static uint16_t attr_add(void)
+{
+		if (m_attr_count >= SIM_SD_MAX_ATTRS) {
+				APP_ERROR_HANDLER(NRF_ERROR_NO_MEM);
+		}
+		memset(&m_attrs[m_attr_count], 0, sizeof(sim_attr_t));
+		return ++m_attr_count;
+}
+
+static uint16_t conn_params_interval(void)
+{
+		return (uint16_t)(m_conn_interval_us / UNIT_1_25_MS);
+}
+
+void sim_sd_init(void (*evt_handler)(ble_evt_t * p_ble_evt))
+{
+		m_evt_handler			= evt_handler;
+		m_attr_count			= 0;
+		m_evt_head				= 0;
+		m_evt_tail				= 0;
+		m_tx_head					= 0;
+		m_tx_tail					= 0;
+		m_sent						= 0;
+		m_conn_events			= 0;
+		m_skipped_total		= 0;
+		m_svc_calls				= 0;
+		m_auth_pending		= false;
+		m_conn_handle			= BLE_CONN_HANDLE_INVALID;
+		m_next_conn_event	= SIM_TIME_NEVER;
+}
+
+void sim_sd_evt_dispatch(void)
+{
+		while (m_evt_tail != m_evt_head) {
+				ble_evt_t evt = m_evt_queue[m_evt_tail++ % SIM_SD_EVT_QUEUE_SIZE];
+				if (m_evt_handler != NULL) {
+						m_evt_handler(&evt);
+				}
+		}
+}
+
+uint64_t sim_sd_next_event(void)
+{
+		return m_next_conn_event;
+}
+
+void sim_sd_run(uint64_t now_ns)
+{
+		uint8_t count = 0;
+		m_next_conn_event = now_ns + (uint64_t)m_conn_interval_us * 1000;
+		if (m_tx_tail == m_tx_head && m_skipped < m_slave_latency) {
+				m_skipped++;
+				m_skipped_total++;
+				return;
+		}
+		m_skipped = 0;
+		while (m_tx_tail != m_tx_head && count < sim_config()->packets_per_event) {
+				sim_packet_t * p_packet = &m_tx_queue[m_tx_tail % SIM_SD_MAX_TX_BUFFERS];
+				if (m_notify_handler != NULL) {
+						m_notify_handler(p_packet->handle, p_packet->data, p_packet->len, now_ns);
+				}
+				m_tx_tail++;
+				count++;
+		}
+		m_sent += count;
+		m_conn_events++;
+		if (count > 0) {
+				ble_evt_t * p_evt = evt_alloc(BLE_EVT_TX_COMPLETE);
+				p_evt->evt.common_evt.conn_handle							= m_conn_handle;
+				p_evt->evt.common_evt.params.tx_complete.count	= count;
+		}
+}
+
+void sim_sd_connect(void)
+{
+		ble_evt_t * p_evt = evt_alloc(BLE_GAP_EVT_CONNECTED);
+		m_conn_handle				= SIM_SD_CONN_HANDLE;
+		m_tx_head						= 0;
+		m_tx_tail						= 0;
+		m_conn_interval_us	= sim_config()->conn_interval_us;
+		m_slave_latency			= 0;
+		m_skipped						= 0;
+		m_next_conn_event		= sim_now_ns() + (uint64_t)m_conn_interval_us * 1000;
+		p_evt->evt.gap_evt.conn_handle																		= m_conn_handle;
+		p_evt->evt.gap_evt.params.connected.conn_params.min_conn_interval	= conn_params_interval();
+		p_evt->evt.gap_evt.params.connected.conn_params.max_conn_interval	= conn_params_interval();
+		for (uint16_t i = 0; i < m_attr_count; i++) {
+				if (m_attrs[i].is_cccd) {
+						memset(m_attrs[i].value, 0, sizeof(m_attrs[i].value));
+				}
+		}
+}
+
+void sim_sd_disconnect(void)
+{
+		ble_evt_t * p_evt = evt_alloc(BLE_GAP_EVT_DISCONNECTED);
+		p_evt->evt.gap_evt.conn_handle = m_conn_handle;
+		m_conn_handle			= BLE_CONN_HANDLE_INVALID;
+		m_next_conn_event	= SIM_TIME_NEVER;
+		m_tx_tail					= m_tx_head;
+}
+
+void sim_sd_client_write(uint16_t handle, uint8_t const * p_data, uint16_t len)
+{
+		sim_attr_t            * p_attr = attr_get(handle);
+		ble_evt_t             * p_evt;
+		ble_gatts_evt_write_t   write;
+
+		if (p_attr == NULL || len > p_attr->max_len || m_conn_handle == BLE_CONN_HANDLE_INVALID) {
+				return;
+		}
+		memset(&write, 0, sizeof(write));
+		write.handle	= handle;
+		write.op			= BLE_GATTS_OP_WRITE_REQ;
+		write.len			= len;
+		memcpy(write.data, p_data, len);
+		if (p_attr->wr_auth) {
+				p_evt = evt_alloc(BLE_GATTS_EVT_RW_AUTHORIZE_REQUEST);
+				p_evt->evt.gatts_evt.params.authorize_request.type					= BLE_GATTS_AUTHORIZE_TYPE_WRITE;
+				p_evt->evt.gatts_evt.params.authorize_request.request.write	= write;
+				m_auth_write		= write;
+				m_auth_pending	= true;
+		} else {
+				memcpy(p_attr->value, p_data, len);
+				p_attr->len = len;
+				p_evt = evt_alloc(BLE_GATTS_EVT_WRITE);
+				p_evt->evt.gatts_evt.params.write = write;
+		}
+		p_evt->evt.gatts_evt.conn_handle = m_conn_handle;
+}
+
+void sim_sd_set_notify_handler(sim_notify_handler_t handler)
+{
+		m_notify_handler = handler;
+}
+
+uint32_t sim_sd_notifications_sent(void)
+{
+		return m_sent;
+}
+
+uint32_t sim_sd_conn_events(void)
+{
+		return m_conn_events;
+}
+
+uint32_t sim_sd_svc_calls(void)
+{
+		return m_svc_calls;
+}
+
+uint32_t sim_sd_conn_interval_us(void)
+{
+		return m_conn_interval_us;
+}
+
+uint16_t sim_sd_slave_latency(void)
+{
+		return m_slave_latency;
+}
+
+uint32_t sim_sd_conn_events_skipped(void)
+{
+		return m_skipped_total;
+}
+
+/* SoftDevice API *******************************************************************************/
+
+uint32_t sd_ble_uuid_vs_add(ble_uuid128_t const * p_vs_uuid, uint8_t * p_uuid_type)
+{
+		m_svc_calls++;
+		UNUSED_PARAMETER(p_vs_uuid);
+		*p_uuid_type = BLE_UUID_TYPE_VENDOR_BEGIN;
+		return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gap_conn_param_update(uint16_t conn_handle, ble_gap_conn_params_t const * p_conn_params)
+{
+		m_svc_calls++;
+		if (conn_handle != m_conn_handle) {
+				return BLE_ERROR_INVALID_CONN_HANDLE;
+		}
+		if (p_conn_params == NULL || p_conn_params->min_conn_interval > p_conn_params->max_conn_interval) {
+				return NRF_ERROR_INVALID_PARAM;
+		}
+		// The central accepts the longest interval offered. The update instant is not modeled;
+		// the new interval starts after the next connection event.
+		ble_evt_t * p_evt = evt_alloc(BLE_GAP_EVT_CONN_PARAM_UPDATE);
+		m_conn_interval_us = (uint32_t)p_conn_params->max_conn_interval * UNIT_1_25_MS;
+		m_slave_latency		 = p_conn_params->slave_latency;
+		p_evt->evt.gap_evt.conn_handle													= m_conn_handle;
+		p_evt->evt.gap_evt.params.conn_param_update.conn_params	= *p_conn_params;
+		p_evt->evt.gap_evt.params.conn_param_update.conn_params.min_conn_interval	= p_conn_params->max_conn_interval;
+		return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_tx_packet_count_get(uint16_t conn_handle, uint8_t * p_count)
+{
+		m_svc_calls++;
+		if (conn_handle != m_conn_handle) {
+				return BLE_ERROR_INVALID_CONN_HANDLE;
+		}
+		*p_count = MIN(sim_config()->tx_buffers, SIM_SD_MAX_TX_BUFFERS);
+		return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gatts_service_add(uint8_t type, ble_uuid_t const * p_uuid, uint16_t * p_handle)
+{
+		m_svc_calls++;
+		UNUSED_PARAMETER(type);
+		UNUSED_PARAMETER(p_uuid);
+		*p_handle = attr_add();
+		return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gatts_characteristic_add(uint16_t service_handle,
+                                         ble_gatts_char_md_t const * p_char_md,
+                                         ble_gatts_attr_t const * p_attr_char_value,
+                                         ble_gatts_char_handles_t * p_handles)
+{
+		sim_attr_t * p_value;
+
+		m_svc_calls++;
+		UNUSED_PARAMETER(service_handle);
+		if (p_attr_char_value->max_len > BLE_GATTS_VAR_ATTR_LEN_MAX ||
+		    p_attr_char_value->init_len > p_attr_char_value->max_len) {
+				return NRF_ERROR_INVALID_PARAM;
+		}
+		memset(p_handles, 0, sizeof(*p_handles));
+		(void)attr_add();																			// Declaration
+		p_handles->value_handle = attr_add();
+		p_value          = attr_get(p_handles->value_handle);
+		p_value->max_len = p_attr_char_value->max_len;
+		p_value->len     = p_attr_char_value->init_len;
+		p_value->rd_auth = p_attr_char_value->p_attr_md->rd_auth;
+		p_value->wr_auth = p_attr_char_value->p_attr_md->wr_auth;
+		if (p_attr_char_value->init_len > 0) {
+				memcpy(p_value->value, p_attr_char_value->p_value, p_attr_char_value->init_len);
+		}
+		if (p_char_md->char_props.notify) {
+				p_handles->cccd_handle = attr_add();
+				p_value = attr_get(p_handles->value_handle);
+				p_value->cccd_handle = p_handles->cccd_handle;
+				attr_get(p_handles->cccd_handle)->is_cccd = true;
+				attr_get(p_handles->cccd_handle)->max_len = 2;
+				attr_get(p_handles->cccd_handle)->len     = 2;
+		}
+		return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gatts_value_set(uint16_t conn_handle, uint16_t handle, ble_gatts_value_t * p_value)
+{
+		sim_attr_t * p_attr = attr_get(handle);
+
+		m_svc_calls++;
+		UNUSED_PARAMETER(conn_handle);
+		if (p_attr == NULL) {
+				return BLE_ERROR_INVALID_ATTR_HANDLE;
+		}
+		if (p_value->offset + p_value->len > p_attr->max_len) {
+				return NRF_ERROR_INVALID_PARAM;
+		}
+		memcpy(&p_attr->value[p_value->offset], p_value->p_value, p_value->len);
+		p_attr->len = p_value->offset + p_value->len;
+		return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gatts_value_get(uint16_t conn_handle, uint16_t handle, ble_gatts_value_t * p_value)
+{
+		sim_attr_t * p_attr = attr_get(handle);
+
+		m_svc_calls++;
+		UNUSED_PARAMETER(conn_handle);
+		if (p_attr == NULL) {
+				return BLE_ERROR_INVALID_ATTR_HANDLE;
+		}
+		p_value->len = MIN(p_value->len, p_attr->len);
+		if (p_value->p_value != NULL) {
+				memcpy(p_value->p_value, p_attr->value, p_value->len);
+		}
+		return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gatts_hvx(uint16_t conn_handle, ble_gatts_hvx_params_t const * p_hvx_params)
+{
+		sim_attr_t   * p_attr = attr_get(p_hvx_params->handle);
+		sim_packet_t * p_packet;
+		uint16_t       len    = *p_hvx_params->p_len;
+
+		m_svc_calls++;
+		if (conn_handle != m_conn_handle || m_conn_handle == BLE_CONN_HANDLE_INVALID) {
+				return BLE_ERROR_INVALID_CONN_HANDLE;
+		}
+		if (p_attr == NULL || p_attr->cccd_handle == BLE_GATT_HANDLE_INVALID) {
+				return BLE_ERROR_INVALID_ATTR_HANDLE;
+		}
+		if (len > p_attr->max_len) {
+				return NRF_ERROR_DATA_SIZE;
+		}
+		if ((attr_get(p_attr->cccd_handle)->value[0] & BLE_GATT_HVX_NOTIFICATION) == 0) {
+				return NRF_ERROR_INVALID_STATE;
+		}
+		if (m_tx_head - m_tx_tail >= MIN(sim_config()->tx_buffers, SIM_SD_MAX_TX_BUFFERS)) {
+				return BLE_ERROR_NO_TX_PACKETS;
+		}
+		p_packet = &m_tx_queue[m_tx_head++ % SIM_SD_MAX_TX_BUFFERS];
+		p_packet->handle = p_hvx_params->handle;
+		p_packet->len    = len;
+		memcpy(p_packet->data, p_hvx_params->p_data, len);
+		// A notification also becomes the attribute value.
+		memcpy(p_attr->value, p_hvx_params->p_data, len);
+		p_attr->len = len;
+		return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gatts_rw_authorize_reply(uint16_t conn_handle,
+                                         ble_gatts_rw_authorize_reply_params_t const * p_rw_authorize_reply_params)
+{
+		ble_gatts_authorize_params_t const * p_reply = &p_rw_authorize_reply_params->params.write;
+		sim_attr_t                         * p_attr;
+
+		m_svc_calls++;
+		UNUSED_PARAMETER(conn_handle);
+		if (!m_auth_pending || p_rw_authorize_reply_params->type != BLE_GATTS_AUTHORIZE_TYPE_WRITE) {
+				return NRF_ERROR_INVALID_STATE;
+		}
+		m_auth_pending = false;
+		if (p_reply->gatt_status == BLE_GATT_STATUS_SUCCESS && p_reply->update) {
+				p_attr = attr_get(m_auth_write.handle);
+				memcpy(p_attr->value, m_auth_write.data, m_auth_write.len);
+				p_attr->len = m_auth_write.len;
+		}
+		return NRF_SUCCESS;
+}